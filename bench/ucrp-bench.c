@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ucrp-bench -- session capacity benchmark
+ *
+ * opens sessions against a ucrp server as fast as it will accept them
+ * and reports the accept rate (connect until the first message from
+ * the server) and, given the server's pid, the memory the server
+ * spends per session.  run it against the fork-per-connection server
+ * and the event driven one to compare the two.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <ucrp.h>
+
+extern char *__progname;
+
+static double   now(void);
+static long     server_kb(pid_t);
+static long     proc_kb(pid_t);
+static int      bench_connect(struct addrinfo *, int);
+static void     usage(void);
+
+/*
+ * now()
+ *
+ * returns the current time in seconds
+ */
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * proc_kb()
+ *
+ * returns the proportional set size of 'pid' in kB (shared pages
+ * are split between the processes sharing them), falling back to
+ * the resident set size.  returns 0 if unknown.
+ */
+static long
+proc_kb(pid_t pid)
+{
+	char path[64], line[256];
+	FILE *fp;
+	long kb;
+
+	kb = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+	if ((fp = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+				break;
+		fclose(fp);
+		return kb;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if ((fp = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+				break;
+		fclose(fp);
+	}
+
+	return kb;
+}
+
+/*
+ * server_kb()
+ *
+ * returns the memory used by 'pid' and all of its descendants in kB,
+ * so forked per-session servers are counted too.
+ */
+static long
+server_kb(pid_t pid)
+{
+	char path[64];
+	DIR *dp;
+	struct dirent *de;
+	FILE *fp;
+	pid_t *pids, *ppids, p;
+	int i, j, n, max, grew;
+	char *mark;
+	long kb;
+
+	max = 65536;
+	pids = calloc(max, sizeof(pid_t));
+	ppids = calloc(max, sizeof(pid_t));
+	mark = calloc(max, sizeof(char));
+	if (pids == NULL || ppids == NULL || mark == NULL)
+		err(EX_OSERR, "calloc");
+
+	/* collect every process and its parent */
+	n = 0;
+	if ((dp = opendir("/proc")) == NULL)
+		err(EX_OSERR, "/proc");
+
+	while ((de = readdir(dp)) != NULL && n < max) {
+		if ((p = atoi(de->d_name)) <= 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/stat", (int)p);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+
+		if (fscanf(fp, "%*d %*s %*c %d", &ppids[n]) == 1)
+			pids[n++] = p;
+		fclose(fp);
+	}
+	closedir(dp);
+
+	/* mark the descendants of pid */
+	for (i = 0; i < n; i++)
+		mark[i] = (pids[i] == pid);
+
+	do {
+		grew = 0;
+		for (i = 0; i < n; i++) {
+			if (mark[i])
+				continue;
+			for (j = 0; j < n; j++) {
+				if (mark[j] && ppids[i] == pids[j]) {
+					mark[i] = grew = 1;
+					break;
+				}
+			}
+		}
+	} while (grew);
+
+	kb = 0;
+	for (i = 0; i < n; i++)
+		if (mark[i])
+			kb += proc_kb(pids[i]);
+
+	free(pids);
+	free(ppids);
+	free(mark);
+
+	return kb;
+}
+
+/*
+ * bench_connect()
+ *
+ * start a non-blocking connect
+ *
+ * returns the socket or -1 on error
+ */
+static int
+bench_connect(struct addrinfo *ai, int ep)
+{
+	struct epoll_event ee;
+	int s;
+
+	s = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+		   ai->ai_protocol);
+	if (s == -1)
+		return -1;
+
+	if (connect(s, ai->ai_addr, ai->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		close(s);
+		return -1;
+	}
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN;
+	ee.data.fd = s;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ee) == -1) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c concurrency] [-h host] "
+		"[-n sessions] [-P server-pid] [-p port]\n", __progname);
+	exit(EX_USAGE);
+}
+
+/*
+ * main()
+ */
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints, *ai;
+	struct epoll_event evs[256];
+	struct rlimit rl;
+	int *conns;
+	char *nodename, *servname;
+	char buf[UCRP_MAX_MSGSIZE];
+	int ch, ep, i, n, ret, sessions, concurrency;
+	int started, inflight, open, failed;
+	long kb0, kb1;
+	double t0, t1;
+	pid_t pid;
+
+	nodename = "localhost";
+	servname = UCRP_SERVICE;
+	sessions = 1000;
+	concurrency = 64;
+	pid = 0;
+
+	while ((ch = getopt(argc, argv, "c:h:n:P:p:")) != -1)
+		switch (ch) {
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'h':
+			nodename = optarg;
+			break;
+		case 'n':
+			sessions = atoi(optarg);
+			break;
+		case 'P':
+			pid = atoi(optarg);
+			break;
+		case 'p':
+			servname = optarg;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+
+	if (sessions < 1 || concurrency < 1)
+		usage();
+
+	/* we need a descriptor per session */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < sessions + 16) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(nodename, servname, &hints, &ai)) != 0)
+		errx(EX_NOHOST, "%s", gai_strerror(ret));
+
+	if ((conns = calloc(sessions, sizeof(*conns))) == NULL)
+		err(EX_OSERR, "calloc");
+
+	if ((ep = epoll_create1(0)) == -1)
+		err(EX_OSERR, "epoll_create1");
+
+	kb0 = pid ? server_kb(pid) : 0;
+
+	/*
+	 * connect phase: keep 'concurrency' connects outstanding until
+	 * every session has heard from the server.
+	 */
+	started = inflight = open = failed = 0;
+	t0 = now();
+	while (open + failed < sessions) {
+		while (inflight < concurrency && started < sessions) {
+			conns[started] = bench_connect(ai, ep);
+			if (conns[started] == -1) {
+				warn("connect");
+				failed++;
+			} else
+				inflight++;
+			started++;
+		}
+
+		if ((n = epoll_wait(ep, evs, 256, 30000)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "epoll_wait");
+		}
+
+		if (n == 0)
+			errx(EX_UNAVAILABLE, "timed out, %d of %d sessions "
+			     "open", open, sessions);
+
+		for (i = 0; i < n; i++) {
+			ret = recv(evs[i].data.fd, buf, sizeof(buf), 0);
+			if (ret == -1 && errno == EAGAIN)
+				continue;
+
+			inflight--;
+			epoll_ctl(ep, EPOLL_CTL_DEL, evs[i].data.fd, NULL);
+
+			if (ret < 1) {
+				failed++;
+				continue;
+			}
+
+			open++;
+		}
+	}
+	t1 = now();
+
+	/* give forked servers a moment to settle */
+	if (pid)
+		sleep(1);
+	kb1 = pid ? server_kb(pid) : 0;
+
+	printf("sessions:          %d (%d failed)\n", open, failed);
+	printf("elapsed:           %.3f s\n", t1 - t0);
+	printf("accepts/s:         %.0f\n", open / (t1 - t0));
+
+	if (pid && open > 0) {
+		printf("server memory:     %ld kB -> %ld kB\n", kb0, kb1);
+		printf("bytes/session:     %.0f\n",
+		       (kb1 - kb0) * 1024.0 / open);
+		if (kb1 > kb0)
+			printf("sessions/GB:       %.0f\n",
+			       open * 1048576.0 / (kb1 - kb0));
+	}
+
+	for (i = 0; i < sessions; i++)
+		if (conns[i] != -1)
+			close(conns[i]);
+
+	freeaddrinfo(ai);
+
+	return EX_OK;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ucrp-cmdbench -- command tree benchmark
+ *
+ * builds a synthetic grammar of 'nodes' keywords, 'fanout' below each
+ * node, and times compiling it, parsing complete commands,
+ * completing abbreviated ones and rendering help, the work a server
+ * does for every UCRP_COMMAND, Tab and '?'.  keywords are made of a
+ * few syllables so that many share prefixes, as they do in real CLIs.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ucrp.h>
+#include <ucrp_cmd.h>
+
+extern char *__progname;
+
+static char *syllables[] = {
+	"ad", "bgp", "con", "dis", "en", "fig", "ip", "int", "la", "mac",
+	"ne", "ospf", "po", "rou", "ser", "sta", "te", "un", "vl", "x"
+};
+#define NSYLLABLES ((sizeof(syllables) / sizeof(syllables[0])))
+
+static double now(void);
+static int    dblcmp(const void *, const void *);
+static void   report(char *, double *, int);
+static void   keyword(char *, size_t, int);
+static int    path(UCRP_CMDTREE *, int *, int, int, char *, size_t);
+static void   usage(void);
+
+/*
+ * now()
+ *
+ * returns the current time in seconds
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * dblcmp()
+ */
+static int
+dblcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * report()
+ *
+ * print the latency percentiles of 'n' samples in seconds
+ */
+static void
+report(char *what, double *t, int n)
+{
+	qsort(t, n, sizeof(*t), dblcmp);
+
+	printf("%-10s p50 %7.2f us  p99 %7.2f us  max %8.2f us\n", what,
+	       t[n / 2] * 1e6, t[n * 99 / 100] * 1e6, t[n - 1] * 1e6);
+
+	return;
+}
+
+/*
+ * keyword()
+ *
+ * make up the keyword for sibling number 'n', unique among siblings
+ */
+static void
+keyword(char *buf, size_t size, int n)
+{
+	size_t len;
+
+	len = 0;
+	buf[0] = '\0';
+	do {
+		len += snprintf(buf + len, size - len, "%s",
+				syllables[n % NSYLLABLES]);
+		n /= NSYLLABLES;
+	} while (n > 0 && len < size);
+
+	return;
+}
+
+/*
+ * path()
+ *
+ * write the keywords from the top level down to 'id' into 'buf'
+ *
+ * returns the number of keywords
+ */
+static int
+path(UCRP_CMDTREE *t, int *parent, int id, int abbrev, char *buf,
+     size_t size)
+{
+	char *name;
+	size_t len;
+	int n;
+
+	if (id == UCRP_CMD_ROOT) {
+		buf[0] = '\0';
+		return 0;
+	}
+
+	n = path(t, parent, parent[id], 0, buf, size);
+	len = strlen(buf);
+	name = ucrp_cmd_name(t, id);
+
+	/* the last one cut short, as if Tab was hit half way */
+	snprintf(buf + len, size - len, "%s%.*s", n > 0 ? " " : "",
+		 abbrev ? (int)(strlen(name) + 1) / 2 : (int)strlen(name),
+		 name);
+
+	return n + 1;
+}
+
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-f fanout] [-i iterations] [-n nodes]\n",
+		__progname);
+	exit(EX_USAGE);
+}
+
+/*
+ * main()
+ */
+int
+main(int argc, char *argv[])
+{
+	UCRP_CMDTREE *t;
+	UCRP_CMDMATCH m;
+	UCRP_CMDCOMP *comp;
+	char name[64], line[UCRP_MAX_PAYLOAD];
+	int *parent, *kids;
+	double *tparse, *tcomp, t0, t1;
+	int ch, i, id, p, nodes, fanout, iterations, bad, cands;
+
+	nodes = 100000;
+	fanout = 50;
+	iterations = 100000;
+
+	while ((ch = getopt(argc, argv, "f:i:n:")) != -1)
+		switch (ch) {
+		case 'f':
+			fanout = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'n':
+			nodes = atoi(optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+
+	if (nodes < 1 || fanout < 1 || iterations < 1)
+		usage();
+
+	parent = calloc(nodes + 1, sizeof(*parent));
+	kids = calloc(nodes + 1, sizeof(*kids));
+	tparse = calloc(iterations, sizeof(*tparse));
+	tcomp = calloc(iterations, sizeof(*tcomp));
+	comp = malloc(sizeof(*comp));
+	if (parent == NULL || kids == NULL || tparse == NULL ||
+	    tcomp == NULL || comp == NULL)
+		err(EX_OSERR, "malloc");
+
+	if ((t = ucrp_cmd_new()) == NULL)
+		errx(EX_OSERR, "ucrp_cmd_new failed");
+
+	/* breadth first, 'fanout' keywords below each node */
+	t0 = now();
+	for (i = 0, p = UCRP_CMD_ROOT; i < nodes; i++) {
+		if (kids[p] == fanout)
+			p++;
+
+		keyword(name, sizeof(name), kids[p]++);
+		if ((id = ucrp_cmd_add(t, p, name, "help", UCRP_CMD_ARGS,
+				       name)) == -1)
+			errx(EX_SOFTWARE, "ucrp_cmd_add failed");
+		parent[id] = p;
+	}
+	t1 = now();
+	printf("grammar:   %d keywords, %d below each\n", nodes, fanout);
+	printf("add:       %.1f ms\n", (t1 - t0) * 1e3);
+
+	t0 = now();
+	if (ucrp_cmd_compile(t) == -1)
+		errx(EX_SOFTWARE, "ucrp_cmd_compile failed");
+	t1 = now();
+	printf("compile:   %.1f ms\n", (t1 - t0) * 1e3);
+
+	srandom(4646);
+	bad = cands = 0;
+	for (i = 0; i < iterations; i++) {
+		id = 1 + random() % nodes;
+
+		path(t, parent, id, 0, line, sizeof(line));
+		t0 = now();
+		if (ucrp_cmd_parse(t, line, &m) != UCRP_CMD_OK ||
+		    m.node != id)
+			bad++;
+		tparse[i] = now() - t0;
+
+		path(t, parent, id, 1, line, sizeof(line));
+		t0 = now();
+		cands += ucrp_cmd_complete(t, line, comp);
+		tcomp[i] = now() - t0;
+	}
+
+	report("parse:", tparse, iterations);
+	report("complete:", tcomp, iterations);
+	printf("candidates: %.1f per completion\n", (double)cands / iterations);
+
+	/* the worst Tab there is: everything at the top level */
+	t0 = now();
+	line[0] = '\0';
+	cands = ucrp_cmd_complete(t, line, comp);
+	t1 = now();
+	printf("empty Tab: %.2f us, %d candidates, %d listed\n",
+	       (t1 - t0) * 1e6, cands, comp->ncand);
+
+	/* help is rendered once, then only looked up */
+	t0 = now();
+	if (ucrp_cmd_helpbuf(t, UCRP_CMD_ROOT) == NULL)
+		errx(EX_SOFTWARE, "ucrp_cmd_helpbuf failed");
+	t1 = now();
+	printf("top help:  %.2f ms to render, ", (t1 - t0) * 1e3);
+
+	t0 = now();
+	for (i = 0; i < iterations; i++)
+		ucrp_cmd_helpbuf(t, UCRP_CMD_ROOT);
+	t1 = now();
+	printf("%.3f us after that\n", (t1 - t0) * 1e6 / iterations);
+
+	if (bad)
+		printf("MISMATCHES: %d\n", bad);
+
+	ucrp_cmd_free(t);
+
+	return bad ? EX_SOFTWARE : EX_OK;
+}
@@ -0,0 +1,763 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ucrp-fanout -- run a command on many UCRP servers at once
+ *
+ * connects to every host from one event loop, no more than
+ * 'parallel' at a time, and runs the command on each once it has
+ * prompted.  what a host displays is printed a line at a time as it
+ * comes, behind the host's name:
+ *
+ *	r1: Version 1.2
+ *	r2: Version 1.3
+ *
+ * or, with -g, once every host is done, with the hosts that showed
+ * the same output grouped under one heading:
+ *
+ *	=== r1, r3 (2)
+ *	Version 1.2
+ *
+ * hosts are given after the command, or a line each in a file, as
+ * host[:port], an IPv6 address in brackets.  a host that can't be
+ * reached, asks for input or takes longer than 'timeout' seconds is
+ * reported on stderr.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ucrp.h>
+
+#define FO_RXSIZE    4096                  /* >= UCRP_MAX_MSGSIZE      */
+#define FO_TXSIZE    (2 * UCRP_MAX_MSGSIZE)
+#define FO_MAXEVENTS 256
+#define FO_OUTSIZE   4096                  /* first output buffer      */
+
+#define HOST_WAITING 0                     /* not started yet          */
+#define HOST_CONNECT 1                     /* waiting for the prompt   */
+#define HOST_RUNNING 2                     /* waiting for the next one */
+#define HOST_DONE    3
+#define HOST_FAILED  4
+
+typedef struct _fo_host {
+	char    *name;                     /* as given, the label      */
+	char    *host;
+	char    *port;
+	struct addrinfo *res;              /* resolved, before the loop */
+	struct addrinfo *ai;               /* tried, NULL once it works */
+	int      fd;
+	int      state;                    /* HOST_*                   */
+	double   deadline;
+	struct _fo_host *group;            /* -g, first with the same  */
+	int      ngroup;                   /* output, and their number */
+	char    *out;                      /* displayed, not printed   */
+	size_t   outlen;
+	size_t   outsize;
+	size_t   rxlen;
+	size_t   txlen;
+	uint8_t  rx[FO_RXSIZE];
+	uint8_t  tx[FO_TXSIZE];
+} FO_HOST;
+
+extern char *__progname;
+
+static FO_HOST *hosts;
+static int      nhosts;
+static int      width;                     /* of the longest name      */
+static int      ep;
+static int      grouped;
+static int      running, failed;
+static char    *command;
+static char    *defport = UCRP_SERVICE;
+
+static double   now(void);
+static void     host_add(char *);
+static void     host_load(char *);
+static void     host_resolve(FO_HOST *);
+static int      host_connect(FO_HOST *);
+static void     host_fail(FO_HOST *, const char *);
+static void     host_send(FO_HOST *, UCRP *);
+static void     host_flush(FO_HOST *);
+static void     host_output(FO_HOST *, const void *, size_t);
+static void     host_print(FO_HOST *, int);
+static void     host_done(FO_HOST *);
+static void     host_msg(FO_HOST *, UCRP *);
+static void     host_read(FO_HOST *);
+static void     group_print(void);
+static void     usage(void);
+
+/*
+ * now()
+ *
+ * returns the current time in seconds
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * host_add()
+ *
+ * add a host given as host[:port]
+ */
+static void
+host_add(char *arg)
+{
+	FO_HOST *hp;
+	char *host, *port, *p;
+	int len;
+
+	if ((host = strdup(arg)) == NULL)
+		err(EX_OSERR, "strdup");
+
+	port = defport;
+	if (host[0] == '[' && (p = strchr(host, ']')) != NULL) {
+		*p++ = '\0';
+		host++;
+		if (*p == ':')
+			port = p + 1;
+	} else if ((p = strchr(host, ':')) != NULL &&
+		   strchr(p + 1, ':') == NULL) {
+		*p = '\0';
+		port = p + 1;
+	}
+
+	if ((nhosts & (nhosts - 1)) == 0 &&
+	    (hosts = realloc(hosts, (nhosts ? nhosts * 2 : 1) *
+			     sizeof(*hosts))) == NULL)
+		err(EX_OSERR, "realloc");
+
+	hp = &hosts[nhosts++];
+	memset(hp, 0, sizeof(*hp));
+	hp->name = arg;
+	hp->host = host;
+	hp->port = port;
+	hp->fd = -1;
+
+	if ((len = strlen(arg)) > width)
+		width = len;
+
+	return;
+}
+
+/*
+ * host_load()
+ *
+ * add the hosts in 'path', one a line, '#' starts a comment
+ */
+static void
+host_load(char *path)
+{
+	FILE *fp;
+	char line[1024], *p;
+
+	if (strcmp(path, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(path, "r")) == NULL)
+		err(EX_NOINPUT, "%s", path);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		p = line + strspn(line, " \t\r\n");
+		p[strcspn(p, " \t\r\n")] = '\0';
+		if (*p == '\0')
+			continue;
+		if ((p = strdup(p)) == NULL)
+			err(EX_OSERR, "strdup");
+		host_add(p);
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return;
+}
+
+/*
+ * host_resolve()
+ *
+ * look the host up, before the loop where a lookup would hold up
+ * every other host
+ */
+static void
+host_resolve(FO_HOST *hp)
+{
+	struct addrinfo hints;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(hp->host, hp->port, &hints, &hp->res)) != 0) {
+		hp->res = NULL;
+		host_fail(hp, gai_strerror(ret));
+		return;
+	}
+	hp->ai = hp->res;
+
+	return;
+}
+
+/*
+ * host_connect()
+ *
+ * start a non-blocking connect to the host, to the address it is at
+ * and on to the next one each that fails right away.  one that fails
+ * later is tried again from host_read().
+ *
+ * returns 0 or -1 on error
+ */
+static int
+host_connect(FO_HOST *hp)
+{
+	struct epoll_event ee;
+	struct addrinfo *ai;
+	int on = 1, ret = 0;
+
+	/* it could not be resolved */
+	if (hp->state == HOST_FAILED)
+		return -1;
+
+	if (hp->state == HOST_WAITING) {
+		hp->state = HOST_CONNECT;
+		running++;
+	}
+
+	for (; (ai = hp->ai) != NULL; hp->ai = ai->ai_next) {
+		if (hp->fd != -1)
+			close(hp->fd);
+
+		hp->fd = socket(ai->ai_family,
+				ai->ai_socktype | SOCK_NONBLOCK,
+				ai->ai_protocol);
+		if (hp->fd == -1) {
+			ret = errno;
+			continue;
+		}
+
+		setsockopt(hp->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		if (connect(hp->fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+		    errno != EINPROGRESS) {
+			ret = errno;
+			continue;
+		}
+
+		memset(&ee, 0, sizeof(ee));
+		ee.events = EPOLLIN;
+		ee.data.ptr = hp;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, hp->fd, &ee) == -1) {
+			ret = errno;
+			continue;
+		}
+
+		return 0;
+	}
+
+	host_fail(hp, strerror(ret));
+
+	return -1;
+}
+
+/*
+ * host_fail()
+ *
+ * say why the host is no use and close it
+ */
+static void
+host_fail(FO_HOST *hp, const char *why)
+{
+	if (hp->state == HOST_DONE || hp->state == HOST_FAILED)
+		return;
+
+	fprintf(stderr, "%s: %s: %s\n", __progname, hp->name, why);
+
+	if (hp->fd != -1)
+		close(hp->fd);
+	hp->fd = -1;
+	if (hp->state != HOST_WAITING)
+		running--;
+	hp->state = HOST_FAILED;
+	failed++;
+
+	if (hp->res != NULL)
+		freeaddrinfo(hp->res);
+	hp->res = hp->ai = NULL;
+
+	free(hp->out);
+	hp->out = NULL;
+	hp->outlen = 0;
+
+	return;
+}
+
+/*
+ * host_send()
+ *
+ * queue message 'msg' for the host
+ */
+static void
+host_send(FO_HOST *hp, UCRP *msg)
+{
+	size_t len = UCRP_HDR_SIZE + msg->length;
+
+	if (hp->txlen + len > sizeof(hp->tx)) {
+		host_fail(hp, "output overrun");
+		return;
+	}
+
+	ucrp_msg_hton(msg);
+	memcpy(hp->tx + hp->txlen, msg, len);
+	hp->txlen += len;
+
+	host_flush(hp);
+
+	return;
+}
+
+/*
+ * host_flush()
+ *
+ * write out what is queued, waiting for room if there is none
+ */
+static void
+host_flush(FO_HOST *hp)
+{
+	struct epoll_event ee;
+	ssize_t ret;
+
+	if (hp->fd == -1)
+		return;
+
+	while (hp->txlen > 0) {
+		ret = send(hp->fd, hp->tx, hp->txlen, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && errno == EAGAIN)
+			break;
+		if (ret == -1) {
+			host_fail(hp, strerror(errno));
+			return;
+		}
+
+		memmove(hp->tx, hp->tx + ret, hp->txlen - ret);
+		hp->txlen -= ret;
+	}
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN | (hp->txlen > 0 ? EPOLLOUT : 0);
+	ee.data.ptr = hp;
+	epoll_ctl(ep, EPOLL_CTL_MOD, hp->fd, &ee);
+
+	return;
+}
+
+/*
+ * host_output()
+ *
+ * keep what the host displayed, labelled it is printed as soon as
+ * its lines are whole
+ */
+static void
+host_output(FO_HOST *hp, const void *data, size_t len)
+{
+	size_t size;
+
+	if (hp->outlen + len > hp->outsize) {
+		for (size = hp->outsize ? hp->outsize : FO_OUTSIZE;
+		     size < hp->outlen + len; size *= 2)
+			;
+		if ((hp->out = realloc(hp->out, size)) == NULL)
+			err(EX_OSERR, "realloc");
+		hp->outsize = size;
+	}
+
+	memcpy(hp->out + hp->outlen, data, len);
+	hp->outlen += len;
+
+	if (!grouped)
+		host_print(hp, 0);
+
+	return;
+}
+
+/*
+ * host_print()
+ *
+ * print the whole lines the host displayed, and with 'all' the rest
+ * of them too
+ */
+static void
+host_print(FO_HOST *hp, int all)
+{
+	char *p, *nl, *end;
+
+	p = hp->out;
+	end = hp->out + hp->outlen;
+
+	while (p < end) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL) {
+			if (!all)
+				break;
+			nl = end;
+		}
+		printf("%s:%*s %.*s\n", hp->name,
+		       width - (int)strlen(hp->name), "",
+		       (int)(nl - p - (nl > p && nl[-1] == '\r')), p);
+		p = nl + 1;
+	}
+
+	if (p > end)
+		p = end;
+	hp->outlen = end - p;
+	memmove(hp->out, p, hp->outlen);
+
+	return;
+}
+
+/*
+ * host_done()
+ *
+ * the command has ended on the host, which is closed
+ */
+static void
+host_done(FO_HOST *hp)
+{
+	close(hp->fd);
+	hp->fd = -1;
+	hp->state = HOST_DONE;
+	running--;
+
+	if (!grouped) {
+		host_print(hp, 1);
+		fflush(stdout);
+		free(hp->out);
+		hp->out = NULL;
+	}
+
+	return;
+}
+
+/*
+ * host_msg()
+ *
+ * act on message 'rm' from the host
+ */
+static void
+host_msg(FO_HOST *hp, UCRP *rm)
+{
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	UCRP_EXT ext;
+
+	switch (rm->type) {
+	case UCRP_PROMPT:
+		if (hp->state == HOST_RUNNING) {
+			host_done(hp);
+			break;
+		}
+
+		/*
+		 * a program, not a person, and the server may answer
+		 * before it runs the command, or not at all
+		 */
+		memset(&ext, 0, sizeof(ext));
+		ext.flags = UCRP_EXT_BATCH;
+		ucrp_msg_extend(sm, &ext);
+		host_send(hp, sm);
+		ucrp_msg_command(sm, command);
+		host_send(hp, sm);
+		hp->state = HOST_RUNNING;
+		break;
+	case UCRP_DISPLAY:
+		/* the banner isn't the command's */
+		if (hp->state == HOST_RUNNING)
+			host_output(hp, UCRP_PAYLOAD(rm), rm->length);
+		break;
+	case UCRP_ASK:
+	case UCRP_EXEC:
+		host_fail(hp, rm->type == UCRP_ASK ? "asked for input" :
+			  "asked to run a program");
+		break;
+	}
+
+	return;
+}
+
+/*
+ * host_read()
+ *
+ * read what is available and act on every complete message
+ */
+static void
+host_read(FO_HOST *hp)
+{
+	uint16_t rmbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *rm = (UCRP *)rmbuf;
+	ssize_t ret;
+	size_t len, off;
+
+	ret = recv(hp->fd, hp->rx + hp->rxlen, sizeof(hp->rx) - hp->rxlen, 0);
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	/* the connect failed, on to the host's next address */
+	if (ret == -1 && hp->ai != NULL && hp->ai->ai_next != NULL) {
+		hp->ai = hp->ai->ai_next;
+		host_connect(hp);
+		return;
+	}
+	if (ret < 1) {
+		host_fail(hp, ret == -1 ? strerror(errno) :
+			  "connection closed");
+		return;
+	}
+	hp->rxlen += ret;
+
+	/* connected, the addresses are no longer needed */
+	if (hp->res != NULL) {
+		freeaddrinfo(hp->res);
+		hp->res = hp->ai = NULL;
+	}
+
+	off = 0;
+	while (hp->rxlen - off >= UCRP_HDR_SIZE) {
+		memcpy(rm, hp->rx + off, UCRP_HDR_SIZE);
+		ucrp_msg_ntoh(rm);
+		if (rm->length > UCRP_MAX_PAYLOAD) {
+			host_fail(hp, "message too long");
+			return;
+		}
+
+		len = UCRP_HDR_SIZE + rm->length;
+		if (hp->rxlen - off < len)
+			break;
+
+		memcpy(UCRP_PAYLOAD(rm), hp->rx + off + UCRP_HDR_SIZE,
+		       rm->length);
+		UCRP_PAYLOAD(rm)[rm->length] = '\0';
+		off += len;
+
+		host_msg(hp, rm);
+		if (hp->fd == -1)
+			return;
+	}
+
+	memmove(hp->rx, hp->rx + off, hp->rxlen - off);
+	hp->rxlen -= off;
+
+	return;
+}
+
+/*
+ * group_print()
+ *
+ * print the output of every host that is done once, under the names
+ * of all the hosts that showed just the same, in the order of their
+ * first host
+ */
+static void
+group_print(void)
+{
+	FO_HOST *hp, *gp;
+	int i, j, n;
+
+	for (i = 0; i < nhosts; i++) {
+		hp = &hosts[i];
+		if (hp->state != HOST_DONE)
+			continue;
+
+		for (j = 0; j < i; j++) {
+			gp = &hosts[j];
+			if (gp->group == gp && gp->outlen == hp->outlen &&
+			    memcmp(gp->out, hp->out, hp->outlen) == 0)
+				break;
+		}
+		hp->group = j < i ? &hosts[j] : hp;
+		hp->group->ngroup++;
+	}
+
+	for (i = 0; i < nhosts; i++) {
+		gp = &hosts[i];
+		if (gp->state != HOST_DONE || gp->group != gp)
+			continue;
+
+		printf("=== ");
+		for (j = i, n = 0; j < nhosts; j++)
+			if (hosts[j].state == HOST_DONE &&
+			    hosts[j].group == gp)
+				printf("%s%s", n++ ? ", " : "", hosts[j].name);
+		printf(" (%d)\n", gp->ngroup);
+
+		fwrite(gp->out, 1, gp->outlen, stdout);
+		if (gp->outlen > 0 && gp->out[gp->outlen - 1] != '\n')
+			putchar('\n');
+	}
+
+	return;
+}
+
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-g] [-c parallel] [-f file] [-p port] "
+		"[-t timeout]\n"
+		"       command [host[:port] ...]\n", __progname);
+	exit(EX_USAGE);
+}
+
+/*
+ * main()
+ */
+int
+main(int argc, char *argv[])
+{
+	struct epoll_event evs[FO_MAXEVENTS];
+	struct rlimit rl;
+	FO_HOST *hp;
+	char **files;
+	double timeout, t;
+	int ch, i, n, ms, nfiles, parallel, started, oldest;
+
+	files = NULL;
+	nfiles = 0;
+	parallel = 64;
+	timeout = 30;
+
+	while ((ch = getopt(argc, argv, "c:f:gp:t:")) != -1)
+		switch (ch) {
+		case 'c':
+			parallel = atoi(optarg);
+			break;
+		case 'f':
+			if ((files = realloc(files, (nfiles + 1) *
+					     sizeof(*files))) == NULL)
+				err(EX_OSERR, "realloc");
+			files[nfiles++] = optarg;
+			break;
+		case 'g':
+			grouped = 1;
+			break;
+		case 'p':
+			defport = optarg;
+			break;
+		case 't':
+			timeout = atof(optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || parallel < 1 || timeout <= 0)
+		usage();
+	command = argv[0];
+
+	for (i = 1; i < argc; i++)
+		host_add(argv[i]);
+	for (i = 0; i < nfiles; i++)
+		host_load(files[i]);
+	if (nhosts == 0)
+		usage();
+
+	/* we need a descriptor per host running */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < parallel + 16) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if ((ep = epoll_create1(0)) == -1)
+		err(EX_OSERR, "epoll_create1");
+
+	for (i = 0; i < nhosts; i++)
+		host_resolve(&hosts[i]);
+
+	/*
+	 * keep 'parallel' hosts running until every one has had its go.
+	 * the one started first that is still running is the next to
+	 * time out.
+	 */
+	started = oldest = 0;
+	while (started < nhosts || running > 0) {
+		t = now();
+		while (running < parallel && started < nhosts) {
+			hp = &hosts[started++];
+			hp->deadline = t + timeout;
+			host_connect(hp);
+		}
+
+		for (; oldest < started; oldest++) {
+			hp = &hosts[oldest];
+			if (hp->state == HOST_DONE ||
+			    hp->state == HOST_FAILED)
+				continue;
+			if (hp->deadline > t)
+				break;
+			host_fail(hp, "timed out");
+		}
+		if (running == 0)
+			continue;
+
+		ms = (hosts[oldest].deadline - t) * 1000 + 1;
+		if ((n = epoll_wait(ep, evs, FO_MAXEVENTS, ms)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "epoll_wait");
+		}
+
+		for (i = 0; i < n; i++) {
+			hp = evs[i].data.ptr;
+			if (hp->fd != -1 && evs[i].events & EPOLLOUT)
+				host_flush(hp);
+			if (hp->fd != -1 &&
+			    evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				host_read(hp);
+		}
+	}
+
+	if (grouped)
+		group_print();
+
+	return failed > 0 ? EX_UNAVAILABLE : EX_OK;
+}
@@ -0,0 +1,1599 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ucrp-gateway -- route commands to UCRP servers behind it
+ *
+ * every target is a UCRP server given a name on the command line.  a
+ * command line that starts with a target's name runs the rest of the
+ * line there, its output and prompt come back as they are:
+ *
+ *	gw> r1 show version
+ *
+ * the gateway keeps a few connections to every target open all the
+ * time, and the commands of all its sessions share them, each on a
+ * logical channel (UCRP_EXT_CHANNELS) of its own.  going from one
+ * target to the next costs no connect and no login, only the command.
+ * no more than 'limit' commands run on a target at once, others wait
+ * their turn for a while and then give up.
+ *
+ * commands run on the session's thread and never wait there.  every
+ * connection has a thread of its own that reads it, queues each
+ * message for the command on its channel and wakes the command's
+ * session, which passes the queue on.  a command waiting for its
+ * turn waits on a timer and is handed a channel once one is free,
+ * and commands that come on a client channel meanwhile wait behind it.
+ * a command whose client doesn't keep up has its output dropped once
+ * GW_QUEUE messages wait for it, and its target is told to stop, so
+ * that the connection goes on for all the others.
+ *
+ * UCRP_INTERRUPT is passed on to the target, and the client's answer
+ * to a UCRP_ASK or UCRP_EXEC goes back to the channel that asked.
+ * the target's channel is kept for it until the client answers or
+ * runs its next command.  completion and help know the targets and
+ * the gateway's own commands only.
+ */
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ucrp.h>
+#include <ucrp_cmd.h>
+#include <ucrp_server.h>
+
+#define GW_CONNS   2               /* connections to every target    */
+#define GW_LIMIT   32              /* commands running on a target   */
+#define GW_WAIT    10              /* seconds to wait for a turn     */
+#define GW_QUEUE   64              /* messages held for a command    */
+#define GW_RETRY   1               /* seconds between connects       */
+
+extern char *__progname;
+
+typedef struct _gw_msg {
+	struct _gw_msg *next;
+	uint16_t        buf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned */
+} GW_MSG;
+
+struct _gw_conn;
+struct _gw_route;
+
+typedef struct _gw_slot {          /* a channel of a connection      */
+	struct _gw_conn *cn;
+	int             id;
+	int             busy;      /* taken by a command             */
+	int             held;      /* done, kept for the client's    */
+				   /* answer                         */
+	int             dead;      /* the connection was lost        */
+	int             full;      /* its client fell behind         */
+	int             ended;     /* the prompt came once it was    */
+	int             stopped;   /* the target was told to stop    */
+	int             seen;      /* and said UCRP_INTERRUPTED      */
+	unsigned int    epoch;     /* of the connection it was taken */
+	struct _gw_route *rt;      /* whose it is, NULL once it only */
+				   /* runs down                      */
+	GW_MSG         *head;
+	GW_MSG        **tail;
+	int             nq;
+} GW_SLOT;
+
+struct _gw_target;
+
+typedef struct _gw_conn {
+	struct _gw_target *tp;
+	int             n;
+	int             fd;
+	int             up;
+	int             interrupt; /* the target has UCRP_INTERRUPT  */
+	unsigned int    epoch;     /* counts the connections lost    */
+	int             nbusy;     /* slots taken                    */
+	int             next;      /* where to look for a free one   */
+	pthread_mutex_t wlock;     /* one writer at a time, and fd   */
+	pthread_t       thread;
+	GW_SLOT         slot[UCRP_MAX_CHAN + 1];
+} GW_CONN;
+
+typedef struct _gw_cmd GW_CMD;
+
+typedef struct _gw_target {
+	char           *name;
+	char           *host;
+	char           *port;
+	char            help[64];
+	struct addrinfo *ai;
+	int             running;
+	int             waiting;
+	uint64_t        commands;
+	uint64_t        busy;      /* gave up waiting for a turn     */
+	uint64_t        lost;      /* connections                    */
+	pthread_mutex_t lock;      /* all of the above, slots, waitq */
+	TAILQ_HEAD(, _gw_route) waitq;  /* commands waiting for a turn */
+	GW_CONN        *conns;
+} GW_TARGET;
+
+typedef void (function_t)(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+
+struct _gw_cmd {
+	char       *name;
+	char       *help;
+	function_t *f;
+	int         flags;
+	GW_TARGET  *tp;            /* or a target                    */
+};
+
+struct _gw_sess;
+
+typedef struct _gw_route {         /* the commands of a client channel */
+	struct _gw_sess *gs;
+	UCRP_CHANNEL   *cp;
+	GW_TARGET      *tp;        /* the one it runs on or waits for */
+	GW_SLOT        *sl;        /* it runs on, or is kept for it  */
+	GW_SLOT        *given;     /* handed over while it waited    */
+	int             waiting;   /* on tp->waitq                   */
+	int             asked;     /* a UCRP_ASK or UCRP_EXEC came   */
+	time_t          since;     /* it started waiting             */
+	UCRP_TIMER     *timer;     /* gives up waiting               */
+	GW_MSG         *cmdq;      /* commands that came meanwhile   */
+	GW_MSG        **cmdtail;
+	TAILQ_ENTRY(_gw_route) entry;
+	char            line[UCRP_MAX_PAYLOAD];
+} GW_ROUTE;
+
+typedef struct _gw_sess {
+	UCRP_SESSION   *sp;
+	int             fd;        /* eventfd, a route has news      */
+	int             woken;     /* and fd says so already         */
+	pthread_mutex_t lock;      /* woken                          */
+	UCRP_WATCH     *watch;
+	GW_ROUTE       *rt[UCRP_MAX_CHAN + 1];  /* of each channel   */
+} GW_SESS;
+
+static GW_TARGET    *targets;
+static int           ntargets;
+static int           nconns = GW_CONNS;
+static int           limit = GW_LIMIT;
+static int           patience = GW_WAIT;
+static char         *prompt = "gw> ";
+static UCRP_CMDTREE *cmds;
+
+static void     do_targets(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+static void     do_quit(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+
+static GW_CMD cmd_main[] = {
+	{ "targets", "show the targets and their connections", do_targets },
+	{ "quit", "exit out of here", do_quit },
+	{ NULL }
+};
+
+static int      target_add(char *);
+static int      conn_open(GW_CONN *);
+static void    *conn_run(void *);
+static void     conn_deliver(GW_CONN *, UCRP *);
+static void     conn_lost(GW_CONN *);
+static GW_SLOT *slot_get(GW_TARGET *);
+static int      slot_send(GW_SLOT *, UCRP *);
+static void     slot_free(GW_SLOT *);
+static void     slot_abandon(GW_SLOT *);
+static void     target_grant(GW_TARGET *);
+static void     sess_wake(GW_SESS *);
+static void     sess_news(UCRP_WATCH *, int, void *);
+static GW_ROUTE *route_get(GW_SESS *, UCRP_CHANNEL *);
+static void     route_start(GW_ROUTE *);
+static void     route_drain(GW_ROUTE *);
+static void     route_done(GW_ROUTE *);
+static void     route_end(GW_ROUTE *);
+static void     route_stop(GW_ROUTE *);
+static void     route_flush(GW_ROUTE *);
+static void     route_unhold(GW_ROUTE *);
+static void     route_giveup(UCRP_TIMER *, void *);
+static void     gw_route(GW_TARGET *, char *, GW_ROUTE *);
+static void     gw_dispatch(GW_ROUTE *, UCRP *);
+static void     gw_connect(UCRP_SESSION *);
+static void     gw_close(UCRP_SESSION *);
+static void     gw_command(UCRP_CHANNEL *, UCRP *);
+static void     gw_complete(UCRP_CHANNEL *, UCRP *);
+static void     gw_help(UCRP_CHANNEL *, UCRP *);
+static void     gw_interrupt(UCRP_CHANNEL *, UCRP *);
+static void     gw_answer(UCRP_CHANNEL *, UCRP *);
+static void     usage(void);
+
+/*
+ * target_add()
+ *
+ * add a target given as "name=host[:port]", an IPv6 address in
+ * brackets
+ *
+ * returns 0 or -1 on error
+ */
+static int
+target_add(char *arg)
+{
+	struct addrinfo hints;
+	GW_TARGET *tp;
+	char *host, *port, *p;
+	int ret;
+
+	if ((host = strchr(arg, '=')) == NULL || host == arg ||
+	    host[1] == '\0') {
+		warnx("%s: not name=host[:port]", arg);
+		return -1;
+	}
+	*host++ = '\0';
+
+	port = UCRP_SERVICE;
+	if (host[0] == '[' && (p = strchr(host, ']')) != NULL) {
+		*p++ = '\0';
+		host++;
+		if (*p == ':')
+			port = p + 1;
+	} else if ((p = strchr(host, ':')) != NULL &&
+		   strchr(p + 1, ':') == NULL) {
+		*p = '\0';
+		port = p + 1;
+	}
+
+	if ((tp = realloc(targets, (ntargets + 1) * sizeof(*tp))) == NULL) {
+		warn("realloc");
+		return -1;
+	}
+	targets = tp;
+	tp = &targets[ntargets];
+	memset(tp, 0, sizeof(*tp));
+	tp->name = arg;
+	tp->host = host;
+	tp->port = port;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(host, port, &hints, &tp->ai)) != 0) {
+		warnx("%s: %s", arg, gai_strerror(ret));
+		return -1;
+	}
+
+	snprintf(tp->help, sizeof(tp->help), "run a command on %s%s%s:%s",
+		 strchr(host, ':') != NULL ? "[" : "", host,
+		 strchr(host, ':') != NULL ? "]" : "", port);
+	ntargets++;
+
+	return 0;
+}
+
+/*
+ * conn_open()
+ *
+ * connect to the target and agree to channels.  a target that hangs
+ * doesn't hold up the commands waiting on the connection for long.
+ *
+ * returns 0 or -1 on error
+ */
+static int
+conn_open(GW_CONN *cn)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	GW_TARGET *tp = cn->tp;
+	struct addrinfo *ai;
+	struct timeval tv;
+	UCRP_EXT ext;
+	int fd, on = 1;
+
+	fd = -1;
+	for (ai = tp->ai; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+				 ai->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		return -1;
+
+	tv.tv_sec = patience;
+	tv.tv_usec = 0;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&ext, 0, sizeof(ext));
+	ext.flags = UCRP_EXT_CHANNELS | UCRP_EXT_INTERRUPT;
+	ucrp_msg_extend(sm, &ext);
+	if (ucrp_send(fd, sm) <= 0)
+		goto fail;
+
+	/* the banner and first prompt are on channel 0, nobody's */
+	do {
+		if (ucrp_recv(fd, sm) <= 0)
+			goto fail;
+	} while (sm->type != UCRP_EXTENDED);
+
+	if (ucrp_ext_parse(sm, &ext) == -1 ||
+	    (ext.flags & UCRP_EXT_CHANNELS) == 0) {
+		ucrp_log(LOG_WARNING, "%s: %s: no channels, not used\n",
+			 __func__, tp->name);
+		goto fail;
+	}
+
+	/* reading waits for as long as it takes from now on */
+	tv.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	pthread_mutex_lock(&cn->wlock);
+	cn->fd = fd;
+	pthread_mutex_unlock(&cn->wlock);
+
+	pthread_mutex_lock(&tp->lock);
+	cn->up = 1;
+	cn->interrupt = (ext.flags & UCRP_EXT_INTERRUPT) != 0;
+	target_grant(tp);
+	pthread_mutex_unlock(&tp->lock);
+
+	ucrp_log(LOG_NOTICE, "%s: %s: connection %d up\n", __func__,
+		 tp->name, cn->n);
+
+	return 0;
+
+ fail:
+	close(fd);
+	return -1;
+}
+
+/*
+ * conn_run()
+ *
+ * thread of a connection, keeps it open and hands on what it reads
+ */
+static void *
+conn_run(void *arg)
+{
+	uint16_t rmbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *rm = (UCRP *)rmbuf;
+	GW_CONN *cn = arg;
+
+	for (;;) {
+		if (conn_open(cn) == -1) {
+			sleep(GW_RETRY);
+			continue;
+		}
+
+		while (ucrp_recv(cn->fd, rm) > 0)
+			conn_deliver(cn, rm);
+
+		conn_lost(cn);
+	}
+
+	/* NOTREACHED */
+	return NULL;
+}
+
+/*
+ * conn_deliver()
+ *
+ * queue a message for the command on its channel and wake its
+ * session.  a command that has GW_QUEUE messages waiting already
+ * gets no more, so that the reading goes on for the others.
+ */
+static void
+conn_deliver(GW_CONN *cn, UCRP *rm)
+{
+	GW_TARGET *tp = cn->tp;
+	GW_SLOT *sl;
+	GW_MSG *mp;
+	int id;
+
+	/* channel 0 is never taken, what comes on it is not for us */
+	if ((id = UCRP_GETCHAN(rm)) == 0)
+		return;
+	sl = &cn->slot[id];
+
+	if ((mp = malloc(sizeof(*mp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return;
+	}
+	memcpy(mp->buf, rm, UCRP_HDR_SIZE + rm->length);
+	mp->next = NULL;
+
+	pthread_mutex_lock(&tp->lock);
+
+	/* left over from a command that is gone */
+	if (!sl->busy || sl->held)
+		goto drop;
+
+	/* nobody's, it runs down */
+	if (sl->rt == NULL) {
+		if (rm->type == UCRP_INTERRUPTED)
+			sl->seen = 1;
+		else if (rm->type == UCRP_PROMPT && (!sl->stopped || sl->seen))
+			slot_free(sl);
+		goto drop;
+	}
+
+	if (sl->full || sl->nq >= GW_QUEUE) {
+		if (rm->type == UCRP_PROMPT)
+			sl->ended = 1;
+		if (!sl->full) {
+			sl->full = 1;
+			sess_wake(sl->rt->gs);
+		}
+		goto drop;
+	}
+
+	*sl->tail = mp;
+	sl->tail = &mp->next;
+	sl->nq++;
+	sess_wake(sl->rt->gs);
+	pthread_mutex_unlock(&tp->lock);
+
+	return;
+
+ drop:
+	pthread_mutex_unlock(&tp->lock);
+	free(mp);
+
+	return;
+}
+
+/*
+ * conn_lost()
+ *
+ * the connection is gone, and with it whatever ran on it
+ */
+static void
+conn_lost(GW_CONN *cn)
+{
+	GW_TARGET *tp = cn->tp;
+	GW_SLOT *sl;
+	int i;
+
+	pthread_mutex_lock(&cn->wlock);
+	close(cn->fd);
+	cn->fd = -1;
+	cn->epoch++;
+	pthread_mutex_unlock(&cn->wlock);
+
+	pthread_mutex_lock(&tp->lock);
+	cn->up = 0;
+	tp->lost++;
+	for (i = 1; i <= UCRP_MAX_CHAN; i++) {
+		sl = &cn->slot[i];
+		if (!sl->busy)
+			continue;
+		if (sl->rt == NULL)
+			slot_free(sl);
+		else {
+			sl->dead = 1;
+			if (!sl->held)
+				sess_wake(sl->rt->gs);
+		}
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	ucrp_log(LOG_NOTICE, "%s: %s: connection %d lost\n", __func__,
+		 tp->name, cn->n);
+
+	return;
+}
+
+/*
+ * slot_get()
+ *
+ * take a free channel on the connection with the fewest taken, if
+ * the target has room for another command.  tp->lock is held.
+ *
+ * returns the channel or NULL
+ */
+static GW_SLOT *
+slot_get(GW_TARGET *tp)
+{
+	GW_CONN *cn, *best;
+	GW_SLOT *sl;
+	int i, id;
+
+	if (tp->running >= limit)
+		return NULL;
+
+	best = NULL;
+	for (i = 0; i < nconns; i++) {
+		cn = &tp->conns[i];
+		if (cn->up && cn->nbusy < UCRP_MAX_CHAN &&
+		    (best == NULL || cn->nbusy < best->nbusy))
+			best = cn;
+	}
+	if (best == NULL)
+		return NULL;
+
+	for (i = 0, id = best->next; i < UCRP_MAX_CHAN; i++) {
+		id = id % UCRP_MAX_CHAN + 1;
+		if (!best->slot[id].busy)
+			break;
+	}
+	best->next = id;
+
+	sl = &best->slot[id];
+	sl->busy = 1;
+	sl->epoch = best->epoch;
+	best->nbusy++;
+	tp->running++;
+	tp->commands++;
+
+	return sl;
+}
+
+/*
+ * slot_send()
+ *
+ * send a message to the target on the channel, if the connection it
+ * was taken on is still there
+ *
+ * returns 0 or -1 on error
+ */
+static int
+slot_send(GW_SLOT *sl, UCRP *msg)
+{
+	GW_CONN *cn = sl->cn;
+	int ret = -1;
+
+	pthread_mutex_lock(&cn->wlock);
+	if (cn->fd != -1 && sl->epoch == cn->epoch) {
+		UCRP_SETCHAN(msg, sl->id);
+		if ((ret = ucrp_send(cn->fd, msg)) > 0)
+			ret = 0;
+		else {
+			/* its thread finds out and cleans up */
+			shutdown(cn->fd, SHUT_RDWR);
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&cn->wlock);
+
+	return ret;
+}
+
+/*
+ * slot_free()
+ *
+ * give a channel back, with whatever is still queued on it, and hand
+ * it on to a command waiting for its turn.  tp->lock is held.
+ */
+static void
+slot_free(GW_SLOT *sl)
+{
+	GW_TARGET *tp = sl->cn->tp;
+	GW_MSG *mp;
+
+	while ((mp = sl->head) != NULL) {
+		sl->head = mp->next;
+		free(mp);
+	}
+	sl->tail = &sl->head;
+	sl->nq = 0;
+
+	if (!sl->held)
+		tp->running--;
+	sl->busy = sl->held = sl->dead = 0;
+	sl->full = sl->ended = sl->stopped = sl->seen = 0;
+	sl->rt = NULL;
+	sl->cn->nbusy--;
+
+	target_grant(tp);
+
+	return;
+}
+
+/*
+ * slot_abandon()
+ *
+ * leave the command on the channel to run down by itself, told to
+ * stop if the target can be.  what it sends from now on is dropped,
+ * and the channel goes back with the prompt after its
+ * UCRP_INTERRUPTED.  tp->lock is held.
+ */
+static void
+slot_abandon(GW_SLOT *sl)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	GW_MSG *mp;
+
+	while ((mp = sl->head) != NULL) {
+		sl->head = mp->next;
+		if (((UCRP *)mp->buf)->type == UCRP_PROMPT)
+			sl->ended = 1;
+		free(mp);
+	}
+	sl->tail = &sl->head;
+	sl->nq = 0;
+
+	if (sl->ended || sl->dead) {
+		slot_free(sl);
+		return;
+	}
+
+	/* without UCRP_EXT_INTERRUPT it runs to the end */
+	sl->rt = NULL;
+	ucrp_msg_interrupt(sm);
+	sl->stopped = sl->cn->interrupt && slot_send(sl, sm) == 0;
+
+	return;
+}
+
+/*
+ * target_grant()
+ *
+ * hand free channels to the commands waiting for their turn, first
+ * come first served.  tp->lock is held.
+ */
+static void
+target_grant(GW_TARGET *tp)
+{
+	GW_ROUTE *rt;
+	GW_SLOT *sl;
+
+	while ((rt = TAILQ_FIRST(&tp->waitq)) != NULL &&
+	       (sl = slot_get(tp)) != NULL) {
+		TAILQ_REMOVE(&tp->waitq, rt, entry);
+		rt->waiting = 0;
+		tp->waiting--;
+		sl->rt = rt;
+		rt->given = sl;
+		sess_wake(rt->gs);
+	}
+
+	return;
+}
+
+/*
+ * sess_wake()
+ *
+ * tell the session that a route of its has news, once until it has
+ * looked
+ */
+static void
+sess_wake(GW_SESS *gs)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&gs->lock);
+	if (!gs->woken && write(gs->fd, &one, sizeof(one)) == sizeof(one))
+		gs->woken = 1;
+	pthread_mutex_unlock(&gs->lock);
+
+	return;
+}
+
+/*
+ * sess_news()
+ *
+ * watch callback, pass on what came for the session's routes
+ */
+static void
+sess_news(UCRP_WATCH *wp, int fd, void *arg)
+{
+	GW_SESS *gs = arg;
+	GW_ROUTE *rt;
+	uint64_t n;
+	int i;
+
+	pthread_mutex_lock(&gs->lock);
+	gs->woken = 0;
+	if (read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+	pthread_mutex_unlock(&gs->lock);
+
+	for (i = 0; i <= UCRP_MAX_CHAN; i++)
+		if ((rt = gs->rt[i]) != NULL && rt->tp != NULL)
+			route_drain(rt);
+
+	return;
+}
+
+/*
+ * route_get()
+ *
+ * returns the route of the channel, made on first use, or NULL on
+ * error
+ */
+static GW_ROUTE *
+route_get(GW_SESS *gs, UCRP_CHANNEL *cp)
+{
+	GW_ROUTE *rt;
+	int id;
+
+	id = ucrp_channel_id(cp);
+	if ((rt = gs->rt[id]) != NULL)
+		return rt;
+
+	if ((rt = calloc(1, sizeof(*rt))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+	if ((rt->timer = ucrp_timer_new(gs->sp, route_giveup, rt)) == NULL) {
+		free(rt);
+		return NULL;
+	}
+	rt->gs = gs;
+	rt->cp = cp;
+	rt->cmdtail = &rt->cmdq;
+	gs->rt[id] = rt;
+
+	return rt;
+}
+
+/*
+ * route_start()
+ *
+ * send the command on the channel it was given, what comes back for
+ * it wakes its session
+ */
+static void
+route_start(GW_ROUTE *rt)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	ucrp_msg_command(sm, rt->line);
+	if (slot_send(rt->sl, sm) == -1) {
+		pthread_mutex_lock(&rt->tp->lock);
+		rt->sl->dead = 1;
+		pthread_mutex_unlock(&rt->tp->lock);
+		sess_wake(rt->gs);
+	}
+
+	return;
+}
+
+/*
+ * route_drain()
+ *
+ * start the command if its turn came, and pass on what its target
+ * sent for it up to the prompt.  a command that lost its connection,
+ * or whose client fell behind, ends here.
+ */
+static void
+route_drain(GW_ROUTE *rt)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	GW_TARGET *tp = rt->tp;
+	char err[UCRP_MAX_PAYLOAD];
+	int dead, full;
+	GW_SLOT *sl;
+	GW_MSG *mp;
+	UCRP *rm;
+
+	pthread_mutex_lock(&tp->lock);
+	if ((sl = rt->given) != NULL)
+		rt->given = NULL;
+	pthread_mutex_unlock(&tp->lock);
+
+	if (sl != NULL) {
+		ucrp_timer_cancel(rt->timer);
+		rt->sl = sl;
+		route_start(rt);
+	}
+	if ((sl = rt->sl) == NULL)
+		return;
+
+	for (;;) {
+		pthread_mutex_lock(&tp->lock);
+		if ((mp = sl->head) != NULL) {
+			if ((sl->head = mp->next) == NULL)
+				sl->tail = &sl->head;
+			sl->nq--;
+		}
+		dead = sl->dead;
+		full = sl->full;
+		pthread_mutex_unlock(&tp->lock);
+
+		if (mp == NULL)
+			break;
+
+		rm = (UCRP *)mp->buf;
+		rm->options &= ~UCRP_CHAN_MASK;
+
+		switch (rm->type) {
+		case UCRP_INTERRUPTED:
+		case UCRP_BUSY:
+			/* the client was told when the command came in */
+			break;
+		case UCRP_PROMPT:
+			ucrp_channel_send(rt->cp, rm);
+			free(mp);
+			route_done(rt);
+			return;
+		case UCRP_ASK:
+		case UCRP_EXEC:
+			rt->asked = 1;
+			/* FALLTHROUGH */
+		default:
+			ucrp_channel_send(rt->cp, rm);
+			break;
+		}
+		free(mp);
+	}
+
+	if (dead)
+		snprintf(err, sizeof(err), "%% Connection to %s lost.\n",
+			 tp->name);
+	else if (full)
+		snprintf(err, sizeof(err),
+			 "%% Output from %s dropped, the client is behind.\n",
+			 tp->name);
+	else
+		return;
+
+	route_stop(rt);
+
+	ucrp_msg_display(sm, err);
+	ucrp_channel_send(rt->cp, sm);
+	ucrp_msg_prompt(sm, prompt);
+	ucrp_channel_send(rt->cp, sm);
+
+	route_end(rt);
+
+	return;
+}
+
+/*
+ * route_done()
+ *
+ * the command is done.  an answer to come goes to the channel that
+ * asked for it, which is kept until then.
+ */
+static void
+route_done(GW_ROUTE *rt)
+{
+	GW_TARGET *tp = rt->tp;
+	GW_SLOT *sl = rt->sl;
+
+	pthread_mutex_lock(&tp->lock);
+	if (rt->asked && !sl->dead) {
+		sl->held = 1;
+		tp->running--;
+		target_grant(tp);
+	} else {
+		slot_free(sl);
+		rt->sl = NULL;
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	route_end(rt);
+
+	return;
+}
+
+/*
+ * route_end()
+ *
+ * the channel is free for its next command, run those that came
+ * meanwhile
+ */
+static void
+route_end(GW_ROUTE *rt)
+{
+	GW_MSG *mp;
+
+	rt->tp = NULL;
+	while (rt->tp == NULL && (mp = rt->cmdq) != NULL) {
+		if ((rt->cmdq = mp->next) == NULL)
+			rt->cmdtail = &rt->cmdq;
+		gw_dispatch(rt, (UCRP *)mp->buf);
+		free(mp);
+	}
+
+	return;
+}
+
+/*
+ * route_stop()
+ *
+ * stop the command, waiting or running, without a word to the
+ * client
+ */
+static void
+route_stop(GW_ROUTE *rt)
+{
+	GW_TARGET *tp = rt->tp;
+	GW_SLOT *sl;
+
+	if (tp == NULL)
+		return;
+
+	ucrp_timer_cancel(rt->timer);
+
+	pthread_mutex_lock(&tp->lock);
+	if (rt->waiting) {
+		TAILQ_REMOVE(&tp->waitq, rt, entry);
+		rt->waiting = 0;
+		tp->waiting--;
+	}
+	/* handed over, but not sent on yet */
+	if ((sl = rt->given) != NULL) {
+		rt->given = NULL;
+		slot_free(sl);
+	}
+	if ((sl = rt->sl) != NULL) {
+		rt->sl = NULL;
+		slot_abandon(sl);
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	rt->tp = NULL;
+
+	return;
+}
+
+/*
+ * route_flush()
+ *
+ * drop the commands queued behind the one on the channel
+ */
+static void
+route_flush(GW_ROUTE *rt)
+{
+	GW_MSG *mp;
+
+	while ((mp = rt->cmdq) != NULL) {
+		rt->cmdq = mp->next;
+		free(mp);
+	}
+	rt->cmdtail = &rt->cmdq;
+
+	return;
+}
+
+/*
+ * route_unhold()
+ *
+ * give back the channel kept for an answer
+ */
+static void
+route_unhold(GW_ROUTE *rt)
+{
+	GW_TARGET *tp;
+	GW_SLOT *sl;
+
+	if ((sl = rt->sl) == NULL || !sl->held)
+		return;
+
+	tp = sl->cn->tp;
+	pthread_mutex_lock(&tp->lock);
+	slot_free(sl);
+	pthread_mutex_unlock(&tp->lock);
+	rt->sl = NULL;
+
+	return;
+}
+
+/*
+ * route_giveup()
+ *
+ * timer callback, the command waited long enough for its turn or its
+ * target is down.  a turn that came meanwhile is taken instead.
+ */
+static void
+route_giveup(UCRP_TIMER *tm, void *arg)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	GW_ROUTE *rt = arg;
+	GW_TARGET *tp = rt->tp;
+	char err[UCRP_MAX_PAYLOAD];
+	time_t now;
+	int i, up;
+
+	if (tp == NULL)
+		return;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&tp->lock);
+	if (!rt->waiting) {
+		pthread_mutex_unlock(&tp->lock);
+		return;
+	}
+	for (i = up = 0; i < nconns; i++)
+		up += tp->conns[i].up;
+	if (up > 0 && now < rt->since + patience) {
+		pthread_mutex_unlock(&tp->lock);
+		ucrp_timer_set(tm, (rt->since + patience - now) * 1000);
+		return;
+	}
+	TAILQ_REMOVE(&tp->waitq, rt, entry);
+	rt->waiting = 0;
+	tp->waiting--;
+	if (up > 0)
+		tp->busy++;
+	pthread_mutex_unlock(&tp->lock);
+
+	if (up == 0)
+		snprintf(err, sizeof(err), "%% Cannot reach %s.\n", tp->name);
+	else
+		snprintf(err, sizeof(err), "%% %s is busy.\n", tp->name);
+	ucrp_msg_display(sm, err);
+	ucrp_channel_send(rt->cp, sm);
+	ucrp_msg_prompt(sm, prompt);
+	ucrp_channel_send(rt->cp, sm);
+
+	route_end(rt);
+
+	return;
+}
+
+/*
+ * gw_route()
+ *
+ * run 'line' on the target, now if it has room for it or else once
+ * its turn comes.  a target that is down is given the time to
+ * reconnect, no more.
+ */
+static void
+gw_route(GW_TARGET *tp, char *line, GW_ROUTE *rt)
+{
+	GW_SLOT *sl;
+	int wait;
+
+	route_unhold(rt);
+	rt->tp = tp;
+	rt->asked = 0;
+	snprintf(rt->line, sizeof(rt->line), "%s", line);
+
+	pthread_mutex_lock(&tp->lock);
+	/* nobody jumps the queue */
+	sl = NULL;
+	if (TAILQ_EMPTY(&tp->waitq) && (sl = slot_get(tp)) != NULL)
+		sl->rt = rt;
+	else {
+		TAILQ_INSERT_TAIL(&tp->waitq, rt, entry);
+		rt->waiting = 1;
+		tp->waiting++;
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	if (sl != NULL) {
+		rt->sl = sl;
+		route_start(rt);
+		return;
+	}
+
+	rt->since = time(NULL);
+	wait = patience < GW_RETRY + 1 ? patience : GW_RETRY + 1;
+	ucrp_timer_set(rt->timer, wait * 1000);
+
+	return;
+}
+
+/*
+ * do_targets()
+ */
+static void
+do_targets(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	GW_TARGET *tp;
+	UCRP_TSTREAM *ts;
+	int i, j, up;
+
+	if ((ts = ucrp_channel_table(cp)) == NULL)
+		return;
+
+	ucrp_tstream_column(ts, "Target", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "Host", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "Port", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "Up", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Running", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Waiting", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Commands", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Busy", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Lost", UCRP_COL_INT);
+
+	for (i = 0; i < ntargets; i++) {
+		tp = &targets[i];
+		ucrp_tstream_str(ts, tp->name);
+		ucrp_tstream_str(ts, tp->host);
+		ucrp_tstream_str(ts, tp->port);
+
+		pthread_mutex_lock(&tp->lock);
+		for (j = up = 0; j < nconns; j++)
+			up += tp->conns[j].up;
+		ucrp_tstream_int(ts, up);
+		ucrp_tstream_int(ts, tp->running);
+		ucrp_tstream_int(ts, tp->waiting);
+		ucrp_tstream_int(ts, tp->commands);
+		ucrp_tstream_int(ts, tp->busy);
+		ucrp_tstream_int(ts, tp->lost);
+		pthread_mutex_unlock(&tp->lock);
+	}
+
+	ucrp_tstream_end(ts);
+
+	return;
+}
+
+/*
+ * do_quit()
+ */
+static void
+do_quit(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	UCRP_OSTREAM *os;
+
+	if ((os = ucrp_channel_ostream(cp)) != NULL) {
+		ucrp_ostream_printf(os, "goodbye...\n");
+		ucrp_ostream_flush(os);
+	}
+	ucrp_session_close(ucrp_channel_session(cp));
+
+	return;
+}
+
+/*
+ * gw_connect()
+ */
+static void
+gw_connect(UCRP_SESSION *sp)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	GW_SESS *gs;
+
+	if ((gs = calloc(1, sizeof(*gs))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		ucrp_session_close(sp);
+		return;
+	}
+	gs->sp = sp;
+	if ((gs->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(gs);
+		ucrp_session_close(sp);
+		return;
+	}
+	if ((gs->watch = ucrp_watch_new(sp, gs->fd, sess_news, gs)) == NULL) {
+		close(gs->fd);
+		free(gs);
+		ucrp_session_close(sp);
+		return;
+	}
+	pthread_mutex_init(&gs->lock, NULL);
+	ucrp_session_setdata(sp, gs);
+
+	ucrp_msg_prompt(sm, prompt);
+	ucrp_session_send(sp, sm);
+
+	return;
+}
+
+/*
+ * gw_close()
+ *
+ * the session is gone, its commands stop and the channels kept for
+ * its answers go back
+ */
+static void
+gw_close(UCRP_SESSION *sp)
+{
+	GW_SESS *gs = ucrp_session_getdata(sp);
+	GW_ROUTE *rt;
+	int i;
+
+	if (gs == NULL)
+		return;
+
+	for (i = 0; i <= UCRP_MAX_CHAN; i++) {
+		if ((rt = gs->rt[i]) == NULL)
+			continue;
+		route_flush(rt);
+		route_stop(rt);
+		route_unhold(rt);
+		free(rt);
+	}
+
+	ucrp_watch_free(gs->watch);
+	close(gs->fd);
+	pthread_mutex_destroy(&gs->lock);
+	free(gs);
+
+	return;
+}
+
+/*
+ * gw_dispatch()
+ *
+ * run one of our own commands, or send the rest of the line on to
+ * the target it starts with, quoting and all
+ */
+static void
+gw_dispatch(GW_ROUTE *rt, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_CHANNEL *cp = rt->cp;
+	UCRP_CMDMATCH m;
+	GW_CMD *cmd;
+	char *str, *rest, line[UCRP_MAX_PAYLOAD];
+	size_t len;
+
+	ucrp_msg_busy(sm);
+	ucrp_channel_send(cp, sm);
+
+	str = strstr((char *)UCRP_PAYLOAD(rm), UCRP_SEPARATOR);
+	if (str == NULL) {
+		ucrp_msg_display(sm, "invalid message.\n");
+		ucrp_channel_send(cp, sm);
+		ucrp_session_close(ucrp_channel_session(cp));
+		return;
+	}
+	*str = '\0';
+
+	/* only the first word is ours if it names a target */
+	str = (char *)UCRP_PAYLOAD(rm);
+	str += strspn(str, " \t");
+	len = strcspn(str, " \t");
+	rest = str + len + strspn(str + len, " \t");
+	snprintf(line, sizeof(line), "%.*s", (int)len, str);
+	if (ucrp_cmd_parse(cmds, line, &m) == UCRP_CMD_OK &&
+	    (cmd = m.data)->tp != NULL) {
+		gw_route(cmd->tp, rest, rt);
+		return;
+	}
+
+	switch (ucrp_cmd_parse(cmds, (char *)UCRP_PAYLOAD(rm), &m)) {
+	case UCRP_CMD_OK:
+		cmd = m.data;
+		cmd->f(m.argc, m.argv, cp, rm, sm);
+		line[0] = '\0';
+		break;
+	case UCRP_CMD_EMPTY:
+		line[0] = '\0';
+		break;
+	case UCRP_CMD_AMBIGUOUS:
+		snprintf(line, sizeof(line), "%% Ambiguous command: \"%s\"\n",
+			 m.argv[m.bad]);
+		break;
+	case UCRP_CMD_UNKNOWN:
+		snprintf(line, sizeof(line), "%% Unknown target: \"%s\"\n",
+			 m.argv[m.bad]);
+		break;
+	default:
+		snprintf(line, sizeof(line), "%% Invalid input\n");
+		break;
+	}
+
+	if (line[0] != '\0') {
+		ucrp_msg_display(sm, line);
+		ucrp_channel_send(cp, sm);
+	}
+
+	ucrp_msg_prompt(sm, prompt);
+	ucrp_channel_send(cp, sm);
+
+	return;
+}
+
+/*
+ * gw_command()
+ *
+ * run the command, or queue it behind the one still going on the
+ * channel
+ */
+static void
+gw_command(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	GW_SESS *gs = ucrp_session_getdata(ucrp_channel_session(cp));
+	GW_ROUTE *rt;
+	GW_MSG *mp;
+
+	if ((rt = route_get(gs, cp)) == NULL) {
+		ucrp_session_close(ucrp_channel_session(cp));
+		return;
+	}
+
+	if (rt->tp == NULL) {
+		gw_dispatch(rt, rm);
+		return;
+	}
+
+	if ((mp = malloc(sizeof(*mp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		ucrp_session_close(ucrp_channel_session(cp));
+		return;
+	}
+	memcpy(mp->buf, rm, UCRP_HDR_SIZE + rm->length);
+	mp->next = NULL;
+	*rt->cmdtail = mp;
+	rt->cmdtail = &mp->next;
+
+	return;
+}
+
+/*
+ * gw_complete()
+ *
+ * complete target names and our own commands, what follows a target
+ * is left as it is
+ */
+static void
+gw_complete(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_CMDCOMP comp;
+	UCRP_OSTREAM *os;
+	UCRP_EXT *ext;
+	char *str, buf[UCRP_MAX_PAYLOAD];
+	int row;
+
+	if ((str = strstr((char *)UCRP_PAYLOAD(rm), UCRP_SEPARATOR)) != NULL)
+		*str = '\0';
+
+	if (ucrp_cmd_complete(cmds, (char *)UCRP_PAYLOAD(rm), &comp) > 1) {
+		ext = ucrp_session_ext(ucrp_channel_session(cp));
+
+		os = ucrp_channel_ostream(cp);
+
+		row = 0;
+		if (os != NULL) {
+			ucrp_ostream_putc(os, '\n');
+			while (ucrp_cmd_columns(&comp, ext->columns, &row, buf,
+						sizeof(buf)) > 0)
+				ucrp_ostream_write(os, buf, strlen(buf));
+		}
+	}
+
+	ucrp_msg_completed(sm, comp.line);
+	ucrp_channel_send(cp, sm);
+
+	return;
+}
+
+/*
+ * gw_help()
+ */
+static void
+gw_help(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_BUF *bp;
+	char *str;
+
+	if ((str = strstr((char *)UCRP_PAYLOAD(rm), UCRP_SEPARATOR)) != NULL)
+		*str = '\0';
+
+	str = (char *)UCRP_PAYLOAD(rm);
+	bp = ucrp_cmd_helpbuf(cmds, ucrp_cmd_helpnode(cmds, str));
+	if (bp != NULL)
+		ucrp_channel_sendbuf(cp, bp);
+
+	ucrp_msg_helped(sm);
+	ucrp_channel_send(cp, sm);
+
+	return;
+}
+
+/*
+ * gw_interrupt()
+ *
+ * stop the command on the channel, waiting or running, and those
+ * queued behind it, or give back the channel kept for an answer that
+ * won't come now
+ */
+static void
+gw_interrupt(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	GW_SESS *gs = ucrp_session_getdata(ucrp_channel_session(cp));
+	GW_ROUTE *rt;
+
+	if ((rt = gs->rt[ucrp_channel_id(cp)]) != NULL) {
+		route_flush(rt);
+		route_stop(rt);
+		route_unhold(rt);
+	}
+
+	ucrp_msg_prompt(sm, prompt);
+	ucrp_channel_send(cp, sm);
+
+	return;
+}
+
+/*
+ * gw_answer()
+ *
+ * pass UCRP_TELL or UCRP_WAIT on to the target that asked for it, a
+ * channel kept for the answer goes back once it has it
+ */
+static void
+gw_answer(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	GW_SESS *gs = ucrp_session_getdata(ucrp_channel_session(cp));
+	GW_ROUTE *rt;
+
+	if ((rt = gs->rt[ucrp_channel_id(cp)]) != NULL && rt->sl != NULL) {
+		slot_send(rt->sl, rm);
+		route_unhold(rt);
+	}
+
+	return;
+}
+
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c connections] [-l limit] [-P prompt] "
+		"[-p port]\n"
+		"       [-t threads] [-W wait] name=host[:port] ...\n",
+		__progname);
+	exit(EX_USAGE);
+}
+
+/*
+ * main()
+ */
+int
+main(int argc, char *argv[])
+{
+	UCRP_CALLBACKS cb;
+	UCRP_SERVER *srv;
+	GW_TARGET *tp;
+	GW_CONN *cn;
+	GW_CMD *cmd;
+	char *port;
+	int ch, i, j, threads;
+
+	port = UCRP_SERVICE;
+	threads = 1;
+
+	while ((ch = getopt(argc, argv, "c:l:P:p:t:W:")) != -1)
+		switch (ch) {
+		case 'c':
+			nconns = atoi(optarg);
+			if (nconns < 1)
+				usage();
+			break;
+		case 'l':
+			limit = atoi(optarg);
+			if (limit < 1)
+				usage();
+			break;
+		case 'P':
+			prompt = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 0)
+				usage();
+			break;
+		case 'W':
+			patience = atoi(optarg);
+			if (patience < 1)
+				usage();
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage();
+	for (i = 0; i < argc; i++)
+		if (target_add(argv[i]) == -1)
+			exit(EX_USAGE);
+
+	if ((cmds = ucrp_cmd_new()) == NULL)
+		errx(EX_UNAVAILABLE, "command setup failed.");
+	for (cmd = cmd_main; cmd->name != NULL; cmd++)
+		if (ucrp_cmd_add(cmds, UCRP_CMD_ROOT, cmd->name, cmd->help,
+				 cmd->flags, cmd) == -1)
+			errx(EX_UNAVAILABLE, "command setup failed.");
+	for (i = 0; i < ntargets; i++) {
+		tp = &targets[i];
+		if ((cmd = calloc(1, sizeof(*cmd))) == NULL)
+			err(EX_OSERR, "calloc");
+		cmd->name = tp->name;
+		cmd->help = tp->help;
+		cmd->flags = UCRP_CMD_ARGS;
+		cmd->tp = tp;
+		if (ucrp_cmd_add(cmds, UCRP_CMD_ROOT, cmd->name, cmd->help,
+				 cmd->flags, cmd) == -1)
+			errx(EX_USAGE, "%s: cannot be a target", tp->name);
+	}
+	if (ucrp_cmd_compile(cmds) == -1)
+		errx(EX_UNAVAILABLE, "command setup failed.");
+
+	memset(&cb, 0, sizeof(cb));
+	cb.connect = gw_connect;
+	cb.close = gw_close;
+	cb.command = gw_command;
+	cb.complete = gw_complete;
+	cb.help = gw_help;
+	cb.interrupt = gw_interrupt;
+	cb.tell = gw_answer;
+	cb.wait = gw_answer;
+
+	if ((srv = ucrp_server_new(&cb)) == NULL ||
+	    ucrp_server_setthreads(srv, threads, 0) == -1)
+		errx(EX_UNAVAILABLE, "server setup failed.");
+
+	if (ucrp_server_bind(srv, NULL, port) == -1)
+		errx(EX_UNAVAILABLE, "socket setup failed.");
+
+	/* a dead client or target must not take us down */
+	signal(SIGPIPE, SIG_IGN);
+
+	ucrp_setlogprio(LOG_NOTICE);
+	ucrp_setusesyslog(0);
+	ucrp_setlogstream(stderr);
+
+	/* the targets' connections are warm before the first command */
+	for (i = 0; i < ntargets; i++) {
+		tp = &targets[i];
+		pthread_mutex_init(&tp->lock, NULL);
+		TAILQ_INIT(&tp->waitq);
+		if ((tp->conns = calloc(nconns, sizeof(*cn))) == NULL)
+			err(EX_OSERR, "calloc");
+		for (j = 0; j < nconns; j++) {
+			cn = &tp->conns[j];
+			cn->tp = tp;
+			cn->n = j;
+			cn->fd = -1;
+			pthread_mutex_init(&cn->wlock, NULL);
+			for (ch = 1; ch <= UCRP_MAX_CHAN; ch++) {
+				cn->slot[ch].cn = cn;
+				cn->slot[ch].id = ch;
+				cn->slot[ch].tail = &cn->slot[ch].head;
+			}
+			if ((errno = pthread_create(&cn->thread, NULL,
+						    conn_run, cn)) != 0)
+				err(EX_OSERR, "pthread_create");
+		}
+	}
+
+	if (ucrp_server_loop(srv) == -1)
+		exit(EX_OSERR);
+
+	ucrp_server_free(srv);
+
+	return EX_OK;
+}
@@ -43,6 +43,13 @@
 #define UCRP_HELPED    105
 #define UCRP_SWINSZ    106
 #define UCRP_EXEC      107
+#define UCRP_EXTENDED  108
+#define UCRP_INTERRUPTED 109
+#define UCRP_TABLE     110
+#define      TABLE_HEAD    0x1
+#define      TABLE_END     0x2
+#define UCRP_UPDATE    111
+#define      UPDATE_CLEAR  0x1
 
 /* client sends, server receives */
 #define UCRP_COMMAND   200
@@ -55,6 +62,54 @@
 #define      WAIT_STATUS   0x1
 #define      WAIT_SIGNAL   0x2
 #define      WAIT_ERROR    0x4
+#define      WAIT_RUSAGE   0x8
+#define UCRP_EXTEND    207
+
+/*
+ * protocol extensions, see UCRP_EXTEND
+ */
+#define UCRP_EXT_CHANNELS  0x1
+#define UCRP_EXT_INTERRUPT 0x2
+#define UCRP_EXT_COLUMNS   0x4
+#define UCRP_EXT_BATCH     0x8
+#define UCRP_EXT_MAXMSG    0x10
+#define UCRP_EXT_TABLES    0x20
+#define UCRP_EXT_UPDATE    0x40
+
+typedef struct _ucrp_ext {
+	uint32_t flags;                  /* UCRP_EXT_* */
+	uint16_t columns;                /* UCRP_EXT_COLUMNS: terminal width */
+	uint16_t maxmsg;                 /* UCRP_EXT_MAXMSG: largest payload */
+} UCRP_EXT;
+
+/*
+ * what an executed command cost the client, see WAIT_RUSAGE
+ */
+typedef struct _ucrp_rusage {
+	uint64_t utime;                  /* user cpu, microseconds */
+	uint64_t stime;                  /* system cpu, microseconds */
+	uint64_t maxrss;                 /* largest resident set, kB */
+} UCRP_RUSAGE;
+
+/*
+ * command output, thrown away once the command is interrupted
+ */
+#define UCRP_ISOUTPUT(t) \
+	((t) == UCRP_DISPLAY || (t) == UCRP_BUSY || (t) == UCRP_PROMPT || \
+	 (t) == UCRP_ASK || (t) == UCRP_EXEC || (t) == UCRP_SWINSZ || \
+	 (t) == UCRP_TABLE || (t) == UCRP_UPDATE)
+
+/*
+ * logical channels (UCRP_EXT_CHANNELS) are carried in the upper
+ * byte of the options section.  channel 0 is the default channel.
+ */
+#define UCRP_CHAN_MASK   0xff00
+#define UCRP_CHAN_SHIFT  8
+#define UCRP_MAX_CHAN    255
+#define UCRP_GETCHAN(x)  (((x)->options & UCRP_CHAN_MASK) >> UCRP_CHAN_SHIFT)
+#define UCRP_SETCHAN(x, c) \
+	((x)->options = ((x)->options & ~UCRP_CHAN_MASK) | \
+	    (((c) << UCRP_CHAN_SHIFT) & UCRP_CHAN_MASK))
 
 typedef struct _ucrp {
 	uint16_t type;
@@ -62,11 +117,29 @@ typedef struct _ucrp {
 	uint16_t length;
 } UCRP;
 
+/*
+ * shared buffer of messages ready for the wire, see
+ * ucrp_channel_sendbuf()
+ */
+typedef struct _ucrp_buf UCRP_BUF;
+
+/*
+ * rows of typed cells, see UCRP_TABLE.  numbers are right aligned
+ * and text left aligned when a table is printed.
+ */
+typedef struct _ucrp_rows UCRP_ROWS;
+
+#define UCRP_COL_INT       1             /* int64_t */
+#define UCRP_COL_STR       2             /* text */
+#define UCRP_TABLE_MAXCOLS 32
+#define UCRP_TABLE_NAMELEN 32            /* of a column, with the '\0' */
+
 typedef int ucrp_mutex_t;
 
 #define UCRP_HDR_SIZE    sizeof(UCRP)
 #define UCRP_MAX_MSGSIZE (1500 + sizeof(char)) /* don't forget a '\0' */
 #define UCRP_MAX_PAYLOAD ((UCRP_MAX_MSGSIZE - sizeof(char)) - UCRP_HDR_SIZE)
+#define UCRP_MAX_JUMBO   65535                 /* UCRP_EXT_MAXMSG */
 #define UCRP_PAYLOAD(x) ((uint8_t *)x + UCRP_HDR_SIZE)
 
 #define UCRP_LOG_DEFAULT LOG_WARNING
@@ -82,6 +155,7 @@ typedef int ucrp_mutex_t;
 __BEGIN_DECLS
 int     ucrp_connect(char *, char *);
 ssize_t ucrp_recv(int, UCRP *);
+ssize_t ucrp_recvalloc(int, UCRP **, size_t *);
 ssize_t ucrp_send(int, UCRP *);
 
 /*
@@ -98,6 +172,26 @@ void ucrp_setlogstream(FILE *);
 void  ucrp_pmsg(FILE *, UCRP *);
 char *ucrp_strtype(uint16_t);
 
+/*
+ * extension functions
+ */
+int    ucrp_ext_parse(UCRP *, UCRP_EXT *);
+size_t ucrp_ext_format(char *, size_t, UCRP_EXT *);
+
+/*
+ * table functions
+ */
+UCRP_ROWS *ucrp_rows_new(void);
+void    ucrp_rows_free(UCRP_ROWS *);
+int     ucrp_rows_column(UCRP_ROWS *, const char *, int);
+int     ucrp_rows_int(UCRP_ROWS *, int64_t);
+int     ucrp_rows_str(UCRP_ROWS *, const char *);
+size_t  ucrp_rows_schema(UCRP_ROWS *, char *, size_t);
+int     ucrp_rows_parse(UCRP_ROWS *, UCRP *);
+int     ucrp_rows_sort(UCRP_ROWS *, const char *, int);
+int     ucrp_rows_print(UCRP_ROWS *, int,
+			int (*)(const void *, size_t, void *), void *);
+
 /*
  * mutex functions
  */
@@ -127,6 +221,11 @@ void ucrp_msg_prompt(UCRP *, char *);
 void ucrp_msg_helped(UCRP *);
 void ucrp_msg_swinsz(UCRP *, uint, uint, uint, uint);
 void ucrp_msg_exec(UCRP *, char *);
+void ucrp_msg_extended(UCRP *, UCRP_EXT *);
+void ucrp_msg_interrupted(UCRP *);
+void ucrp_msg_table(UCRP *, uint16_t, const void *, size_t);
+void ucrp_msg_update(UCRP *, uint16_t, uint, uint);
+int  ucrp_msg_updateparse(UCRP *, uint *, uint *, char **);
 
 void ucrp_msg_command(UCRP *, char *);
 void ucrp_msg_complete(UCRP *, char *);
@@ -135,6 +234,9 @@ void ucrp_msg_interrupt(UCRP *);
 void ucrp_msg_tell(UCRP *, char *);
 void ucrp_msg_suspend(UCRP *);
 void ucrp_msg_wait(UCRP *, uint16_t, int);
+void ucrp_msg_rusage(UCRP *, UCRP_RUSAGE *);
+int  ucrp_msg_waitparse(UCRP *, int *, UCRP_RUSAGE *);
+void ucrp_msg_extend(UCRP *, UCRP_EXT *);
 __END_DECLS
 
 #endif /* _UCRP_H */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _UCRP_CMD_H
+#define _UCRP_CMD_H
+
+#include <sys/cdefs.h>
+
+#include <ucrp.h>
+
+/*
+ * command trees
+ *
+ * commands are registered as a tree of keywords ("show" -> "version")
+ * and compiled into one character trie per level, so that parsing a
+ * line costs the same however many commands there are.  keywords may
+ * be abbreviated to any unique prefix.  a compiled tree is read only
+ * and may be used from any number of threads.
+ *
+ * the help listing of a node is rendered the first time it is asked
+ * for and kept, as UCRP_DISPLAY messages ready for the wire.
+ */
+typedef struct _ucrp_cmdtree UCRP_CMDTREE;
+
+#define UCRP_CMD_ROOT     0            /* parent of the top level      */
+
+#define UCRP_CMD_ARGS     0x1          /* takes arguments after its    */
+                                       /* keywords                     */
+
+#define UCRP_CMD_MAXARGS  64
+
+/*
+ * ucrp_cmd_parse() results
+ */
+#define UCRP_CMD_OK         0          /* runnable command found       */
+#define UCRP_CMD_EMPTY      1          /* nothing but white space      */
+#define UCRP_CMD_UNKNOWN    2          /* argv[bad] is not a keyword   */
+#define UCRP_CMD_AMBIGUOUS  3          /* argv[bad] abbreviates several */
+#define UCRP_CMD_INCOMPLETE 4          /* more keywords needed         */
+#define UCRP_CMD_SYNTAX     5          /* bad quoting, too many args   */
+
+typedef struct _ucrp_cmdmatch {
+	int   argc;
+	char *argv[UCRP_CMD_MAXARGS + 1];  /* NULL terminated          */
+	int   nkeys;                   /* argv[0..nkeys-1] are keywords */
+	int   bad;                     /* offending argument           */
+	int   node;                    /* deepest keyword matched      */
+	void *data;                    /* registered with 'node'       */
+} UCRP_CMDMATCH;
+
+/*
+ * completion
+ *
+ * ucrp_cmd_complete() completes the last word of a line to the longest
+ * prefix its candidates have in common and collects the candidates for
+ * listing.  keywords come from the tree; the values of a UCRP_CMD_ARGS
+ * command's arguments come from its parameter callback, which offers
+ * them with ucrp_cmd_candidate() and should stop once that returns -1.
+ */
+#define UCRP_CMD_MAXCAND  256          /* candidates kept for listing  */
+#define UCRP_CMD_POOLSIZE 4096         /* room for callback candidates */
+
+typedef struct _ucrp_cmdcomp {
+	char   line[UCRP_MAX_PAYLOAD];  /* the completed line           */
+	size_t word;                   /* last word starts at line[word] */
+	int    lcp;                    /* its completion is this long  */
+	char  *partial;                /* the word being completed     */
+	int    total;                  /* candidates matching          */
+	int    more;                   /* callback stopped, total is a */
+	                               /* lower bound                  */
+	int    ncand;
+	char  *cand[UCRP_CMD_MAXCAND];  /* sorted                       */
+	size_t poolused;
+	char   pool[UCRP_CMD_POOLSIZE];
+} UCRP_CMDCOMP;
+
+/*
+ * parameter callback: 'argc' and 'argv' are the words before the one
+ * being completed (comp->partial), keywords in full.
+ */
+typedef void (UCRP_CMDPARAM)(UCRP_CMDCOMP *, int, char **, void *);
+
+__BEGIN_DECLS
+UCRP_CMDTREE *ucrp_cmd_new(void);
+int   ucrp_cmd_add(UCRP_CMDTREE *, int, char *, char *, int, void *);
+int   ucrp_cmd_compile(UCRP_CMDTREE *);
+void  ucrp_cmd_free(UCRP_CMDTREE *);
+
+int   ucrp_cmd_tokenize(char *, char **, int);
+int   ucrp_cmd_parse(UCRP_CMDTREE *, char *, UCRP_CMDMATCH *);
+
+int   ucrp_cmd_setparam(UCRP_CMDTREE *, int, UCRP_CMDPARAM *, void *);
+int   ucrp_cmd_complete(UCRP_CMDTREE *, char *, UCRP_CMDCOMP *);
+int   ucrp_cmd_candidate(UCRP_CMDCOMP *, const char *);
+size_t ucrp_cmd_columns(UCRP_CMDCOMP *, int, int *, char *, size_t);
+
+int       ucrp_cmd_helpnode(UCRP_CMDTREE *, char *);
+UCRP_BUF *ucrp_cmd_helpbuf(UCRP_CMDTREE *, int);
+
+char *ucrp_cmd_name(UCRP_CMDTREE *, int);
+char *ucrp_cmd_help(UCRP_CMDTREE *, int);
+void *ucrp_cmd_data(UCRP_CMDTREE *, int);
+__END_DECLS
+
+#endif /* _UCRP_CMD_H */
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _UCRP_SERVER_H
+#define _UCRP_SERVER_H
+
+#include <ucrp.h>
+#include <ucrp_stats.h>
+
+/*
+ * event driven ucrp server
+ *
+ * one UCRP_SERVER services any number of UCRP_SESSIONs (connections)
+ * from one event loop per thread.  every session has one or more
+ * UCRP_CHANNELs; channel 0 always exists, others only if the client
+ * negotiated UCRP_EXT_CHANNELS.  received messages are handed to the
+ * callbacks below, which MUST NOT block.
+ *
+ * a session lives on one thread for its whole life and its callbacks
+ * are always called there, but with several threads the callbacks for
+ * different sessions run concurrently.  sessions and channels may
+ * only be used from their own thread.
+ *
+ * the exception is the command callback: given worker threads (see
+ * ucrp_server_setworkers()) commands run on those and may block.  a
+ * command handler may send on its channel and close its session, the
+ * output is passed back to the session's thread.  commands on the
+ * same channel run one at a time, in order.  a command that is to
+ * go on later, as "watch" does, should ask for that with
+ * ucrp_channel_again() rather than sleep, so that its worker serves
+ * other sessions in between.
+ *
+ * if there is an interrupt callback, UCRP_INTERRUPT interrupts the
+ * command running on the channel (see ucrp_channel_interrupted()),
+ * drops the commands queued behind it and the channel's unsent
+ * output, and tells the client where that happened.  the callback is
+ * called last and should send a new prompt.
+ *
+ * UCRP_LIMITS keep a loaded server responsive, see
+ * ucrp_server_setlimits().  every limit is divided evenly between the
+ * threads, so that each enforces its share on its own.
+ *
+ * a thread accepts every connection waiting on its listening sockets
+ * when it wakes up, so a burst of reconnects costs one wakeup, not
+ * one each.  UCRP_LISTEN sets the accept queue and how sockets are
+ * bound, see ucrp_server_setlisten().
+ *
+ * every server counts what it does in a statistics segment, see
+ * ucrp_stats.h, at the cost of a few stores per message.  the time
+ * every command takes is kept too, apart for commands named with
+ * ucrp_server_cmdstat().
+ *
+ * events published on a topic, see ucrp_server_publish(), are shown
+ * on channel 0 of every session subscribed to it whose filter they
+ * pass.  an event is encoded once and the same bytes are queued for
+ * all of them.  a session that doesn't keep up loses its oldest
+ * events first and is told how many.
+ */
+typedef struct _ucrp_server  UCRP_SERVER;
+typedef struct _ucrp_session UCRP_SESSION;
+typedef struct _ucrp_channel UCRP_CHANNEL;
+typedef struct _ucrp_ostream UCRP_OSTREAM;
+typedef struct _ucrp_tstream UCRP_TSTREAM;
+typedef struct _ucrp_screen  UCRP_SCREEN;
+typedef struct _ucrp_filter  UCRP_FILTER;
+typedef struct _ucrp_arena   UCRP_ARENA;
+typedef struct _ucrp_timer   UCRP_TIMER;
+typedef struct _ucrp_watch   UCRP_WATCH;
+
+typedef struct _ucrp_arenastat {
+	size_t        used;                         /* bytes handed out */
+	size_t        peak;                         /* most ever used   */
+	size_t        reserved;                     /* bytes in chunks  */
+	unsigned long allocs;                       /* allocations      */
+	unsigned long resets;
+	unsigned long mallocs;                      /* chunks made      */
+} UCRP_ARENASTAT;
+
+#define UCRP_BUS_MAXTOPICS 32      /* ucrp_server_topic()               */
+#define UCRP_BUS_NAMELEN   16
+
+typedef struct _ucrp_limits {
+	unsigned int sessions;   /* connections, more are turned away   */
+	unsigned int batch;      /* of those, UCRP_EXT_BATCH ones       */
+	unsigned int commands;   /* running, more wait after UCRP_BUSY  */
+	size_t       output;     /* bytes queued for a session before   */
+				 /* we stop reading from it             */
+	unsigned int idle;       /* seconds without input, or a command */
+				 /* running, before a session is closed */
+	size_t       maxmsg;     /* largest UCRP_EXT_MAXMSG payload we  */
+				 /* agree to, the same for every thread */
+} UCRP_LIMITS;                   /* 0 is no limit                       */
+
+typedef struct _ucrp_listen {
+	int          backlog;    /* listen() queue, 0 is SOMAXCONN      */
+	unsigned int defer;      /* seconds a connection may wait for   */
+				 /* its first message before it is      */
+				 /* accepted, 0 is off                  */
+	int          v6only;     /* IPv4 gets sockets of its own        */
+} UCRP_LISTEN;                   /* for ucrp_server_bind()              */
+
+typedef struct _ucrp_callbacks {
+	void (*connect)(UCRP_SESSION *);            /* new session      */
+	void (*close)(UCRP_SESSION *);              /* session is gone  */
+	void (*command)(UCRP_CHANNEL *, UCRP *);    /* UCRP_COMMAND     */
+	void (*complete)(UCRP_CHANNEL *, UCRP *);   /* UCRP_COMPLETE    */
+	void (*help)(UCRP_CHANNEL *, UCRP *);       /* UCRP_HELP        */
+	void (*interrupt)(UCRP_CHANNEL *, UCRP *);  /* UCRP_INTERRUPT   */
+	void (*tell)(UCRP_CHANNEL *, UCRP *);       /* UCRP_TELL        */
+	void (*suspend)(UCRP_CHANNEL *, UCRP *);    /* UCRP_SUSPEND     */
+	void (*wait)(UCRP_CHANNEL *, UCRP *);       /* UCRP_WAIT        */
+} UCRP_CALLBACKS;
+
+__BEGIN_DECLS
+/*
+ * server functions
+ */
+UCRP_SERVER *ucrp_server_new(UCRP_CALLBACKS *);
+int   ucrp_server_setthreads(UCRP_SERVER *, int, int);
+int   ucrp_server_threads(UCRP_SERVER *);
+int   ucrp_server_setworkers(UCRP_SERVER *, int);
+void  ucrp_server_setlimits(UCRP_SERVER *, UCRP_LIMITS *);
+void  ucrp_server_setlisten(UCRP_SERVER *, UCRP_LISTEN *);
+int   ucrp_server_setstats(UCRP_SERVER *, const char *);
+int   ucrp_server_cmdstat(UCRP_SERVER *, const char *);
+UCRP_STATS *ucrp_server_stats(UCRP_SERVER *);
+int   ucrp_server_printstats(UCRP_SERVER *, UCRP_OSTREAM *);
+int   ucrp_server_topic(UCRP_SERVER *, const char *);
+int   ucrp_server_publish(UCRP_SERVER *, int, int, const char *);
+int   ucrp_server_listen(UCRP_SERVER *, int);
+int   ucrp_server_bind(UCRP_SERVER *, char *, char *);
+int   ucrp_server_loop(UCRP_SERVER *);
+void  ucrp_server_stop(UCRP_SERVER *);
+void  ucrp_server_free(UCRP_SERVER *);
+
+/*
+ * session functions
+ */
+int           ucrp_session_send(UCRP_SESSION *, UCRP *);
+void          ucrp_session_close(UCRP_SESSION *);
+int           ucrp_session_fd(UCRP_SESSION *);
+int           ucrp_session_thread(UCRP_SESSION *);
+UCRP_EXT     *ucrp_session_ext(UCRP_SESSION *);
+UCRP_SERVER  *ucrp_session_server(UCRP_SESSION *);
+UCRP_CHANNEL *ucrp_session_channel(UCRP_SESSION *, int);
+void          ucrp_session_setdata(UCRP_SESSION *, void *);
+void         *ucrp_session_getdata(UCRP_SESSION *);
+int           ucrp_session_subscribe(UCRP_SESSION *, int, int, const char *);
+int           ucrp_session_unsubscribe(UCRP_SESSION *, int);
+
+/*
+ * channel functions
+ */
+int           ucrp_channel_send(UCRP_CHANNEL *, UCRP *);
+int           ucrp_channel_sendbuf(UCRP_CHANNEL *, UCRP_BUF *);
+UCRP_OSTREAM *ucrp_channel_ostream(UCRP_CHANNEL *);
+UCRP_TSTREAM *ucrp_channel_table(UCRP_CHANNEL *);
+UCRP_SCREEN  *ucrp_channel_screen(UCRP_CHANNEL *);
+UCRP_ARENA   *ucrp_channel_arena(UCRP_CHANNEL *);
+int           ucrp_channel_interrupted(UCRP_CHANNEL *);
+int           ucrp_channel_filter(UCRP_CHANNEL *, char *, char *, size_t);
+int           ucrp_channel_filterend(UCRP_CHANNEL *);
+void          ucrp_channel_cmdstat(UCRP_CHANNEL *, int);
+int           ucrp_channel_id(UCRP_CHANNEL *);
+UCRP_SESSION *ucrp_channel_session(UCRP_CHANNEL *);
+int           ucrp_channel_again(UCRP_CHANNEL *, unsigned int,
+				 void (*)(UCRP_CHANNEL *, void *), void *);
+ssize_t       ucrp_channel_readfd(UCRP_CHANNEL *, int, size_t);
+
+/*
+ * output stream functions
+ *
+ * text written to a channel's stream is packed into as few
+ * UCRP_DISPLAY messages as it takes.  a frame goes out when it is
+ * full, when the stream is flushed, when anything else is sent on the
+ * channel, when the callback returns, or a couple of milliseconds
+ * after it was started, whichever comes first.
+ *
+ * a file sent on a stream is not copied, the connection is written
+ * to straight from a mapping of it as fast as the client reads.  the
+ * client's UCRP_INTERRUPT drops what is left of it.
+ *
+ * a frame holds as much as the client agreed to with UCRP_EXT_MAXMSG
+ * when the stream was first used, up to UCRP_LIMITS maxmsg, and
+ * UCRP_MAX_PAYLOAD bytes otherwise.  ucrp_channel_readfd() frames
+ * what it reads the same way.
+ */
+int   ucrp_ostream_write(UCRP_OSTREAM *, const void *, size_t);
+int   ucrp_ostream_printf(UCRP_OSTREAM *, const char *, ...)
+	__attribute__((__format__ (__printf__, 2, 3)));
+int   ucrp_ostream_putc(UCRP_OSTREAM *, int);
+int   ucrp_ostream_sendfile(UCRP_OSTREAM *, int, off_t, size_t);
+int   ucrp_ostream_flush(UCRP_OSTREAM *);
+
+/*
+ * output filters
+ *
+ * ucrp_channel_filter() takes a trailing chain of filters off a
+ * command line and passes what the channel's stream is written
+ * through them until ucrp_channel_filterend():
+ *
+ *	command ... | include <re> | exclude <re> | begin <re>
+ *		    | head <n> | count
+ *
+ * any prefix of a filter's name will do.  patterns are extended
+ * regular expressions, compiled once, those without special
+ * characters are searched for as plain text.  lines are filtered as
+ * they are written, only those that pass are framed.  once a head
+ * filter has its lines ucrp_channel_interrupted() is set, so that
+ * the command stops early.  rows of a table are filtered as the text
+ * of their cells.
+ */
+
+/*
+ * table stream functions
+ *
+ * a table is sent as its columns and then rows of typed cells, see
+ * UCRP_TABLE, and the client lays it out for its own terminal.
+ * clients that don't know UCRP_EXT_TABLES get it laid out as text
+ * when it ends, as wide as their UCRP_EXT_COLUMNS say.  columns are
+ * added first, then the cells row by row, left to right.
+ * ucrp_tstream_end() sends the rest and frees the stream.
+ */
+int   ucrp_tstream_column(UCRP_TSTREAM *, const char *, int);
+int   ucrp_tstream_int(UCRP_TSTREAM *, int64_t);
+int   ucrp_tstream_str(UCRP_TSTREAM *, const char *);
+int   ucrp_tstream_end(UCRP_TSTREAM *);
+
+/*
+ * screen functions
+ *
+ * a screen shows the output of a command run again and again, as
+ * "watch" does.  what the channel's stream is written between
+ * ucrp_screen_begin() and ucrp_screen_end() is kept, not sent, and
+ * compared line by line with the last run.  clients that know
+ * UCRP_EXT_UPDATE are only sent the lines that changed, see
+ * UCRP_UPDATE, others all of it if anything changed.  tables are
+ * kept as text.  memory from the channel's arena is given back at
+ * every ucrp_screen_end().
+ */
+int   ucrp_screen_begin(UCRP_SCREEN *);
+int   ucrp_screen_end(UCRP_SCREEN *);
+void  ucrp_screen_free(UCRP_SCREEN *);
+
+/*
+ * timer functions
+ *
+ * a timer calls its function on its session's thread once, when the
+ * milliseconds it was set to have passed.  setting it again moves
+ * it.  a command running on a worker may set and cancel timers, all
+ * else happens on the session's thread.  the session's timers are
+ * cancelled when it is closed and freed with it.
+ */
+UCRP_TIMER *ucrp_timer_new(UCRP_SESSION *, void (*)(UCRP_TIMER *, void *),
+			   void *);
+void        ucrp_timer_set(UCRP_TIMER *, unsigned int);
+void        ucrp_timer_cancel(UCRP_TIMER *);
+int         ucrp_timer_pending(UCRP_TIMER *);
+void        ucrp_timer_free(UCRP_TIMER *);
+
+/*
+ * watch functions
+ *
+ * a watch calls its function on its session's thread whenever its
+ * descriptor, which must be non-blocking, has something to read.
+ * while the session has a lot of output queued the watch is held
+ * off, so that a program writing to the descriptor is slowed down to
+ * what the client takes.  a watch is stopped when its session is
+ * closed and freed with it, the descriptor is left alone.
+ */
+UCRP_WATCH *ucrp_watch_new(UCRP_SESSION *, int,
+			   void (*)(UCRP_WATCH *, int, void *), void *);
+void        ucrp_watch_free(UCRP_WATCH *);
+
+/*
+ * arena functions
+ *
+ * an arena hands out memory that is all given back at once.  the
+ * arena of a channel, see ucrp_channel_arena(), is reset when the
+ * callback that got it returns: memory from it must not be kept
+ * past that.
+ */
+UCRP_ARENA *ucrp_arena_new(size_t);
+void       *ucrp_arena_alloc(UCRP_ARENA *, size_t);
+char       *ucrp_arena_strdup(UCRP_ARENA *, const char *);
+char       *ucrp_arena_printf(UCRP_ARENA *, const char *, ...)
+	__attribute__((__format__ (__printf__, 2, 3)));
+void        ucrp_arena_reset(UCRP_ARENA *);
+void        ucrp_arena_stats(UCRP_ARENA *, UCRP_ARENASTAT *);
+void        ucrp_arena_free(UCRP_ARENA *);
+__END_DECLS
+
+#endif /* _UCRP_SERVER_H */
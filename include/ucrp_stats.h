@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _UCRP_STATS_H
+#define _UCRP_STATS_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * server statistics
+ *
+ * a server keeps its counters in one shared memory segment, laid out
+ * as below, that other processes may map read only (see
+ * ucrp_stats_map()) without the server doing anything for them.
+ * every block has a single writer, the io thread or worker it
+ * belongs to, which stores whole 64 bit words; readers see each word
+ * either old or new, and nothing is ever locked.
+ *
+ * command latencies are kept in log-linear histograms: below
+ * UCRP_HIST_SUB microseconds one bucket per microsecond, above that
+ * UCRP_HIST_SUB buckets per power of two, so every bucket is within
+ * 1/UCRP_HIST_SUB of its value.  the last bucket takes anything
+ * longer than about an hour.
+ */
+#define UCRP_STATS_MAGIC   0x75637270          /* "ucrp"                */
+#define UCRP_STATS_VERSION 1
+
+#define UCRP_STATS_NTYPES  32                  /* server 100+, client 200+ */
+#define UCRP_STATS_TYPE(t) \
+	((t) >= 200 && (t) < 216 ? (t) - 200 + 16 : \
+	 (t) >= 100 && (t) < 116 ? (t) - 100 : -1)
+
+#define UCRP_STATS_MAXCMDS 64                  /* 0 is every other one  */
+#define UCRP_STATS_NAMELEN 32
+
+#define UCRP_HIST_SUBBITS  4
+#define UCRP_HIST_SUB      (1 << UCRP_HIST_SUBBITS)
+#define UCRP_HIST_BUCKETS  ((32 - UCRP_HIST_SUBBITS + 1) * UCRP_HIST_SUB)
+
+typedef struct _ucrp_stats_io {                /* one io thread         */
+	uint64_t msgs_in[UCRP_STATS_NTYPES];
+	uint64_t bytes_in[UCRP_STATS_NTYPES];
+	uint64_t msgs_out[UCRP_STATS_NTYPES];
+	uint64_t bytes_out[UCRP_STATS_NTYPES];
+	uint64_t sessions;                     /* accepted              */
+	uint64_t refused;                      /* over UCRP_LIMITS      */
+	uint64_t drained;                      /* posts from workers    */
+	uint64_t events;                       /* bus events queued     */
+	uint64_t dropped;                      /* and held, then lost   */
+	/* gauges, brought up to date every time round the loop */
+	uint64_t active;                       /* sessions              */
+	uint64_t running;                      /* commands on the pool  */
+	uint64_t waiting[2];                   /* interactive, batch    */
+	uint64_t queued;                       /* output bytes          */
+	uint64_t timers;                       /* pending               */
+} UCRP_STATS_IO;
+
+typedef struct _ucrp_stats_worker {            /* one worker            */
+	uint64_t commands;
+	uint64_t posted;                       /* to the io threads     */
+	uint64_t hist[UCRP_STATS_MAXCMDS][UCRP_HIST_BUCKETS];
+} UCRP_STATS_WORKER;
+
+typedef struct _ucrp_stats {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nio;                          /* UCRP_STATS_IO blocks  */
+	uint32_t nworkers;                     /* UCRP_STATS_WORKERs    */
+	uint32_t ncmds;                        /* names in use          */
+	uint32_t pad;
+	uint64_t size;                         /* of the whole segment  */
+	uint64_t started;                      /* time(3)               */
+	char     cmdnames[UCRP_STATS_MAXCMDS][UCRP_STATS_NAMELEN];
+	/* UCRP_STATS_IO io[nio], then UCRP_STATS_WORKER workers[nworkers] */
+} UCRP_STATS;
+
+#define UCRP_STATS_IOP(st, i) \
+	((UCRP_STATS_IO *)((char *)(st) + sizeof(UCRP_STATS)) + (i))
+#define UCRP_STATS_WORKERP(st, i) \
+	((UCRP_STATS_WORKER *)UCRP_STATS_IOP(st, (st)->nio) + (i))
+#define UCRP_STATS_SIZE(nio, nworkers) \
+	(sizeof(UCRP_STATS) + (nio) * sizeof(UCRP_STATS_IO) + \
+	 (nworkers) * sizeof(UCRP_STATS_WORKER))
+
+__BEGIN_DECLS
+int         ucrp_hist_bucket(uint64_t);
+uint64_t    ucrp_hist_value(int);
+uint64_t    ucrp_hist_percentile(const uint64_t *, double);
+
+UCRP_STATS *ucrp_stats_map(const char *);
+void        ucrp_stats_unmap(UCRP_STATS *);
+__END_DECLS
+
+#endif /* _UCRP_STATS_H */
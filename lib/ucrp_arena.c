@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bump allocator for the short lived memory of one command
+ *
+ * allocations are carved out of a list of chunks and never freed one
+ * by one; ucrp_arena_reset() takes everything back at once.  the
+ * chunks are kept for the next command, so once an arena has grown
+ * to what its commands need it stops calling malloc() altogether.
+ * chunks bigger than usual, made for one large allocation, are given
+ * back on reset.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+#define ARENA_ALIGN     16                    /* >= max_align_t        */
+#define ARENA_CHUNKSIZE 8192                  /* default chunk size    */
+#define ARENA_ROUND(n)  (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct _arena_chunk {
+	struct _arena_chunk *next;
+	size_t  size;                          /* bytes at data         */
+	size_t  used;
+	uint8_t data[] __attribute__((aligned(ARENA_ALIGN)));
+} ARENA_CHUNK;
+
+struct _ucrp_arena {
+	ARENA_CHUNK   *head;                   /* all chunks, in order  */
+	ARENA_CHUNK   *cur;                    /* allocating from here  */
+	size_t         chunksize;
+	UCRP_ARENASTAT st;
+};
+
+static ARENA_CHUNK *arena_chunk(UCRP_ARENA *, size_t);
+static void        *arena_room(UCRP_ARENA *, size_t);
+
+/*
+ * ucrp_arena_new()
+ *
+ * create an arena that grows 'chunksize' bytes at a time, or
+ * ARENA_CHUNKSIZE if 'chunksize' is 0
+ *
+ * returns the arena or NULL on error
+ */
+UCRP_ARENA *
+ucrp_arena_new(size_t chunksize)
+{
+	UCRP_ARENA *ap;
+
+	if ((ap = calloc(1, sizeof(*ap))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	ap->chunksize = chunksize > 0 ? ARENA_ROUND(chunksize) :
+		ARENA_CHUNKSIZE;
+
+	return ap;
+}
+
+/*
+ * arena_chunk()
+ *
+ * link a new chunk of at least 'len' bytes in after the current one
+ *
+ * returns the chunk or NULL on error
+ */
+static ARENA_CHUNK *
+arena_chunk(UCRP_ARENA *ap, size_t len)
+{
+	ARENA_CHUNK *ch;
+	size_t size;
+
+	size = len > ap->chunksize ? len : ap->chunksize;
+	if ((ch = malloc(sizeof(*ch) + size)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	ch->size = size;
+	ch->used = 0;
+
+	if (ap->cur == NULL) {
+		ch->next = ap->head;
+		ap->head = ch;
+	} else {
+		ch->next = ap->cur->next;
+		ap->cur->next = ch;
+	}
+
+	ap->st.reserved += size;
+	ap->st.mallocs++;
+
+	return ch;
+}
+
+/*
+ * arena_room()
+ *
+ * make the current chunk one with 'len' bytes free, moving on to a
+ * kept chunk if there is one or else to a new one
+ *
+ * returns a pointer to the free bytes or NULL on error
+ */
+static void *
+arena_room(UCRP_ARENA *ap, size_t len)
+{
+	ARENA_CHUNK *ch;
+
+	if ((ch = ap->cur) != NULL && ch->size - ch->used >= len)
+		return ch->data + ch->used;
+
+	/* the chunks after cur are empty, kept from earlier commands */
+	ch = ap->cur != NULL ? ap->cur->next : ap->head;
+	if (ch == NULL || ch->size < len)
+		ch = arena_chunk(ap, len);
+	if (ch == NULL)
+		return NULL;
+
+	ap->cur = ch;
+
+	return ch->data;
+}
+
+/*
+ * ucrp_arena_alloc()
+ *
+ * returns 'len' bytes aligned for any type, valid until the arena is
+ * reset, or NULL on error
+ */
+void *
+ucrp_arena_alloc(UCRP_ARENA *ap, size_t len)
+{
+	void *p;
+
+	len = ARENA_ROUND(len > 0 ? len : 1);
+
+	if ((p = arena_room(ap, len)) == NULL)
+		return NULL;
+
+	ap->cur->used += len;
+	ap->st.used += len;
+	ap->st.allocs++;
+	if (ap->st.used > ap->st.peak)
+		ap->st.peak = ap->st.used;
+
+	return p;
+}
+
+/*
+ * ucrp_arena_strdup()
+ *
+ * returns a copy of 's' in the arena or NULL on error
+ */
+char *
+ucrp_arena_strdup(UCRP_ARENA *ap, const char *s)
+{
+	size_t len;
+	char *p;
+
+	len = strlen(s) + 1;
+	if ((p = ucrp_arena_alloc(ap, len)) != NULL)
+		memcpy(p, s, len);
+
+	return p;
+}
+
+/*
+ * ucrp_arena_printf()
+ *
+ * asprintf() into the arena.  the string is formatted straight into
+ * the current chunk, only one that does not fit is formatted twice.
+ *
+ * returns the string or NULL on error
+ */
+char *
+ucrp_arena_printf(UCRP_ARENA *ap, const char *fmt, ...)
+{
+	ARENA_CHUNK *ch;
+	va_list va;
+	size_t room, len;
+	char *p;
+	int n;
+
+	ch = ap->cur;
+	room = ch != NULL ? ch->size - ch->used : 0;
+	p = ch != NULL ? (char *)ch->data + ch->used : NULL;
+
+	va_start(va, fmt);
+	n = vsnprintf(p, room, fmt, va);
+	va_end(va);
+
+	if (n < 0)
+		return NULL;
+
+	if (n < room) {
+		len = ARENA_ROUND(n + 1) < room ? ARENA_ROUND(n + 1) : room;
+		ch->used += len;
+		ap->st.used += len;
+		ap->st.allocs++;
+		if (ap->st.used > ap->st.peak)
+			ap->st.peak = ap->st.used;
+		return p;
+	}
+
+	if ((p = ucrp_arena_alloc(ap, n + 1)) == NULL)
+		return NULL;
+
+	va_start(va, fmt);
+	vsnprintf(p, n + 1, fmt, va);
+	va_end(va);
+
+	return p;
+}
+
+/*
+ * ucrp_arena_reset()
+ *
+ * take back everything allocated, keeping the chunks of the usual
+ * size for next time
+ */
+void
+ucrp_arena_reset(UCRP_ARENA *ap)
+{
+	ARENA_CHUNK *ch, **chp;
+
+	for (chp = &ap->head; (ch = *chp) != NULL; ) {
+		if (ch->size > ap->chunksize) {
+			*chp = ch->next;
+			ap->st.reserved -= ch->size;
+			free(ch);
+			continue;
+		}
+
+		ch->used = 0;
+		chp = &ch->next;
+	}
+
+	ap->cur = NULL;
+	ap->st.used = 0;
+	ap->st.resets++;
+
+	return;
+}
+
+/*
+ * ucrp_arena_stats()
+ *
+ * copy out the arena's statistics
+ */
+void
+ucrp_arena_stats(UCRP_ARENA *ap, UCRP_ARENASTAT *st)
+{
+	*st = ap->st;
+
+	return;
+}
+
+/*
+ * ucrp_arena_free()
+ */
+void
+ucrp_arena_free(UCRP_ARENA *ap)
+{
+	ARENA_CHUNK *ch;
+
+	if (ap == NULL)
+		return;
+
+	while ((ch = ap->head) != NULL) {
+		ap->head = ch->next;
+		free(ch);
+	}
+
+	free(ap);
+
+	return;
+}
+
+/*
+ * ucrp_channel_arena()
+ *
+ * returns the arena for the callback running on the channel, created
+ * on first use, or NULL on error.  commands on the worker pool use
+ * the channel's own, everything on the session's thread shares that
+ * thread's.  either is reset when the callback returns.
+ */
+UCRP_ARENA *
+ucrp_channel_arena(UCRP_CHANNEL *cp)
+{
+	UCRP_ARENA **app;
+
+	app = ucrp_curshard != NULL ? &ucrp_curshard->arena : &cp->arena;
+	if (*app == NULL)
+		*app = ucrp_arena_new(0);
+
+	return *app;
+}
@@ -0,0 +1,657 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+#define SEGQ_IOVMAX 256                        /* 128 file messages     */
+
+static UCRP_SEG *seg_get(UCRP_SEGQ *, size_t);
+static void      seg_put(UCRP_SEGQ *, UCRP_SEG *);
+static void      segq_count(UCRP_SEGQ *, ssize_t);
+static void      segq_used(UCRP_SEGQ *, UCRP_SEG *, size_t);
+static int       segq_frames(UCRP_SEG *, struct iovec *, int);
+static size_t    segq_trim(UCRP_SEG *);
+static void      filebuf_free(UCRP_BUF *);
+
+/*
+ * ucrp_buf_new()
+ *
+ * allocate a buffer of 'size' bytes with a single reference
+ *
+ * returns the buffer or NULL on error
+ */
+UCRP_BUF *
+ucrp_buf_new(size_t size)
+{
+	UCRP_BUF *bp;
+
+	if ((bp = malloc(sizeof(*bp) + size)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	bp->refcnt = 1;
+	bp->size = size;
+	bp->data = (uint8_t *)(bp + 1);
+	bp->free = NULL;
+
+	return bp;
+}
+
+/*
+ * ucrp_buf_ref()
+ */
+void
+ucrp_buf_ref(UCRP_BUF *bp)
+{
+	__atomic_add_fetch(&bp->refcnt, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * ucrp_buf_rele()
+ *
+ * drop a reference, freeing the buffer with the last one
+ */
+void
+ucrp_buf_rele(UCRP_BUF *bp)
+{
+	if (__atomic_sub_fetch(&bp->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	if (bp->free != NULL)
+		bp->free(bp);
+	else
+		free(bp);
+
+	return;
+}
+
+/*
+ * ucrp_filebuf_new()
+ *
+ * map 'len' bytes of file 'fd' from 'off' for sending as messages of
+ * up to 'frame' bytes of payload
+ *
+ * returns the buffer, with a single reference, or NULL on error
+ */
+UCRP_FILEBUF *
+ucrp_filebuf_new(int fd, off_t off, size_t len, size_t frame)
+{
+	UCRP_FILEBUF *fb;
+	off_t start;
+
+	if ((fb = calloc(1, sizeof(*fb))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	start = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	fb->maplen = len + (off - start);
+	fb->map = mmap(NULL, fb->maplen, PROT_READ, MAP_SHARED, fd, start);
+	if (fb->map == MAP_FAILED) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(fb);
+		return NULL;
+	}
+	madvise(fb->map, fb->maplen, MADV_SEQUENTIAL);
+
+	fb->payload = len;
+	fb->frame = frame;
+	fb->buf.refcnt = 1;
+	fb->buf.data = (uint8_t *)fb->map + (off - start);
+	fb->buf.size = len + FILEBUF_FRAMES(fb) * UCRP_HDR_SIZE;
+	fb->buf.free = filebuf_free;
+
+	return fb;
+}
+
+/*
+ * filebuf_free()
+ */
+static void
+filebuf_free(UCRP_BUF *bp)
+{
+	UCRP_FILEBUF *fb = (UCRP_FILEBUF *)bp;
+
+	munmap(fb->map, fb->maplen);
+	free(fb);
+
+	return;
+}
+
+/*
+ * ucrp_segcache_init()
+ */
+void
+ucrp_segcache_init(UCRP_SEGCACHE *sc)
+{
+	TAILQ_INIT(&sc->chunks);
+	TAILQ_INIT(&sc->segs);
+	sc->nchunks = sc->nsegs = 0;
+	sc->bytes = 0;
+
+	return;
+}
+
+/*
+ * ucrp_segcache_clear()
+ *
+ * free the segments and chunks kept in the cache
+ */
+void
+ucrp_segcache_clear(UCRP_SEGCACHE *sc)
+{
+	UCRP_SEG *sg;
+
+	while ((sg = TAILQ_FIRST(&sc->chunks)) != NULL) {
+		TAILQ_REMOVE(&sc->chunks, sg, entry);
+		ucrp_buf_rele(sg->buf);
+		free(sg);
+	}
+
+	while ((sg = TAILQ_FIRST(&sc->segs)) != NULL) {
+		TAILQ_REMOVE(&sc->segs, sg, entry);
+		free(sg);
+	}
+
+	sc->nchunks = sc->nsegs = 0;
+
+	return;
+}
+
+/*
+ * segq_count()
+ *
+ * 'n' bytes more, or fewer, are queued
+ */
+static void
+segq_count(UCRP_SEGQ *q, ssize_t n)
+{
+	q->bytes += n;
+	if (q->cache != NULL)
+		q->cache->bytes += n;
+
+	return;
+}
+
+/*
+ * ucrp_segq_init()
+ *
+ * 'sc', if not NULL, is where segments come from and go back to.  it
+ * must only be used from the queue's thread.
+ */
+void
+ucrp_segq_init(UCRP_SEGQ *q, UCRP_SEGCACHE *sc)
+{
+	TAILQ_INIT(&q->head);
+	q->bytes = q->mapped = 0;
+	q->cache = sc;
+
+	return;
+}
+
+/*
+ * seg_get()
+ *
+ * get a segment from the cache, or else allocate one.  if 'len' is
+ * not 0 it is a private segment with a chunk of at least 'len' bytes.
+ *
+ * returns the segment, not on any queue, or NULL on error
+ */
+static UCRP_SEG *
+seg_get(UCRP_SEGQ *q, size_t len)
+{
+	UCRP_SEGCACHE *sc = q->cache;
+	UCRP_SEG *sg;
+
+	if (sc != NULL && len > 0 && len <= SEG_CHUNK &&
+	    (sg = TAILQ_FIRST(&sc->chunks)) != NULL) {
+		TAILQ_REMOVE(&sc->chunks, sg, entry);
+		sc->nchunks--;
+		return sg;
+	}
+
+	if (sc != NULL && (sg = TAILQ_FIRST(&sc->segs)) != NULL) {
+		TAILQ_REMOVE(&sc->segs, sg, entry);
+		sc->nsegs--;
+	} else if ((sg = malloc(sizeof(*sg))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	sg->buf = NULL;
+	if (len > 0 && (sg->buf = ucrp_buf_new(len > SEG_CHUNK ?
+						len : SEG_CHUNK)) == NULL) {
+		seg_put(q, sg);
+		return NULL;
+	}
+
+	return sg;
+}
+
+/*
+ * seg_put()
+ *
+ * give back a segment that is off the queue, keeping it and its
+ * chunk for later if the cache has room
+ */
+static void
+seg_put(UCRP_SEGQ *q, UCRP_SEG *sg)
+{
+	UCRP_SEGCACHE *sc = q->cache;
+
+	if (sc != NULL && sg->buf != NULL && (sg->flags & SEG_PRIVATE) &&
+	    sg->buf->size == SEG_CHUNK && sc->nchunks < SEGCACHE_KEEP) {
+		TAILQ_INSERT_HEAD(&sc->chunks, sg, entry);
+		sc->nchunks++;
+		return;
+	}
+
+	if (sg->buf != NULL)
+		ucrp_buf_rele(sg->buf);
+
+	if (sc != NULL && sc->nsegs < SEGCACHE_KEEP) {
+		TAILQ_INSERT_HEAD(&sc->segs, sg, entry);
+		sc->nsegs++;
+		return;
+	}
+
+	free(sg);
+
+	return;
+}
+
+/*
+ * ucrp_segq_reserve()
+ *
+ * reserve 'len' contiguous bytes at the end of the queue, in the
+ * last private chunk if it has room or else in a new one.
+ *
+ * returns a pointer to the reserved bytes or NULL on error
+ */
+void *
+ucrp_segq_reserve(UCRP_SEGQ *q, size_t len)
+{
+	UCRP_SEG *sg;
+	uint8_t *p;
+
+	sg = TAILQ_LAST(&q->head, _ucrp_seg_head);
+	if (sg == NULL || (sg->flags & SEG_PRIVATE) == 0 ||
+	    sg->off + sg->len + len > sg->buf->size) {
+		if ((sg = seg_get(q, len)) == NULL)
+			return NULL;
+
+		sg->start = sg->off = sg->len = 0;
+		sg->flags = SEG_PRIVATE;
+		TAILQ_INSERT_TAIL(&q->head, sg, entry);
+	}
+
+	p = sg->buf->data + sg->off + sg->len;
+	sg->len += len;
+	segq_count(q, len);
+
+	return p;
+}
+
+/*
+ * ucrp_segq_append()
+ *
+ * copy 'len' bytes to the end of the queue
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_segq_append(UCRP_SEGQ *q, const void *data, size_t len)
+{
+	void *p;
+
+	if ((p = ucrp_segq_reserve(q, len)) == NULL)
+		return -1;
+
+	memcpy(p, data, len);
+
+	return 0;
+}
+
+/*
+ * ucrp_segq_appendbuf()
+ *
+ * queue a slice of a shared buffer without copying it.  the slice
+ * must hold whole messages.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_segq_appendbuf(UCRP_SEGQ *q, UCRP_BUF *bp, size_t off, size_t len)
+{
+	UCRP_SEG *sg;
+
+	if ((sg = seg_get(q, 0)) == NULL)
+		return -1;
+
+	ucrp_buf_ref(bp);
+	sg->buf = bp;
+	sg->start = sg->off = off;
+	sg->len = len;
+	sg->flags = 0;
+	TAILQ_INSERT_TAIL(&q->head, sg, entry);
+	segq_count(q, len);
+
+	return 0;
+}
+
+/*
+ * ucrp_segq_appendfile()
+ *
+ * queue a mapped file, the headers set, without copying it
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_segq_appendfile(UCRP_SEGQ *q, UCRP_FILEBUF *fb)
+{
+	if (ucrp_segq_appendbuf(q, &fb->buf, 0, fb->buf.size) == -1)
+		return -1;
+
+	TAILQ_LAST(&q->head, _ucrp_seg_head)->flags = SEG_FRAMED;
+	q->mapped += fb->buf.size;
+
+	return 0;
+}
+
+/*
+ * segq_frames()
+ *
+ * add the iovecs for the unwritten part of a SEG_FRAMED slice, a
+ * header and a piece of the mapping for every message, from 'n' on
+ *
+ * returns the number of iovecs now in 'iov'
+ */
+static int
+segq_frames(UCRP_SEG *sg, struct iovec *iov, int n)
+{
+	UCRP_FILEBUF *fb = (UCRP_FILEBUF *)sg->buf;
+	size_t w, end, k, r, plen, len;
+
+	end = sg->off + sg->len;
+	for (w = sg->off; w < end && n < SEGQ_IOVMAX; w += len) {
+		k = w / FILEBUF_FRAME(fb);
+		r = w % FILEBUF_FRAME(fb);
+
+		if (r < UCRP_HDR_SIZE) {
+			iov[n].iov_base = (k == FILEBUF_FRAMES(fb) - 1 ?
+					   fb->last : fb->full) + r;
+			iov[n].iov_len = len = UCRP_HDR_SIZE - r;
+			n++;
+			continue;
+		}
+
+		plen = fb->payload - k * fb->frame;
+		if (plen > fb->frame)
+			plen = fb->frame;
+		len = UCRP_HDR_SIZE + plen - r;
+		if (len > end - w)
+			len = end - w;
+
+		iov[n].iov_base = fb->buf.data + k * fb->frame +
+		    (r - UCRP_HDR_SIZE);
+		iov[n].iov_len = len;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * segq_used()
+ *
+ * 'n' bytes of a slice were written or dropped
+ */
+static void
+segq_used(UCRP_SEGQ *q, UCRP_SEG *sg, size_t n)
+{
+	if (sg->flags & SEG_FRAMED)
+		q->mapped -= n;
+
+	return;
+}
+
+/*
+ * ucrp_segq_write()
+ *
+ * write as much of the queue to 's' as it will take
+ *
+ * returns the number of bytes written or -1 on error.  EAGAIN is
+ * not an error.
+ */
+ssize_t
+ucrp_segq_write(UCRP_SEGQ *q, int s)
+{
+	struct iovec iov[SEGQ_IOVMAX];
+	struct msghdr mh;
+	UCRP_SEG *sg;
+	ssize_t ret, done;
+	int n;
+
+	done = 0;
+	while (!TAILQ_EMPTY(&q->head)) {
+		n = 0;
+		TAILQ_FOREACH(sg, &q->head, entry) {
+			if (n == SEGQ_IOVMAX)
+				break;
+
+			if (sg->flags & SEG_FRAMED) {
+				n = segq_frames(sg, iov, n);
+				continue;
+			}
+
+			iov[n].iov_base = sg->buf->data + sg->off;
+			iov[n].iov_len = sg->len;
+			n++;
+		}
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+
+		ret = sendmsg(s, &mh, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return -1;
+		}
+
+		done += ret;
+		segq_count(q, -ret);
+
+		/* consume what was written */
+		while (ret > 0) {
+			sg = TAILQ_FIRST(&q->head);
+
+			if (ret < sg->len) {
+				segq_used(q, sg, ret);
+				sg->off += ret;
+				sg->len -= ret;
+				break;
+			}
+
+			segq_used(q, sg, sg->len);
+			ret -= sg->len;
+			TAILQ_REMOVE(&q->head, sg, entry);
+			seg_put(q, sg);
+		}
+	}
+
+	return done;
+}
+
+/*
+ * ucrp_segq_discard()
+ *
+ * drop the unsent messages 'match' returns non-zero for.  'match' is
+ * given the header in host order.  a message that is partly written
+ * is always kept, as are slices of shared buffers unless every
+ * message in them goes.
+ *
+ * returns the number of bytes dropped
+ */
+size_t
+ucrp_segq_discard(UCRP_SEGQ *q, int (*match)(UCRP *, void *), void *arg)
+{
+	UCRP_SEG *sg, *next;
+	UCRP hdr;
+	uint8_t *data;
+	size_t pos, end, mlen, w, dropped, before;
+	int all;
+
+	dropped = 0;
+
+	for (sg = TAILQ_FIRST(&q->head); sg != NULL; sg = next) {
+		next = TAILQ_NEXT(sg, entry);
+
+		/* a file's messages are all alike */
+		if (sg->flags & SEG_FRAMED) {
+			memcpy(&hdr, ((UCRP_FILEBUF *)sg->buf)->full,
+			       UCRP_HDR_SIZE);
+			ucrp_msg_ntoh(&hdr);
+			if (match(&hdr, arg)) {
+				mlen = segq_trim(sg);
+				dropped += mlen;
+				segq_count(q, -(ssize_t)mlen);
+				segq_used(q, sg, mlen);
+			}
+			if (sg->len == 0) {
+				TAILQ_REMOVE(&q->head, sg, entry);
+				seg_put(q, sg);
+			}
+			continue;
+		}
+
+		data = sg->buf->data;
+		end = sg->off + sg->len;
+		before = sg->len;
+
+		/* w is where the next message we keep goes */
+		w = sg->off;
+		all = (sg->off == sg->start);
+
+		for (pos = sg->start; pos < end; pos += mlen) {
+			memcpy(&hdr, data + pos, UCRP_HDR_SIZE);
+			ucrp_msg_ntoh(&hdr);
+			mlen = UCRP_HDR_SIZE + hdr.length;
+
+			if (pos + mlen <= sg->off)
+				continue;		/* already written */
+
+			if (pos < sg->off) {
+				w = pos + mlen;		/* partly written */
+				continue;
+			}
+
+			if (match(&hdr, arg))
+				continue;
+
+			all = 0;
+			if (sg->flags & SEG_PRIVATE) {
+				if (w != pos)
+					memmove(data + w, data + pos, mlen);
+				w += mlen;
+			}
+		}
+
+		if (sg->flags & SEG_PRIVATE)
+			sg->len = w - sg->off;
+		else if (all)
+			sg->len = 0;
+
+		dropped += before - sg->len;
+		segq_count(q, -(ssize_t)(before - sg->len));
+
+		if (sg->len == 0) {
+			TAILQ_REMOVE(&q->head, sg, entry);
+			seg_put(q, sg);
+		}
+	}
+
+	return dropped;
+}
+
+/*
+ * ucrp_segq_clear()
+ *
+ * throw away everything queued
+ */
+void
+ucrp_segq_clear(UCRP_SEGQ *q)
+{
+	UCRP_SEG *sg;
+
+	while ((sg = TAILQ_FIRST(&q->head)) != NULL) {
+		TAILQ_REMOVE(&q->head, sg, entry);
+		seg_put(q, sg);
+	}
+
+	segq_count(q, -(ssize_t)q->bytes);
+	q->mapped = 0;
+
+	return;
+}
+
+/*
+ * segq_trim()
+ *
+ * cut a SEG_FRAMED slice short after the message being written
+ *
+ * returns the number of bytes cut
+ */
+static size_t
+segq_trim(UCRP_SEG *sg)
+{
+	UCRP_FILEBUF *fb = (UCRP_FILEBUF *)sg->buf;
+	size_t end, keep;
+
+	if (sg->off % FILEBUF_FRAME(fb) == 0) {
+		keep = 0;
+	} else {
+		end = (sg->off / FILEBUF_FRAME(fb) + 1) * FILEBUF_FRAME(fb);
+		if (end > fb->buf.size)
+			end = fb->buf.size;
+		keep = end - sg->off;
+	}
+
+	if (keep >= sg->len)
+		return 0;
+
+	end = sg->len - keep;
+	sg->len = keep;
+
+	return end;
+}
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * event bus
+ *
+ * events are published from any thread to every io thread with
+ * subscribers, as one reference counted buffer of wire ready
+ * UCRP_DISPLAY messages.  each io thread puts the buffer on the
+ * output queue of its subscribers that want it, so however many
+ * there are the text is encoded once and never copied.
+ *
+ * a subscriber with more than SUB_LOWAT bytes queued has its events
+ * held back, up to SUB_QLEN of them, and loses the oldest one for
+ * every one after that.  held events go out as its queue drains,
+ * after a line saying how many were lost.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+#define BUS_MATCHLEN 128                       /* longest filter        */
+
+static UCRP_EVENT *event_new(int, int, const char *);
+static void        sub_push(UCRP_SUB *, UCRP_EVENT *);
+
+/*
+ * ucrp_server_topic()
+ *
+ * look up topic 'name', adding it if it is new.  must be called
+ * before ucrp_server_loop().
+ *
+ * returns the topic or -1 if there are UCRP_BUS_MAXTOPICS already
+ */
+int
+ucrp_server_topic(UCRP_SERVER *srv, const char *name)
+{
+	int i;
+
+	for (i = 0; i < srv->ntopics; i++)
+		if (strncmp(srv->topics[i], name, UCRP_BUS_NAMELEN - 1) == 0)
+			return i;
+
+	if (srv->ntopics == UCRP_BUS_MAXTOPICS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	snprintf(srv->topics[srv->ntopics], UCRP_BUS_NAMELEN, "%s", name);
+
+	return srv->ntopics++;
+}
+
+/*
+ * event_new()
+ *
+ * encode 'text' as UCRP_DISPLAY messages for channel 0, cut at line
+ * ends, with a line end added if it has none
+ *
+ * returns the event, with one reference, or NULL on error
+ */
+static UCRP_EVENT *
+event_new(int topic, int prio, const char *text)
+{
+	UCRP_EVENT *ev;
+	UCRP hdr;
+	const char *p, *end, *nl;
+	size_t len, chunk, size, n, m, pos;
+	int eol;
+
+	len = strlen(text);
+	eol = (len == 0 || text[len - 1] != '\n');
+	chunk = UCRP_MAX_PAYLOAD - 1;
+
+	/* the messages, then the text again for the filters */
+	size = len + eol + (2 * (len + eol) / chunk + 2) * UCRP_HDR_SIZE;
+	if ((ev = malloc(sizeof(*ev) + size + len + 1)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	ev->buf.refcnt = 1;
+	ev->buf.data = (uint8_t *)(ev + 1);
+	ev->buf.free = NULL;
+	ev->topic = topic;
+	ev->prio = prio;
+	ev->text = (char *)ev->buf.data + size;
+	memcpy(ev->text, text, len + 1);
+
+	pos = 0;
+	for (p = text, end = text + len; p < end || eol; p += n) {
+		n = end - p > chunk ? chunk : end - p;
+		if (p + n < end) {
+			for (nl = p + n - 1; nl > p && *nl != '\n'; nl--)
+				;
+			if (nl > p)
+				n = nl - p + 1;
+		}
+
+		memcpy(ev->buf.data + pos + UCRP_HDR_SIZE, p, n);
+		m = n;
+
+		/* the line end goes in the last message */
+		if (p + n == end && eol) {
+			ev->buf.data[pos + UCRP_HDR_SIZE + m++] = '\n';
+			eol = 0;
+		}
+
+		hdr.type = UCRP_DISPLAY;
+		hdr.options = 0;
+		hdr.length = m;
+		ucrp_msg_hton(&hdr);
+
+		memcpy(ev->buf.data + pos, &hdr, UCRP_HDR_SIZE);
+		pos += UCRP_HDR_SIZE + m;
+	}
+	ev->buf.size = pos;
+
+	return ev;
+}
+
+/*
+ * ucrp_server_publish()
+ *
+ * show 'text' to the sessions subscribed to 'topic' at syslog
+ * priority 'prio' or less urgent.  safe from any thread.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_publish(UCRP_SERVER *srv, int topic, int prio, const char *text)
+{
+	UCRP_SHARD *shp;
+	UCRP_EVENT *ev;
+	int i, ret;
+
+	if (topic < 0 || topic >= srv->ntopics) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((ev = event_new(topic, prio, text)) == NULL)
+		return -1;
+
+	ret = 0;
+	for (i = 0; i < srv->nshards; i++) {
+		shp = &srv->shards[i];
+		if (__atomic_load_n(&shp->nsubs, __ATOMIC_RELAXED) == 0)
+			continue;
+
+		if (shp == ucrp_curshard) {
+			ucrp_bus_deliver(shp, &ev->buf);
+			continue;
+		}
+
+		ucrp_buf_ref(&ev->buf);
+		if (ucrp_shard_postptr(shp, POST_EVENT, NULL, &ev->buf,
+				       0) == -1) {
+			ucrp_buf_rele(&ev->buf);
+			ret = -1;
+		}
+	}
+
+	ucrp_buf_rele(&ev->buf);
+
+	return ret;
+}
+
+/*
+ * ucrp_bus_deliver()
+ *
+ * queue event 'bp' for the shard's subscribers whose filters it
+ * passes
+ */
+void
+ucrp_bus_deliver(UCRP_SHARD *shp, UCRP_BUF *bp)
+{
+	UCRP_EVENT *ev = (UCRP_EVENT *)bp;
+	UCRP_SUB *sub;
+	int t = ev->topic;
+
+	LIST_FOREACH(sub, &shp->subs, entry) {
+		if ((sub->topics & (1U << t)) == 0 || ev->prio > sub->prio[t])
+			continue;
+		if (sub->match[t] != NULL &&
+		    strstr(ev->text, sub->match[t]) == NULL)
+			continue;
+
+		sub_push(sub, ev);
+	}
+
+	return;
+}
+
+/*
+ * sub_push()
+ *
+ * queue an event for a subscriber, or hold it back if the session
+ * is behind
+ */
+static void
+sub_push(UCRP_SUB *sub, UCRP_EVENT *ev)
+{
+	UCRP_SESSION *sp = sub->sp;
+	UCRP_SHARD *shp = sp->shard;
+
+	if (sp->flags & (SESS_DEAD | SESS_CLOSING))
+		return;
+
+	if (sub->nheld == 0 && sp->txq.bytes < SUB_LOWAT) {
+		if (ucrp_session_queuebuf(sp, &ev->buf) == 0)
+			STATS_ADD(shp->stats->events, 1);
+		return;
+	}
+
+	/* the oldest goes, what is going on now matters more */
+	if (sub->nheld == SUB_QLEN) {
+		ucrp_buf_rele(sub->held[sub->first]);
+		sub->first = (sub->first + 1) % SUB_QLEN;
+		sub->nheld--;
+		sub->dropped++;
+		STATS_ADD(shp->stats->dropped, 1);
+	}
+
+	ucrp_buf_ref(&ev->buf);
+	sub->held[(sub->first + sub->nheld) % SUB_QLEN] = &ev->buf;
+	sub->nheld++;
+
+	return;
+}
+
+/*
+ * ucrp_bus_refill()
+ *
+ * queue held back events while the session's output queue is short
+ */
+void
+ucrp_bus_refill(UCRP_SESSION *sp)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_SUB *sub = sp->sub;
+	UCRP_BUF *bp;
+	char line[64];
+
+	while (sub->nheld > 0 && sp->txq.bytes < SUB_LOWAT &&
+	       (sp->flags & (SESS_DEAD | SESS_CLOSING)) == 0) {
+		if (sub->dropped > 0) {
+			snprintf(line, sizeof(line),
+				 "%% %u event%s dropped, output too slow\n",
+				 sub->dropped, sub->dropped == 1 ? "" : "s");
+			sub->dropped = 0;
+			ucrp_msg_display(sm, line);
+			ucrp_session_queue(sp, 0, sm);
+		}
+
+		bp = sub->held[sub->first];
+		sub->first = (sub->first + 1) % SUB_QLEN;
+		sub->nheld--;
+
+		if (ucrp_session_queuebuf(sp, bp) == 0)
+			STATS_ADD(sp->shard->stats->events, 1);
+		ucrp_buf_rele(bp);
+	}
+
+	return;
+}
+
+/*
+ * ucrp_bus_subscribe()
+ *
+ * show the session events on 'topic' at priority 'prio' or less
+ * urgent that contain 'match', or no events on it if 'prio' is -1.
+ * on the session's thread.
+ */
+void
+ucrp_bus_subscribe(UCRP_SESSION *sp, int topic, int prio, const char *match)
+{
+	UCRP_SHARD *shp = sp->shard;
+	UCRP_SUB *sub;
+
+	if ((sub = sp->sub) == NULL) {
+		if (prio < 0)
+			return;
+
+		if ((sub = calloc(1, sizeof(*sub))) == NULL) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return;
+		}
+
+		sub->sp = sp;
+		sp->sub = sub;
+		LIST_INSERT_HEAD(&shp->subs, sub, entry);
+		__atomic_store_n(&shp->nsubs, shp->nsubs + 1,
+				 __ATOMIC_RELAXED);
+	}
+
+	free(sub->match[topic]);
+	sub->match[topic] = NULL;
+
+	if (prio < 0) {
+		sub->topics &= ~(1U << topic);
+		if (sub->topics == 0)
+			ucrp_bus_free(sp);
+		return;
+	}
+
+	if (match != NULL && match[0] != '\0' &&
+	    (sub->match[topic] = strdup(match)) == NULL)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+
+	sub->topics |= 1U << topic;
+	sub->prio[topic] = prio;
+
+	return;
+}
+
+/*
+ * ucrp_bus_free()
+ *
+ * drop all of the session's subscriptions and held events
+ */
+void
+ucrp_bus_free(UCRP_SESSION *sp)
+{
+	UCRP_SHARD *shp = sp->shard;
+	UCRP_SUB *sub = sp->sub;
+	int i;
+
+	LIST_REMOVE(sub, entry);
+	__atomic_store_n(&shp->nsubs, shp->nsubs - 1, __ATOMIC_RELAXED);
+
+	for (; sub->nheld > 0; sub->nheld--) {
+		ucrp_buf_rele(sub->held[sub->first]);
+		sub->first = (sub->first + 1) % SUB_QLEN;
+	}
+
+	for (i = 0; i < UCRP_BUS_MAXTOPICS; i++)
+		free(sub->match[i]);
+
+	free(sub);
+	sp->sub = NULL;
+
+	return;
+}
+
+/*
+ * ucrp_session_subscribe()
+ *
+ * show the session events published on 'topic' at syslog priority
+ * 'prio' or more urgent that contain 'match', any if it is NULL.
+ * subscribing again replaces the filter.  may be called from a
+ * command running on a worker.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_subscribe(UCRP_SESSION *sp, int topic, int prio,
+		       const char *match)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	size_t len;
+
+	if (topic < 0 || topic >= sp->srv->ntopics || prio < -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ucrp_curshard == sp->shard) {
+		ucrp_bus_subscribe(sp, topic, prio, match);
+		return 0;
+	}
+
+	/* the priority rides in the options, 0 is unsubscribe */
+	len = match != NULL ? strnlen(match, BUS_MATCHLEN) : 0;
+	sm->type = UCRP_TELL;
+	sm->options = prio + 1;
+	sm->length = len + 1;
+	memcpy(UCRP_PAYLOAD(sm), match != NULL ? match : "", len);
+	UCRP_PAYLOAD(sm)[len] = '\0';
+
+	return ucrp_shard_post(sp->shard, POST_SUBSCRIBE, sp, topic, NULL,
+			       sm);
+}
+
+/*
+ * ucrp_session_unsubscribe()
+ *
+ * stop showing the session events on 'topic'
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_unsubscribe(UCRP_SESSION *sp, int topic)
+{
+	return ucrp_session_subscribe(sp, topic, -1, NULL);
+}
@@ -0,0 +1,1222 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ucrp.h>
+#include <ucrp_cmd.h>
+
+#include "ucrp_local.h"
+
+/*
+ * registered command
+ */
+typedef struct _cmd_node {
+	char *name;
+	char *help;
+	void *data;
+	int   flags;
+	int   parent;
+	int   child;                   /* first child, -1 if none      */
+	int   lastchild;
+	int   sibling;                 /* next child of parent         */
+	int   trie;                    /* compiled children or -1      */
+	UCRP_CMDPARAM *param;          /* completes the arguments      */
+	void *paramarg;
+	UCRP_BUF *helpbuf;             /* rendered help, atomic        */
+} CMD_NODE;
+
+/*
+ * compiled trie node.  the children of a node are contiguous and
+ * sorted by character.
+ */
+typedef struct _cmd_trie {
+	uint32_t kids;                 /* first child in tries[]       */
+	uint16_t nkids;
+	uint8_t  ch;
+	int32_t  cmd;                  /* keyword ending here or -1    */
+	int32_t  only;                 /* the one keyword below or -1  */
+	uint32_t count;                /* keywords here and below      */
+} CMD_TRIE;
+
+typedef struct _cmd_sort {
+	char *name;
+	int   id;
+} CMD_SORT;
+
+struct _ucrp_cmdtree {
+	CMD_NODE *nodes;
+	int       nnodes;
+	int       maxnodes;
+	CMD_TRIE *tries;
+	uint32_t  ntries;
+	uint32_t  maxtries;
+	int       compiled;
+};
+
+#define CMD_NOMATCH 0
+#define CMD_MATCH   1
+#define CMD_AMBIG   2
+
+static int  cmd_sortcmp(const void *, const void *);
+static int  trie_alloc(UCRP_CMDTREE *, uint32_t);
+static int  trie_build(UCRP_CMDTREE *, uint32_t, CMD_SORT *, int, int,
+		       size_t);
+static int  trie_level(UCRP_CMDTREE *, int);
+static const CMD_TRIE *trie_find(UCRP_CMDTREE *, int, const char *);
+static int  trie_match(UCRP_CMDTREE *, int, const char *, int *);
+static int  trie_list(UCRP_CMDTREE *, const CMD_TRIE *, UCRP_CMDCOMP *);
+static void comp_lcp(UCRP_CMDCOMP *, const char *, size_t);
+static int  comp_keep(UCRP_CMDCOMP *, char *);
+static void comp_keywords(UCRP_CMDTREE *, int, UCRP_CMDCOMP *);
+static int  comp_sortcmp(const void *, const void *);
+static int  help_grow(char **, size_t, size_t *, size_t);
+static int  help_line(char **, size_t *, size_t *, char *, int, char *);
+static int  help_list(UCRP_CMDTREE *, const CMD_TRIE *, int, char **,
+		      size_t *, size_t *);
+static UCRP_BUF *help_render(UCRP_CMDTREE *, int);
+static void help_forget(UCRP_CMDTREE *);
+
+/*
+ * ucrp_cmd_new()
+ *
+ * returns an empty command tree or NULL on error
+ */
+UCRP_CMDTREE *
+ucrp_cmd_new(void)
+{
+	UCRP_CMDTREE *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	/* the root node, parent of the top level keywords */
+	if (ucrp_cmd_add(t, -1, "", NULL, 0, NULL) != UCRP_CMD_ROOT) {
+		ucrp_cmd_free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/*
+ * ucrp_cmd_add()
+ *
+ * register keyword 'name' below node 'parent' (UCRP_CMD_ROOT for the
+ * top level).  'data' is handed back by ucrp_cmd_parse(); a node
+ * without data is not a command by itself, it only groups those below
+ * it.  'flags' may be UCRP_CMD_ARGS.  the tree must be compiled again
+ * before it is used.
+ *
+ * returns the id of the new node or -1 on error
+ */
+int
+ucrp_cmd_add(UCRP_CMDTREE *t, int parent, char *name, char *help,
+	     int flags, void *data)
+{
+	CMD_NODE *np, *nodes;
+	int id, max;
+
+	/* only the root has no parent and an empty name */
+	if (name == NULL || (t->nnodes == 0 ? parent != -1 :
+	    (parent < 0 || parent >= t->nnodes || *name == '\0' ||
+	     strpbrk(name, " \t\r\n\"") != NULL))) {
+		ucrp_log(LOG_WARNING, "%s: bad keyword\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (t->nnodes == t->maxnodes) {
+		max = t->maxnodes ? t->maxnodes * 2 : 64;
+		if ((nodes = realloc(t->nodes, max * sizeof(*nodes))) == NULL) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+		t->nodes = nodes;
+		t->maxnodes = max;
+	}
+
+	id = t->nnodes;
+	np = &t->nodes[id];
+	memset(np, 0, sizeof(*np));
+
+	if ((np->name = strdup(name)) == NULL ||
+	    (help != NULL && (np->help = strdup(help)) == NULL)) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(np->name);
+		return -1;
+	}
+
+	np->data = data;
+	np->flags = flags;
+	np->parent = parent;
+	np->child = np->lastchild = np->sibling = np->trie = -1;
+
+	if (parent != -1) {
+		if (t->nodes[parent].child == -1)
+			t->nodes[parent].child = id;
+		else
+			t->nodes[t->nodes[parent].lastchild].sibling = id;
+		t->nodes[parent].lastchild = id;
+	}
+
+	t->nnodes++;
+	t->compiled = 0;
+
+	return id;
+}
+
+/*
+ * cmd_sortcmp()
+ */
+static int
+cmd_sortcmp(const void *a, const void *b)
+{
+	return strcmp(((const CMD_SORT *)a)->name, ((const CMD_SORT *)b)->name);
+}
+
+/*
+ * trie_alloc()
+ *
+ * returns the index of 'n' new trie nodes or -1 on error
+ */
+static int
+trie_alloc(UCRP_CMDTREE *t, uint32_t n)
+{
+	CMD_TRIE *tries;
+	uint32_t max, base;
+
+	if (t->ntries + n > t->maxtries) {
+		max = t->maxtries ? t->maxtries : 256;
+		while (max < t->ntries + n)
+			max *= 2;
+
+		if ((tries = realloc(t->tries, max * sizeof(*tries))) == NULL) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+		t->tries = tries;
+		t->maxtries = max;
+	}
+
+	base = t->ntries;
+	t->ntries += n;
+	memset(&t->tries[base], 0, n * sizeof(*t->tries));
+
+	return base;
+}
+
+/*
+ * trie_build()
+ *
+ * fill in trie node 'self' for the keywords s[lo..hi), which are
+ * sorted and share their first 'd' characters
+ *
+ * returns 0 or -1 on error
+ */
+static int
+trie_build(UCRP_CMDTREE *t, uint32_t self, CMD_SORT *s, int lo, int hi,
+	   size_t d)
+{
+	int i, j, k, base;
+
+	t->tries[self].cmd = -1;
+	t->tries[self].only = (hi - lo == 1) ? s[lo].id : -1;
+	t->tries[self].count = hi - lo;
+
+	/* a keyword ending here sorts first */
+	if (lo < hi && s[lo].name[d] == '\0')
+		t->tries[self].cmd = s[lo++].id;
+
+	/* one child per distinct next character */
+	for (k = 0, i = lo; i < hi; k++)
+		for (j = i; i < hi && s[i].name[d] == s[j].name[d]; i++)
+			;
+
+	if (k == 0)
+		return 0;
+
+	if ((base = trie_alloc(t, k)) == -1)
+		return -1;
+	t->tries[self].kids = base;
+	t->tries[self].nkids = k;
+
+	for (k = 0, i = lo; i < hi; k++) {
+		for (j = i; i < hi && s[i].name[d] == s[j].name[d]; i++)
+			;
+
+		t->tries[base + k].ch = s[j].name[d];
+		if (trie_build(t, base + k, s, j, i, d + 1) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * trie_level()
+ *
+ * compile the children of node 'id'
+ *
+ * returns 0 or -1 on error
+ */
+static int
+trie_level(UCRP_CMDTREE *t, int id)
+{
+	CMD_SORT *s;
+	int c, i, n, root, ret;
+
+	t->nodes[id].trie = -1;
+
+	for (n = 0, c = t->nodes[id].child; c != -1; c = t->nodes[c].sibling)
+		n++;
+
+	if (n == 0)
+		return 0;
+
+	if ((s = malloc(n * sizeof(*s))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0, c = t->nodes[id].child; c != -1; c = t->nodes[c].sibling) {
+		s[i].name = t->nodes[c].name;
+		s[i++].id = c;
+	}
+
+	qsort(s, n, sizeof(*s), cmd_sortcmp);
+
+	for (i = 1; i < n; i++) {
+		if (strcmp(s[i - 1].name, s[i].name) == 0) {
+			ucrp_log(LOG_WARNING, "%s: duplicate keyword %s\n",
+				 __func__, s[i].name);
+			free(s);
+			errno = EEXIST;
+			return -1;
+		}
+	}
+
+	ret = -1;
+	if ((root = trie_alloc(t, 1)) != -1 &&
+	    trie_build(t, root, s, 0, n, 0) == 0) {
+		t->nodes[id].trie = root;
+		ret = 0;
+	}
+
+	free(s);
+
+	return ret;
+}
+
+/*
+ * ucrp_cmd_compile()
+ *
+ * build the lookup tries, after the last ucrp_cmd_add()
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_cmd_compile(UCRP_CMDTREE *t)
+{
+	CMD_TRIE *tries;
+	int id;
+
+	t->ntries = 0;
+	t->compiled = 0;
+
+	/* the listings may have changed */
+	help_forget(t);
+
+	for (id = 0; id < t->nnodes; id++)
+		if (trie_level(t, id) == -1)
+			return -1;
+
+	/* give back what the doubling left over */
+	if (t->ntries > 0 && t->ntries < t->maxtries &&
+	    (tries = realloc(t->tries, t->ntries * sizeof(*tries))) != NULL) {
+		t->tries = tries;
+		t->maxtries = t->ntries;
+	}
+
+	t->compiled = 1;
+
+	return 0;
+}
+
+/*
+ * ucrp_cmd_free()
+ */
+void
+ucrp_cmd_free(UCRP_CMDTREE *t)
+{
+	int id;
+
+	help_forget(t);
+
+	for (id = 0; id < t->nnodes; id++) {
+		free(t->nodes[id].name);
+		free(t->nodes[id].help);
+	}
+
+	free(t->nodes);
+	free(t->tries);
+	free(t);
+
+	return;
+}
+
+/*
+ * trie_find()
+ *
+ * follow 'prefix' down the compiled trie 'root'
+ *
+ * returns the trie node it ends at or NULL if no keyword starts
+ * with 'prefix'
+ */
+static const CMD_TRIE *
+trie_find(UCRP_CMDTREE *t, int root, const char *prefix)
+{
+	const CMD_TRIE *tp, *kids;
+	int lo, hi, mid;
+	uint8_t ch;
+
+	if (root == -1)
+		return NULL;
+
+	tp = &t->tries[root];
+	for (; *prefix != '\0'; prefix++) {
+		ch = *prefix;
+		kids = &t->tries[tp->kids];
+
+		lo = 0;
+		hi = tp->nkids;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (kids[mid].ch < ch)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == tp->nkids || kids[lo].ch != ch)
+			return NULL;
+
+		tp = &kids[lo];
+	}
+
+	return tp;
+}
+
+/*
+ * trie_match()
+ *
+ * look 'word' up in the compiled trie 'root': an exact keyword wins,
+ * otherwise it must be the prefix of exactly one.
+ *
+ * returns CMD_MATCH (with the keyword's node in '*id'), CMD_NOMATCH
+ * or CMD_AMBIG
+ */
+static int
+trie_match(UCRP_CMDTREE *t, int root, const char *word, int *id)
+{
+	const CMD_TRIE *tp;
+
+	if (*word == '\0' || (tp = trie_find(t, root, word)) == NULL)
+		return CMD_NOMATCH;
+
+	if (tp->cmd != -1) {
+		*id = tp->cmd;
+		return CMD_MATCH;
+	}
+
+	if (tp->only != -1) {
+		*id = tp->only;
+		return CMD_MATCH;
+	}
+
+	return CMD_AMBIG;
+}
+
+/*
+ * ucrp_cmd_tokenize()
+ *
+ * split 'line' into at most 'max' words in place: white space is
+ * replaced by NULs and 'argv' points into 'line'.  a word in double
+ * quotes may contain white space.  argv[argc] is NULL, so 'argv'
+ * needs room for max + 1 pointers.
+ *
+ * returns the number of words or -1 on error
+ */
+int
+ucrp_cmd_tokenize(char *line, char **argv, int max)
+{
+	char *p;
+	int argc;
+
+	argc = 0;
+	p = line;
+
+	for (;;) {
+		p += strspn(p, " \t\r\n");
+		if (*p == '\0')
+			break;
+
+		if (argc == max)
+			return -1;
+
+		if (*p == '"') {
+			argv[argc++] = ++p;
+			if ((p = strchr(p, '"')) == NULL)
+				return -1;
+		} else {
+			argv[argc++] = p;
+			p += strcspn(p, " \t\r\n");
+		}
+
+		if (*p == '\0')
+			break;
+		*p++ = '\0';
+	}
+
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+/*
+ * ucrp_cmd_parse()
+ *
+ * tokenize 'line' (modifying it) and match it against the compiled
+ * tree.  keywords, abbreviated or not, are replaced in argv by their
+ * full names.  words after the keywords of a UCRP_CMD_ARGS command
+ * are its arguments.
+ *
+ * returns UCRP_CMD_OK or the reason there is no command to run, or
+ * -1 if the tree is not compiled
+ */
+int
+ucrp_cmd_parse(UCRP_CMDTREE *t, char *line, UCRP_CMDMATCH *m)
+{
+	CMD_NODE *np;
+	int i, id, ret;
+
+	if (!t->compiled) {
+		ucrp_log(LOG_WARNING, "%s: not compiled\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+
+	m->nkeys = 0;
+	m->bad = -1;
+	m->node = UCRP_CMD_ROOT;
+	m->data = NULL;
+
+	if ((m->argc = ucrp_cmd_tokenize(line, m->argv,
+					 UCRP_CMD_MAXARGS)) == -1) {
+		m->argc = 0;
+		m->argv[0] = NULL;
+		return UCRP_CMD_SYNTAX;
+	}
+
+	if (m->argc == 0)
+		return UCRP_CMD_EMPTY;
+
+	for (i = 0; i < m->argc; i++) {
+		np = &t->nodes[m->node];
+
+		ret = trie_match(t, np->trie, m->argv[i], &id);
+		if (ret == CMD_MATCH) {
+			m->node = id;
+			m->argv[i] = t->nodes[id].name;
+			m->nkeys++;
+			continue;
+		}
+
+		if (m->node != UCRP_CMD_ROOT && (np->flags & UCRP_CMD_ARGS))
+			break;
+
+		m->bad = i;
+		return ret == CMD_AMBIG ? UCRP_CMD_AMBIGUOUS :
+		    UCRP_CMD_UNKNOWN;
+	}
+
+	m->data = t->nodes[m->node].data;
+	if (m->data == NULL) {
+		m->bad = m->argc;
+		return UCRP_CMD_INCOMPLETE;
+	}
+
+	return UCRP_CMD_OK;
+}
+
+/*
+ * ucrp_cmd_setparam()
+ *
+ * have 'f' complete the arguments of UCRP_CMD_ARGS command 'id'
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_cmd_setparam(UCRP_CMDTREE *t, int id, UCRP_CMDPARAM *f, void *arg)
+{
+	if (id <= UCRP_CMD_ROOT || id >= t->nnodes) {
+		ucrp_log(LOG_WARNING, "%s: no node %d\n", __func__, id);
+		errno = EINVAL;
+		return -1;
+	}
+
+	t->nodes[id].param = f;
+	t->nodes[id].paramarg = arg;
+
+	return 0;
+}
+
+/*
+ * comp_lcp()
+ *
+ * shorten the completion to the prefix it has in common with 's'
+ */
+static void
+comp_lcp(UCRP_CMDCOMP *c, const char *s, size_t len)
+{
+	char *lp;
+	size_t i;
+
+	lp = c->line + c->word;
+	if (len > sizeof(c->line) - c->word - 1)
+		len = sizeof(c->line) - c->word - 1;
+
+	/* the first candidate is the completion so far */
+	if (c->lcp == -1) {
+		memcpy(lp, s, len);
+		lp[len] = '\0';
+		c->lcp = len;
+		return;
+	}
+
+	for (i = 0; i < c->lcp && i < len && lp[i] == s[i]; i++)
+		;
+	c->lcp = i;
+
+	return;
+}
+
+/*
+ * comp_keep()
+ *
+ * returns 0 or -1 if the candidate list is full
+ */
+static int
+comp_keep(UCRP_CMDCOMP *c, char *word)
+{
+	if (c->ncand == UCRP_CMD_MAXCAND)
+		return -1;
+
+	c->cand[c->ncand++] = word;
+
+	return 0;
+}
+
+/*
+ * trie_list()
+ *
+ * keep the keywords at and below 'tp', in order
+ *
+ * returns 0 or -1 once the candidate list is full
+ */
+static int
+trie_list(UCRP_CMDTREE *t, const CMD_TRIE *tp, UCRP_CMDCOMP *c)
+{
+	int i;
+
+	if (tp->cmd != -1 && comp_keep(c, t->nodes[tp->cmd].name) == -1)
+		return -1;
+
+	for (i = 0; i < tp->nkids; i++)
+		if (trie_list(t, &t->tries[tp->kids + i], c) == -1)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * comp_keywords()
+ *
+ * add the keywords below 'node' that start with the partial word.
+ * the trie knows how many there are and where they part, so only the
+ * ones listed are visited.
+ */
+static void
+comp_keywords(UCRP_CMDTREE *t, int node, UCRP_CMDCOMP *c)
+{
+	const CMD_TRIE *tp, *start;
+	char buf[UCRP_MAX_PAYLOAD];
+	size_t len;
+
+	start = trie_find(t, t->nodes[node].trie, c->partial);
+	if (start == NULL || start->count == 0)
+		return;
+
+	c->total += start->count;
+
+	/* they share the path down to the first fork */
+	len = snprintf(buf, sizeof(buf), "%s", c->partial);
+	for (tp = start; tp->cmd == -1 && tp->nkids == 1 &&
+		 len < sizeof(buf) - 1; ) {
+		tp = &t->tries[tp->kids];
+		buf[len++] = tp->ch;
+	}
+	comp_lcp(c, buf, len);
+
+	trie_list(t, start, c);
+
+	return;
+}
+
+/*
+ * comp_sortcmp()
+ */
+static int
+comp_sortcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * ucrp_cmd_candidate()
+ *
+ * offer 'word' as a completion from a parameter callback.  words
+ * that don't start with the partial word are ignored, so a callback
+ * may offer everything; a good one narrows by comp->partial first.
+ *
+ * returns 0 or -1 if the candidate list is full and the callback
+ * should stop
+ */
+int
+ucrp_cmd_candidate(UCRP_CMDCOMP *c, const char *word)
+{
+	size_t len;
+
+	len = strlen(c->partial);
+	if (*word == '\0' || strncmp(word, c->partial, len) != 0 ||
+	    strpbrk(word, " \t\r\n\"") != NULL)
+		return 0;
+
+	len = strlen(word) + 1;
+	if (c->ncand == UCRP_CMD_MAXCAND ||
+	    c->poolused + len > sizeof(c->pool)) {
+		c->more = 1;
+		return -1;
+	}
+
+	memcpy(c->pool + c->poolused, word, len);
+	c->cand[c->ncand++] = c->pool + c->poolused;
+	c->poolused += len;
+
+	c->total++;
+	comp_lcp(c, word, len - 1);
+
+	return 0;
+}
+
+/*
+ * ucrp_cmd_complete()
+ *
+ * complete the last word of 'line' (without UCRP_SEPARATOR), or the
+ * next one if 'line' ends in white space.  'line' is tokenized and so
+ * modified.  the result is in 'c': the line with its keywords spelled
+ * out and the last word completed as far as the candidates agree (and
+ * followed by a space if there is only one), and the candidates
+ * themselves.  a line that can't be completed is handed back as is.
+ *
+ * returns the number of candidates or -1 if the tree is not compiled
+ */
+int
+ucrp_cmd_complete(UCRP_CMDTREE *t, char *line, UCRP_CMDCOMP *c)
+{
+	char *argv[UCRP_CMD_MAXARGS + 1];
+	char buf[UCRP_MAX_PAYLOAD];
+	CMD_NODE *np;
+	size_t len;
+	int argc, i, id, node, inargs, partial;
+
+	if (!t->compiled) {
+		ucrp_log(LOG_WARNING, "%s: not compiled\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+
+	c->word = 0;
+	c->lcp = -1;
+	c->partial = "";
+	c->total = c->more = c->ncand = 0;
+	c->poolused = 0;
+	snprintf(c->line, sizeof(c->line), "%s", line);
+
+	/* "sh" completes the last word, "sh " the next one */
+	len = strlen(line);
+	partial = len > 0 && strchr(" \t\r\n", line[len - 1]) == NULL;
+
+	if ((argc = ucrp_cmd_tokenize(line, argv, UCRP_CMD_MAXARGS)) == -1)
+		return 0;
+
+	if (partial) {
+		c->partial = argv[--argc];
+		if (strpbrk(c->partial, " \t") != NULL)
+			return 0;
+	}
+
+	/* walk the finished words */
+	node = UCRP_CMD_ROOT;
+	inargs = 0;
+	for (i = 0; i < argc && !inargs; i++) {
+		np = &t->nodes[node];
+
+		if (trie_match(t, np->trie, argv[i], &id) == CMD_MATCH) {
+			node = id;
+			argv[i] = t->nodes[id].name;
+		} else if (node != UCRP_CMD_ROOT && (np->flags & UCRP_CMD_ARGS))
+			inargs = 1;
+		else
+			return 0;
+	}
+
+	/* put the line back together with the keywords in full */
+	for (i = 0, len = 0; i < argc && len < sizeof(buf); i++)
+		len += snprintf(buf + len, sizeof(buf) - len,
+				strpbrk(argv[i], " \t") != NULL ?
+				"\"%s\" " : "%s ", argv[i]);
+	if (len < sizeof(buf))
+		len += snprintf(buf + len, sizeof(buf) - len, "%s",
+				c->partial);
+	if (len >= sizeof(c->line))
+		return 0;
+
+	memcpy(c->line, buf, len + 1);
+	c->word = len - strlen(c->partial);
+
+	np = &t->nodes[node];
+	if (!inargs)
+		comp_keywords(t, node, c);
+
+	if (np->param != NULL && node != UCRP_CMD_ROOT &&
+	    (np->flags & UCRP_CMD_ARGS))
+		np->param(c, argc, argv, np->paramarg);
+
+	/* every candidate starts with the partial word */
+	if (c->total == 0 || c->more)
+		c->lcp = strlen(c->partial);
+	c->line[c->word + c->lcp] = '\0';
+
+	if (c->total == 1 && !c->more &&
+	    c->word + c->lcp < sizeof(c->line) - 1)
+		strcat(c->line, " ");
+
+	qsort(c->cand, c->ncand, sizeof(c->cand[0]), comp_sortcmp);
+
+	return c->total;
+}
+
+/*
+ * ucrp_cmd_columns()
+ *
+ * format the candidates in columns for a 'width' wide terminal, in
+ * as many whole rows as fit into 'buf', starting with row '*row' (0
+ * the first time).  call again until it returns 0.
+ *
+ * returns the length of the text in 'buf'
+ */
+size_t
+ucrp_cmd_columns(UCRP_CMDCOMP *c, int width, int *row, char *buf,
+		 size_t size)
+{
+	size_t len, start, n, maxlen;
+	int i, j, cols, rows, colw, last;
+
+	if (c->ncand == 0 || size < 2)
+		return 0;
+
+	maxlen = 0;
+	for (i = 0; i < c->ncand; i++)
+		if ((n = strlen(c->cand[i])) > maxlen)
+			maxlen = n;
+
+	/* down the columns, then across, like ls(1) */
+	colw = maxlen + 2;
+	if (width < 1)
+		width = 80;
+	if ((cols = (width + 2) / colw) < 1)
+		cols = 1;
+	rows = (c->ncand + cols - 1) / cols;
+
+	/* a last row says what didn't fit */
+	last = rows;
+	if (c->more || c->total > c->ncand)
+		last++;
+
+	len = 0;
+	buf[0] = '\0';
+	for (; *row < last; (*row)++) {
+		start = len;
+
+		if (*row == rows) {
+			if (c->more)
+				len += snprintf(buf + len, size - len,
+						"...\n");
+			else
+				len += snprintf(buf + len, size - len,
+						"... %d more\n",
+						c->total - c->ncand);
+		}
+
+		for (j = 0; *row < rows && j < cols; j++) {
+			i = j * rows + *row;
+			if (i >= c->ncand || len >= size)
+				break;
+
+			if (i + rows < c->ncand)
+				len += snprintf(buf + len, size - len, "%-*s",
+						colw, c->cand[i]);
+			else
+				len += snprintf(buf + len, size - len, "%s\n",
+						c->cand[i]);
+		}
+
+		if (len < size)
+			continue;
+
+		/* a row that doesn't fit on its own is cut short */
+		if (start > 0) {
+			len = start;
+			buf[len] = '\0';
+			break;
+		}
+
+		len = size - 1;
+		buf[len - 1] = '\n';
+		(*row)++;
+		break;
+	}
+
+	return len;
+}
+
+/*
+ * ucrp_cmd_helpnode()
+ *
+ * follow the keywords of 'line' (modifying it) as far as they go
+ *
+ * returns the node whose help the line asks for, UCRP_CMD_ROOT if
+ * it names none, or -1 if the tree is not compiled
+ */
+int
+ucrp_cmd_helpnode(UCRP_CMDTREE *t, char *line)
+{
+	char *argv[UCRP_CMD_MAXARGS + 1];
+	int argc, i, id, node;
+
+	if (!t->compiled) {
+		ucrp_log(LOG_WARNING, "%s: not compiled\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((argc = ucrp_cmd_tokenize(line, argv, UCRP_CMD_MAXARGS)) == -1)
+		return UCRP_CMD_ROOT;
+
+	node = UCRP_CMD_ROOT;
+	for (i = 0; i < argc; i++) {
+		if (trie_match(t, t->nodes[node].trie, argv[i],
+			       &id) != CMD_MATCH)
+			break;
+		node = id;
+	}
+
+	return node;
+}
+
+/*
+ * help_grow()
+ *
+ * make room for 'need' more bytes of text in '*text'
+ *
+ * returns 0 or -1 on error
+ */
+static int
+help_grow(char **text, size_t len, size_t *size, size_t need)
+{
+	size_t max;
+	char *p;
+
+	if (len + need <= *size)
+		return 0;
+
+	for (max = *size ? *size : 4096; max < len + need; max *= 2)
+		;
+
+	if ((p = realloc(*text, max)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	*text = p;
+	*size = max;
+
+	return 0;
+}
+
+/*
+ * help_line()
+ *
+ * append " name  help" to the text, the name padded to 'width'
+ *
+ * returns 0 or -1 on error
+ */
+static int
+help_line(char **text, size_t *len, size_t *size, char *name, int width,
+	  char *help)
+{
+	if (help == NULL)
+		help = "";
+
+	if (help_grow(text, *len, size, strlen(name) + width +
+		      strlen(help) + 8) == -1)
+		return -1;
+
+	if (*help == '\0')
+		*len += snprintf(*text + *len, *size - *len, " %s\n", name);
+	else
+		*len += snprintf(*text + *len, *size - *len, " %-*s  %s\n",
+				 width, name, help);
+
+	return 0;
+}
+
+/*
+ * help_list()
+ *
+ * append a line for every keyword at and below 'tp', in order
+ *
+ * returns 0 or -1 on error
+ */
+static int
+help_list(UCRP_CMDTREE *t, const CMD_TRIE *tp, int width, char **text,
+	  size_t *len, size_t *size)
+{
+	CMD_NODE *np;
+	int i;
+
+	if (tp->cmd != -1) {
+		np = &t->nodes[tp->cmd];
+		if (help_line(text, len, size, np->name, width,
+			      np->help) == -1)
+			return -1;
+	}
+
+	for (i = 0; i < tp->nkids; i++)
+		if (help_list(t, &t->tries[tp->kids + i], width, text, len,
+			      size) == -1)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * help_render()
+ *
+ * lay out the help of node 'id': the keywords that may follow it, or
+ * the node itself if none may, then whether it takes arguments or may
+ * be run as it is.  the text is cut into UCRP_DISPLAY messages at line
+ * ends and encoded into one buffer.
+ *
+ * returns the buffer or NULL on error
+ */
+static UCRP_BUF *
+help_render(UCRP_CMDTREE *t, int id)
+{
+	CMD_NODE *np;
+	UCRP_BUF *bp;
+	UCRP hdr;
+	char *text, *p, *end, *nl;
+	size_t len, size, chunk, n, pos;
+	int c, width, ret;
+
+	np = &t->nodes[id];
+
+	width = 10;
+	for (c = np->child; c != -1; c = t->nodes[c].sibling)
+		if (strlen(t->nodes[c].name) > width)
+			width = strlen(t->nodes[c].name);
+
+	text = NULL;
+	len = size = 0;
+	if ((ret = help_grow(&text, len, &size, 2)) == 0)
+		text[len++] = '\n';
+
+	if (ret == 0 && np->trie != -1)
+		ret = help_list(t, &t->tries[np->trie], width, &text, &len,
+				&size);
+	else if (ret == 0 && id != UCRP_CMD_ROOT)
+		ret = help_line(&text, &len, &size, np->name, width,
+				np->help);
+
+	if (ret == 0 && id != UCRP_CMD_ROOT && (np->flags & UCRP_CMD_ARGS))
+		ret = help_line(&text, &len, &size, "<args>", width, NULL);
+	if (ret == 0 && id != UCRP_CMD_ROOT && np->data != NULL)
+		ret = help_line(&text, &len, &size, "<cr>", width, NULL);
+	if (ret == 0 && (ret = help_grow(&text, len, &size, 1)) == 0)
+		text[len++] = '\n';
+
+	if (ret == -1) {
+		free(text);
+		return NULL;
+	}
+
+	/*
+	 * whole lines per message, so two messages in a row always
+	 * carry more than 'chunk' bytes between them
+	 */
+	chunk = UCRP_MAX_PAYLOAD - 1;
+	if ((bp = ucrp_buf_new(len + (2 * len / chunk + 2) *
+			       UCRP_HDR_SIZE)) == NULL) {
+		free(text);
+		return NULL;
+	}
+
+	pos = 0;
+	for (p = text, end = text + len; p < end; p += n) {
+		n = end - p > chunk ? chunk : end - p;
+		if (p + n < end) {
+			for (nl = p + n - 1; nl > p && *nl != '\n'; nl--)
+				;
+			if (nl > p)
+				n = nl - p + 1;
+		}
+
+		hdr.type = UCRP_DISPLAY;
+		hdr.options = 0;
+		hdr.length = n;
+		ucrp_msg_hton(&hdr);
+
+		memcpy(bp->data + pos, &hdr, UCRP_HDR_SIZE);
+		memcpy(bp->data + pos + UCRP_HDR_SIZE, p, n);
+		pos += UCRP_HDR_SIZE + n;
+	}
+	bp->size = pos;
+
+	free(text);
+
+	return bp;
+}
+
+/*
+ * help_forget()
+ *
+ * drop the rendered help, sessions may still hold on to it
+ */
+static void
+help_forget(UCRP_CMDTREE *t)
+{
+	int id;
+
+	for (id = 0; id < t->nnodes; id++) {
+		if (t->nodes[id].helpbuf != NULL) {
+			ucrp_buf_rele(t->nodes[id].helpbuf);
+			t->nodes[id].helpbuf = NULL;
+		}
+	}
+
+	return;
+}
+
+/*
+ * ucrp_cmd_helpbuf()
+ *
+ * the help listing of node 'id' as UCRP_DISPLAY messages, for
+ * ucrp_channel_sendbuf().  it is rendered the first time and shared
+ * from then on; the tree keeps it until it is compiled again or
+ * freed.
+ *
+ * returns the buffer or NULL on error
+ */
+UCRP_BUF *
+ucrp_cmd_helpbuf(UCRP_CMDTREE *t, int id)
+{
+	UCRP_BUF *bp, *old;
+
+	if (!t->compiled || id < 0 || id >= t->nnodes) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bp = __atomic_load_n(&t->nodes[id].helpbuf, __ATOMIC_ACQUIRE);
+	if (bp != NULL)
+		return bp;
+
+	if ((bp = help_render(t, id)) == NULL)
+		return NULL;
+
+	/* another thread may have beaten us to it */
+	old = NULL;
+	if (!__atomic_compare_exchange_n(&t->nodes[id].helpbuf, &old, bp, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		ucrp_buf_rele(bp);
+		bp = old;
+	}
+
+	return bp;
+}
+
+/*
+ * ucrp_cmd_name()
+ *
+ * returns the keyword of node 'id' or NULL if there is no such node
+ */
+char *
+ucrp_cmd_name(UCRP_CMDTREE *t, int id)
+{
+	return (id >= 0 && id < t->nnodes) ? t->nodes[id].name : NULL;
+}
+
+/*
+ * ucrp_cmd_help()
+ *
+ * returns the help text of node 'id' or NULL
+ */
+char *
+ucrp_cmd_help(UCRP_CMDTREE *t, int id)
+{
+	return (id >= 0 && id < t->nnodes) ? t->nodes[id].help : NULL;
+}
+
+/*
+ * ucrp_cmd_data()
+ *
+ * returns the data registered with node 'id' or NULL
+ */
+void *
+ucrp_cmd_data(UCRP_CMDTREE *t, int id)
+{
+	return (id >= 0 && id < t->nnodes) ? t->nodes[id].data : NULL;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ucrp.h>
+
+static struct {
+	uint32_t flag;
+	char *name;
+} ext_names[] = {
+	{ UCRP_EXT_CHANNELS, "channels" },
+	{ UCRP_EXT_INTERRUPT, "interrupt" },
+	{ UCRP_EXT_COLUMNS, "columns" },       /* columns=<n> */
+	{ UCRP_EXT_BATCH, "batch" },
+	{ UCRP_EXT_MAXMSG, "maxmsg" },         /* maxmsg=<n> */
+	{ UCRP_EXT_TABLES, "tables" },
+	{ UCRP_EXT_UPDATE, "update" },
+};
+#define EXT_NAMES_SIZE ((sizeof(ext_names) / sizeof(ext_names[0])))
+
+/*
+ * ucrp_ext_parse()
+ *
+ * parse the payload of a UCRP_EXTEND or UCRP_EXTENDED message into
+ * 'ext'.  unknown extensions, and ones with a bad value, are
+ * ignored.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ext_parse(UCRP *msg, UCRP_EXT *ext)
+{
+	char buf[UCRP_MAX_PAYLOAD + 1];
+	char *ln, *lp, *val, *ep;
+	long n;
+	int i;
+
+	memset(ext, 0, sizeof(*ext));
+
+	if (msg->type != UCRP_EXTEND && msg->type != UCRP_EXTENDED)
+		return -1;
+
+	/* work on a copy, ucrp_msg_getln() is destructive */
+	memcpy(buf, UCRP_PAYLOAD(msg), msg->length);
+	buf[msg->length] = '\0';
+
+	lp = buf;
+	while ((ln = ucrp_msg_getln(&lp)) != NULL) {
+		if ((val = strchr(ln, '=')) != NULL)
+			*val++ = '\0';
+
+		for (i = 0; i < EXT_NAMES_SIZE; i++) {
+			if (strcmp(ln, ext_names[i].name) != 0)
+				continue;
+
+			if (ext_names[i].flag == UCRP_EXT_COLUMNS) {
+				if (val == NULL)
+					break;
+				n = strtol(val, &ep, 10);
+				if (*val == '\0' || *ep != '\0' ||
+				    n < 1 || n > UCRP_MAX_PAYLOAD)
+					break;
+				ext->columns = n;
+			}
+
+			if (ext_names[i].flag == UCRP_EXT_MAXMSG) {
+				if (val == NULL)
+					break;
+				n = strtol(val, &ep, 10);
+				if (*val == '\0' || *ep != '\0' ||
+				    n < UCRP_MAX_PAYLOAD || n > UCRP_MAX_JUMBO)
+					break;
+				ext->maxmsg = n;
+			}
+
+			ext->flags |= ext_names[i].flag;
+			break;
+		}
+
+		if (i == EXT_NAMES_SIZE)
+			UCRP_DEBUG((LOG_DEBUG, "%s: ignoring '%s'\n",
+				    __func__, ln));
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_ext_format()
+ *
+ * format 'ext' as a UCRP_EXTEND or UCRP_EXTENDED payload, one
+ * extension per UCRP_SEPARATOR line.
+ *
+ * returns the length of the payload
+ */
+size_t
+ucrp_ext_format(char *buf, size_t size, UCRP_EXT *ext)
+{
+	size_t len;
+	int i;
+
+	len = 0;
+	buf[0] = '\0';
+
+	for (i = 0; i < EXT_NAMES_SIZE; i++) {
+		if ((ext->flags & ext_names[i].flag) == 0)
+			continue;
+
+		if (ext_names[i].flag == UCRP_EXT_COLUMNS)
+			len += snprintf(buf + len, size - len, "%s=%u\r\n",
+					ext_names[i].name, ext->columns);
+		else if (ext_names[i].flag == UCRP_EXT_MAXMSG)
+			len += snprintf(buf + len, size - len, "%s=%u\r\n",
+					ext_names[i].name, ext->maxmsg);
+		else
+			len += snprintf(buf + len, size - len, "%s\r\n",
+					ext_names[i].name);
+		if (len >= size) {
+			len = size - 1;
+			break;
+		}
+	}
+
+	return len;
+}
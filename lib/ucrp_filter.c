@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+static const struct {
+	int   op;
+	char *name;
+	int   arg;                                 /* 1 pattern, 2 number  */
+} filter_ops[] = {
+	{ FILTER_INCLUDE, "include", 1 },
+	{ FILTER_EXCLUDE, "exclude", 1 },
+	{ FILTER_BEGIN,   "begin",   1 },
+	{ FILTER_COUNT,   "count",   0 },
+	{ FILTER_HEAD,    "head",    2 },
+	{ 0, NULL, 0 }
+};
+
+static int   filter_op(const char *, size_t);
+static char *filter_next(char *);
+static int   filter_stage(UCRP_FILTER *, char *, char *, size_t);
+static int   filter_match(FILTER_STAGE *, const char *, size_t);
+static int   filter_line(UCRP_FILTER *, const char *, size_t);
+static void  filter_reset(UCRP_FILTER *);
+
+/*
+ * filter_op()
+ *
+ * returns the filter_ops[] entry 'len' bytes at 'word' abbreviate,
+ * or -1
+ */
+static int
+filter_op(const char *word, size_t len)
+{
+	int i;
+
+	if (len == 0)
+		return -1;
+
+	for (i = 0; filter_ops[i].name != NULL; i++)
+		if (len <= strlen(filter_ops[i].name) &&
+		    strncmp(word, filter_ops[i].name, len) == 0)
+			return i;
+
+	return -1;
+}
+
+/*
+ * filter_next()
+ *
+ * find the '|' that starts the next filter: one after white space,
+ * outside double quotes, followed by the name of a filter.  a '|'
+ * anywhere else belongs to the command or the pattern.
+ *
+ * returns the '|' or NULL if there is none
+ */
+static char *
+filter_next(char *start)
+{
+	char *p, *w;
+	size_t n;
+	int quoted;
+
+	for (quoted = 0, p = start; *p != '\0'; p++) {
+		if (*p == '"')
+			quoted = !quoted;
+		if (quoted || *p != '|' || p == start ||
+		    (p[-1] != ' ' && p[-1] != '\t'))
+			continue;
+
+		w = p + 1 + strspn(p + 1, " \t");
+		n = strcspn(w, " \t\r\n");
+		if (filter_op(w, n) != -1)
+			return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * filter_stage()
+ *
+ * add the filter in 'text', its name and what it takes
+ *
+ * returns 0 or -1 with why in 'err'
+ */
+static int
+filter_stage(UCRP_FILTER *f, char *text, char *err, size_t errlen)
+{
+	FILTER_STAGE *st;
+	char *arg, *end, *p;
+	size_t n;
+	int i, ret;
+
+	text += strspn(text, " \t");
+	n = strcspn(text, " \t\r\n");
+	i = filter_op(text, n);
+
+	/* the rest, without the white space and quotes around it */
+	arg = text + n;
+	arg += strspn(arg, " \t");
+	end = arg + strlen(arg);
+	while (end > arg && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	if (end - arg >= 2 && arg[0] == '"' && end[-1] == '"') {
+		*--end = '\0';
+		arg++;
+	}
+
+	if (f->nstages == FILTER_MAXSTAGES) {
+		snprintf(err, errlen, "too many filters");
+		return -1;
+	}
+	if (filter_ops[i].arg == 0 && *arg != '\0') {
+		snprintf(err, errlen, "%s takes nothing", filter_ops[i].name);
+		return -1;
+	}
+	if (filter_ops[i].arg != 0 && *arg == '\0') {
+		snprintf(err, errlen, "%s needs %s", filter_ops[i].name,
+			 filter_ops[i].arg == 1 ? "a pattern" : "a number");
+		return -1;
+	}
+
+	st = &f->stage[f->nstages];
+	memset(st, 0, sizeof(*st));
+	st->op = filter_ops[i].op;
+
+	switch (filter_ops[i].arg) {
+	case 1:
+		/* plain text is found faster than an expression matches */
+		if (strpbrk(arg, ".[]()*+?{}|^$\\") == NULL) {
+			if ((st->literal = strdup(arg)) == NULL) {
+				snprintf(err, errlen, "%s", strerror(errno));
+				return -1;
+			}
+			st->litlen = strlen(arg);
+			break;
+		}
+		ret = regcomp(&st->re, arg, REG_EXTENDED | REG_NOSUB);
+		if (ret != 0) {
+			regerror(ret, &st->re, err, errlen);
+			return -1;
+		}
+		st->compiled = 1;
+		break;
+	case 2:
+		st->arg = strtoul(arg, &p, 10);
+		if (*p != '\0' || st->arg == 0) {
+			snprintf(err, errlen, "%s needs a number",
+				 filter_ops[i].name);
+			return -1;
+		}
+		break;
+	}
+	f->nstages++;
+
+	return 0;
+}
+
+/*
+ * ucrp_channel_filter()
+ *
+ * cut the filters off the end of 'line' and filter what the channel's
+ * stream is written through them from now on.  a line without any
+ * is left alone.
+ *
+ * returns 0 or -1 on error, with why in 'err' for the user
+ */
+int
+ucrp_channel_filter(UCRP_CHANNEL *cp, char *line, char *err, size_t errlen)
+{
+	UCRP_OSTREAM *os;
+	UCRP_FILTER *f;
+	char *p, *next;
+
+	err[0] = '\0';
+	if ((p = filter_next(line)) == NULL)
+		return 0;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		snprintf(err, errlen, "%s", strerror(errno));
+		return -1;
+	}
+
+	/* the command is what comes before the first one */
+	*p = '\0';
+	for (; p != NULL; p = next) {
+		if ((next = filter_next(p + 1)) != NULL)
+			*next = '\0';
+		if (filter_stage(f, p + 1, err, errlen) == -1) {
+			ucrp_filter_free(f);
+			return -1;
+		}
+	}
+	filter_reset(f);
+
+	if ((os = ucrp_channel_ostream(cp)) == NULL ||
+	    ucrp_ostream_flush(os) == -1) {
+		ucrp_filter_free(f);
+		snprintf(err, errlen, "no output");
+		return -1;
+	}
+
+	pthread_mutex_lock(&os->lock);
+	if (os->filter != NULL) {
+		pthread_mutex_unlock(&os->lock);
+		ucrp_filter_free(f);
+		snprintf(err, errlen, "already filtered");
+		errno = EBUSY;
+		return -1;
+	}
+	os->filter = f;
+	pthread_mutex_unlock(&os->lock);
+
+	return 0;
+}
+
+/*
+ * ucrp_channel_filterend()
+ *
+ * send what the filters held back, a last line without its '\n' and
+ * the count, and stop filtering the channel's output
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_channel_filterend(UCRP_CHANNEL *cp)
+{
+	UCRP_OSTREAM *os;
+	UCRP_FILTER *f;
+	int ret;
+
+	if ((os = __atomic_load_n(&cp->os, __ATOMIC_ACQUIRE)) == NULL)
+		return 0;
+
+	pthread_mutex_lock(&os->lock);
+	if ((f = os->filter) == NULL) {
+		pthread_mutex_unlock(&os->lock);
+		return 0;
+	}
+	ret = 0;
+	if (!ucrp_channel_cancelled(cp))
+		ret = ucrp_filter_finish(f, os);
+	os->filter = NULL;
+	pthread_mutex_unlock(&os->lock);
+
+	ucrp_filter_free(f);
+
+	return ret;
+}
+
+/*
+ * filter_match()
+ *
+ * returns 1 if the 'len' bytes of a line at 'p' match the stage's
+ * pattern, 0 otherwise
+ */
+static int
+filter_match(FILTER_STAGE *st, const char *p, size_t len)
+{
+	regmatch_t pm;
+
+	if (st->literal != NULL)
+		return memmem(p, len, st->literal, st->litlen) != NULL;
+
+	/* the line is matched where it is, it has no '\0' */
+	pm.rm_so = 0;
+	pm.rm_eo = len;
+
+	return regexec(&st->re, p, 1, &pm, REG_STARTEND) == 0;
+}
+
+/*
+ * filter_line()
+ *
+ * put a line, without its '\n', through the stages
+ *
+ * returns 1 if it gets out the end, 0 otherwise
+ */
+static int
+filter_line(UCRP_FILTER *f, const char *p, size_t len)
+{
+	FILTER_STAGE *st;
+	int i;
+
+	if (f->done)
+		return 0;
+
+	for (i = 0; i < f->nstages; i++) {
+		st = &f->stage[i];
+
+		switch (st->op) {
+		case FILTER_INCLUDE:
+			if (!filter_match(st, p, len))
+				return 0;
+			break;
+		case FILTER_EXCLUDE:
+			if (filter_match(st, p, len))
+				return 0;
+			break;
+		case FILTER_BEGIN:
+			if (!st->on && !filter_match(st, p, len))
+				return 0;
+			st->on = 1;
+			break;
+		case FILTER_COUNT:
+			st->n++;
+			return 0;
+		case FILTER_HEAD:
+			/* nothing can get past once it's had its lines */
+			if (++st->n == st->arg)
+				f->done = 1;
+			break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * ucrp_filter_write()
+ *
+ * filter 'len' bytes of output and put the lines that pass on the
+ * stream, called with the stream's lock held.  whole lines are judged
+ * where they are, only the start of a line still to be finished is
+ * kept back.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_filter_write(UCRP_FILTER *f, UCRP_OSTREAM *os, const void *data,
+		  size_t len)
+{
+	const char *p = data, *nl;
+	size_t n, m;
+	int keep, ended;
+
+	while (len > 0) {
+		if (f->done && f->keep == -1)
+			break;
+
+		nl = memchr(p, '\n', len);
+		n = nl != NULL ? nl - p + 1 : len;
+
+		/* the rest of a line judged already */
+		if (f->keep != -1) {
+			if (f->keep && ucrp_ostream_put(os, p, n) == -1)
+				return -1;
+			if (nl != NULL)
+				f->keep = -1;
+			p += n;
+			len -= n;
+			continue;
+		}
+
+		/* a whole line */
+		if (nl != NULL && f->len == 0) {
+			if (filter_line(f, p, n - 1) &&
+			    ucrp_ostream_put(os, p, n) == -1)
+				return -1;
+			p += n;
+			len -= n;
+			continue;
+		}
+
+		/* part of one, wait for the rest unless it is too long */
+		m = sizeof(f->line) - f->len;
+		if (m > n)
+			m = n;
+		memcpy(f->line + f->len, p, m);
+		f->len += m;
+		p += m;
+		len -= m;
+
+		ended = f->line[f->len - 1] == '\n';
+		if (!ended && f->len < sizeof(f->line))
+			continue;
+
+		keep = filter_line(f, f->line, f->len - ended);
+		if (keep && ucrp_ostream_put(os, f->line, f->len) == -1)
+			return -1;
+		f->len = 0;
+		if (!ended)
+			f->keep = keep;
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_filter_row()
+ *
+ * returns 1 if the text of a table's row passes the filters, 0 if
+ * the row is to be left out
+ */
+int
+ucrp_filter_row(UCRP_FILTER *f, const char *p, size_t len)
+{
+	return filter_line(f, p, len);
+}
+
+/*
+ * ucrp_filter_finish()
+ *
+ * the command is done writing: judge a last line that lacks its '\n'
+ * and put the count on the stream, called with the stream's lock
+ * held.  the filters start over after.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_filter_finish(UCRP_FILTER *f, UCRP_OSTREAM *os)
+{
+	char buf[64];
+	int i, ret;
+
+	ret = 0;
+	if (f->len > 0 && filter_line(f, f->line, f->len))
+		ret = ucrp_ostream_put(os, f->line, f->len);
+
+	for (i = 0; i < f->nstages && ret == 0; i++)
+		if (f->stage[i].op == FILTER_COUNT) {
+			snprintf(buf, sizeof(buf), "Count: %lu line%s\n",
+				 f->stage[i].n, f->stage[i].n == 1 ? "" : "s");
+			ret = ucrp_ostream_put(os, buf, strlen(buf));
+		}
+
+	filter_reset(f);
+
+	return ret;
+}
+
+/*
+ * filter_reset()
+ */
+static void
+filter_reset(UCRP_FILTER *f)
+{
+	int i;
+
+	f->done = 0;
+	f->keep = -1;
+	f->len = 0;
+	for (i = 0; i < f->nstages; i++) {
+		f->stage[i].n = 0;
+		f->stage[i].on = 0;
+	}
+
+	return;
+}
+
+/*
+ * ucrp_filter_free()
+ */
+void
+ucrp_filter_free(UCRP_FILTER *f)
+{
+	int i;
+
+	for (i = 0; i < f->nstages; i++) {
+		free(f->stage[i].literal);
+		if (f->stage[i].compiled)
+			regfree(&f->stage[i].re);
+	}
+	free(f);
+
+	return;
+}
@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
+static int  listener_new(UCRP_SHARD *, int, int);
+static void listener_unwind(UCRP_SERVER *, int);
+static int  listener_socket(UCRP_SERVER *, struct addrinfo *);
+static int  listener_anyaddr(struct addrinfo *);
+static void listener_handler(UCRP_EV *, uint32_t);
+static void listener_accept(UCRP_LISTENER *, int);
+static void listener_refuse(int);
+static void listener_pause(UCRP_LISTENER *);
+static void listener_resume(UCRP_TIMER *, void *);
+
+/*
+ * ucrp_server_setlisten()
+ *
+ * set how ucrp_server_bind() makes its sockets, see UCRP_LISTEN.
+ * TCP_DEFER_ACCEPT has a client that waits for the server to speak
+ * first accepted only once 'defer' runs out.
+ */
+void
+ucrp_server_setlisten(UCRP_SERVER *srv, UCRP_LISTEN *lo)
+{
+	srv->listen = *lo;
+
+	return;
+}
+
+/*
+ * listener_new()
+ *
+ * accept connections on 's' in this shard.  if 'owned' the socket is
+ * closed with the server.
+ *
+ * returns 0 or -1 on error
+ */
+static int
+listener_new(UCRP_SHARD *shp, int s, int owned)
+{
+	struct epoll_event ee;
+	UCRP_LISTENER *lp;
+
+	if ((lp = calloc(1, sizeof(*lp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	lp->ev.fd = s;
+	lp->ev.handler = listener_handler;
+	lp->shard = shp;
+	lp->owned = owned;
+	ucrp_timer_init(&lp->pause, shp, listener_resume, lp);
+
+	/*
+	 * a socket shared by several shards wakes only one of them per
+	 * connection instead of the whole herd.
+	 */
+	lp->events = EPOLLIN;
+	if (!owned && shp->srv->nshards > 1)
+		lp->events |= EPOLLEXCLUSIVE;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = lp->events;
+	ee.data.ptr = &lp->ev;
+	if (epoll_ctl(shp->epfd, EPOLL_CTL_ADD, s, &ee) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(lp);
+		return -1;
+	}
+
+	LIST_INSERT_HEAD(&shp->listeners, lp, entry);
+
+	return 0;
+}
+
+/*
+ * ucrp_listener_free()
+ *
+ * free a listener, closing its socket if it is ours
+ */
+void
+ucrp_listener_free(UCRP_LISTENER *lp)
+{
+	LIST_REMOVE(lp, entry);
+	if (ucrp_timer_pending(&lp->pause))
+		ucrp_timer_cancel(&lp->pause);
+	if (lp->owned)
+		close(lp->ev.fd);
+	free(lp);
+
+	return;
+}
+
+/*
+ * listener_unwind()
+ *
+ * take back the listeners just added to the first 'n' shards, when
+ * the others could not have theirs
+ */
+static void
+listener_unwind(UCRP_SERVER *srv, int n)
+{
+	UCRP_LISTENER *lp;
+	int i, saved = errno;
+
+	for (i = 0; i < n; i++) {
+		lp = LIST_FIRST(&srv->shards[i].listeners);
+		epoll_ctl(srv->shards[i].epfd, EPOLL_CTL_DEL, lp->ev.fd, NULL);
+		ucrp_listener_free(lp);
+	}
+
+	errno = saved;
+
+	return;
+}
+
+/*
+ * ucrp_server_listen()
+ *
+ * accept connections on the listening socket 's', which stays the
+ * caller's.  with several threads they all accept from it; use
+ * ucrp_server_bind() to give each thread a socket of its own.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_listen(UCRP_SERVER *srv, int s)
+{
+	int i;
+
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < srv->nshards; i++)
+		if (listener_new(&srv->shards[i], s, 0) == -1) {
+			listener_unwind(srv, i);
+			return -1;
+		}
+
+	return 0;
+}
+
+/*
+ * listener_socket()
+ *
+ * returns a socket listening on 'ai' set up as the server's
+ * UCRP_LISTEN says, or -1 on error
+ */
+static int
+listener_socket(UCRP_SERVER *srv, struct addrinfo *ai)
+{
+	UCRP_LISTEN *lo = &srv->listen;
+	int s, v, save, on = 1;
+
+	s = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+		   SOCK_CLOEXEC, ai->ai_protocol);
+	if (s == -1)
+		return -1;
+
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (srv->nshards > 1 &&
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+		goto fail;
+
+#ifdef IPV6_V6ONLY
+	/* set either way, the system default varies */
+	v = lo->v6only != 0;
+	if (ai->ai_family == AF_INET6 &&
+	    setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v, sizeof(v)) == -1)
+		goto fail;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	v = lo->defer;
+	if (v > 0 &&
+	    setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, &v, sizeof(v)) == -1)
+		goto fail;
+#endif
+
+	if (bind(s, ai->ai_addr, ai->ai_addrlen) == -1 ||
+	    listen(s, lo->backlog > 0 ? lo->backlog : SOMAXCONN) == -1)
+		goto fail;
+
+	return s;
+
+fail:
+	save = errno;
+	close(s);
+	errno = save;
+
+	return -1;
+}
+
+/*
+ * listener_anyaddr()
+ *
+ * returns 1 if 'ai' is the wildcard address of its family, 0 if not
+ */
+static int
+listener_anyaddr(struct addrinfo *ai)
+{
+	struct sockaddr_in6 *sin6;
+
+	if (ai->ai_family == AF_INET)
+		return ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr ==
+		    htonl(INADDR_ANY);
+
+	sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+
+	return ai->ai_family == AF_INET6 &&
+	    IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr);
+}
+
+/*
+ * ucrp_server_bind()
+ *
+ * listen on every address 'nodename' and 'servname' resolve to (any
+ * address if 'nodename' is NULL).  each thread gets its own socket per
+ * address, bound with SO_REUSEPORT so the kernel spreads connections
+ * across the threads.  unless UCRP_LISTEN says v6only the IPv6
+ * wildcard socket takes IPv4 connections too, and the IPv4 wildcard
+ * is only bound where there is no IPv6.
+ *
+ * returns 0 if at least one address could be bound or -1 on error
+ */
+int
+ucrp_server_bind(UCRP_SERVER *srv, char *nodename, char *servname)
+{
+	struct addrinfo hints, *res, *ai;
+	int i, s, ret, pass, dual = 0, nbound = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((ret = getaddrinfo(nodename, servname, &hints, &res)) != 0) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+			 gai_strerror(ret));
+		return -1;
+	}
+
+	/* IPv6 first, so we know whether IPv4 is taken care of */
+	for (pass = 0; pass < 2; pass++) {
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((ai->ai_family == AF_INET6) != (pass == 0))
+				continue;
+			if (dual && listener_anyaddr(ai))
+				continue;
+
+			for (i = 0; i < srv->nshards; i++) {
+				if ((s = listener_socket(srv, ai)) == -1)
+					break;
+
+				if (listener_new(&srv->shards[i], s, 1) == -1) {
+					close(s);
+					break;
+				}
+			}
+
+			if (i < srv->nshards) {
+				listener_unwind(srv, i);
+				ucrp_log(LOG_WARNING, "%s: %s: %s\n", __func__,
+					 ai->ai_family == AF_INET6 ?
+					 "inet6" : "inet", strerror(errno));
+				continue;
+			}
+
+			nbound++;
+			if (ai->ai_family == AF_INET6 &&
+			    !srv->listen.v6only && listener_anyaddr(ai))
+				dual = 1;
+		}
+	}
+
+	freeaddrinfo(res);
+
+	return nbound > 0 ? 0 : -1;
+}
+
+/*
+ * listener_refuse()
+ *
+ * tell a connection we have no room for it and close it.  the socket
+ * is new, the message fits in its buffer.
+ */
+static void
+listener_refuse(int c)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	ucrp_msg_display(sm, SESS_REFUSED);
+	ucrp_send(c, sm);
+	close(c);
+
+	return;
+}
+
+/*
+ * listener_handler()
+ *
+ * accept the connections waiting, up to LISTEN_BATCH of them so the
+ * sessions of this thread get their turn
+ */
+static void
+listener_handler(UCRP_EV *ev, uint32_t events)
+{
+	UCRP_LISTENER *lp = (UCRP_LISTENER *)ev;
+	int c, n;
+
+	for (n = 0; n < LISTEN_BATCH; n++) {
+		c = accept4(ev->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (c != -1) {
+			listener_accept(lp, c);
+			continue;
+		}
+
+		switch (errno) {
+		case EINTR:
+		case ECONNABORTED:
+			continue;
+		case EAGAIN:
+			break;
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			/* the connection stays queued, try again later */
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			listener_pause(lp);
+			break;
+		default:
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			break;
+		}
+		break;
+	}
+
+	return;
+}
+
+/*
+ * listener_accept()
+ *
+ * start a session for connection 'c'
+ */
+static void
+listener_accept(UCRP_LISTENER *lp, int c)
+{
+	UCRP_SERVER *srv = lp->shard->srv;
+	UCRP_SESSION *sp;
+	unsigned int share;
+	int on = 1;
+
+	/* we batch output ourselves, don't let nagle delay prompts */
+	setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	share = LIMIT_SHARE(srv, srv->limits.sessions);
+	if (share > 0 && lp->shard->nsessions >= share) {
+		ucrp_log(LOG_INFO, "%s: refused, %u sessions\n", __func__,
+			 lp->shard->nsessions);
+		STATS_ADD(lp->shard->stats->refused, 1);
+		listener_refuse(c);
+		return;
+	}
+
+	if ((sp = ucrp_session_new(lp->shard, c)) == NULL) {
+		close(c);
+		return;
+	}
+	STATS_ADD(lp->shard->stats->sessions, 1);
+
+	if (srv->cb.connect != NULL)
+		srv->cb.connect(sp);
+
+	if (sp->chan0.os != NULL)
+		ucrp_ostream_flush(sp->chan0.os);
+	if (lp->shard->arena != NULL)
+		ucrp_arena_reset(lp->shard->arena);
+
+	return;
+}
+
+/*
+ * listener_pause()
+ *
+ * stop listening for LISTEN_PAUSE ms.  out of descriptors the socket
+ * stays readable, epoll would hand it straight back to us.
+ */
+static void
+listener_pause(UCRP_LISTENER *lp)
+{
+	if (ucrp_timer_pending(&lp->pause))
+		return;
+
+	/* EPOLLEXCLUSIVE ones can't be modified, only removed */
+	if (epoll_ctl(lp->shard->epfd, EPOLL_CTL_DEL, lp->ev.fd, NULL) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return;
+	}
+
+	ucrp_timer_set(&lp->pause, LISTEN_PAUSE);
+
+	return;
+}
+
+/*
+ * listener_resume()
+ */
+static void
+listener_resume(UCRP_TIMER *tm, void *arg)
+{
+	UCRP_LISTENER *lp = arg;
+	struct epoll_event ee;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = lp->events;
+	ee.data.ptr = &lp->ev;
+	if (epoll_ctl(lp->shard->epfd, EPOLL_CTL_ADD, lp->ev.fd, &ee) == -1)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+
+	return;
+}
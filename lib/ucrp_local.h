@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * libucrp internals shared by the server sources, not installed.
+ */
+
+#ifndef _UCRP_LOCAL_H
+#define _UCRP_LOCAL_H
+
+#include <sys/queue.h>
+
+#include <pthread.h>
+#include <regex.h>
+
+#include <ucrp_server.h>
+
+/*
+ * reference counted byte buffer, may be shared between threads
+ */
+struct _ucrp_buf {
+	int      refcnt;                       /* atomic                */
+	size_t   size;                         /* bytes at data         */
+	uint8_t *data;
+	void   (*free)(struct _ucrp_buf *);    /* NULL: data is inline  */
+};
+
+/*
+ * a file mapped for sending, see ucrp_ostream_sendfile().  data is
+ * the payload only, the queue writes one of the headers in front of
+ * every 'frame' bytes of it.
+ */
+typedef struct _ucrp_filebuf {
+	UCRP_BUF  buf;                         /* must be first         */
+	void     *map;                         /* page aligned          */
+	size_t    maplen;
+	size_t    payload;                     /* bytes at buf.data     */
+	size_t    frame;                       /* payload of a message  */
+	uint8_t   full[UCRP_HDR_SIZE];         /* network order         */
+	uint8_t   last[UCRP_HDR_SIZE];         /* of the last message   */
+} UCRP_FILEBUF;
+
+#define FILEBUF_FRAME(fb) (UCRP_HDR_SIZE + (fb)->frame)
+#define FILEBUF_FRAMES(fb) \
+	(((fb)->payload + (fb)->frame - 1) / (fb)->frame)
+
+/*
+ * output queue, a list of buffer slices waiting to be written.
+ * small messages are copied into private chunks so that one
+ * writev() carries many of them.  a SEG_FRAMED slice is of a
+ * UCRP_FILEBUF, off and len count the headers too.
+ */
+#define SEG_PRIVATE  0x1                       /* we may append to buf  */
+#define SEG_FRAMED   0x2                       /* of a UCRP_FILEBUF     */
+#define SEG_CHUNK    16384                     /* private chunk size    */
+
+typedef struct _ucrp_seg {
+	TAILQ_ENTRY(_ucrp_seg) entry;
+	UCRP_BUF *buf;
+	size_t    start;                       /* first message at      */
+	size_t    off;                         /* next byte to write    */
+	size_t    len;                         /* bytes left to write   */
+	int       flags;
+} UCRP_SEG;
+
+TAILQ_HEAD(_ucrp_seg_head, _ucrp_seg);
+
+/*
+ * segments kept for reuse by the queues of one thread, private ones
+ * with their chunk still attached, and the bytes those queues hold
+ */
+#define SEGCACHE_KEEP 64                       /* of each kind          */
+
+typedef struct _ucrp_segcache {
+	struct _ucrp_seg_head chunks;          /* SEG_PRIVATE, SEG_CHUNK */
+	struct _ucrp_seg_head segs;            /* no buffer             */
+	int nchunks;
+	int nsegs;
+	size_t bytes;                          /* queued on all of them */
+} UCRP_SEGCACHE;
+
+typedef struct _ucrp_segq {
+	struct _ucrp_seg_head head;
+	size_t bytes;                          /* bytes queued          */
+	size_t mapped;                         /* of those, in files    */
+	UCRP_SEGCACHE *cache;                  /* NULL: malloc() always */
+} UCRP_SEGQ;
+
+/*
+ * every descriptor in the event loop starts with one of these
+ */
+typedef struct _ucrp_ev {
+	int fd;
+	void (*handler)(struct _ucrp_ev *, uint32_t);
+} UCRP_EV;
+
+/*
+ * timers of one io thread, in a hierarchical wheel of millisecond
+ * ticks: a timer is in the slot of the level its deadline is within
+ * reach of, and moves down a level each time the one below wraps.
+ * setting, cancelling and running a timer costs the same however
+ * many there are.  deadlines further off than the top level reaches,
+ * about 4.6 hours, wait in its last slot and are put back.
+ */
+#define TIMER_BITS    6
+#define TIMER_SLOTS   (1 << TIMER_BITS)
+#define TIMER_MASK    (TIMER_SLOTS - 1)
+#define TIMER_LEVELS  4
+#define TIMER_REACH   ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS))
+
+typedef struct _ucrp_shard UCRP_SHARD;
+
+struct _ucrp_timer {
+	LIST_ENTRY(_ucrp_timer) entry;         /* in a slot             */
+	LIST_ENTRY(_ucrp_timer) sessent;       /* ucrp_timer_new() ones */
+	UCRP_SHARD   *shard;
+	UCRP_SESSION *sp;                      /* NULL: internal        */
+	int           pending;
+	int           slot;                    /* level, slot in one    */
+	uint64_t      expires;                 /* ucrp_msec() tick      */
+	void        (*f)(UCRP_TIMER *, void *);
+	void         *arg;
+};
+
+LIST_HEAD(_ucrp_timer_head, _ucrp_timer);
+
+typedef struct _ucrp_wheel {
+	uint64_t now;                          /* last tick run         */
+	unsigned int n;                        /* timers pending        */
+	uint64_t used[TIMER_LEVELS];           /* slots not empty       */
+	struct _ucrp_timer_head slots[TIMER_LEVELS][TIMER_SLOTS];
+} UCRP_WHEEL;
+
+/*
+ * a descriptor of the application's, read on its session's thread.
+ * watches are held off while the session has more than WATCH_HIWAT
+ * bytes queued, so a client that doesn't keep up slows the writer
+ * down instead of growing the queue.  a freed watch may still have an
+ * event in the batch being handled, it is reaped after the batch.
+ */
+#define WATCH_HIWAT   (SESS_TXHIWAT * 8)       /* queued before holding */
+
+struct _ucrp_watch {
+	UCRP_EV       ev;                      /* must be first         */
+	UCRP_SESSION *sp;
+	LIST_ENTRY(_ucrp_watch) entry;         /* sp->watches or reap   */
+	uint32_t      evmask;                  /* registered events     */
+	int           dead;                    /* no more callbacks     */
+	void        (*f)(UCRP_WATCH *, int, void *);
+	void         *arg;
+};
+
+LIST_HEAD(_ucrp_watch_head, _ucrp_watch);
+
+/*
+ * a received command waiting for or running on the worker pool.
+ * commands on a channel run one at a time, in order.  one that asked
+ * to run again, see ucrp_channel_again(), stays first on its channel
+ * while the channel's timer runs, and is then given to the pool with
+ * 'fn' to call instead of the command callback.
+ */
+#define JOB_SIZE      (sizeof(UCRP_JOB) + UCRP_MAX_PAYLOAD + 1)
+#define JOB_KEEP      64                       /* kept by each shard    */
+
+typedef struct _ucrp_job {
+	TAILQ_ENTRY(_ucrp_job) chanent;        /* channel's commands    */
+	TAILQ_ENTRY(_ucrp_job) poolent;        /* worker's queue        */
+	UCRP_CHANNEL *cp;
+	int           cancel;                  /* interrupted, atomic   */
+	int           waiting;                 /* on admitq[waiting - 1] */
+	int           again;                   /* fn is owed a call     */
+	unsigned int  delay;                   /* ms before it          */
+	void        (*fn)(UCRP_CHANNEL *, void *);
+	void         *arg;
+	UCRP          rm;                      /* payload follows       */
+} UCRP_JOB;
+
+TAILQ_HEAD(_ucrp_job_head, _ucrp_job);
+
+struct _ucrp_channel {
+	UCRP_SESSION *sp;
+	int           id;
+	struct _ucrp_job_head jobs;            /* first one is running  */
+	UCRP_OSTREAM *os;                      /* created on use, atomic */
+	UCRP_ARENA   *arena;                   /* for commands on workers */
+	UCRP_TIMER    again;                   /* first job runs again  */
+};
+
+/*
+ * rows of a table as they go on the wire, every cell of a row in
+ * turn: a number as a zigzag varint, text as a varint length and the
+ * bytes.  row[] has where each row starts.
+ */
+struct _ucrp_rows {
+	int       ncols;
+	int       type[UCRP_TABLE_MAXCOLS];
+	char      name[UCRP_TABLE_MAXCOLS][UCRP_TABLE_NAMELEN];
+	int       cell;                        /* next one of this row  */
+	uint8_t  *data;
+	size_t    len;
+	size_t    size;
+	size_t   *row;
+	size_t    nrows;
+	size_t    rowsize;                     /* room in row[]         */
+};
+
+/*
+ * a table being sent on a channel.  clients that know UCRP_TABLE get
+ * the rows a frame at a time, others get them printed at the end.
+ */
+struct _ucrp_tstream {
+	UCRP_CHANNEL *cp;
+	UCRP_ROWS    *rows;
+	int           native;                  /* UCRP_EXT_TABLES       */
+	int           started;                 /* schema sent           */
+	int           columns;                 /* to print for          */
+};
+
+/*
+ * a screen a command's output is refreshed on, see ucrp_screen_end().
+ * 'old' is what the client shows, 'cur' what the command wrote since
+ * ucrp_screen_begin(), both as lines.
+ */
+#define SCREEN_MAXSIZE (1024 * 1024)           /* of 'cur', rest dropped */
+
+typedef struct _screen_text {
+	char         *data;
+	size_t        len;
+	size_t        size;
+	size_t       *line;                    /* where each line starts */
+	unsigned int  nlines;
+	unsigned int  maxlines;
+} SCREEN_TEXT;
+
+struct _ucrp_screen {
+	UCRP_CHANNEL *cp;
+	int           native;                  /* UCRP_EXT_UPDATE       */
+	int           drawn;                   /* 'old' was sent        */
+	SCREEN_TEXT   old;
+	SCREEN_TEXT   cur;
+};
+
+/*
+ * output filters, the stages of a "| include ..." chain.  every line
+ * of a command's output goes through them in turn until one drops
+ * it, only what comes out the end is framed.  a line that doesn't
+ * end in the first FILTER_LINEMAX bytes is judged on those.
+ */
+#define FILTER_MAXSTAGES 8
+#define FILTER_LINEMAX   4096
+
+#define FILTER_INCLUDE   1                     /* lines that match      */
+#define FILTER_EXCLUDE   2                     /* lines that don't      */
+#define FILTER_BEGIN     3                     /* from one that matches */
+#define FILTER_COUNT     4                     /* how many, not them    */
+#define FILTER_HEAD      5                     /* the first so many     */
+
+typedef struct _filter_stage {
+	int           op;                      /* FILTER_*              */
+	char         *literal;                 /* plain text, or        */
+	size_t        litlen;
+	regex_t       re;                      /* a regular expression  */
+	int           compiled;
+	unsigned long arg;                     /* FILTER_HEAD lines     */
+	unsigned long n;                       /* passed, or counted    */
+	int           on;                      /* FILTER_BEGIN matched  */
+} FILTER_STAGE;
+
+struct _ucrp_filter {
+	FILTER_STAGE  stage[FILTER_MAXSTAGES];
+	int           nstages;
+	int           done;                    /* no line gets out now  */
+	int           keep;                    /* the rest of a long    */
+					       /* line, -1 at a start   */
+	size_t        len;                     /* of a part line, in    */
+	char          line[FILTER_LINEMAX];
+};
+
+/*
+ * a channel's UCRP_DISPLAY output, packed into one frame until the
+ * frame is full, the writer flushes or the deadline passes.  the lock
+ * is shared by the writer, maybe a worker, and the session's thread,
+ * which keeps the deadlines.
+ */
+#define OSTREAM_DELAY 2                        /* ms a part frame waits */
+
+struct _ucrp_ostream {
+	UCRP_CHANNEL   *cp;
+	pthread_mutex_t lock;
+	int             armed;                 /* deadline asked for    */
+	UCRP_TIMER      timer;                 /* the deadline          */
+	UCRP_SCREEN    *capture;               /* gets output, not sent */
+	UCRP_FILTER    *filter;                /* output goes through   */
+	size_t          max;                   /* payload of a frame    */
+	uint16_t        frame[];               /* a UCRP, max + 1 bytes */
+};
+
+/*
+ * lock-free multiple producer, single consumer queue of intrusive
+ * nodes.  producers only touch head, the consumer only tail.
+ */
+typedef struct _ucrp_mpsc_node {
+	struct _ucrp_mpsc_node *next;
+} UCRP_MPSC_NODE;
+
+typedef struct _ucrp_mpsc {
+	UCRP_MPSC_NODE *head __attribute__((aligned(64)));
+	UCRP_MPSC_NODE *tail __attribute__((aligned(64)));
+	UCRP_MPSC_NODE  stub;
+} UCRP_MPSC;
+
+/*
+ * something a worker wants done on a session's own thread
+ */
+#define POST_MSG      1                        /* queue msg             */
+#define POST_CLOSE    2                        /* ucrp_session_close()  */
+#define POST_DONE     3                        /* job has finished      */
+#define POST_ARM      4                        /* ostream deadline      */
+#define POST_EVENT    5                        /* bus event in ptr      */
+#define POST_SUBSCRIBE 6                       /* see ucrp_bus.c        */
+#define POST_TIMER    7                        /* set ptr to chan ms    */
+#define POST_FILE     8                        /* queue UCRP_FILEBUF    */
+#define POST_FRAME    9                        /* queue UCRP_BUF in ptr */
+
+#define POST_SIZE     (sizeof(UCRP_POST) + UCRP_MAX_PAYLOAD)
+#define POST_KEEP     256                      /* per worker            */
+#define POST_WAIT     100                      /* us, for one back      */
+
+typedef struct _ucrp_post {
+	UCRP_MPSC_NODE node;                   /* must be first         */
+	struct _ucrp_worker *owner;            /* recycled by, or NULL  */
+	int            kind;
+	UCRP_SESSION  *sp;
+	int            chan;
+	UCRP_JOB      *job;
+	void          *ptr;                    /* by kind               */
+	UCRP           msg;                    /* payload follows       */
+} UCRP_POST;
+
+#define SESS_CLOSING  0x1                      /* close when txq drains */
+#define SESS_DEAD     0x2                      /* close now             */
+#define SESS_FLUSHQ   0x4                      /* on shard->flushq      */
+#define SESS_GONE     0x8                      /* destroyed, has refs   */
+
+#define SESS_RXSIZE   2048                     /* >= UCRP_MAX_MSGSIZE   */
+#define SESS_TXHIWAT  32768                    /* write out early       */
+#define SESS_READMAX  64                       /* messages per readfd   */
+#define SESS_FRAME(sp)                         /* largest payload sent  */ \
+	((sp)->ext.flags & UCRP_EXT_MAXMSG ? \
+	    (sp)->ext.maxmsg : UCRP_MAX_PAYLOAD)
+#define SESS_REFUSED  "% Server busy, try again later.\n"
+#define SESS_IDLE     "% Idle timeout, closing.\n"
+
+/*
+ * an event on the bus, encoded as UCRP_DISPLAY messages in buf, with
+ * the text kept for the filters
+ */
+typedef struct _ucrp_event {
+	UCRP_BUF      buf;                     /* must be first         */
+	int           topic;
+	int           prio;
+	char         *text;
+} UCRP_EVENT;
+
+/*
+ * a session's subscriptions, and the events held back while its
+ * output queue is long, oldest first
+ */
+#define SUB_QLEN      64                       /* events held back      */
+#define SUB_LOWAT     (SESS_TXHIWAT / 2)       /* queued before holding */
+
+typedef struct _ucrp_sub {
+	LIST_ENTRY(_ucrp_sub) entry;           /* on shard->subs        */
+	UCRP_SESSION *sp;
+	uint32_t      topics;                  /* bit per topic         */
+	int           prio[UCRP_BUS_MAXTOPICS]; /* least urgent shown   */
+	char         *match[UCRP_BUS_MAXTOPICS]; /* NULL: everything    */
+	UCRP_BUF     *held[SUB_QLEN];
+	int           first;
+	int           nheld;
+	unsigned int  dropped;                 /* since we last said so */
+} UCRP_SUB;
+
+struct _ucrp_session {
+	UCRP_EV       ev;                      /* must be first         */
+	UCRP_SERVER  *srv;
+	UCRP_SHARD   *shard;                   /* the loop we live on   */
+	LIST_ENTRY(_ucrp_session) entry;
+	TAILQ_ENTRY(_ucrp_session) flushent;
+	int           flags;
+	uint32_t      evmask;                  /* registered events     */
+	UCRP_EXT      ext;
+	size_t        rxlen;
+	uint8_t       rx[SESS_RXSIZE];
+	UCRP_SEGQ     txq;
+	UCRP_CHANNEL  chan0;
+	UCRP_CHANNEL **chans;                  /* 1..UCRP_MAX_CHAN      */
+	int           refs;                    /* jobs queued/running   */
+	UCRP_SUB     *sub;                     /* NULL: not subscribed  */
+	struct _ucrp_timer_head timers;        /* ucrp_timer_new() ones */
+	struct _ucrp_watch_head watches;       /* ucrp_watch_new() ones */
+	int           held;                    /* watches held off      */
+	UCRP_TIMER    idle;                    /* UCRP_LIMITS idle      */
+	uint64_t      lastin;                  /* tick of last input    */
+	void         *data;
+};
+
+#define LISTEN_BATCH  64                       /* accepts per wakeup    */
+#define LISTEN_PAUSE  100                      /* ms out of descriptors */
+
+typedef struct _ucrp_listener {
+	UCRP_EV      ev;                       /* must be first         */
+	UCRP_SHARD  *shard;
+	int          owned;                    /* we close the socket   */
+	uint32_t     events;                   /* for epoll             */
+	UCRP_TIMER   pause;                    /* back in the epoll set */
+	LIST_ENTRY(_ucrp_listener) entry;
+} UCRP_LISTENER;
+
+/*
+ * a shard is one event loop thread with its own listeners, sessions
+ * and buffers.  sessions never move between shards, so nothing on
+ * the hot path is shared or locked.
+ */
+struct _ucrp_shard {
+	UCRP_SERVER   *srv;
+	int            id;
+	int            epfd;
+	UCRP_EV        wake;                   /* eventfd, see shard_wake */
+	int            wakeflag;               /* wake already pending  */
+	UCRP_MPSC      mbox;                   /* UCRP_POSTs for us     */
+	pthread_t      thread;
+	LIST_HEAD(, _ucrp_session)  sessions;
+	LIST_HEAD(, _ucrp_listener) listeners;
+	TAILQ_HEAD(, _ucrp_session) flushq;    /* output pending        */
+	UCRP_WHEEL     wheel;
+	struct _ucrp_watch_head reap;          /* freed watches         */
+	LIST_HEAD(, _ucrp_sub) subs;           /* subscribed sessions   */
+	unsigned int   nsubs;                  /* atomic                */
+	struct _ucrp_job_head jobcache;        /* free JOB_SIZE jobs    */
+	struct _ucrp_job_head admitq[2];       /* interactive, batch    */
+	unsigned int   nrunning;               /* jobs given to the pool */
+	unsigned int   nwaiting[2];            /* jobs on admitq        */
+	unsigned int   nbatch;                 /* UCRP_EXT_BATCH sessions */
+	int            njobcache;
+	UCRP_SEGCACHE  segcache;
+	UCRP_ARENA    *arena;                  /* for callbacks here    */
+	unsigned int   nsessions;
+	unsigned int   nextworker;             /* where to submit next  */
+	UCRP          *rm;                     /* message being handled */
+	UCRP_STATS_IO *stats;                  /* ours in srv->stats    */
+	UCRP_STATS_WORKER *cmdstats;           /* commands run inline   */
+	UCRP_STATS_IO  nostats;                /* until there are some  */
+};
+
+typedef struct _ucrp_worker {
+	struct _ucrp_pool *pool;
+	int             id;
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	TAILQ_HEAD(, _ucrp_job) jobs;
+	UCRP_MPSC       spares;                /* our posts, drained    */
+	UCRP_MPSC_NODE *spare;                 /* taken off spares      */
+	int             nposts;                /* posts we own          */
+	UCRP_STATS_WORKER *stats;              /* ours in srv->stats    */
+} UCRP_WORKER;
+
+typedef struct _ucrp_pool {
+	UCRP_SERVER    *srv;
+	int             nworkers;
+	UCRP_WORKER    *workers;
+	pthread_mutex_t idlelock;
+	pthread_cond_t  idlecv;
+	int             nidle;                 /* workers asleep        */
+	int             stop;
+	unsigned int    pending;               /* jobs queued, atomic   */
+} UCRP_POOL;
+
+#define SRV_PIN       0x1                      /* pin shards to cpus    */
+
+struct _ucrp_server {
+	volatile int   stop;
+	int            flags;
+	UCRP_CALLBACKS cb;
+	uint32_t       extensions;             /* we agree to these     */
+	int            nshards;
+	UCRP_SHARD    *shards;
+	UCRP_POOL     *pool;                   /* NULL: commands inline */
+	UCRP_LIMITS    limits;                 /* for the whole server  */
+	UCRP_LISTEN    listen;                 /* ucrp_server_bind()    */
+	UCRP_STATS    *stats;                  /* shared memory segment */
+	char          *statspath;              /* its file, or NULL     */
+	int            ncmds;                  /* cmdnames in use       */
+	char           cmdnames[UCRP_STATS_MAXCMDS][UCRP_STATS_NAMELEN];
+	int            ntopics;                /* topics in use         */
+	char           topics[UCRP_BUS_MAXTOPICS][UCRP_BUS_NAMELEN];
+};
+
+/*
+ * one thread's share of a server wide limit, 0 if there is none
+ */
+#define LIMIT_SHARE(srv, n) \
+	((n) == 0 ? 0 : ((n) + (srv)->nshards - 1) / (srv)->nshards)
+
+/*
+ * statistics are only ever written by the thread they belong to and
+ * read from anywhere, a whole word at a time
+ */
+#define STATS_ADD(v, n) \
+	__atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#define STATS_SET(v, n) \
+	__atomic_store_n(&(v), (n), __ATOMIC_RELAXED)
+#define STATS_MSG(io, dir, type, len) do {				\
+	int _t = UCRP_STATS_TYPE(type);					\
+	if (_t >= 0) {							\
+		STATS_ADD((io)->msgs_##dir[_t], 1);			\
+		STATS_ADD((io)->bytes_##dir[_t], (len));		\
+	}								\
+} while (0)
+
+extern __thread UCRP_SHARD *ucrp_curshard;     /* NULL off the io threads */
+extern __thread UCRP_JOB   *ucrp_curjob;       /* set on the workers      */
+extern __thread int         ucrp_curstat;      /* ucrp_channel_cmdstat()  */
+
+__BEGIN_DECLS
+/*
+ * ucrp_buf.c
+ */
+UCRP_BUF *ucrp_buf_new(size_t);
+void      ucrp_buf_ref(UCRP_BUF *);
+void      ucrp_buf_rele(UCRP_BUF *);
+UCRP_FILEBUF *ucrp_filebuf_new(int, off_t, size_t, size_t);
+
+void      ucrp_segcache_init(UCRP_SEGCACHE *);
+void      ucrp_segcache_clear(UCRP_SEGCACHE *);
+
+void      ucrp_segq_init(UCRP_SEGQ *, UCRP_SEGCACHE *);
+void     *ucrp_segq_reserve(UCRP_SEGQ *, size_t);
+int       ucrp_segq_append(UCRP_SEGQ *, const void *, size_t);
+int       ucrp_segq_appendbuf(UCRP_SEGQ *, UCRP_BUF *, size_t, size_t);
+int       ucrp_segq_appendfile(UCRP_SEGQ *, UCRP_FILEBUF *);
+ssize_t   ucrp_segq_write(UCRP_SEGQ *, int);
+size_t    ucrp_segq_discard(UCRP_SEGQ *, int (*)(UCRP *, void *), void *);
+void      ucrp_segq_clear(UCRP_SEGQ *);
+
+/*
+ * ucrp_server.c
+ */
+void      ucrp_shard_wake(UCRP_SHARD *);
+
+/*
+ * ucrp_listen.c
+ */
+void      ucrp_listener_free(UCRP_LISTENER *);
+
+/*
+ * ucrp_pool.c
+ */
+void      ucrp_mpsc_init(UCRP_MPSC *);
+void      ucrp_mpsc_push(UCRP_MPSC *, UCRP_MPSC_NODE *);
+UCRP_MPSC_NODE *ucrp_mpsc_pop(UCRP_MPSC *, int *);
+
+UCRP_POOL *ucrp_pool_new(UCRP_SERVER *, int);
+int       ucrp_pool_start(UCRP_POOL *);
+void      ucrp_pool_stop(UCRP_POOL *);
+void      ucrp_pool_free(UCRP_POOL *);
+void      ucrp_pool_submit(UCRP_POOL *, UCRP_SHARD *, UCRP_JOB *);
+void      ucrp_pool_throttle(void);
+
+int       ucrp_shard_post(UCRP_SHARD *, int, UCRP_SESSION *, int,
+			  UCRP_JOB *, UCRP *);
+int       ucrp_shard_postptr(UCRP_SHARD *, int, UCRP_SESSION *, void *,
+			     int);
+void      ucrp_shard_drain(UCRP_SHARD *);
+
+/*
+ * ucrp_ostream.c
+ */
+uint64_t  ucrp_msec(void);
+void      ucrp_ostream_arm(UCRP_OSTREAM *);
+void      ucrp_ostream_discard(UCRP_OSTREAM *);
+void      ucrp_ostream_free(UCRP_OSTREAM *);
+int       ucrp_ostream_put(UCRP_OSTREAM *, const void *, size_t);
+int       ucrp_ostream_writeraw(UCRP_OSTREAM *, const void *, size_t);
+
+/*
+ * ucrp_filter.c
+ */
+int       ucrp_filter_write(UCRP_FILTER *, UCRP_OSTREAM *, const void *,
+			    size_t);
+int       ucrp_filter_row(UCRP_FILTER *, const char *, size_t);
+int       ucrp_filter_finish(UCRP_FILTER *, UCRP_OSTREAM *);
+void      ucrp_filter_free(UCRP_FILTER *);
+
+/*
+ * ucrp_table.c
+ */
+size_t    ucrp_rows_text(UCRP_ROWS *, char *, size_t);
+void      ucrp_rows_drop(UCRP_ROWS *);
+
+/*
+ * ucrp_screen.c
+ */
+int       ucrp_screen_add(UCRP_SCREEN *, const void *, size_t);
+
+/*
+ * ucrp_bus.c
+ */
+void      ucrp_bus_deliver(UCRP_SHARD *, UCRP_BUF *);
+void      ucrp_bus_subscribe(UCRP_SESSION *, int, int, const char *);
+void      ucrp_bus_refill(UCRP_SESSION *);
+void      ucrp_bus_free(UCRP_SESSION *);
+
+/*
+ * ucrp_timer.c
+ */
+void      ucrp_wheel_init(UCRP_WHEEL *);
+void      ucrp_wheel_run(UCRP_WHEEL *);
+int       ucrp_wheel_timeout(UCRP_WHEEL *);
+void      ucrp_timer_init(UCRP_TIMER *, UCRP_SHARD *,
+			  void (*)(UCRP_TIMER *, void *), void *);
+
+/*
+ * ucrp_watch.c
+ */
+void      ucrp_watch_hold(UCRP_SESSION *, int);
+void      ucrp_watch_stop(UCRP_SESSION *);
+void      ucrp_watch_reap(UCRP_SHARD *);
+
+/*
+ * ucrp_stats.c
+ */
+uint64_t  ucrp_usec(void);
+int       ucrp_stats_start(UCRP_SERVER *);
+void      ucrp_stats_stop(UCRP_SERVER *);
+void      ucrp_stats_command(UCRP_STATS_WORKER *, uint64_t);
+
+/*
+ * ucrp_session.c
+ */
+UCRP_SESSION *ucrp_session_new(UCRP_SHARD *, int);
+void          ucrp_session_destroy(UCRP_SESSION *);
+int           ucrp_session_flush(UCRP_SESSION *);
+int           ucrp_session_queue(UCRP_SESSION *, int, UCRP *);
+int           ucrp_session_queuebuf(UCRP_SESSION *, UCRP_BUF *);
+int           ucrp_session_queuefile(UCRP_SESSION *, int, UCRP_FILEBUF *);
+int           ucrp_session_queueframe(UCRP_SESSION *, int, UCRP_BUF *);
+int           ucrp_session_output(UCRP_SESSION *, int, UCRP *);
+int           ucrp_session_outputfile(UCRP_SESSION *, int, UCRP_FILEBUF *);
+int           ucrp_session_outputframe(UCRP_SESSION *, int, UCRP_BUF *);
+int           ucrp_session_check(UCRP_SESSION *);
+void          ucrp_session_done(UCRP_JOB *);
+int           ucrp_channel_cancelled(UCRP_CHANNEL *);
+__END_DECLS
+
+#endif /* _UCRP_LOCAL_H */
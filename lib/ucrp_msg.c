@@ -18,6 +18,7 @@
 
 #include <netinet/in.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <ucrp.h>
@@ -208,6 +209,108 @@ ucrp_msg_exec(UCRP *msg, char *command)
 	return;
 }
 
+/*
+ * ucrp_msg_extended()
+ *
+ * format ucrp message
+ */
+void
+ucrp_msg_extended(UCRP *msg, UCRP_EXT *ext)
+{
+	msg->type = UCRP_EXTENDED; 
+        msg->options = 0; 
+        msg->length = ucrp_ext_format((char *)UCRP_PAYLOAD(msg),
+				      UCRP_MAX_PAYLOAD, ext);
+
+	return;
+}
+
+/*
+ * ucrp_msg_interrupted()
+ *
+ * format ucrp message
+ */
+void
+ucrp_msg_interrupted(UCRP *msg)
+{
+	msg->type = UCRP_INTERRUPTED; 
+        msg->options = 0; 
+        msg->length = 0;
+
+	return;
+}
+
+/*
+ * ucrp_msg_table()
+ *
+ * format ucrp message, 'len' bytes of a table's schema or rows
+ */
+void
+ucrp_msg_table(UCRP *msg, uint16_t opts, const void *data, size_t len)
+{
+	if (len > UCRP_MAX_PAYLOAD)
+		len = UCRP_MAX_PAYLOAD;
+
+	msg->type = UCRP_TABLE;
+	msg->options = opts;
+	memcpy(UCRP_PAYLOAD(msg), data, len);
+	msg->length = len;
+
+	return;
+}
+
+/*
+ * ucrp_msg_update()
+ *
+ * format ucrp message, the lines from 'first' on follow of a screen
+ * 'total' lines long.  the caller appends them.
+ */
+void
+ucrp_msg_update(UCRP *msg, uint16_t opts, uint first, uint total)
+{
+	msg->type = UCRP_UPDATE;
+	msg->options = opts;
+	snprintf((char *)UCRP_PAYLOAD(msg), UCRP_MAX_PAYLOAD, "%u\r\n%u\r\n",
+		 first, total);
+	msg->length = strlen((char *)UCRP_PAYLOAD(msg));
+
+	return;
+}
+
+/*
+ * ucrp_msg_updateparse()
+ *
+ * parse the payload of a UCRP_UPDATE message into 'first' and 'total'
+ * and point 'text' at the lines that follow, in the payload
+ *
+ * returns the length of the lines or -1 on error
+ */
+int
+ucrp_msg_updateparse(UCRP *msg, uint *first, uint *total, char **text)
+{
+	char *p, *end, *ep;
+	unsigned long n[2];
+	int i;
+
+	if (msg->type != UCRP_UPDATE)
+		return -1;
+
+	p = (char *)UCRP_PAYLOAD(msg);
+	end = p + msg->length;
+	for (i = 0; i < 2; i++) {
+		n[i] = strtoul(p, &ep, 10);
+		if (ep == p || end - ep < 2 || ep[0] != '\r' || ep[1] != '\n')
+			return -1;
+		p = ep + 2;
+	}
+
+	*first = n[0];
+	*total = n[1];
+	*text = p;
+
+	return end - p;
+}
+
 /*
  * UCRP clients MAY send the following message types.
  */
@@ -330,3 +433,91 @@ ucrp_msg_wait(UCRP *msg, uint16_t options, int status)
 
 	return;
 }
+
+/*
+ * ucrp_msg_rusage()
+ *
+ * add what the command cost to a UCRP_WAIT message
+ */
+void
+ucrp_msg_rusage(UCRP *msg, UCRP_RUSAGE *ru)
+{
+	msg->options |= WAIT_RUSAGE;
+	msg->length += snprintf((char *)UCRP_PAYLOAD(msg) + msg->length,
+				UCRP_MAX_PAYLOAD - msg->length,
+				"utime=%llu\r\nstime=%llu\r\nmaxrss=%llu\r\n",
+				(unsigned long long)ru->utime,
+				(unsigned long long)ru->stime,
+				(unsigned long long)ru->maxrss);
+
+	return;
+}
+
+/*
+ * ucrp_msg_waitparse()
+ *
+ * parse the payload of a UCRP_WAIT message into 'status', if it has
+ * WAIT_STATUS, and 'ru', zero unless it has WAIT_RUSAGE.  unknown
+ * lines are ignored.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_msg_waitparse(UCRP *msg, int *status, UCRP_RUSAGE *ru)
+{
+	char buf[UCRP_MAX_PAYLOAD + 1];
+	char *ln, *lp, *val;
+	uint64_t n;
+
+	memset(ru, 0, sizeof(*ru));
+	*status = 0;
+
+	if (msg->type != UCRP_WAIT)
+		return -1;
+
+	/* work on a copy, ucrp_msg_getln() is destructive */
+	memcpy(buf, UCRP_PAYLOAD(msg), msg->length);
+	buf[msg->length] = '\0';
+	lp = buf;
+
+	if (msg->options & WAIT_STATUS) {
+		if ((ln = ucrp_msg_getln(&lp)) == NULL)
+			return -1;
+		*status = strtol(ln, NULL, 10);
+	}
+
+	if ((msg->options & WAIT_RUSAGE) == 0)
+		return 0;
+
+	while ((ln = ucrp_msg_getln(&lp)) != NULL) {
+		if ((val = strchr(ln, '=')) == NULL)
+			continue;
+		*val++ = '\0';
+		n = strtoull(val, NULL, 10);
+
+		if (strcmp(ln, "utime") == 0)
+			ru->utime = n;
+		else if (strcmp(ln, "stime") == 0)
+			ru->stime = n;
+		else if (strcmp(ln, "maxrss") == 0)
+			ru->maxrss = n;
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_msg_extend()
+ *
+ * format ucrp message
+ */
+void
+ucrp_msg_extend(UCRP *msg, UCRP_EXT *ext)
+{
+	msg->type = UCRP_EXTEND; 
+        msg->options = 0; 
+        msg->length = ucrp_ext_format((char *)UCRP_PAYLOAD(msg),
+				      UCRP_MAX_PAYLOAD, ext);
+
+	return;
+}
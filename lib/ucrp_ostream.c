@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+static int  ostream_stale(UCRP_OSTREAM *);
+static int  ostream_push(UCRP_OSTREAM *);
+static int  ostream_pushbuf(UCRP_OSTREAM *, int);
+static int  ostream_append(UCRP_OSTREAM *, const void *, size_t);
+static int  ostream_readfile(UCRP_OSTREAM *, int, off_t, size_t);
+static void ostream_arm(UCRP_OSTREAM *);
+static void ostream_expire(UCRP_TIMER *, void *);
+
+/*
+ * ucrp_msec()
+ *
+ * returns a monotonic time in milliseconds
+ */
+uint64_t
+ucrp_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * ucrp_channel_ostream()
+ *
+ * returns the channel's output stream, created on first use, or NULL
+ * on error
+ */
+UCRP_OSTREAM *
+ucrp_channel_ostream(UCRP_CHANNEL *cp)
+{
+	UCRP_OSTREAM *os, *old;
+	size_t max;
+
+	if ((os = __atomic_load_n(&cp->os, __ATOMIC_ACQUIRE)) != NULL)
+		return os;
+
+	/* frames as large as the session agreed to, and a '\0' */
+	max = SESS_FRAME(cp->sp);
+	if ((os = calloc(1, sizeof(*os) + UCRP_HDR_SIZE + max + 1)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	os->cp = cp;
+	os->max = max;
+	pthread_mutex_init(&os->lock, NULL);
+	ucrp_timer_init(&os->timer, cp->sp->shard, ostream_expire, os);
+
+	/* a worker and the session's thread may both get here */
+	old = NULL;
+	if (!__atomic_compare_exchange_n(&cp->os, &old, os, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		ucrp_ostream_free(os);
+		os = old;
+	}
+
+	return os;
+}
+
+/*
+ * ostream_stale()
+ *
+ * returns 1 if the command writing is interrupted, its output goes
+ * nowhere
+ */
+static int
+ostream_stale(UCRP_OSTREAM *os)
+{
+	return ucrp_channel_cancelled(os->cp);
+}
+
+/*
+ * ostream_push()
+ *
+ * send the frame, called with the lock held
+ *
+ * returns 0 or -1 on error
+ */
+static int
+ostream_push(UCRP_OSTREAM *os)
+{
+	UCRP *msg = (UCRP *)os->frame;
+	int ret;
+
+	if (msg->length == 0)
+		return 0;
+
+	msg->type = UCRP_DISPLAY;
+	msg->options = 0;
+	if (msg->length > UCRP_MAX_PAYLOAD)
+		ret = ostream_pushbuf(os, 0);
+	else
+		ret = ucrp_session_output(os->cp->sp, os->cp->id, msg);
+	msg->length = 0;
+
+	return ret;
+}
+
+/*
+ * ostream_pushbuf()
+ *
+ * send a frame too large for a post in a buffer of its own, which
+ * the session queues as it is.  it goes by way of the mailbox if
+ * 'post', even from the session's thread.
+ *
+ * returns 0 or -1 on error
+ */
+static int
+ostream_pushbuf(UCRP_OSTREAM *os, int post)
+{
+	UCRP *msg = (UCRP *)os->frame;
+	UCRP_SESSION *sp = os->cp->sp;
+	UCRP_BUF *bp;
+	int ret;
+
+	if ((bp = ucrp_buf_new(UCRP_HDR_SIZE + msg->length)) == NULL)
+		return -1;
+
+	memcpy(bp->data, msg, UCRP_HDR_SIZE + msg->length);
+	if (post) {
+		/* the post takes our reference */
+		if ((ret = ucrp_shard_postptr(sp->shard, POST_FRAME, sp, bp,
+					      os->cp->id)) == 0)
+			return 0;
+	} else
+		ret = ucrp_session_outputframe(sp, os->cp->id, bp);
+	ucrp_buf_rele(bp);
+
+	return ret;
+}
+
+/*
+ * ostream_arm()
+ *
+ * have the session's thread flush a part frame in a while, called
+ * with the lock held
+ */
+static void
+ostream_arm(UCRP_OSTREAM *os)
+{
+	UCRP_SESSION *sp = os->cp->sp;
+
+	if (os->armed || ((UCRP *)os->frame)->length == 0)
+		return;
+
+	os->armed = 1;
+
+	/* unarmed, the next write tries again */
+	if (ucrp_curshard == sp->shard)
+		ucrp_ostream_arm(os);
+	else if (ucrp_shard_post(sp->shard, POST_ARM, sp, os->cp->id, NULL,
+				 NULL) == -1)
+		os->armed = 0;
+
+	return;
+}
+
+/*
+ * ostream_append()
+ *
+ * put 'len' bytes on the stream by way of its filters, called with
+ * the lock held
+ *
+ * returns 0 or -1 on error
+ */
+static int
+ostream_append(UCRP_OSTREAM *os, const void *data, size_t len)
+{
+	if (os->filter != NULL)
+		return ucrp_filter_write(os->filter, os, data, len);
+
+	return ucrp_ostream_put(os, data, len);
+}
+
+/*
+ * ucrp_ostream_put()
+ *
+ * copy 'len' bytes into the frame, sending every frame that fills
+ * up, or to the screen that captures the stream.  called with the
+ * lock held.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_put(UCRP_OSTREAM *os, const void *data, size_t len)
+{
+	UCRP *msg = (UCRP *)os->frame;
+	const uint8_t *p = data;
+	size_t n;
+
+	if (os->capture != NULL)
+		return ucrp_screen_add(os->capture, data, len);
+
+	while (len > 0) {
+		n = os->max - msg->length;
+		if (n > len)
+			n = len;
+
+		memcpy(UCRP_PAYLOAD(msg) + msg->length, p, n);
+		msg->length += n;
+		p += n;
+		len -= n;
+
+		if (msg->length == os->max && ostream_push(os) == -1)
+			return -1;
+	}
+
+	ostream_arm(os);
+
+	return 0;
+}
+
+/*
+ * ucrp_ostream_write()
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_write(UCRP_OSTREAM *os, const void *data, size_t len)
+{
+	int ret;
+
+	if (ostream_stale(os))
+		return 0;
+
+	ucrp_pool_throttle();
+
+	pthread_mutex_lock(&os->lock);
+	ret = ostream_append(os, data, len);
+	pthread_mutex_unlock(&os->lock);
+
+	return ret;
+}
+
+/*
+ * ucrp_ostream_writeraw()
+ *
+ * write past the filters, what they have seen already
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_writeraw(UCRP_OSTREAM *os, const void *data, size_t len)
+{
+	int ret;
+
+	if (ostream_stale(os))
+		return 0;
+
+	ucrp_pool_throttle();
+
+	pthread_mutex_lock(&os->lock);
+	ret = ucrp_ostream_put(os, data, len);
+	pthread_mutex_unlock(&os->lock);
+
+	return ret;
+}
+
+/*
+ * ucrp_ostream_printf()
+ *
+ * format straight into the frame.  only text that runs over the end
+ * of the frame is formatted twice.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_printf(UCRP_OSTREAM *os, const char *fmt, ...)
+{
+	UCRP *msg = (UCRP *)os->frame;
+	char buf[UCRP_MAX_MSGSIZE], *p;
+	va_list ap;
+	size_t room;
+	int n, ret;
+
+	if (ostream_stale(os))
+		return 0;
+
+	ucrp_pool_throttle();
+
+	pthread_mutex_lock(&os->lock);
+
+	/*
+	 * the frame has room for the '\0' after a full payload.  a
+	 * filtered or captured stream always takes the long way.
+	 */
+	room = os->filter != NULL || os->capture != NULL ? 0 :
+	    os->max - msg->length;
+	va_start(ap, fmt);
+	n = vsnprintf((char *)UCRP_PAYLOAD(msg) + msg->length, room + 1,
+		      fmt, ap);
+	va_end(ap);
+
+	if (n < 0) {
+		pthread_mutex_unlock(&os->lock);
+		return -1;
+	}
+
+	if (n <= room) {
+		msg->length += n;
+		ret = 0;
+		if (msg->length == os->max)
+			ret = ostream_push(os);
+		ostream_arm(os);
+		pthread_mutex_unlock(&os->lock);
+		return ret;
+	}
+
+	/* too long, do it again somewhere bigger */
+	p = buf;
+	if (n >= sizeof(buf) && (p = malloc(n + 1)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		pthread_mutex_unlock(&os->lock);
+		return -1;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(p, n + 1, fmt, ap);
+	va_end(ap);
+
+	ret = ostream_append(os, p, n);
+	pthread_mutex_unlock(&os->lock);
+
+	if (p != buf)
+		free(p);
+
+	return ret;
+}
+
+/*
+ * ucrp_ostream_putc()
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_putc(UCRP_OSTREAM *os, int c)
+{
+	char ch = c;
+
+	return ucrp_ostream_write(os, &ch, 1);
+}
+
+/*
+ * ucrp_ostream_sendfile()
+ *
+ * send 'len' bytes of file 'fd' from 'off', or all of it from there
+ * if 'len' is 0.  the file is mapped and written to the client from
+ * the mapping as the connection takes it, and may be closed once
+ * this returns.  it must not be truncated while it is sent.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_sendfile(UCRP_OSTREAM *os, int fd, off_t off, size_t len)
+{
+	UCRP_FILEBUF *fb;
+	struct stat st;
+	int ret;
+
+	if (ostream_stale(os))
+		return 0;
+
+	if (fstat(fd, &st) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	if (off >= st.st_size)
+		return 0;
+	if (len == 0 || len > st.st_size - off)
+		len = st.st_size - off;
+
+	pthread_mutex_lock(&os->lock);
+	if (os->filter != NULL || os->capture != NULL) {
+		ret = ostream_readfile(os, fd, off, len);
+		pthread_mutex_unlock(&os->lock);
+		return ret;
+	}
+	pthread_mutex_unlock(&os->lock);
+
+	if ((fb = ucrp_filebuf_new(fd, off, len, os->max)) == NULL)
+		return -1;
+
+	ucrp_pool_throttle();
+
+	/* what was written before goes first */
+	pthread_mutex_lock(&os->lock);
+	if ((ret = ostream_push(os)) == 0)
+		ret = ucrp_session_outputfile(os->cp->sp, os->cp->id, fb);
+	pthread_mutex_unlock(&os->lock);
+
+	ucrp_buf_rele(&fb->buf);
+
+	return ret;
+}
+
+/*
+ * ostream_readfile()
+ *
+ * read the file through the filters or to the screen instead of
+ * sending it from a mapping, called with the lock held
+ *
+ * returns 0 or -1 on error
+ */
+static int
+ostream_readfile(UCRP_OSTREAM *os, int fd, off_t off, size_t len)
+{
+	char buf[8192];
+	ssize_t n;
+
+	while (len > 0) {
+		/* interrupted, or the filters let no more through */
+		if (ostream_stale(os) ||
+		    (os->filter != NULL && os->filter->done &&
+		     os->filter->keep == -1))
+			break;
+
+		n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf),
+			  off);
+		if (n == -1) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+		if (n == 0)
+			break;
+
+		if (ostream_append(os, buf, n) == -1)
+			return -1;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_ostream_flush()
+ *
+ * send what is in the frame now
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_ostream_flush(UCRP_OSTREAM *os)
+{
+	int ret;
+
+	pthread_mutex_lock(&os->lock);
+	ret = ostream_push(os);
+	pthread_mutex_unlock(&os->lock);
+
+	return ret;
+}
+
+/*
+ * ucrp_ostream_arm()
+ *
+ * start the deadline, on the session's thread
+ */
+void
+ucrp_ostream_arm(UCRP_OSTREAM *os)
+{
+	if (!ucrp_timer_pending(&os->timer))
+		ucrp_timer_set(&os->timer, OSTREAM_DELAY);
+
+	return;
+}
+
+/*
+ * ostream_expire()
+ *
+ * the deadline has passed, send the part frame
+ */
+static void
+ostream_expire(UCRP_TIMER *tm, void *arg)
+{
+	UCRP_OSTREAM *os = arg;
+	UCRP *msg = (UCRP *)os->frame;
+	UCRP_SESSION *sp = os->cp->sp;
+	UCRP_JOB *job;
+	int ret;
+
+	pthread_mutex_lock(&os->lock);
+	os->armed = 0;
+
+	/* nothing of an interrupted command goes out */
+	job = TAILQ_FIRST(&os->cp->jobs);
+	if (job != NULL && __atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE))
+		msg->length = 0;
+
+	/*
+	 * frames a worker sent before may still be in the mailbox, the
+	 * part frame goes in behind them rather than ahead
+	 */
+	if (msg->length > 0) {
+		msg->type = UCRP_DISPLAY;
+		msg->options = 0;
+		if (msg->length > UCRP_MAX_PAYLOAD)
+			ret = ostream_pushbuf(os, 1);
+		else
+			ret = ucrp_shard_post(sp->shard, POST_MSG, sp,
+					      os->cp->id, NULL, msg);
+
+		/* kept for another try in a while */
+		if (ret == -1) {
+			os->armed = 1;
+			ucrp_timer_set(tm, OSTREAM_DELAY);
+		} else
+			msg->length = 0;
+	}
+	pthread_mutex_unlock(&os->lock);
+
+	return;
+}
+
+/*
+ * ucrp_ostream_discard()
+ *
+ * throw away the part frame, the channel was interrupted
+ */
+void
+ucrp_ostream_discard(UCRP_OSTREAM *os)
+{
+	pthread_mutex_lock(&os->lock);
+	((UCRP *)os->frame)->length = 0;
+	pthread_mutex_unlock(&os->lock);
+
+	return;
+}
+
+/*
+ * ucrp_ostream_free()
+ *
+ * free a stream, cancelling its deadline
+ */
+void
+ucrp_ostream_free(UCRP_OSTREAM *os)
+{
+	if (ucrp_timer_pending(&os->timer))
+		ucrp_timer_cancel(&os->timer);
+
+	if (os->filter != NULL)
+		ucrp_filter_free(os->filter);
+	pthread_mutex_destroy(&os->lock);
+	free(os);
+
+	return;
+}
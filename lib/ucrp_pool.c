@@ -0,0 +1,672 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * command worker pool
+ *
+ * commands are run by a fixed set of worker threads so that a slow
+ * handler never holds up an io thread.  every worker has its own job
+ * queue; io threads deal jobs out round robin and a worker that runs
+ * dry steals from the others.  whatever a handler sends is posted back
+ * to the session's io thread through that thread's lock-free mailbox.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+static void     *worker_main(void *);
+static UCRP_JOB *worker_pop(UCRP_WORKER *);
+static UCRP_JOB *pool_take(UCRP_WORKER *);
+static void      pool_done(UCRP_JOB *);
+static UCRP_POST *post_get(size_t);
+static void       post_put(UCRP_POST *);
+static void       shard_push(UCRP_SHARD *, UCRP_POST *);
+
+__thread UCRP_JOB *ucrp_curjob;
+static __thread UCRP_WORKER *curworker;
+
+/*
+ * ucrp_mpsc_init()
+ */
+void
+ucrp_mpsc_init(UCRP_MPSC *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+
+	return;
+}
+
+/*
+ * ucrp_mpsc_push()
+ *
+ * append 'n' to the queue, safe from any number of threads
+ */
+void
+ucrp_mpsc_push(UCRP_MPSC *q, UCRP_MPSC_NODE *n)
+{
+	UCRP_MPSC_NODE *prev;
+
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	/* the queue is briefly cut here, see ucrp_mpsc_pop() */
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+
+	return;
+}
+
+/*
+ * ucrp_mpsc_pop()
+ *
+ * take the oldest node off the queue, consumer only.  '*busy' is set
+ * if a producer is half way through a push and the caller should
+ * try again shortly.
+ *
+ * returns the node or NULL if there is none
+ */
+UCRP_MPSC_NODE *
+ucrp_mpsc_pop(UCRP_MPSC *q, int *busy)
+{
+	UCRP_MPSC_NODE *tail, *next, *head;
+
+	*busy = 0;
+
+	tail = q->tail;
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == NULL)
+			goto empty;
+		q->tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* tail is the last node, put the stub behind it to take it */
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail != head) {
+		*busy = 1;
+		return NULL;
+	}
+
+	ucrp_mpsc_push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	*busy = 1;
+	return NULL;
+
+empty:
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	*busy = (head != tail);
+	return NULL;
+}
+
+/*
+ * post_get()
+ *
+ * returns a post with room for a 'len' byte payload or NULL on error.
+ * a worker reuses the posts it made before, which the io threads hand
+ * back once they are done with them.
+ */
+static UCRP_POST *
+post_get(size_t len)
+{
+	UCRP_WORKER *wp = curworker;
+	UCRP_MPSC_NODE *n;
+	UCRP_POST *pp;
+	int busy;
+
+	if (wp != NULL) {
+		if ((n = wp->spare) != NULL) {
+			wp->spare = n->next;
+			return (UCRP_POST *)n;
+		}
+
+		if ((n = ucrp_mpsc_pop(&wp->spares, &busy)) != NULL)
+			return (UCRP_POST *)n;
+
+		if (wp->nposts < POST_KEEP) {
+			if ((pp = malloc(POST_SIZE)) != NULL) {
+				pp->owner = wp;
+				wp->nposts++;
+			}
+			goto out;
+		}
+	}
+
+	if ((pp = malloc(sizeof(*pp) + len)) != NULL)
+		pp->owner = NULL;
+
+out:
+	if (pp == NULL)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+
+	return pp;
+}
+
+/*
+ * ucrp_pool_throttle()
+ *
+ * called by a worker before it sends, outside any lock.  a worker
+ * with all of its POST_KEEP posts out waits here for one to come
+ * back, so a command can't run ahead of its session's thread by more
+ * than that.
+ */
+void
+ucrp_pool_throttle(void)
+{
+	UCRP_WORKER *wp = curworker;
+	UCRP_MPSC_NODE *n;
+	int busy;
+
+	if (wp == NULL || wp->spare != NULL || wp->nposts < POST_KEEP)
+		return;
+
+	while ((n = ucrp_mpsc_pop(&wp->spares, &busy)) == NULL) {
+		/* the io threads are not draining when the pool stops */
+		if (__atomic_load_n(&wp->pool->stop, __ATOMIC_ACQUIRE))
+			return;
+		usleep(POST_WAIT);
+	}
+
+	n->next = wp->spare;
+	wp->spare = n;
+
+	return;
+}
+
+/*
+ * post_put()
+ *
+ * give a drained post back to the worker that made it
+ */
+static void
+post_put(UCRP_POST *pp)
+{
+	if (pp->owner != NULL)
+		ucrp_mpsc_push(&pp->owner->spares, &pp->node);
+	else
+		free(pp);
+
+	return;
+}
+
+/*
+ * ucrp_shard_post()
+ *
+ * hand work to the io thread of shard 'shp': queue 'msg' on channel
+ * 'chan' of 'sp', close 'sp', or retire 'job', depending on 'kind'.
+ * safe from any thread.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_shard_post(UCRP_SHARD *shp, int kind, UCRP_SESSION *sp, int chan,
+		UCRP_JOB *job, UCRP *msg)
+{
+	UCRP_POST *pp;
+	size_t len;
+
+	len = msg != NULL ? msg->length : 0;
+	if ((pp = post_get(len)) == NULL)
+		return -1;
+
+	pp->kind = kind;
+	pp->sp = sp;
+	pp->chan = chan;
+	pp->job = job;
+	pp->ptr = NULL;
+	if (msg != NULL)
+		memcpy(&pp->msg, msg, UCRP_HDR_SIZE + len);
+
+	shard_push(shp, pp);
+
+	return 0;
+}
+
+/*
+ * ucrp_shard_postptr()
+ *
+ * hand 'ptr', a buffer and the reference to it or a timer, to the io
+ * thread of shard 'shp' along with 'arg'.  like ucrp_shard_post() it
+ * is tagged with the command of the session posting it, if any.
+ * safe from any thread.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_shard_postptr(UCRP_SHARD *shp, int kind, UCRP_SESSION *sp, void *ptr,
+		   int arg)
+{
+	UCRP_POST *pp;
+
+	if ((pp = post_get(0)) == NULL)
+		return -1;
+
+	pp->kind = kind;
+	pp->sp = sp;
+	pp->chan = arg;
+	pp->job = ucrp_curjob;
+	if (pp->job != NULL && pp->job->cp->sp != sp)
+		pp->job = NULL;
+	pp->ptr = ptr;
+
+	shard_push(shp, pp);
+
+	return 0;
+}
+
+/*
+ * shard_push()
+ *
+ * put a post in the shard's mailbox and wake it if need be
+ */
+static void
+shard_push(UCRP_SHARD *shp, UCRP_POST *pp)
+{
+	ucrp_mpsc_push(&shp->mbox, &pp->node);
+	if (curworker != NULL)
+		STATS_ADD(curworker->stats->posted, 1);
+
+	/* one wakeup is enough for any number of posts */
+	if (__atomic_exchange_n(&shp->wakeflag, 1, __ATOMIC_ACQ_REL) == 0)
+		ucrp_shard_wake(shp);
+
+	return;
+}
+
+/*
+ * ucrp_shard_drain()
+ *
+ * carry out everything posted to the shard, on its own thread
+ */
+void
+ucrp_shard_drain(UCRP_SHARD *shp)
+{
+	UCRP_CHANNEL *cp;
+	UCRP_POST *pp;
+	int busy;
+
+	__atomic_store_n(&shp->wakeflag, 0, __ATOMIC_SEQ_CST);
+
+	while ((pp = (UCRP_POST *)ucrp_mpsc_pop(&shp->mbox, &busy)) != NULL) {
+		switch (pp->kind) {
+		case POST_MSG:
+			/* output of an interrupted command goes nowhere */
+			if ((pp->sp->flags & SESS_GONE) == 0 &&
+			    (pp->job == NULL || pp->job->cancel == 0))
+				ucrp_session_queue(pp->sp, pp->chan, &pp->msg);
+			break;
+		case POST_CLOSE:
+			if ((pp->sp->flags & SESS_GONE) == 0)
+				ucrp_session_close(pp->sp);
+			break;
+		case POST_DONE:
+			ucrp_session_done(pp->job);
+			break;
+		case POST_ARM:
+			if ((pp->sp->flags & SESS_GONE) == 0 &&
+			    (cp = ucrp_session_channel(pp->sp,
+						       pp->chan)) != NULL &&
+			    cp->os != NULL)
+				ucrp_ostream_arm(cp->os);
+			break;
+		case POST_EVENT:
+			ucrp_bus_deliver(shp, pp->ptr);
+			ucrp_buf_rele(pp->ptr);
+			break;
+		case POST_SUBSCRIBE:
+			if ((pp->sp->flags & SESS_GONE) == 0)
+				ucrp_bus_subscribe(pp->sp, pp->chan,
+				    pp->msg.options - 1,
+				    (char *)UCRP_PAYLOAD(&pp->msg));
+			break;
+		case POST_TIMER:
+			if (pp->sp != NULL && (pp->sp->flags & SESS_GONE))
+				break;
+			if (pp->chan < 0)
+				ucrp_timer_cancel(pp->ptr);
+			else
+				ucrp_timer_set(pp->ptr, pp->chan);
+			break;
+		case POST_FILE:
+			if ((pp->sp->flags & SESS_GONE) == 0 &&
+			    (pp->job == NULL || pp->job->cancel == 0))
+				ucrp_session_queuefile(pp->sp, pp->chan,
+						       pp->ptr);
+			ucrp_buf_rele(pp->ptr);
+			break;
+		case POST_FRAME:
+			if ((pp->sp->flags & SESS_GONE) == 0 &&
+			    (pp->job == NULL || pp->job->cancel == 0))
+				ucrp_session_queueframe(pp->sp, pp->chan,
+							pp->ptr);
+			ucrp_buf_rele(pp->ptr);
+			break;
+		}
+		post_put(pp);
+		STATS_ADD(shp->stats->drained, 1);
+	}
+
+	/* a producer was mid push, come back for it */
+	if (busy &&
+	    __atomic_exchange_n(&shp->wakeflag, 1, __ATOMIC_ACQ_REL) == 0)
+		ucrp_shard_wake(shp);
+
+	return;
+}
+
+/*
+ * ucrp_pool_new()
+ *
+ * returns a pool of 'n' workers for 'srv', not yet running, or NULL
+ * on error
+ */
+UCRP_POOL *
+ucrp_pool_new(UCRP_SERVER *srv, int n)
+{
+	UCRP_POOL *pool;
+	int i;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL ||
+	    (pool->workers = calloc(n, sizeof(UCRP_WORKER))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(pool);
+		return NULL;
+	}
+
+	pool->srv = srv;
+	pool->nworkers = n;
+	pthread_mutex_init(&pool->idlelock, NULL);
+	pthread_cond_init(&pool->idlecv, NULL);
+
+	for (i = 0; i < n; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		TAILQ_INIT(&pool->workers[i].jobs);
+		ucrp_mpsc_init(&pool->workers[i].spares);
+	}
+
+	return pool;
+}
+
+/*
+ * ucrp_pool_start()
+ *
+ * start the worker threads with all signals blocked
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_pool_start(UCRP_POOL *pool)
+{
+	sigset_t all, old;
+	int i, ret;
+
+	pool->stop = 0;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		ret = pthread_create(&pool->workers[i].thread, NULL,
+				     worker_main, &pool->workers[i]);
+		if (ret != 0) {
+			ucrp_log(LOG_ERR, "%s: %s\n", __func__,
+				 strerror(ret));
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (i < pool->nworkers) {
+		pool->nworkers = i;
+		ucrp_pool_stop(pool);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_pool_stop()
+ *
+ * wait for the running commands to finish and stop the workers.
+ * commands that never started are retired without running.
+ */
+void
+ucrp_pool_stop(UCRP_POOL *pool)
+{
+	UCRP_JOB *job;
+	int i;
+
+	pthread_mutex_lock(&pool->idlelock);
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->idlecv);
+	pthread_mutex_unlock(&pool->idlelock);
+
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	/* one that was to run again still has to free its argument */
+	for (i = 0; i < pool->nworkers; i++)
+		while ((job = worker_pop(&pool->workers[i])) != NULL) {
+			job->cancel = 1;
+			job->again = job->fn != NULL;
+			pool_done(job);
+		}
+
+	return;
+}
+
+/*
+ * ucrp_pool_free()
+ */
+void
+ucrp_pool_free(UCRP_POOL *pool)
+{
+	UCRP_MPSC_NODE *n;
+	int i, busy;
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		while ((n = ucrp_mpsc_pop(&pool->workers[i].spares,
+					  &busy)) != NULL)
+			free(n);
+		while ((n = pool->workers[i].spare) != NULL) {
+			pool->workers[i].spare = n->next;
+			free(n);
+		}
+	}
+
+	pthread_cond_destroy(&pool->idlecv);
+	pthread_mutex_destroy(&pool->idlelock);
+	free(pool->workers);
+	free(pool);
+
+	return;
+}
+
+/*
+ * ucrp_pool_submit()
+ *
+ * queue 'job' on the next worker in 'shp's rotation.  once the pool
+ * has stopped no worker would take it, so it is retired the way
+ * ucrp_pool_stop() retires the ones that never started.
+ */
+void
+ucrp_pool_submit(UCRP_POOL *pool, UCRP_SHARD *shp, UCRP_JOB *job)
+{
+	UCRP_WORKER *wp;
+
+	/* the next on a channel, or from the admit queue, as we drain */
+	if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+		job->cancel = 1;
+		job->again = job->fn != NULL;
+		pool_done(job);
+		return;
+	}
+
+	wp = &pool->workers[shp->nextworker++ % pool->nworkers];
+
+	pthread_mutex_lock(&wp->lock);
+	TAILQ_INSERT_TAIL(&wp->jobs, job, poolent);
+	pthread_mutex_unlock(&wp->lock);
+
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+	/* taken so a worker can't miss this between its check and sleep */
+	pthread_mutex_lock(&pool->idlelock);
+	if (pool->nidle > 0)
+		pthread_cond_signal(&pool->idlecv);
+	pthread_mutex_unlock(&pool->idlelock);
+
+	return;
+}
+
+/*
+ * worker_pop()
+ *
+ * returns the oldest job on 'wp's queue or NULL if it is empty
+ */
+static UCRP_JOB *
+worker_pop(UCRP_WORKER *wp)
+{
+	UCRP_JOB *job;
+
+	pthread_mutex_lock(&wp->lock);
+	if ((job = TAILQ_FIRST(&wp->jobs)) != NULL) {
+		TAILQ_REMOVE(&wp->jobs, job, poolent);
+		__atomic_sub_fetch(&wp->pool->pending, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&wp->lock);
+
+	return job;
+}
+
+/*
+ * pool_take()
+ *
+ * returns the next job for worker 'wp', from its own queue or stolen
+ * from another worker's, sleeping until there is one.  returns NULL
+ * when the pool is stopping.
+ */
+static UCRP_JOB *
+pool_take(UCRP_WORKER *wp)
+{
+	UCRP_POOL *pool = wp->pool;
+	UCRP_JOB *job;
+	int i;
+
+	for (;;) {
+		if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		if ((job = worker_pop(wp)) != NULL)
+			return job;
+
+		for (i = 1; i < pool->nworkers; i++) {
+			job = worker_pop(&pool->workers[(wp->id + i) %
+							pool->nworkers]);
+			if (job != NULL)
+				return job;
+		}
+
+		pthread_mutex_lock(&pool->idlelock);
+		while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 &&
+		       !pool->stop) {
+			pool->nidle++;
+			pthread_cond_wait(&pool->idlecv, &pool->idlelock);
+			pool->nidle--;
+		}
+		pthread_mutex_unlock(&pool->idlelock);
+	}
+
+	/* NOTREACHED */
+}
+
+/*
+ * pool_done()
+ *
+ * tell the session's io thread that 'job' is finished
+ */
+static void
+pool_done(UCRP_JOB *job)
+{
+	UCRP_SESSION *sp = job->cp->sp;
+
+	/*
+	 * if even this small allocation fails the session is stuck
+	 * with a busy channel, there is nothing better to do.
+	 */
+	ucrp_shard_post(sp->shard, POST_DONE, sp, job->cp->id, job, NULL);
+
+	return;
+}
+
+/*
+ * worker_main()
+ *
+ * worker thread start routine
+ */
+static void *
+worker_main(void *arg)
+{
+	UCRP_WORKER *wp = arg;
+	UCRP_SERVER *srv = wp->pool->srv;
+	UCRP_OSTREAM *os;
+	UCRP_JOB *job;
+	uint64_t start;
+
+	curworker = wp;
+
+	while ((job = pool_take(wp)) != NULL) {
+		ucrp_curjob = job;
+		start = ucrp_usec();
+		if (job->fn != NULL)
+			job->fn(job->cp, job->arg);
+		else
+			srv->cb.command(job->cp, &job->rm);
+		ucrp_stats_command(wp->stats, start);
+		if ((os = __atomic_load_n(&job->cp->os,
+					  __ATOMIC_ACQUIRE)) != NULL)
+			ucrp_ostream_flush(os);
+		if (job->cp->arena != NULL)
+			ucrp_arena_reset(job->cp->arena);
+		ucrp_curjob = NULL;
+		pool_done(job);
+	}
+
+	return NULL;
+}
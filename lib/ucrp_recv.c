@@ -19,6 +19,7 @@
 
 #include <errno.h> 
 #include <stdio.h> 
+#include <stdlib.h>
 #include <string.h>
 
 #include <ucrp.h>
@@ -78,3 +79,73 @@ ucrp_recv(int s, UCRP *msg)
 
 	return done;
 }
+
+/*
+ * ucrp_recvalloc()
+ *
+ * ucrp_recv() into a buffer that grows to fit, for peers that agreed
+ * to UCRP_EXT_MAXMSG.  '*msgp' is a malloc()ed buffer of '*sizep'
+ * bytes, or NULL, and is replaced by a larger one, never smaller
+ * than UCRP_MAX_MSGSIZE, when a message does not fit.  the payload
+ * is always followed by a '\0'.
+ *
+ * returns the number of bytes received or -1 on error.
+ */
+ssize_t
+ucrp_recvalloc(int s, UCRP **msgp, size_t *sizep)
+{
+	UCRP hdr, *msg;
+	ssize_t ret;
+	uint32_t todo, done;
+	size_t size;
+
+	/* read headers */
+	done = 0;
+	todo = UCRP_HDR_SIZE;
+	while (done != todo) {
+		ret = recv(s, (uint8_t *)&hdr + done, todo - done, 0);
+		UCRP_DEBUG((LOG_DEBUG, "%s: ret=%d todo=%u done=%u\n",
+			    __func__, ret, todo, done));
+
+		if (ret < 1)
+			return ret;
+
+		done += ret;
+	}
+
+	ucrp_msg_ntoh(&hdr);
+
+	/* make room for the payload */
+	size = UCRP_HDR_SIZE + hdr.length + 1;
+	if (*msgp == NULL || *sizep < size) {
+		if (size < UCRP_MAX_MSGSIZE)
+			size = UCRP_MAX_MSGSIZE;
+		if ((msg = realloc(*msgp, size)) == NULL) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+		*msgp = msg;
+		*sizep = size;
+	}
+	msg = *msgp;
+	memcpy(msg, &hdr, UCRP_HDR_SIZE);
+
+	/* read payload */
+	todo += msg->length;
+	while (done != todo) {
+		ret = recv(s, (uint8_t *)msg + done, todo - done, 0);
+		UCRP_DEBUG((LOG_DEBUG, "%s: ret=%d todo=%u done=%u\n",
+			    __func__, ret, todo, done));
+
+		if (ret < 1)
+			return ret;
+
+		done += ret;
+	}
+	UCRP_PAYLOAD(msg)[msg->length] = '\0';
+
+	UCRP_DEBUG((LOG_DEBUG, "%s: todo=%u done=%u\n", __func__, todo, done));
+
+	return done;
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+static int  screen_lines(SCREEN_TEXT *);
+static const char *screen_line(SCREEN_TEXT *, unsigned int, size_t *);
+static int  screen_same(UCRP_SCREEN *, unsigned int);
+static int  screen_send(UCRP_SCREEN *, uint16_t, unsigned int,
+			unsigned int);
+static int  screen_update(UCRP_SCREEN *);
+static int  screen_display(UCRP_SCREEN *);
+
+/*
+ * ucrp_channel_screen()
+ *
+ * returns a new screen for the channel or NULL on error
+ */
+UCRP_SCREEN *
+ucrp_channel_screen(UCRP_CHANNEL *cp)
+{
+	UCRP_SCREEN *sc;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	sc->cp = cp;
+	sc->native = (ucrp_session_ext(cp->sp)->flags & UCRP_EXT_UPDATE) != 0;
+
+	return sc;
+}
+
+/*
+ * ucrp_screen_begin()
+ *
+ * keep what is written to the channel's stream from now on.  what
+ * was written before is sent first.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_screen_begin(UCRP_SCREEN *sc)
+{
+	UCRP_OSTREAM *os;
+
+	if ((os = ucrp_channel_ostream(sc->cp)) == NULL ||
+	    ucrp_ostream_flush(os) == -1)
+		return -1;
+
+	pthread_mutex_lock(&os->lock);
+	if (os->capture != NULL) {
+		pthread_mutex_unlock(&os->lock);
+		errno = EBUSY;
+		return -1;
+	}
+	sc->cur.len = 0;
+	sc->cur.nlines = 0;
+	os->capture = sc;
+	pthread_mutex_unlock(&os->lock);
+
+	return 0;
+}
+
+/*
+ * ucrp_screen_add()
+ *
+ * keep 'len' more bytes of output, called with the stream's lock
+ * held.  what doesn't fit in SCREEN_MAXSIZE is dropped.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_screen_add(UCRP_SCREEN *sc, const void *data, size_t len)
+{
+	SCREEN_TEXT *t = &sc->cur;
+	size_t size;
+	char *p;
+
+	if (len > SCREEN_MAXSIZE - t->len)
+		len = SCREEN_MAXSIZE - t->len;
+	if (len == 0)
+		return 0;
+
+	if (t->len + len > t->size) {
+		size = t->size ? t->size * 2 : 4096;
+		while (size < t->len + len)
+			size *= 2;
+		if ((p = realloc(t->data, size)) == NULL) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+		t->data = p;
+		t->size = size;
+	}
+
+	memcpy(t->data + t->len, data, len);
+	t->len += len;
+
+	return 0;
+}
+
+/*
+ * ucrp_screen_end()
+ *
+ * stop keeping the stream's output and bring the client's screen up
+ * to date with it
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_screen_end(UCRP_SCREEN *sc)
+{
+	UCRP_OSTREAM *os;
+	SCREEN_TEXT t;
+	int ret;
+
+	if ((os = ucrp_channel_ostream(sc->cp)) == NULL)
+		return -1;
+
+	/* the filters start over with every run */
+	pthread_mutex_lock(&os->lock);
+	if (os->filter != NULL && os->capture == sc)
+		ucrp_filter_finish(os->filter, os);
+	if (os->capture == sc)
+		os->capture = NULL;
+	pthread_mutex_unlock(&os->lock);
+
+	/* the run is over, like a callback returning */
+	if (sc->cp->arena != NULL)
+		ucrp_arena_reset(sc->cp->arena);
+
+	if (ucrp_channel_cancelled(sc->cp))
+		return 0;
+
+	if (screen_lines(&sc->cur) == -1)
+		return -1;
+
+	if (sc->native)
+		ret = screen_update(sc);
+	else
+		ret = screen_display(sc);
+	if (ret == -1)
+		return -1;
+
+	/* what was sent is what the next run is compared with */
+	t = sc->old;
+	sc->old = sc->cur;
+	sc->cur = t;
+	sc->drawn = 1;
+
+	return 0;
+}
+
+/*
+ * screen_lines()
+ *
+ * find where the lines of 't' start, a last line may lack its '\n'
+ *
+ * returns 0 or -1 on error
+ */
+static int
+screen_lines(SCREEN_TEXT *t)
+{
+	unsigned int max;
+	size_t *p, off;
+	char *nl;
+
+	t->nlines = 0;
+	for (off = 0; off < t->len; off = nl - t->data + 1) {
+		if (t->nlines == t->maxlines) {
+			max = t->maxlines ? t->maxlines * 2 : 256;
+			if ((p = realloc(t->line, max * sizeof(*p))) == NULL) {
+				ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+					 strerror(errno));
+				return -1;
+			}
+			t->line = p;
+			t->maxlines = max;
+		}
+		t->line[t->nlines++] = off;
+
+		if ((nl = memchr(t->data + off, '\n', t->len - off)) == NULL)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * screen_line()
+ *
+ * returns the start of line 'i' of 't', its length without the '\n'
+ * in 'len'
+ */
+static const char *
+screen_line(SCREEN_TEXT *t, unsigned int i, size_t *len)
+{
+	size_t end;
+
+	end = i + 1 < t->nlines ? t->line[i + 1] : t->len;
+	*len = end - t->line[i];
+	if (*len > 0 && t->data[end - 1] == '\n')
+		(*len)--;
+
+	return t->data + t->line[i];
+}
+
+/*
+ * screen_same()
+ *
+ * returns 1 if line 'i' is what the client shows already
+ */
+static int
+screen_same(UCRP_SCREEN *sc, unsigned int i)
+{
+	const char *a, *b;
+	size_t alen, blen;
+
+	if (i >= sc->old.nlines || i >= sc->cur.nlines)
+		return 0;
+
+	a = screen_line(&sc->old, i, &alen);
+	b = screen_line(&sc->cur, i, &blen);
+
+	return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+/*
+ * screen_send()
+ *
+ * send lines 'first' up to 'last' of the run in as few UCRP_UPDATEs
+ * as they fit.  a line too long for a message of its own is cut.
+ *
+ * returns 0 or -1 on error
+ */
+static int
+screen_send(UCRP_SCREEN *sc, uint16_t opts, unsigned int first,
+	    unsigned int last)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	unsigned int i, total;
+	const char *p;
+	size_t n, hdr;
+
+	total = sc->cur.nlines;
+	ucrp_msg_update(sm, opts, first, total);
+	hdr = sm->length;
+
+	for (i = first; i < last; i++) {
+		p = screen_line(&sc->cur, i, &n);
+
+		/* start another message, without the options */
+		if (sm->length + n + 1 > UCRP_MAX_PAYLOAD &&
+		    sm->length > hdr) {
+			if (ucrp_channel_send(sc->cp, sm) == -1)
+				return -1;
+			ucrp_msg_update(sm, 0, i, total);
+			hdr = sm->length;
+		}
+
+		if (sm->length + n + 1 > UCRP_MAX_PAYLOAD)
+			n = UCRP_MAX_PAYLOAD - sm->length - 1;
+
+		memcpy(UCRP_PAYLOAD(sm) + sm->length, p, n);
+		sm->length += n;
+		UCRP_PAYLOAD(sm)[sm->length++] = '\n';
+	}
+
+	return ucrp_channel_send(sc->cp, sm);
+}
+
+/*
+ * screen_update()
+ *
+ * send the client each run of lines that changed, all of them the
+ * first time
+ *
+ * returns 0 or -1 on error
+ */
+static int
+screen_update(UCRP_SCREEN *sc)
+{
+	unsigned int i, first;
+	int sent;
+
+	if (!sc->drawn)
+		return screen_send(sc, UPDATE_CLEAR, 0, sc->cur.nlines);
+
+	sent = 0;
+	for (i = 0; i < sc->cur.nlines; i++) {
+		if (screen_same(sc, i))
+			continue;
+
+		for (first = i; i < sc->cur.nlines; i++)
+			if (screen_same(sc, i))
+				break;
+		if (screen_send(sc, 0, first, i) == -1)
+			return -1;
+		sent = 1;
+	}
+
+	/* fewer lines, the client clears the rest */
+	if (!sent && sc->cur.nlines < sc->old.nlines)
+		return screen_send(sc, 0, sc->cur.nlines, sc->cur.nlines);
+
+	return 0;
+}
+
+/*
+ * screen_display()
+ *
+ * for a client that can't update its screen, send all of it again
+ * if anything changed, a blank line apart from the last
+ *
+ * returns 0 or -1 on error
+ */
+static int
+screen_display(UCRP_SCREEN *sc)
+{
+	UCRP_OSTREAM *os;
+
+	if (sc->drawn && sc->cur.len == sc->old.len &&
+	    memcmp(sc->cur.data, sc->old.data, sc->cur.len) == 0)
+		return 0;
+
+	if ((os = ucrp_channel_ostream(sc->cp)) == NULL)
+		return -1;
+
+	/* the capture went through the filters already */
+	if (sc->drawn && ucrp_ostream_writeraw(os, "\n", 1) == -1)
+		return -1;
+	if (sc->cur.len > 0 &&
+	    ucrp_ostream_writeraw(os, sc->cur.data, sc->cur.len) == -1)
+		return -1;
+
+	return ucrp_ostream_flush(os);
+}
+
+/*
+ * ucrp_screen_free()
+ */
+void
+ucrp_screen_free(UCRP_SCREEN *sc)
+{
+	UCRP_OSTREAM *os;
+
+	if ((os = __atomic_load_n(&sc->cp->os, __ATOMIC_ACQUIRE)) != NULL) {
+		pthread_mutex_lock(&os->lock);
+		if (os->capture == sc)
+			os->capture = NULL;
+		pthread_mutex_unlock(&os->lock);
+	}
+
+	free(sc->old.data);
+	free(sc->old.line);
+	free(sc->cur.data);
+	free(sc->cur.line);
+	free(sc);
+
+	return;
+}
@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+#define SERVER_MAXEVENTS 64
+
+__thread UCRP_SHARD *ucrp_curshard;
+
+static int   shard_init(UCRP_SERVER *, UCRP_SHARD *, int);
+static void  shard_free(UCRP_SHARD *);
+static void  shard_flush(UCRP_SHARD *);
+static int   shard_run(UCRP_SHARD *);
+static void  shard_gauges(UCRP_SHARD *);
+static void  shard_pin(UCRP_SHARD *);
+static void *shard_main(void *);
+static void  wake_handler(UCRP_EV *, uint32_t);
+static int   server_setshards(UCRP_SERVER *, int);
+
+/*
+ * ucrp_server_new()
+ *
+ * returns a new single threaded server using the callbacks in 'cb'
+ * or NULL on error
+ */
+UCRP_SERVER *
+ucrp_server_new(UCRP_CALLBACKS *cb)
+{
+	UCRP_SERVER *srv;
+
+	if ((srv = calloc(1, sizeof(*srv))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	srv->cb = *cb;
+	srv->extensions = UCRP_EXT_CHANNELS | UCRP_EXT_COLUMNS |
+		UCRP_EXT_BATCH | UCRP_EXT_MAXMSG | UCRP_EXT_TABLES |
+		UCRP_EXT_UPDATE;
+	if (cb->interrupt != NULL)
+		srv->extensions |= UCRP_EXT_INTERRUPT;
+
+	if (server_setshards(srv, 1) == -1) {
+		free(srv);
+		return NULL;
+	}
+
+	return srv;
+}
+
+/*
+ * server_setshards()
+ *
+ * replace the server's shards with 'n' new ones
+ *
+ * returns 0 or -1 on error
+ */
+static int
+server_setshards(UCRP_SERVER *srv, int n)
+{
+	UCRP_SHARD *shards;
+	int i;
+
+	if ((shards = calloc(n, sizeof(*shards))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (shard_init(srv, &shards[i], i) == -1) {
+			while (--i >= 0)
+				shard_free(&shards[i]);
+			free(shards);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < srv->nshards; i++)
+		shard_free(&srv->shards[i]);
+	free(srv->shards);
+
+	srv->shards = shards;
+	srv->nshards = n;
+
+	return 0;
+}
+
+/*
+ * ucrp_server_setthreads()
+ *
+ * run the server on 'n' threads, or one per online cpu if 'n' is 0.
+ * every thread has its own event loop, listening sockets and sessions.
+ * if 'pin' is set each thread is bound to its own cpu.  must be called
+ * before any listeners are added.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_setthreads(UCRP_SERVER *srv, int n, int pin)
+{
+	int i;
+
+	for (i = 0; i < srv->nshards; i++) {
+		if (!LIST_EMPTY(&srv->shards[i].listeners) ||
+		    !LIST_EMPTY(&srv->shards[i].sessions)) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(EBUSY));
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	if (n < 1 && (n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+
+	if (n != srv->nshards && server_setshards(srv, n) == -1)
+		return -1;
+
+	if (pin)
+		srv->flags |= SRV_PIN;
+	else
+		srv->flags &= ~SRV_PIN;
+
+	return 0;
+}
+
+/*
+ * ucrp_server_setworkers()
+ *
+ * run commands on a pool of 'n' worker threads instead of the io
+ * threads, so that command handlers may block.  0 runs them inline
+ * again.  must be called before ucrp_server_loop().
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_setworkers(UCRP_SERVER *srv, int n)
+{
+	UCRP_POOL *pool;
+
+	if (n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pool = NULL;
+	if (n > 0 && (pool = ucrp_pool_new(srv, n)) == NULL)
+		return -1;
+
+	if (srv->pool != NULL)
+		ucrp_pool_free(srv->pool);
+	srv->pool = pool;
+
+	return 0;
+}
+
+/*
+ * ucrp_server_threads()
+ *
+ * returns the number of threads the server runs on
+ */
+int
+ucrp_server_threads(UCRP_SERVER *srv)
+{
+	return srv->nshards;
+}
+
+/*
+ * shard_init()
+ *
+ * returns 0 or -1 on error
+ */
+static int
+shard_init(UCRP_SERVER *srv, UCRP_SHARD *shp, int id)
+{
+	struct epoll_event ee;
+
+	shp->srv = srv;
+	shp->id = id;
+	shp->epfd = shp->wake.fd = -1;
+	shp->stats = &shp->nostats;
+	LIST_INIT(&shp->sessions);
+	LIST_INIT(&shp->listeners);
+	TAILQ_INIT(&shp->flushq);
+	ucrp_wheel_init(&shp->wheel);
+	LIST_INIT(&shp->reap);
+	LIST_INIT(&shp->subs);
+	TAILQ_INIT(&shp->jobcache);
+	TAILQ_INIT(&shp->admitq[0]);
+	TAILQ_INIT(&shp->admitq[1]);
+	ucrp_segcache_init(&shp->segcache);
+	ucrp_mpsc_init(&shp->mbox);
+
+	if ((shp->rm = malloc(UCRP_MAX_MSGSIZE)) == NULL)
+		goto fail;
+
+	if ((shp->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		goto fail;
+
+	/* for ucrp_server_stop() and posts from the worker pool */
+	if ((shp->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		goto fail;
+	shp->wake.handler = wake_handler;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN;
+	ee.data.ptr = &shp->wake;
+	if (epoll_ctl(shp->epfd, EPOLL_CTL_ADD, shp->wake.fd, &ee) == -1)
+		goto fail;
+
+	return 0;
+
+fail:
+	ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+	shard_free(shp);
+	return -1;
+}
+
+/*
+ * shard_free()
+ *
+ * close the shard's sessions and release its resources
+ */
+static void
+shard_free(UCRP_SHARD *shp)
+{
+	UCRP_LISTENER *lp;
+	UCRP_SESSION *sp;
+	UCRP_JOB *job;
+
+	/* the thread is gone, timers are cancelled here, not posted */
+	ucrp_curshard = shp;
+	while ((sp = LIST_FIRST(&shp->sessions)) != NULL)
+		ucrp_session_destroy(sp);
+	while ((lp = LIST_FIRST(&shp->listeners)) != NULL)
+		ucrp_listener_free(lp);
+	ucrp_watch_reap(shp);
+	ucrp_curshard = NULL;
+
+	if (shp->wake.fd != -1)
+		close(shp->wake.fd);
+	if (shp->epfd != -1)
+		close(shp->epfd);
+	free(shp->rm);
+
+	while ((job = TAILQ_FIRST(&shp->jobcache)) != NULL) {
+		TAILQ_REMOVE(&shp->jobcache, job, chanent);
+		free(job);
+	}
+	shp->njobcache = 0;
+	ucrp_segcache_clear(&shp->segcache);
+	ucrp_arena_free(shp->arena);
+
+	shp->wake.fd = shp->epfd = -1;
+	shp->rm = NULL;
+	shp->arena = NULL;
+
+	return;
+}
+
+/*
+ * ucrp_server_setlimits()
+ *
+ * set the limits that keep a loaded server responsive, see
+ * UCRP_LIMITS.  must be called before ucrp_server_loop().
+ */
+void
+ucrp_server_setlimits(UCRP_SERVER *srv, UCRP_LIMITS *limits)
+{
+	srv->limits = *limits;
+
+	return;
+}
+
+/*
+ * wake_handler()
+ *
+ * drain the wakeup eventfd and the mailbox
+ */
+static void
+wake_handler(UCRP_EV *ev, uint32_t events)
+{
+	UCRP_SHARD *shp;
+	uint64_t n;
+
+	shp = (UCRP_SHARD *)((char *)ev - offsetof(UCRP_SHARD, wake));
+
+	while (read(ev->fd, &n, sizeof(n)) == -1 && errno == EINTR)
+		;
+
+	ucrp_shard_drain(shp);
+
+	return;
+}
+
+/*
+ * ucrp_shard_wake()
+ *
+ * get the shard out of epoll_wait(), safe from a signal handler or
+ * any thread
+ */
+void
+ucrp_shard_wake(UCRP_SHARD *shp)
+{
+	uint64_t one = 1;
+
+	while (write(shp->wake.fd, &one, sizeof(one)) == -1 &&
+	       errno == EINTR)
+		;
+
+	return;
+}
+
+/*
+ * shard_flush()
+ *
+ * write out the output queued since the last wakeup
+ */
+static void
+shard_flush(UCRP_SHARD *shp)
+{
+	UCRP_SESSION *sp;
+
+	while ((sp = TAILQ_FIRST(&shp->flushq)) != NULL) {
+		TAILQ_REMOVE(&shp->flushq, sp, flushent);
+		sp->flags &= ~SESS_FLUSHQ;
+
+		ucrp_session_flush(sp);
+		ucrp_session_check(sp);
+	}
+
+	return;
+}
+
+/*
+ * shard_run()
+ *
+ * service the shard's listeners and sessions until the server stops
+ *
+ * returns 0 or -1 on error
+ */
+static int
+shard_run(UCRP_SHARD *shp)
+{
+	struct epoll_event evs[SERVER_MAXEVENTS];
+	UCRP_EV *ev;
+	int i, n;
+
+	ucrp_curshard = shp;
+
+	while (!shp->srv->stop) {
+		n = epoll_wait(shp->epfd, evs, SERVER_MAXEVENTS,
+			       ucrp_wheel_timeout(&shp->wheel));
+		ucrp_wheel_run(&shp->wheel);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ucrp_log(LOG_ERR, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			ev = evs[i].data.ptr;
+			ev->handler(ev, evs[i].events);
+		}
+
+		ucrp_watch_reap(shp);
+		shard_flush(shp);
+		shard_gauges(shp);
+	}
+
+	return 0;
+}
+
+/*
+ * shard_gauges()
+ *
+ * bring the shard's gauges in the statistics up to date
+ */
+static void
+shard_gauges(UCRP_SHARD *shp)
+{
+	UCRP_STATS_IO *io = shp->stats;
+
+	STATS_SET(io->active, shp->nsessions);
+	STATS_SET(io->running, shp->nrunning);
+	STATS_SET(io->waiting[0], shp->nwaiting[0]);
+	STATS_SET(io->waiting[1], shp->nwaiting[1]);
+	STATS_SET(io->queued, shp->segcache.bytes);
+	STATS_SET(io->timers, shp->wheel.n);
+
+	return;
+}
+
+/*
+ * shard_pin()
+ *
+ * bind the calling thread to the shard's cpu, counting only the cpus
+ * we are allowed to run on
+ */
+static void
+shard_pin(UCRP_SHARD *shp)
+{
+	cpu_set_t allowed, set;
+	int cpu, n, ret;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 ||
+	    (n = CPU_COUNT(&allowed)) == 0)
+		return;
+
+	n = shp->id % n;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+			break;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(set),
+					  &set)) != 0)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(ret));
+
+	return;
+}
+
+/*
+ * shard_main()
+ *
+ * thread start routine for shards other than the first
+ */
+static void *
+shard_main(void *arg)
+{
+	UCRP_SHARD *shp = arg;
+
+	if (shp->srv->flags & SRV_PIN)
+		shard_pin(shp);
+
+	if (shard_run(shp) == -1) {
+		/* take the others down with us */
+		ucrp_server_stop(shp->srv);
+		return (void *)-1;
+	}
+
+	return NULL;
+}
+
+/*
+ * ucrp_server_loop()
+ *
+ * service listeners and sessions until ucrp_server_stop() is called.
+ * the first shard runs in the calling thread, the others in threads
+ * of their own which only ever see blocked signals.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_loop(UCRP_SERVER *srv)
+{
+	sigset_t all, old;
+	void *status;
+	int i, ret, started;
+
+	if (ucrp_stats_start(srv) == -1)
+		return -1;
+
+	if (srv->pool != NULL && ucrp_pool_start(srv->pool) == -1)
+		return -1;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (started = 1; started < srv->nshards; started++) {
+		ret = pthread_create(&srv->shards[started].thread, NULL,
+				     shard_main, &srv->shards[started]);
+		if (ret != 0) {
+			ucrp_log(LOG_ERR, "%s: %s\n", __func__,
+				 strerror(ret));
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ret = -1;
+	if (started == srv->nshards) {
+		if (srv->flags & SRV_PIN)
+			shard_pin(&srv->shards[0]);
+		ret = shard_run(&srv->shards[0]);
+	}
+
+	ucrp_server_stop(srv);
+
+	for (i = 1; i < started; i++) {
+		pthread_join(srv->shards[i].thread, &status);
+		if (status != NULL)
+			ret = -1;
+	}
+
+	/* let running commands finish, then settle what they posted */
+	if (srv->pool != NULL) {
+		ucrp_pool_stop(srv->pool);
+
+		for (i = 0; i < srv->nshards; i++) {
+			ucrp_curshard = &srv->shards[i];
+			ucrp_shard_drain(&srv->shards[i]);
+		}
+	}
+	ucrp_curshard = NULL;
+
+	return ret;
+}
+
+/*
+ * ucrp_server_stop()
+ *
+ * make ucrp_server_loop() return, safe to call from a signal handler
+ * or any thread
+ */
+void
+ucrp_server_stop(UCRP_SERVER *srv)
+{
+	int i;
+
+	srv->stop = 1;
+
+	for (i = 0; i < srv->nshards; i++)
+		ucrp_shard_wake(&srv->shards[i]);
+
+	return;
+}
+
+/*
+ * ucrp_server_free()
+ *
+ * close all sessions and free the server.  listening sockets passed
+ * to ucrp_server_listen() belong to the caller and are left open.
+ */
+void
+ucrp_server_free(UCRP_SERVER *srv)
+{
+	int i;
+
+	for (i = 0; i < srv->nshards; i++)
+		shard_free(&srv->shards[i]);
+
+	if (srv->pool != NULL)
+		ucrp_pool_free(srv->pool);
+
+	ucrp_stats_stop(srv);
+	free(srv->statspath);
+	free(srv->shards);
+	free(srv);
+
+	return;
+}
@@ -0,0 +1,1495 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+static void session_handler(UCRP_EV *, uint32_t);
+static void session_read(UCRP_SESSION *);
+static void session_dispatch(UCRP_SESSION *, UCRP *);
+static void session_extend(UCRP_SESSION *, UCRP *);
+static void session_events(UCRP_SESSION *);
+static void session_schedule(UCRP_SESSION *);
+static void session_free(UCRP_SESSION *);
+static void session_command(UCRP_CHANNEL *, UCRP *);
+static void session_interrupt(UCRP_CHANNEL *, UCRP *);
+static int  session_stale(UCRP *, void *);
+static void session_dropjobs(UCRP_CHANNEL *);
+static void session_flushos(UCRP_CHANNEL *);
+static UCRP_JOB *session_jobget(UCRP_SHARD *);
+static void session_jobput(UCRP_SHARD *, UCRP_JOB *);
+static void session_admit(UCRP_JOB *);
+static void session_admitq(UCRP_SHARD *);
+static void session_countbuf(UCRP_SESSION *, UCRP_BUF *);
+static void session_idle(UCRP_TIMER *, void *);
+static void session_again(UCRP_TIMER *, void *);
+static void session_forget(UCRP_JOB *);
+
+/*
+ * ucrp_session_new()
+ *
+ * create a session for the connected, non-blocking socket 's'
+ *
+ * returns the session or NULL on error
+ */
+UCRP_SESSION *
+ucrp_session_new(UCRP_SHARD *shp, int s)
+{
+	struct epoll_event ee;
+	UCRP_SESSION *sp;
+
+	if ((sp = calloc(1, sizeof(*sp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	sp->ev.fd = s;
+	sp->ev.handler = session_handler;
+	sp->srv = shp->srv;
+	sp->shard = shp;
+	sp->evmask = EPOLLIN;
+	sp->chan0.sp = sp;
+	sp->chan0.id = 0;
+	TAILQ_INIT(&sp->chan0.jobs);
+	ucrp_timer_init(&sp->chan0.again, shp, session_again, &sp->chan0);
+	ucrp_segq_init(&sp->txq, &shp->segcache);
+	LIST_INIT(&sp->timers);
+	LIST_INIT(&sp->watches);
+	ucrp_timer_init(&sp->idle, shp, session_idle, sp);
+	sp->lastin = shp->wheel.now;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = sp->evmask;
+	ee.data.ptr = &sp->ev;
+	if (epoll_ctl(shp->epfd, EPOLL_CTL_ADD, s, &ee) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(sp);
+		return NULL;
+	}
+
+	LIST_INSERT_HEAD(&shp->sessions, sp, entry);
+	shp->nsessions++;
+
+	if (sp->srv->limits.idle > 0)
+		ucrp_timer_set(&sp->idle, sp->srv->limits.idle * 1000);
+
+	return sp;
+}
+
+/*
+ * session_idle()
+ *
+ * close the session if nothing came in for the idle limit.  a command
+ * still running counts as activity.
+ */
+static void
+session_idle(UCRP_TIMER *tm, void *arg)
+{
+	UCRP_SESSION *sp = arg;
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	uint64_t limit, quiet;
+
+	limit = (uint64_t)sp->srv->limits.idle * 1000;
+	if (sp->refs > 0)
+		sp->lastin = sp->shard->wheel.now;
+
+	quiet = sp->shard->wheel.now - sp->lastin;
+	if (quiet < limit) {
+		ucrp_timer_set(tm, limit - quiet);
+		return;
+	}
+
+	ucrp_msg_display(sm, SESS_IDLE);
+	ucrp_session_queue(sp, 0, sm);
+	ucrp_session_close(sp);
+
+	return;
+}
+
+/*
+ * ucrp_session_destroy()
+ *
+ * close the session and drop the commands still waiting for a worker.
+ * the session is freed (and the application told) once the commands
+ * already running have finished.
+ */
+void
+ucrp_session_destroy(UCRP_SESSION *sp)
+{
+	UCRP_SHARD *shp = sp->shard;
+	UCRP_TIMER *tm;
+	int i;
+
+	if (sp->flags & SESS_FLUSHQ)
+		TAILQ_REMOVE(&shp->flushq, sp, flushent);
+
+	LIST_REMOVE(sp, entry);
+	shp->nsessions--;
+	if (sp->ext.flags & UCRP_EXT_BATCH)
+		shp->nbatch--;
+
+	close(sp->ev.fd); /* also drops it from the epoll set */
+	ucrp_segq_clear(&sp->txq);
+	ucrp_timer_cancel(&sp->idle);
+	LIST_FOREACH(tm, &sp->timers, sessent)
+		ucrp_timer_cancel(tm);
+	ucrp_watch_stop(sp);
+	if (sp->sub != NULL)
+		ucrp_bus_free(sp);
+	sp->flags |= SESS_DEAD | SESS_GONE;
+
+	session_dropjobs(&sp->chan0);
+	for (i = 1; sp->chans != NULL && i <= UCRP_MAX_CHAN; i++)
+		if (sp->chans[i] != NULL)
+			session_dropjobs(sp->chans[i]);
+
+	if (sp->refs == 0)
+		session_free(sp);
+
+	return;
+}
+
+/*
+ * session_dropjobs()
+ *
+ * throw away the commands waiting on a channel and interrupt the one
+ * running, which is the pool's until it is done
+ */
+static void
+session_dropjobs(UCRP_CHANNEL *cp)
+{
+	UCRP_SHARD *shp = cp->sp->shard;
+	UCRP_JOB *job, *next;
+
+	if ((job = TAILQ_FIRST(&cp->jobs)) == NULL)
+		return;
+
+	while ((next = TAILQ_NEXT(job, chanent)) != NULL) {
+		TAILQ_REMOVE(&cp->jobs, next, chanent);
+		session_jobput(shp, next);
+		cp->sp->refs--;
+	}
+
+	/* one never admitted, or waiting to run again, isn't running */
+	if (job->waiting || ucrp_timer_pending(&cp->again)) {
+		if (job->waiting) {
+			TAILQ_REMOVE(&shp->admitq[job->waiting - 1], job,
+				     poolent);
+			shp->nwaiting[job->waiting - 1]--;
+		} else
+			ucrp_timer_cancel(&cp->again);
+		TAILQ_REMOVE(&cp->jobs, job, chanent);
+		if (job->fn != NULL)
+			session_forget(job);
+		session_jobput(shp, job);
+		cp->sp->refs--;
+		return;
+	}
+
+	__atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+
+	return;
+}
+
+/*
+ * session_flushos()
+ *
+ * send what the channel's output stream holds, so that what is sent
+ * next does not overtake it
+ */
+static void
+session_flushos(UCRP_CHANNEL *cp)
+{
+	UCRP_OSTREAM *os;
+
+	if ((os = __atomic_load_n(&cp->os, __ATOMIC_ACQUIRE)) != NULL)
+		ucrp_ostream_flush(os);
+
+	return;
+}
+
+/*
+ * session_free()
+ *
+ * tell the application the session is gone and free it
+ */
+static void
+session_free(UCRP_SESSION *sp)
+{
+	int i;
+
+	if (sp->srv->cb.close != NULL)
+		sp->srv->cb.close(sp);
+
+	/* the ones the application did not free */
+	while (!LIST_EMPTY(&sp->timers))
+		ucrp_timer_free(LIST_FIRST(&sp->timers));
+	while (!LIST_EMPTY(&sp->watches))
+		ucrp_watch_free(LIST_FIRST(&sp->watches));
+
+	if (sp->chan0.os != NULL)
+		ucrp_ostream_free(sp->chan0.os);
+	ucrp_arena_free(sp->chan0.arena);
+
+	if (sp->chans != NULL) {
+		for (i = 1; i <= UCRP_MAX_CHAN; i++) {
+			if (sp->chans[i] == NULL)
+				continue;
+			if (sp->chans[i]->os != NULL)
+				ucrp_ostream_free(sp->chans[i]->os);
+			ucrp_arena_free(sp->chans[i]->arena);
+			free(sp->chans[i]);
+		}
+		free(sp->chans);
+	}
+
+	free(sp);
+
+	return;
+}
+
+/*
+ * ucrp_session_done()
+ *
+ * a worker has finished 'job', start the next command on its channel
+ * unless this one runs again later
+ */
+void
+ucrp_session_done(UCRP_JOB *job)
+{
+	UCRP_CHANNEL *cp = job->cp;
+	UCRP_SESSION *sp = cp->sp;
+	UCRP_JOB *next;
+
+	sp->shard->nrunning--;
+
+	if (job->again) {
+		if (job->cancel == 0 && (sp->flags & SESS_GONE) == 0) {
+			job->again = 0;
+			ucrp_timer_set(&cp->again, job->delay);
+			session_admitq(sp->shard);
+			return;
+		}
+		session_forget(job);
+	}
+
+	TAILQ_REMOVE(&cp->jobs, job, chanent);
+	session_jobput(sp->shard, job);
+
+	if ((next = TAILQ_FIRST(&cp->jobs)) != NULL &&
+	    (sp->flags & SESS_GONE) == 0)
+		session_admit(next);
+	session_admitq(sp->shard);
+
+	if (--sp->refs == 0 && (sp->flags & SESS_GONE))
+		session_free(sp);
+
+	return;
+}
+
+/*
+ * session_again()
+ *
+ * the time has come for the command first on the channel to run again
+ */
+static void
+session_again(UCRP_TIMER *tm, void *arg)
+{
+	UCRP_CHANNEL *cp = arg;
+
+	session_admit(TAILQ_FIRST(&cp->jobs));
+
+	return;
+}
+
+/*
+ * session_forget()
+ *
+ * a command that asked to run again won't, the channel was
+ * interrupted or the session closed first.  the filters it left on
+ * the channel go, and its function is called without a channel to
+ * free what it kept.
+ */
+static void
+session_forget(UCRP_JOB *job)
+{
+	UCRP_OSTREAM *os;
+	UCRP_FILTER *f;
+
+	if ((os = __atomic_load_n(&job->cp->os, __ATOMIC_ACQUIRE)) != NULL) {
+		pthread_mutex_lock(&os->lock);
+		f = os->filter;
+		os->filter = NULL;
+		pthread_mutex_unlock(&os->lock);
+		if (f != NULL)
+			ucrp_filter_free(f);
+	}
+
+	job->again = 0;
+	job->fn(NULL, job->arg);
+
+	return;
+}
+
+/*
+ * session_jobget()
+ *
+ * returns a job big enough for any command, kept from an earlier one
+ * if there is one, or NULL on error
+ */
+static UCRP_JOB *
+session_jobget(UCRP_SHARD *shp)
+{
+	UCRP_JOB *job;
+
+	if ((job = TAILQ_FIRST(&shp->jobcache)) != NULL) {
+		TAILQ_REMOVE(&shp->jobcache, job, chanent);
+		shp->njobcache--;
+		return job;
+	}
+
+	if ((job = malloc(JOB_SIZE)) == NULL)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+
+	return job;
+}
+
+/*
+ * session_jobput()
+ *
+ * keep a finished job for the next command, up to JOB_KEEP of them
+ */
+static void
+session_jobput(UCRP_SHARD *shp, UCRP_JOB *job)
+{
+	if (shp->njobcache >= JOB_KEEP) {
+		free(job);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&shp->jobcache, job, chanent);
+	shp->njobcache++;
+
+	return;
+}
+
+/*
+ * session_command()
+ *
+ * queue a command for the worker pool.  commands on one channel run
+ * in the order they arrived, one after the other.
+ */
+static void
+session_command(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	UCRP_JOB *job;
+	int idle;
+
+	if ((job = session_jobget(cp->sp->shard)) == NULL)
+		return;
+
+	job->cp = cp;
+	job->cancel = 0;
+	job->waiting = 0;
+	job->again = 0;
+	job->fn = NULL;
+	memcpy(&job->rm, rm, UCRP_HDR_SIZE + rm->length + 1);
+
+	idle = TAILQ_EMPTY(&cp->jobs);
+	TAILQ_INSERT_TAIL(&cp->jobs, job, chanent);
+	cp->sp->refs++;
+
+	if (idle)
+		session_admit(job);
+
+	return;
+}
+
+/*
+ * session_admit()
+ *
+ * give the command at the head of its channel to the pool.  if the
+ * thread already runs its share of the commands limit, or others are
+ * waiting, tell the client we are busy and queue it instead.
+ */
+static void
+session_admit(UCRP_JOB *job)
+{
+	UCRP_SESSION *sp = job->cp->sp;
+	UCRP_SHARD *shp = sp->shard;
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	unsigned int share;
+	int class;
+
+	share = LIMIT_SHARE(sp->srv, sp->srv->limits.commands);
+	class = (sp->ext.flags & UCRP_EXT_BATCH) ? 1 : 0;
+
+	if (share > 0 &&
+	    (shp->nrunning >= share || !TAILQ_EMPTY(&shp->admitq[0]) ||
+	     !TAILQ_EMPTY(&shp->admitq[class]))) {
+		job->waiting = class + 1;
+		TAILQ_INSERT_TAIL(&shp->admitq[class], job, poolent);
+		shp->nwaiting[class]++;
+
+		ucrp_msg_busy(sm);
+		ucrp_session_queue(sp, job->cp->id, sm);
+		return;
+	}
+
+	shp->nrunning++;
+	ucrp_pool_submit(sp->srv->pool, shp, job);
+
+	return;
+}
+
+/*
+ * session_admitq()
+ *
+ * start waiting commands while there is room, interactive ones first
+ */
+static void
+session_admitq(UCRP_SHARD *shp)
+{
+	UCRP_JOB *job;
+	unsigned int share;
+
+	share = LIMIT_SHARE(shp->srv, shp->srv->limits.commands);
+
+	while (share == 0 || shp->nrunning < share) {
+		if ((job = TAILQ_FIRST(&shp->admitq[0])) == NULL &&
+		    (job = TAILQ_FIRST(&shp->admitq[1])) == NULL)
+			break;
+
+		TAILQ_REMOVE(&shp->admitq[job->waiting - 1], job, poolent);
+		shp->nwaiting[job->waiting - 1]--;
+		job->waiting = 0;
+		shp->nrunning++;
+		ucrp_pool_submit(shp->srv->pool, shp, job);
+	}
+
+	return;
+}
+
+/*
+ * ucrp_session_check()
+ *
+ * destroy the session if it is dead, or closing with nothing left
+ * to send.
+ *
+ * returns 1 if the session was destroyed, 0 otherwise
+ */
+int
+ucrp_session_check(UCRP_SESSION *sp)
+{
+	if ((sp->flags & SESS_DEAD) ||
+	    ((sp->flags & SESS_CLOSING) && sp->txq.bytes == 0)) {
+		ucrp_session_destroy(sp);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_session_flush()
+ *
+ * write out as much queued output as the socket will take
+ *
+ * returns 0 or -1 on error (the session is then dead)
+ */
+int
+ucrp_session_flush(UCRP_SESSION *sp)
+{
+	if (sp->flags & SESS_DEAD)
+		return -1;
+
+	if (ucrp_segq_write(&sp->txq, sp->ev.fd) == -1) {
+		ucrp_log(LOG_NOTICE, "%s: %s\n", __func__, strerror(errno));
+		sp->flags |= SESS_DEAD;
+		ucrp_segq_clear(&sp->txq);
+		return -1;
+	}
+
+	/* room again for events held back */
+	if (sp->sub != NULL && sp->sub->nheld > 0 &&
+	    sp->txq.bytes < SUB_LOWAT)
+		ucrp_bus_refill(sp);
+
+	session_events(sp);
+
+	return 0;
+}
+
+/*
+ * ucrp_session_queue()
+ *
+ * queue a message for sending on channel 'chan'.  the message itself
+ * is left untouched (unlike ucrp_send()).  output is written out when
+ * the event loop gets to it, or right away once there is a lot of it.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_queue(UCRP_SESSION *sp, int chan, UCRP *msg)
+{
+	UCRP hdr;
+	uint8_t *p;
+
+	if (sp->flags & (SESS_DEAD | SESS_CLOSING))
+		return -1;
+
+	hdr.type = msg->type;
+	hdr.options = msg->options;
+	hdr.length = msg->length;
+	if (sp->ext.flags & UCRP_EXT_CHANNELS)
+		UCRP_SETCHAN(&hdr, chan);
+	ucrp_msg_hton(&hdr);
+
+	if ((p = ucrp_segq_reserve(&sp->txq,
+				   UCRP_HDR_SIZE + msg->length)) == NULL)
+		return -1;
+
+	memcpy(p, &hdr, UCRP_HDR_SIZE);
+	memcpy(p + UCRP_HDR_SIZE, UCRP_PAYLOAD(msg), msg->length);
+	STATS_MSG(sp->shard->stats, out, msg->type,
+		  UCRP_HDR_SIZE + msg->length);
+
+	if (sp->txq.bytes > SESS_TXHIWAT)
+		return ucrp_session_flush(sp);
+
+	session_schedule(sp);
+
+	return 0;
+}
+
+/*
+ * session_schedule()
+ *
+ * have the event loop flush this session before it sleeps again
+ */
+static void
+session_schedule(UCRP_SESSION *sp)
+{
+	if (sp->flags & SESS_FLUSHQ)
+		return;
+
+	sp->flags |= SESS_FLUSHQ;
+	TAILQ_INSERT_TAIL(&sp->shard->flushq, sp, flushent);
+
+	return;
+}
+
+/*
+ * session_events()
+ *
+ * keep the registered events in line with the session state: read
+ * unless closing, wait for writability only while output is queued.
+ */
+static void
+session_events(UCRP_SESSION *sp)
+{
+	struct epoll_event ee;
+	uint32_t mask;
+	size_t limit;
+
+	/*
+	 * no new work from a client that doesn't take what it has.
+	 * files cost no memory and may be interrupted.
+	 */
+	limit = sp->srv->limits.output;
+	mask = 0;
+	if ((sp->flags & SESS_CLOSING) == 0 &&
+	    (limit == 0 || sp->txq.bytes - sp->txq.mapped <= limit))
+		mask |= EPOLLIN;
+	if (sp->txq.bytes > 0)
+		mask |= EPOLLOUT;
+
+	ucrp_watch_hold(sp, sp->txq.bytes > WATCH_HIWAT);
+
+	if (mask == sp->evmask)
+		return;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = mask;
+	ee.data.ptr = &sp->ev;
+	if (epoll_ctl(sp->shard->epfd, EPOLL_CTL_MOD, sp->ev.fd, &ee) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		sp->flags |= SESS_DEAD;
+		return;
+	}
+
+	sp->evmask = mask;
+
+	return;
+}
+
+/*
+ * session_handler()
+ *
+ * event loop callback
+ */
+static void
+session_handler(UCRP_EV *ev, uint32_t events)
+{
+	UCRP_SESSION *sp = (UCRP_SESSION *)ev;
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		session_read(sp);
+
+	if ((events & EPOLLOUT) && (sp->flags & SESS_DEAD) == 0)
+		ucrp_session_flush(sp);
+
+	ucrp_session_check(sp);
+
+	return;
+}
+
+/*
+ * session_read()
+ *
+ * read what is available and dispatch every complete message.  one
+ * recv() per wakeup keeps a busy session from starving the others.
+ */
+static void
+session_read(UCRP_SESSION *sp)
+{
+	UCRP *rm = sp->shard->rm;
+	ssize_t ret;
+	size_t len, off;
+	uint16_t length;
+
+	if (sp->flags & (SESS_DEAD | SESS_CLOSING))
+		return;
+
+	ret = recv(sp->ev.fd, sp->rx + sp->rxlen, SESS_RXSIZE - sp->rxlen, 0);
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (ret < 1) {
+		ucrp_log(LOG_INFO, "%s: %s\n", __func__,
+			 ret == 0 ? "connection closed" : strerror(errno));
+		sp->flags |= SESS_DEAD;
+		return;
+	}
+
+	sp->rxlen += ret;
+	sp->lastin = sp->shard->wheel.now;
+
+	off = 0;
+	while (sp->rxlen - off >= UCRP_HDR_SIZE) {
+		memcpy(&length, sp->rx + off + offsetof(UCRP, length),
+		       sizeof(length));
+		length = ntohs(length);
+
+		if (length > UCRP_MAX_PAYLOAD) {
+			ucrp_log(LOG_NOTICE,
+				 "%s: msg->length=%hu > UCRP_MAX_PAYLOAD=%hu\n",
+				 __func__, length, UCRP_MAX_PAYLOAD);
+			sp->flags |= SESS_DEAD;
+			return;
+		}
+
+		len = UCRP_HDR_SIZE + length;
+		if (sp->rxlen - off < len)
+			break;
+
+		memcpy(rm, sp->rx + off, len);
+		UCRP_PAYLOAD(rm)[length] = '\0';
+		ucrp_msg_ntoh(rm);
+		off += len;
+		STATS_MSG(sp->shard->stats, in, rm->type, len);
+
+		session_dispatch(sp, rm);
+
+		if (sp->flags & (SESS_DEAD | SESS_CLOSING))
+			return;
+	}
+
+	sp->rxlen -= off;
+	if (sp->rxlen > 0 && off > 0)
+		memmove(sp->rx, sp->rx + off, sp->rxlen);
+
+	return;
+}
+
+/*
+ * session_dispatch()
+ *
+ * hand a message to the application
+ */
+static void
+session_dispatch(UCRP_SESSION *sp, UCRP *rm)
+{
+	UCRP_CALLBACKS *cb = &sp->srv->cb;
+	void (*f)(UCRP_CHANNEL *, UCRP *);
+	UCRP_CHANNEL *cp;
+	uint64_t start;
+
+	UCRP_PMSG((stdout, rm));
+
+	if (rm->type == UCRP_EXTEND) {
+		session_extend(sp, rm);
+		return;
+	}
+
+	if ((cp = ucrp_session_channel(sp, UCRP_GETCHAN(rm))) == NULL)
+		return;
+
+	/* handlers only see the type specific options */
+	rm->options &= ~UCRP_CHAN_MASK;
+
+	switch (rm->type) {
+	case UCRP_COMMAND:
+		f = cb->command;
+		if (f != NULL && sp->srv->pool != NULL)
+			f = session_command;
+		break;
+	case UCRP_COMPLETE:
+		f = cb->complete;
+		break;
+	case UCRP_HELP:
+		f = cb->help;
+		break;
+	case UCRP_INTERRUPT:
+		f = cb->interrupt;
+		if (f != NULL)
+			f = session_interrupt;
+		break;
+	case UCRP_TELL:
+		f = cb->tell;
+		break;
+	case UCRP_SUSPEND:
+		f = cb->suspend;
+		break;
+	case UCRP_WAIT:
+		f = cb->wait;
+		break;
+	default:
+		ucrp_log(LOG_NOTICE, "%s: unknown message type=%u\n",
+			 __func__, rm->type);
+		return;
+	}
+
+	if (f == NULL) {
+		ucrp_log(LOG_INFO, "%s: ignoring %s\n", __func__,
+			 ucrp_strtype(rm->type));
+		return;
+	}
+
+	if (f == cb->command) {
+		start = ucrp_usec();
+		f(cp, rm);
+		ucrp_stats_command(sp->shard->cmdstats, start);
+	} else
+		f(cp, rm);
+
+	/* what the callback wrote goes out now, commands run elsewhere */
+	if (f != session_command)
+		session_flushos(cp);
+
+	if (sp->shard->arena != NULL)
+		ucrp_arena_reset(sp->shard->arena);
+
+	return;
+}
+
+/*
+ * session_interrupt()
+ *
+ * stop the command running on the channel and drop the ones waiting,
+ * throw away their output that has not been sent yet, mark the spot
+ * for the client, then let the application follow up with a prompt.
+ */
+static void
+session_interrupt(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	UCRP_SESSION *sp = cp->sp;
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	UCRP_OSTREAM *os;
+	size_t n;
+
+	session_dropjobs(cp);
+
+	if ((os = __atomic_load_n(&cp->os, __ATOMIC_ACQUIRE)) != NULL)
+		ucrp_ostream_discard(os);
+
+	if ((n = ucrp_segq_discard(&sp->txq, session_stale, cp)) > 0) {
+		ucrp_log(LOG_DEBUG, "%s: dropped %lu bytes\n", __func__,
+			 (unsigned long)n);
+		session_events(sp);
+	}
+
+	if (sp->ext.flags & UCRP_EXT_INTERRUPT) {
+		ucrp_msg_interrupted(sm);
+		ucrp_session_queue(sp, cp->id, sm);
+	}
+
+	sp->srv->cb.interrupt(cp, rm);
+
+	return;
+}
+
+/*
+ * session_stale()
+ *
+ * segq match function, selects the output of channel 'arg'
+ */
+static int
+session_stale(UCRP *hdr, void *arg)
+{
+	UCRP_CHANNEL *cp = arg;
+
+	if (!UCRP_ISOUTPUT(hdr->type))
+		return 0;
+
+	if ((cp->sp->ext.flags & UCRP_EXT_CHANNELS) == 0)
+		return 1;
+
+	return UCRP_GETCHAN(hdr) == cp->id;
+}
+
+/*
+ * session_extend()
+ *
+ * answer UCRP_EXTEND with the extensions we agree to.  the reply
+ * goes out on the old terms, the new ones apply from then on.
+ */
+static void
+session_extend(UCRP_SESSION *sp, UCRP *rm)
+{
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	UCRP_SHARD *shp = sp->shard;
+	UCRP_EXT want;
+	unsigned int share;
+	uint32_t was;
+	size_t max;
+
+	if (ucrp_ext_parse(rm, &want) == -1)
+		return;
+
+	want.flags &= sp->srv->extensions;
+	if ((want.flags & UCRP_EXT_COLUMNS) == 0)
+		want.columns = 0;
+
+	/* frames no larger than either side wants */
+	max = sp->srv->limits.maxmsg;
+	if (max > 0 && want.maxmsg > max)
+		want.maxmsg = max;
+	if (want.maxmsg <= UCRP_MAX_PAYLOAD) {
+		want.flags &= ~UCRP_EXT_MAXMSG;
+		want.maxmsg = 0;
+	}
+
+	ucrp_msg_extended(sm, &want);
+	ucrp_session_queue(sp, 0, sm);
+
+	was = sp->ext.flags & UCRP_EXT_BATCH;
+	sp->ext = want;
+
+	if ((want.flags & UCRP_EXT_BATCH) == was)
+		return;
+
+	if (was) {
+		shp->nbatch--;
+		return;
+	}
+
+	/* automation gets a smaller share than people do */
+	share = LIMIT_SHARE(sp->srv, sp->srv->limits.batch);
+	if (share > 0 && shp->nbatch >= share) {
+		sp->ext.flags &= ~UCRP_EXT_BATCH;
+		ucrp_msg_display(sm, SESS_REFUSED);
+		ucrp_session_queue(sp, 0, sm);
+		ucrp_session_close(sp);
+		return;
+	}
+
+	shp->nbatch++;
+
+	return;
+}
+
+/*
+ * ucrp_session_output()
+ *
+ * queue a message on channel 'chan', by way of the session's own
+ * thread when called from a worker
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_output(UCRP_SESSION *sp, int chan, UCRP *msg)
+{
+	UCRP_JOB *job;
+
+	if (ucrp_curshard != sp->shard) {
+		/* tag it so it can be dropped if the command is interrupted */
+		job = ucrp_curjob;
+		if (job != NULL && job->cp->sp != sp)
+			job = NULL;
+
+		return ucrp_shard_post(sp->shard, POST_MSG, sp, chan,
+				       job, msg);
+	}
+
+	return ucrp_session_queue(sp, chan, msg);
+}
+
+/*
+ * ucrp_session_queuefile()
+ *
+ * queue a mapped file as UCRP_DISPLAY messages on channel 'chan'
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_queuefile(UCRP_SESSION *sp, int chan, UCRP_FILEBUF *fb)
+{
+	UCRP_STATS_IO *io = sp->shard->stats;
+	UCRP hdr;
+	size_t n;
+	int t;
+
+	if (sp->flags & (SESS_DEAD | SESS_CLOSING))
+		return -1;
+
+	hdr.type = UCRP_DISPLAY;
+	hdr.options = 0;
+	if (sp->ext.flags & UCRP_EXT_CHANNELS)
+		UCRP_SETCHAN(&hdr, chan);
+
+	hdr.length = fb->frame;
+	ucrp_msg_hton(&hdr);
+	memcpy(fb->full, &hdr, UCRP_HDR_SIZE);
+	ucrp_msg_ntoh(&hdr);
+
+	n = FILEBUF_FRAMES(fb);
+	hdr.length = fb->payload - (n - 1) * fb->frame;
+	ucrp_msg_hton(&hdr);
+	memcpy(fb->last, &hdr, UCRP_HDR_SIZE);
+
+	if (ucrp_segq_appendfile(&sp->txq, fb) == -1)
+		return -1;
+
+	t = UCRP_STATS_TYPE(UCRP_DISPLAY);
+	STATS_ADD(io->msgs_out[t], n);
+	STATS_ADD(io->bytes_out[t], fb->buf.size);
+
+	if (sp->txq.bytes > SESS_TXHIWAT)
+		return ucrp_session_flush(sp);
+
+	session_schedule(sp);
+
+	return 0;
+}
+
+/*
+ * ucrp_session_outputfile()
+ *
+ * ucrp_session_output() for a mapped file, takes a reference to it
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_outputfile(UCRP_SESSION *sp, int chan, UCRP_FILEBUF *fb)
+{
+	if (ucrp_curshard != sp->shard) {
+		ucrp_buf_ref(&fb->buf);
+		if (ucrp_shard_postptr(sp->shard, POST_FILE, sp, fb,
+				       chan) == -1) {
+			ucrp_buf_rele(&fb->buf);
+			return -1;
+		}
+		return 0;
+	}
+
+	return ucrp_session_queuefile(sp, chan, fb);
+}
+
+/*
+ * ucrp_session_queueframe()
+ *
+ * queue the one message in 'bp', in host order and larger than a
+ * post can carry, on channel 'chan' without copying it
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_queueframe(UCRP_SESSION *sp, int chan, UCRP_BUF *bp)
+{
+	UCRP *msg = (UCRP *)bp->data;
+
+	if (sp->ext.flags & UCRP_EXT_CHANNELS)
+		UCRP_SETCHAN(msg, chan);
+	ucrp_msg_hton(msg);
+
+	return ucrp_session_queuebuf(sp, bp);
+}
+
+/*
+ * ucrp_session_outputframe()
+ *
+ * ucrp_session_output() for a message in a buffer of its own, takes a
+ * reference to it
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_outputframe(UCRP_SESSION *sp, int chan, UCRP_BUF *bp)
+{
+	if (ucrp_curshard != sp->shard) {
+		ucrp_buf_ref(bp);
+		if (ucrp_shard_postptr(sp->shard, POST_FRAME, sp, bp,
+				       chan) == -1) {
+			ucrp_buf_rele(bp);
+			return -1;
+		}
+		return 0;
+	}
+
+	return ucrp_session_queueframe(sp, chan, bp);
+}
+
+/*
+ * ucrp_session_send()
+ *
+ * queue a message on the default channel
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_send(UCRP_SESSION *sp, UCRP *msg)
+{
+	ucrp_pool_throttle();
+	session_flushos(&sp->chan0);
+
+	return ucrp_session_output(sp, 0, msg);
+}
+
+/*
+ * ucrp_session_close()
+ *
+ * stop reading and close the session once its output is written
+ */
+void
+ucrp_session_close(UCRP_SESSION *sp)
+{
+	if (ucrp_curshard != sp->shard) {
+		ucrp_shard_post(sp->shard, POST_CLOSE, sp, 0, NULL, NULL);
+		return;
+	}
+
+	if (sp->flags & SESS_DEAD)
+		return;
+
+	sp->flags |= SESS_CLOSING;
+	session_events(sp);
+	session_schedule(sp);
+
+	return;
+}
+
+/*
+ * ucrp_session_fd()
+ */
+int
+ucrp_session_fd(UCRP_SESSION *sp)
+{
+	return sp->ev.fd;
+}
+
+/*
+ * ucrp_session_thread()
+ *
+ * returns the index of the server thread the session lives on,
+ * 0 .. ucrp_server_threads() - 1
+ */
+int
+ucrp_session_thread(UCRP_SESSION *sp)
+{
+	return sp->shard->id;
+}
+
+/*
+ * ucrp_session_ext()
+ *
+ * returns the extensions in effect for this session
+ */
+UCRP_EXT *
+ucrp_session_ext(UCRP_SESSION *sp)
+{
+	return &sp->ext;
+}
+
+/*
+ * ucrp_session_server()
+ *
+ * returns the server the session belongs to
+ */
+UCRP_SERVER *
+ucrp_session_server(UCRP_SESSION *sp)
+{
+	return sp->srv;
+}
+
+/*
+ * ucrp_session_channel()
+ *
+ * look up channel 'id', creating it on first use.  without
+ * UCRP_EXT_CHANNELS everything happens on channel 0.
+ *
+ * returns the channel or NULL on error
+ */
+UCRP_CHANNEL *
+ucrp_session_channel(UCRP_SESSION *sp, int id)
+{
+	UCRP_CHANNEL *cp;
+
+	if (id == 0 || (sp->ext.flags & UCRP_EXT_CHANNELS) == 0)
+		return &sp->chan0;
+
+	if (id < 0 || id > UCRP_MAX_CHAN)
+		return NULL;
+
+	if (sp->chans == NULL &&
+	    (sp->chans = calloc(UCRP_MAX_CHAN + 1, sizeof(cp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	if ((cp = sp->chans[id]) != NULL)
+		return cp;
+
+	if ((cp = calloc(1, sizeof(*cp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	cp->sp = sp;
+	cp->id = id;
+	TAILQ_INIT(&cp->jobs);
+	ucrp_timer_init(&cp->again, sp->shard, session_again, cp);
+	sp->chans[id] = cp;
+
+	return cp;
+}
+
+/*
+ * ucrp_session_setdata()
+ *
+ * attach application data to the session
+ */
+void
+ucrp_session_setdata(UCRP_SESSION *sp, void *data)
+{
+	sp->data = data;
+	return;
+}
+
+/*
+ * ucrp_session_getdata()
+ */
+void *
+ucrp_session_getdata(UCRP_SESSION *sp)
+{
+	return sp->data;
+}
+
+/*
+ * ucrp_channel_send()
+ *
+ * queue a message on the channel
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_channel_send(UCRP_CHANNEL *cp, UCRP *msg)
+{
+	ucrp_pool_throttle();
+	session_flushos(cp);
+
+	return ucrp_session_output(cp->sp, cp->id, msg);
+}
+
+/*
+ * ucrp_session_queuebuf()
+ *
+ * queue the messages in 'bp', which are encoded for this session,
+ * without copying them
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_session_queuebuf(UCRP_SESSION *sp, UCRP_BUF *bp)
+{
+	if (sp->flags & (SESS_DEAD | SESS_CLOSING))
+		return -1;
+
+	if (ucrp_segq_appendbuf(&sp->txq, bp, 0, bp->size) == -1)
+		return -1;
+	session_countbuf(sp, bp);
+
+	if (sp->txq.bytes > SESS_TXHIWAT)
+		return ucrp_session_flush(sp);
+
+	session_schedule(sp);
+
+	return 0;
+}
+
+/*
+ * session_countbuf()
+ *
+ * count the messages in a buffer queued without looking at them
+ */
+static void
+session_countbuf(UCRP_SESSION *sp, UCRP_BUF *bp)
+{
+	UCRP hdr;
+	size_t pos, len;
+
+	for (pos = 0; pos + UCRP_HDR_SIZE <= bp->size; pos += len) {
+		memcpy(&hdr, bp->data + pos, UCRP_HDR_SIZE);
+		ucrp_msg_ntoh(&hdr);
+		len = UCRP_HDR_SIZE + hdr.length;
+		STATS_MSG(sp->shard->stats, out, hdr.type, len);
+	}
+
+	return;
+}
+
+/*
+ * ucrp_channel_sendbuf()
+ *
+ * queue the messages in a shared buffer, such as the ones
+ * ucrp_cmd_helpbuf() returns.  on the session's own thread they are
+ * sent straight from the buffer, which is encoded for channel 0;
+ * from a worker, or on another channel, they are copied.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_channel_sendbuf(UCRP_CHANNEL *cp, UCRP_BUF *bp)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_SESSION *sp;
+	size_t pos;
+
+	sp = cp->sp;
+
+	session_flushos(cp);
+
+	if (ucrp_curshard == sp->shard &&
+	    (cp->id == 0 || (sp->ext.flags & UCRP_EXT_CHANNELS) == 0))
+		return ucrp_session_queuebuf(sp, bp);
+
+	for (pos = 0; pos + UCRP_HDR_SIZE <= bp->size;
+	     pos += UCRP_HDR_SIZE + sm->length) {
+		memcpy(sm, bp->data + pos, UCRP_HDR_SIZE);
+		ucrp_msg_ntoh(sm);
+		if (sm->length > UCRP_MAX_PAYLOAD ||
+		    pos + UCRP_HDR_SIZE + sm->length > bp->size)
+			break;
+
+		memcpy(UCRP_PAYLOAD(sm), bp->data + pos + UCRP_HDR_SIZE,
+		       sm->length);
+		if (ucrp_session_output(sp, cp->id, sm) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * ucrp_channel_readfd()
+ *
+ * read up to 'max' bytes from 'fd' straight into the payloads of
+ * UCRP_DISPLAY messages and queue those without copying them again.
+ * no more is read than the descriptor says it holds, when it says.
+ * only on the session's own thread.
+ *
+ * returns the number of bytes read, 0 at end of file or -1 on error
+ */
+ssize_t
+ucrp_channel_readfd(UCRP_CHANNEL *cp, int fd, size_t max)
+{
+	struct iovec iov[SESS_READMAX];
+	UCRP_SESSION *sp = cp->sp;
+	UCRP_BUF *bp;
+	UCRP hdr;
+	size_t frame, left, n;
+	ssize_t ret;
+	int avail, i, nframes;
+
+	frame = SESS_FRAME(sp);
+	if (ioctl(fd, FIONREAD, &avail) == 0 && avail > 0 && avail < max)
+		max = avail;
+	if (max > SESS_READMAX * frame)
+		max = SESS_READMAX * frame;
+	if (max == 0)
+		max = frame;
+	nframes = (max + frame - 1) / frame;
+
+	if ((bp = ucrp_buf_new(nframes * (UCRP_HDR_SIZE + frame))) == NULL)
+		return -1;
+
+	/* the headers go in the gaps once we know the lengths */
+	for (i = 0, left = max; i < nframes; i++, left -= n) {
+		n = left < frame ? left : frame;
+		iov[i].iov_base = bp->data +
+		    i * (UCRP_HDR_SIZE + frame) + UCRP_HDR_SIZE;
+		iov[i].iov_len = n;
+	}
+
+	while ((ret = readv(fd, iov, nframes)) == -1 && errno == EINTR)
+		;
+	if (ret <= 0) {
+		ucrp_buf_rele(bp);
+		return ret;
+	}
+
+	for (i = 0, left = ret; left > 0; i++, left -= n) {
+		n = left < frame ? left : frame;
+		hdr.type = UCRP_DISPLAY;
+		hdr.options = 0;
+		hdr.length = n;
+		if (sp->ext.flags & UCRP_EXT_CHANNELS)
+			UCRP_SETCHAN(&hdr, cp->id);
+		ucrp_msg_hton(&hdr);
+		memcpy(bp->data + i * (UCRP_HDR_SIZE + frame), &hdr,
+		       UCRP_HDR_SIZE);
+	}
+	bp->size = i * UCRP_HDR_SIZE + ret;
+
+	session_flushos(cp);
+	if (ucrp_session_queuebuf(sp, bp) == -1)
+		ret = -1;
+	ucrp_buf_rele(bp);
+
+	return ret;
+}
+
+/*
+ * ucrp_channel_interrupted()
+ *
+ * the cancellation token of the command running on the channel.
+ * command handlers running on a worker should poll it and give up
+ * early once it is set, anything they send after that is dropped.
+ * commands run inline are never interrupted.  it is set too once the
+ * output filters let nothing more through.
+ *
+ * returns 1 if the command was interrupted, 0 otherwise
+ */
+int
+ucrp_channel_interrupted(UCRP_CHANNEL *cp)
+{
+	UCRP_OSTREAM *os;
+
+	os = __atomic_load_n(&cp->os, __ATOMIC_ACQUIRE);
+	if (os != NULL && os->filter != NULL && os->filter->done)
+		return 1;
+
+	return ucrp_channel_cancelled(cp);
+}
+
+/*
+ * ucrp_channel_again()
+ *
+ * called by a command on a worker: when it returns, keep the channel
+ * and call fn(cp, arg) on a worker 'ms' milliseconds later as if it
+ * were the command, which may ask again in turn.  the worker is free
+ * in between.  if the channel is interrupted or the session closed
+ * first, fn(NULL, arg) is called on the session's thread instead,
+ * only to free 'arg'.
+ *
+ * returns 0 or -1 on error, if the command was interrupted already
+ */
+int
+ucrp_channel_again(UCRP_CHANNEL *cp, unsigned int ms,
+		   void (*fn)(UCRP_CHANNEL *, void *), void *arg)
+{
+	UCRP_JOB *job = ucrp_curjob;
+
+	if (job == NULL || job->cp != cp || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE)) {
+		errno = EINTR;
+		return -1;
+	}
+
+	job->fn = fn;
+	job->arg = arg;
+	job->delay = ms;
+	job->again = 1;
+
+	return 0;
+}
+
+/*
+ * ucrp_channel_cancelled()
+ *
+ * returns 1 if the client interrupted the command running on the
+ * channel, 0 otherwise
+ */
+int
+ucrp_channel_cancelled(UCRP_CHANNEL *cp)
+{
+	UCRP_JOB *job = ucrp_curjob;
+
+	if (job == NULL || job->cp != cp)
+		return 0;
+
+	return __atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * ucrp_channel_id()
+ */
+int
+ucrp_channel_id(UCRP_CHANNEL *cp)
+{
+	return cp->id;
+}
+
+/*
+ * ucrp_channel_session()
+ */
+UCRP_SESSION *
+ucrp_channel_session(UCRP_CHANNEL *cp)
+{
+	return cp->sp;
+}
@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * server statistics, see ucrp_stats.h
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ucrp_local.h"
+
+__thread int ucrp_curstat;
+
+static UCRP_STATS *stats_create(UCRP_SERVER *, size_t);
+static void        stats_hist(UCRP_STATS *, int, uint64_t *);
+
+/*
+ * ucrp_usec()
+ *
+ * returns a monotonic time in microseconds
+ */
+uint64_t
+ucrp_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * ucrp_hist_bucket()
+ *
+ * returns the histogram bucket for 'v'
+ */
+int
+ucrp_hist_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < UCRP_HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	if (e > 31)
+		return UCRP_HIST_BUCKETS - 1;
+
+	return (e - UCRP_HIST_SUBBITS + 1) * UCRP_HIST_SUB +
+		((v >> (e - UCRP_HIST_SUBBITS)) & (UCRP_HIST_SUB - 1));
+}
+
+/*
+ * ucrp_hist_value()
+ *
+ * returns the highest value bucket 'b' holds
+ */
+uint64_t
+ucrp_hist_value(int b)
+{
+	int e, sub;
+
+	if (b < UCRP_HIST_SUB)
+		return b;
+
+	e = b / UCRP_HIST_SUB + UCRP_HIST_SUBBITS - 1;
+	sub = b % UCRP_HIST_SUB;
+
+	return ((uint64_t)(UCRP_HIST_SUB + sub + 1) <<
+		(e - UCRP_HIST_SUBBITS)) - 1;
+}
+
+/*
+ * ucrp_hist_percentile()
+ *
+ * returns the value 'p' percent of the histogram's samples are at or
+ * below, 100 for the largest, or 0 if there are none
+ */
+uint64_t
+ucrp_hist_percentile(const uint64_t *hist, double p)
+{
+	uint64_t n, want, seen;
+	int b;
+
+	for (n = 0, b = 0; b < UCRP_HIST_BUCKETS; b++)
+		n += hist[b];
+	if (n == 0)
+		return 0;
+
+	want = (uint64_t)(n * p / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+
+	for (seen = 0, b = 0; b < UCRP_HIST_BUCKETS - 1; b++)
+		if ((seen += hist[b]) >= want)
+			break;
+
+	return ucrp_hist_value(b);
+}
+
+/*
+ * ucrp_stats_map()
+ *
+ * map the statistics segment in file 'path' read only
+ *
+ * returns the segment or NULL on error
+ */
+UCRP_STATS *
+ucrp_stats_map(const char *path)
+{
+	UCRP_STATS *st;
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	if (sb.st_size < sizeof(UCRP_STATS)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	st = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED)
+		return NULL;
+
+	/* the server writes the magic last */
+	if (__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) !=
+	    UCRP_STATS_MAGIC || st->version != UCRP_STATS_VERSION ||
+	    st->size != sb.st_size) {
+		munmap(st, sb.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return st;
+}
+
+/*
+ * ucrp_stats_unmap()
+ */
+void
+ucrp_stats_unmap(UCRP_STATS *st)
+{
+	munmap(st, st->size);
+
+	return;
+}
+
+/*
+ * stats_create()
+ *
+ * returns a zeroed segment of 'size' bytes, in the server's stats
+ * file if it has one, or NULL on error
+ */
+static UCRP_STATS *
+stats_create(UCRP_SERVER *srv, size_t size)
+{
+	void *p;
+	int fd;
+
+	if (srv->statspath == NULL)
+		return ucrp_mmap(&p, size) == -1 ? NULL : p;
+
+	if ((fd = open(srv->statspath, O_RDWR | O_CREAT | O_TRUNC |
+		       O_CLOEXEC, 0644)) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s: %s\n", __func__,
+			 srv->statspath, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) == -1 ||
+	    (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		      0)) == MAP_FAILED) {
+		ucrp_log(LOG_WARNING, "%s: %s: %s\n", __func__,
+			 srv->statspath, strerror(errno));
+		close(fd);
+		unlink(srv->statspath);
+		return NULL;
+	}
+
+	close(fd);
+
+	return p;
+}
+
+/*
+ * ucrp_stats_start()
+ *
+ * give the server a segment to count in, one io block per thread and
+ * one command block per worker, or per thread if commands run inline.
+ * a segment from an earlier ucrp_server_loop() is kept if it fits.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_stats_start(UCRP_SERVER *srv)
+{
+	UCRP_STATS *st;
+	size_t size;
+	int i, nworkers;
+
+	nworkers = srv->pool != NULL ? srv->pool->nworkers : srv->nshards;
+	size = UCRP_STATS_SIZE(srv->nshards, nworkers);
+
+	if ((st = srv->stats) != NULL && st->size != size) {
+		ucrp_stats_stop(srv);
+		st = NULL;
+	}
+
+	if (st == NULL) {
+		if ((st = stats_create(srv, size)) == NULL)
+			return -1;
+
+		st->version = UCRP_STATS_VERSION;
+		st->nio = srv->nshards;
+		st->nworkers = nworkers;
+		st->ncmds = srv->ncmds;
+		st->size = size;
+		st->started = time(NULL);
+		memcpy(st->cmdnames, srv->cmdnames, sizeof(st->cmdnames));
+		__atomic_store_n(&st->magic, UCRP_STATS_MAGIC,
+				 __ATOMIC_RELEASE);
+		srv->stats = st;
+	}
+
+	for (i = 0; i < srv->nshards; i++) {
+		srv->shards[i].stats = UCRP_STATS_IOP(st, i);
+		srv->shards[i].cmdstats = srv->pool != NULL ? NULL :
+			UCRP_STATS_WORKERP(st, i);
+	}
+
+	if (srv->pool != NULL)
+		for (i = 0; i < nworkers; i++)
+			srv->pool->workers[i].stats = UCRP_STATS_WORKERP(st, i);
+
+	return 0;
+}
+
+/*
+ * ucrp_stats_stop()
+ *
+ * unmap the server's segment and remove its file
+ */
+void
+ucrp_stats_stop(UCRP_SERVER *srv)
+{
+	int i;
+
+	if (srv->stats == NULL)
+		return;
+
+	for (i = 0; i < srv->nshards; i++) {
+		srv->shards[i].stats = &srv->shards[i].nostats;
+		srv->shards[i].cmdstats = NULL;
+	}
+
+	if (srv->statspath != NULL)
+		unlink(srv->statspath);
+	ucrp_munmap(srv->stats, srv->stats->size);
+	srv->stats = NULL;
+
+	return;
+}
+
+/*
+ * ucrp_stats_command()
+ *
+ * file the time since 'start' under the command that just returned
+ */
+void
+ucrp_stats_command(UCRP_STATS_WORKER *ws, uint64_t start)
+{
+	int b;
+
+	if (ws == NULL)
+		return;
+
+	b = ucrp_hist_bucket(ucrp_usec() - start);
+	STATS_ADD(ws->hist[ucrp_curstat][b], 1);
+	STATS_ADD(ws->commands, 1);
+	ucrp_curstat = 0;
+
+	return;
+}
+
+/*
+ * ucrp_server_setstats()
+ *
+ * keep the statistics in file 'path', where other processes can map
+ * them with ucrp_stats_map(), instead of anonymous memory.  the file
+ * is removed with the server.  must be called before
+ * ucrp_server_loop().
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_setstats(UCRP_SERVER *srv, const char *path)
+{
+	char *p;
+
+	p = NULL;
+	if (path != NULL && (p = strdup(path)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	free(srv->statspath);
+	srv->statspath = p;
+
+	return 0;
+}
+
+/*
+ * ucrp_server_cmdstat()
+ *
+ * name a command whose latencies are kept apart from the others, see
+ * ucrp_channel_cmdstat().  the same name gets the same id.  must be
+ * called before ucrp_server_loop().
+ *
+ * returns the id, or 0, where every other command goes, if there are
+ * UCRP_STATS_MAXCMDS already
+ */
+int
+ucrp_server_cmdstat(UCRP_SERVER *srv, const char *name)
+{
+	int i;
+
+	if (srv->ncmds == 0) {
+		snprintf(srv->cmdnames[0], UCRP_STATS_NAMELEN, "(other)");
+		srv->ncmds = 1;
+	}
+
+	for (i = 1; i < srv->ncmds; i++)
+		if (strncmp(srv->cmdnames[i], name,
+			    UCRP_STATS_NAMELEN - 1) == 0)
+			return i;
+
+	if (srv->ncmds == UCRP_STATS_MAXCMDS)
+		return 0;
+
+	snprintf(srv->cmdnames[srv->ncmds], UCRP_STATS_NAMELEN, "%s", name);
+
+	return srv->ncmds++;
+}
+
+/*
+ * ucrp_channel_cmdstat()
+ *
+ * called from the command callback, files the command's latency
+ * under 'id' from ucrp_server_cmdstat()
+ */
+void
+ucrp_channel_cmdstat(UCRP_CHANNEL *cp, int id)
+{
+	if (id > 0 && id < cp->sp->srv->ncmds)
+		ucrp_curstat = id;
+
+	return;
+}
+
+/*
+ * ucrp_server_stats()
+ *
+ * returns the server's statistics segment, NULL until
+ * ucrp_server_loop() runs
+ */
+UCRP_STATS *
+ucrp_server_stats(UCRP_SERVER *srv)
+{
+	return srv->stats;
+}
+
+/*
+ * stats_hist()
+ *
+ * add up command 'id's histograms from every worker into 'hist'
+ */
+static void
+stats_hist(UCRP_STATS *st, int id, uint64_t *hist)
+{
+	UCRP_STATS_WORKER *ws;
+	int i, b;
+
+	memset(hist, 0, UCRP_HIST_BUCKETS * sizeof(*hist));
+
+	for (i = 0; i < st->nworkers; i++) {
+		ws = UCRP_STATS_WORKERP(st, i);
+		for (b = 0; b < UCRP_HIST_BUCKETS; b++)
+			hist[b] += ws->hist[id][b];
+	}
+
+	return;
+}
+
+/*
+ * ucrp_server_printstats()
+ *
+ * write the server's statistics to 'os', and the tables in them to
+ * its channel, as 'show ucrp statistics' would
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_server_printstats(UCRP_SERVER *srv, UCRP_OSTREAM *os)
+{
+	uint64_t hist[UCRP_HIST_BUCKETS];
+	uint64_t n;
+	UCRP_STATS_IO sum, *io;
+	UCRP_TSTREAM *ts;
+	UCRP_STATS *st;
+	time_t up;
+	int i, t, type;
+
+	if ((st = srv->stats) == NULL)
+		return ucrp_ostream_printf(os, "%% No statistics yet.\n");
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < st->nio; i++) {
+		io = UCRP_STATS_IOP(st, i);
+		for (t = 0; t < UCRP_STATS_NTYPES; t++) {
+			sum.msgs_in[t] += io->msgs_in[t];
+			sum.bytes_in[t] += io->bytes_in[t];
+			sum.msgs_out[t] += io->msgs_out[t];
+			sum.bytes_out[t] += io->bytes_out[t];
+		}
+		sum.sessions += io->sessions;
+		sum.refused += io->refused;
+		sum.drained += io->drained;
+		sum.events += io->events;
+		sum.dropped += io->dropped;
+		sum.active += io->active;
+		sum.running += io->running;
+		sum.waiting[0] += io->waiting[0];
+		sum.waiting[1] += io->waiting[1];
+		sum.queued += io->queued;
+		sum.timers += io->timers;
+	}
+
+	for (n = 0, i = 0; i < st->nworkers; i++)
+		n += UCRP_STATS_WORKERP(st, i)->posted;
+
+	up = time(NULL) - st->started;
+	ucrp_ostream_printf(os, "Up %lldd %02d:%02d:%02d, %u io threads, "
+			    "%u workers\n", (long long)up / 86400,
+			    (int)(up / 3600 % 24), (int)(up / 60 % 60),
+			    (int)(up % 60), st->nio,
+			    srv->pool != NULL ? st->nworkers : 0);
+	ucrp_ostream_printf(os, "Sessions: %llu active, %llu accepted, "
+			    "%llu refused\n", (unsigned long long)sum.active,
+			    (unsigned long long)sum.sessions,
+			    (unsigned long long)sum.refused);
+	ucrp_ostream_printf(os, "Commands: %llu running, %llu waiting, "
+			    "%llu batch waiting\n",
+			    (unsigned long long)sum.running,
+			    (unsigned long long)sum.waiting[0],
+			    (unsigned long long)sum.waiting[1]);
+	ucrp_ostream_printf(os, "Posts: %llu from workers, %llu handled\n",
+			    (unsigned long long)n,
+			    (unsigned long long)sum.drained);
+	ucrp_ostream_printf(os, "Events: %llu queued, %llu dropped\n",
+			    (unsigned long long)sum.events,
+			    (unsigned long long)sum.dropped);
+	ucrp_ostream_printf(os, "Output: %llu bytes queued\n",
+			    (unsigned long long)sum.queued);
+	ucrp_ostream_printf(os, "Timers: %llu pending\n\n",
+			    (unsigned long long)sum.timers);
+
+	/* laid out by the client, if it can */
+	if ((ts = ucrp_channel_table(os->cp)) == NULL)
+		return -1;
+	ucrp_tstream_column(ts, "Message", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "In", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "InBytes", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Out", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "OutBytes", UCRP_COL_INT);
+	for (t = 0; t < UCRP_STATS_NTYPES; t++) {
+		if (sum.msgs_in[t] == 0 && sum.msgs_out[t] == 0)
+			continue;
+		type = t < 16 ? 100 + t : 200 + t - 16;
+		ucrp_tstream_str(ts, ucrp_strtype(type));
+		ucrp_tstream_int(ts, sum.msgs_in[t]);
+		ucrp_tstream_int(ts, sum.bytes_in[t]);
+		ucrp_tstream_int(ts, sum.msgs_out[t]);
+		ucrp_tstream_int(ts, sum.bytes_out[t]);
+	}
+	ucrp_tstream_end(ts);
+
+	ucrp_ostream_printf(os, "\n");
+	if ((ts = ucrp_channel_table(os->cp)) == NULL)
+		return -1;
+	ucrp_tstream_column(ts, "Command", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "Count", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "p50us", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "p90us", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "p99us", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "MaxUs", UCRP_COL_INT);
+	for (i = 0; i < st->ncmds; i++) {
+		stats_hist(st, i, hist);
+		for (n = 0, t = 0; t < UCRP_HIST_BUCKETS; t++)
+			n += hist[t];
+		if (n == 0)
+			continue;
+		ucrp_tstream_str(ts, st->cmdnames[i]);
+		ucrp_tstream_int(ts, n);
+		ucrp_tstream_int(ts, ucrp_hist_percentile(hist, 50));
+		ucrp_tstream_int(ts, ucrp_hist_percentile(hist, 90));
+		ucrp_tstream_int(ts, ucrp_hist_percentile(hist, 99));
+		ucrp_tstream_int(ts, ucrp_hist_percentile(hist, 100));
+	}
+
+	return ucrp_tstream_end(ts);
+}
@@ -0,0 +1,677 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "ucrp_local.h"
+
+#define ROWS_VARINT   10                       /* bytes, at most        */
+#define ROWS_OUTSIZE  16384                    /* printed per call      */
+
+typedef struct _rows_key {
+	int64_t        n;
+	const uint8_t *s;                      /* NULL: a number        */
+	size_t         slen;
+	size_t         row;                    /* where it starts       */
+	size_t         i;                      /* keeps the sort stable */
+} ROWS_KEY;
+
+static int    rows_grow(UCRP_ROWS *, size_t);
+static int    rows_cell(UCRP_ROWS *, int);
+static void   rows_done(UCRP_ROWS *);
+static void   rows_varint(UCRP_ROWS *, uint64_t);
+static int    rows_getvarint(const uint8_t **, const uint8_t *,
+			     uint64_t *);
+static int    rows_get(UCRP_ROWS *, const uint8_t **, const uint8_t *,
+		       int, int64_t *, const uint8_t **, size_t *);
+static size_t rows_scan(UCRP_ROWS *, const uint8_t *, size_t);
+static int    rows_cmp(const void *, const void *);
+
+/*
+ * ucrp_rows_new()
+ *
+ * returns an empty table, without columns, or NULL on error
+ */
+UCRP_ROWS *
+ucrp_rows_new(void)
+{
+	UCRP_ROWS *rows;
+
+	if ((rows = calloc(1, sizeof(*rows))) == NULL)
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+
+	return rows;
+}
+
+/*
+ * ucrp_rows_free()
+ */
+void
+ucrp_rows_free(UCRP_ROWS *rows)
+{
+	if (rows == NULL)
+		return;
+
+	free(rows->data);
+	free(rows->row);
+	free(rows);
+
+	return;
+}
+
+/*
+ * ucrp_rows_column()
+ *
+ * add a column called 'name' of UCRP_COL_* 'type', before any rows
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_rows_column(UCRP_ROWS *rows, const char *name, int type)
+{
+	if (rows->nrows > 0 || rows->cell > 0 ||
+	    rows->ncols == UCRP_TABLE_MAXCOLS ||
+	    (type != UCRP_COL_INT && type != UCRP_COL_STR) ||
+	    name[0] == '\0' || strpbrk(name, "=\r\n") != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(rows->name[rows->ncols], UCRP_TABLE_NAMELEN, "%s", name);
+	rows->type[rows->ncols] = type;
+	rows->ncols++;
+
+	return 0;
+}
+
+/*
+ * ucrp_rows_int()
+ *
+ * add a number as the next cell, rows fill up left to right
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_rows_int(UCRP_ROWS *rows, int64_t n)
+{
+	if (rows_cell(rows, UCRP_COL_INT) == -1)
+		return -1;
+
+	rows_varint(rows, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+	rows_done(rows);
+
+	return 0;
+}
+
+/*
+ * ucrp_rows_str()
+ *
+ * add text as the next cell
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_rows_str(UCRP_ROWS *rows, const char *s)
+{
+	size_t len;
+
+	len = strlen(s);
+	if (rows_cell(rows, UCRP_COL_STR) == -1 ||
+	    rows_grow(rows, len) == -1)
+		return -1;
+
+	rows_varint(rows, len);
+	memcpy(rows->data + rows->len, s, len);
+	rows->len += len;
+	rows_done(rows);
+
+	return 0;
+}
+
+/*
+ * rows_cell()
+ *
+ * make room for a cell of 'type', the next one of the row.  a new
+ * row starts where the last one ended.
+ *
+ * returns 0 or -1 on error
+ */
+static int
+rows_cell(UCRP_ROWS *rows, int type)
+{
+	size_t *p, size;
+
+	if (rows->ncols == 0 || rows->type[rows->cell] != type) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rows_grow(rows, ROWS_VARINT) == -1)
+		return -1;
+
+	if (rows->cell > 0)
+		return 0;
+
+	if (rows->nrows == rows->rowsize) {
+		size = rows->rowsize ? rows->rowsize * 2 : 64;
+		if ((p = realloc(rows->row, size * sizeof(*p))) == NULL) {
+			ucrp_log(LOG_WARNING, "%s: %s\n", __func__,
+				 strerror(errno));
+			return -1;
+		}
+		rows->row = p;
+		rows->rowsize = size;
+	}
+	rows->row[rows->nrows] = rows->len;
+
+	return 0;
+}
+
+/*
+ * rows_done()
+ *
+ * a cell was added, the row is complete after its last column
+ */
+static void
+rows_done(UCRP_ROWS *rows)
+{
+	if (++rows->cell == rows->ncols) {
+		rows->cell = 0;
+		rows->nrows++;
+	}
+
+	return;
+}
+
+/*
+ * rows_grow()
+ *
+ * make room for 'n' more bytes of rows
+ *
+ * returns 0 or -1 on error
+ */
+static int
+rows_grow(UCRP_ROWS *rows, size_t n)
+{
+	uint8_t *p;
+	size_t size;
+
+	if (rows->len + n <= rows->size)
+		return 0;
+
+	size = rows->size ? rows->size : 4096;
+	while (size < rows->len + n)
+		size *= 2;
+
+	if ((p = realloc(rows->data, size)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	rows->data = p;
+	rows->size = size;
+
+	return 0;
+}
+
+/*
+ * rows_varint()
+ *
+ * append 'v' seven bits at a time, low bits first, there is room
+ */
+static void
+rows_varint(UCRP_ROWS *rows, uint64_t v)
+{
+	while (v >= 0x80) {
+		rows->data[rows->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	rows->data[rows->len++] = v;
+
+	return;
+}
+
+/*
+ * rows_getvarint()
+ *
+ * returns 0 or -1 if the varint at '*p' runs past 'end'
+ */
+static int
+rows_getvarint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; *p < end && shift < 7 * ROWS_VARINT; shift += 7) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * rows_get()
+ *
+ * decode the cell at '*p' of column 'col' into 'n', or 's' and
+ * 'slen', and move past it
+ *
+ * returns 0 or -1 if it runs past 'end'
+ */
+static int
+rows_get(UCRP_ROWS *rows, const uint8_t **p, const uint8_t *end, int col,
+	 int64_t *n, const uint8_t **s, size_t *slen)
+{
+	uint64_t v;
+
+	if (rows_getvarint(p, end, &v) == -1)
+		return -1;
+
+	if (rows->type[col] == UCRP_COL_INT) {
+		*n = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		*s = NULL;
+		return 0;
+	}
+
+	if (v > end - *p)
+		return -1;
+
+	*s = *p;
+	*slen = v;
+	*p += v;
+
+	return 0;
+}
+
+/*
+ * ucrp_rows_text()
+ *
+ * the cells of the last row as text, a space apart, the way output
+ * filters see it
+ *
+ * returns the length of the text
+ */
+size_t
+ucrp_rows_text(UCRP_ROWS *rows, char *buf, size_t size)
+{
+	const uint8_t *p, *end, *s;
+	size_t len, slen;
+	int64_t n;
+	int i;
+
+	if (rows->nrows == 0 || size == 0)
+		return 0;
+
+	p = rows->data + rows->row[rows->nrows - 1];
+	end = rows->data + rows->len;
+	len = 0;
+	for (i = 0; i < rows->ncols && len < size - 1; i++) {
+		if (rows_get(rows, &p, end, i, &n, &s, &slen) == -1)
+			break;
+		if (s == NULL)
+			len += snprintf(buf + len, size - len, "%s%lld",
+					i > 0 ? " " : "", (long long)n);
+		else
+			len += snprintf(buf + len, size - len, "%s%.*s",
+					i > 0 ? " " : "", (int)slen, s);
+	}
+	if (len >= size)
+		len = size - 1;
+
+	return len;
+}
+
+/*
+ * ucrp_rows_drop()
+ *
+ * take the last row back out
+ */
+void
+ucrp_rows_drop(UCRP_ROWS *rows)
+{
+	if (rows->nrows == 0 || rows->cell != 0)
+		return;
+
+	rows->len = rows->row[--rows->nrows];
+
+	return;
+}
+
+/*
+ * ucrp_rows_schema()
+ *
+ * format the columns as the payload of a TABLE_HEAD message, one
+ * "name=type" line for each
+ *
+ * returns the length of the payload
+ */
+size_t
+ucrp_rows_schema(UCRP_ROWS *rows, char *buf, size_t size)
+{
+	size_t len;
+	int i;
+
+	len = 0;
+	buf[0] = '\0';
+
+	for (i = 0; i < rows->ncols; i++) {
+		len += snprintf(buf + len, size - len, "%s=%s\r\n",
+				rows->name[i],
+				rows->type[i] == UCRP_COL_INT ? "int" : "str");
+		if (len >= size) {
+			len = size - 1;
+			break;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * ucrp_rows_parse()
+ *
+ * add a received UCRP_TABLE message to 'rows'.  TABLE_HEAD starts the
+ * table over with the columns in it, others carry whole rows.  rows
+ * that don't decode are dropped.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_rows_parse(UCRP_ROWS *rows, UCRP *msg)
+{
+	char buf[UCRP_MAX_PAYLOAD + 1];
+	char *ln, *lp, *val;
+	size_t n;
+	int type;
+
+	if (msg->type != UCRP_TABLE || msg->length > UCRP_MAX_PAYLOAD) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((msg->options & TABLE_HEAD) == 0) {
+		if (rows_grow(rows, msg->length) == -1)
+			return -1;
+		n = rows_scan(rows, UCRP_PAYLOAD(msg), msg->length);
+		if (n < msg->length) {
+			UCRP_DEBUG((LOG_DEBUG, "%s: %zu bytes dropped\n",
+				    __func__, msg->length - n));
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	rows->ncols = 0;
+	rows->cell = 0;
+	rows->len = 0;
+	rows->nrows = 0;
+
+	/* work on a copy, ucrp_msg_getln() is destructive */
+	memcpy(buf, UCRP_PAYLOAD(msg), msg->length);
+	buf[msg->length] = '\0';
+
+	lp = buf;
+	while ((ln = ucrp_msg_getln(&lp)) != NULL) {
+		if ((val = strchr(ln, '=')) == NULL)
+			continue;
+		*val++ = '\0';
+
+		type = strcmp(val, "int") == 0 ? UCRP_COL_INT : UCRP_COL_STR;
+		if (ucrp_rows_column(rows, ln, type) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * rows_scan()
+ *
+ * add the whole rows in 'len' bytes at 'data', there is room
+ *
+ * returns the number of bytes used
+ */
+static size_t
+rows_scan(UCRP_ROWS *rows, const uint8_t *data, size_t len)
+{
+	const uint8_t *p, *row, *end, *s;
+	size_t used, slen;
+	int64_t n;
+	int i;
+
+	if (rows->ncols == 0)
+		return 0;
+
+	end = data + len;
+	for (used = 0, p = data; p < end; used = p - data) {
+		row = p;
+		for (i = 0; i < rows->ncols; i++)
+			if (rows_get(rows, &p, end, i, &n, &s, &slen) == -1)
+				return used;
+
+		if (rows_cell(rows, rows->type[0]) == -1)
+			return used;
+		memcpy(rows->data + rows->len, row, p - row);
+		rows->len += p - row;
+		rows->nrows++;
+	}
+
+	return used;
+}
+
+/*
+ * ucrp_rows_sort()
+ *
+ * sort the rows by column 'name', numbers by value and text byte by
+ * byte, in reverse if 'reverse'.  rows that are the same there keep
+ * their order.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_rows_sort(UCRP_ROWS *rows, const char *name, int reverse)
+{
+	const uint8_t *p, *end;
+	ROWS_KEY *keys, *k, t;
+	size_t i, j;
+	int col, c;
+
+	for (col = 0; col < rows->ncols; col++)
+		if (strcasecmp(rows->name[col], name) == 0)
+			break;
+	if (col == rows->ncols) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (rows->nrows < 2)
+		return 0;
+
+	if ((keys = calloc(rows->nrows, sizeof(*keys))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	end = rows->data + rows->len;
+	for (i = 0; i < rows->nrows; i++) {
+		k = &keys[i];
+		k->row = rows->row[i];
+		k->i = i;
+		p = rows->data + k->row;
+		for (c = 0; c <= col; c++)
+			rows_get(rows, &p, end, c, &k->n, &k->s, &k->slen);
+	}
+
+	qsort(keys, rows->nrows, sizeof(*keys), rows_cmp);
+
+	for (i = 0, j = rows->nrows - 1; reverse && i < j; i++, j--) {
+		t = keys[i];
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+
+	for (i = 0; i < rows->nrows; i++)
+		rows->row[i] = keys[i].row;
+
+	free(keys);
+
+	return 0;
+}
+
+/*
+ * rows_cmp()
+ *
+ * qsort() order of two ROWS_KEYs
+ */
+static int
+rows_cmp(const void *a, const void *b)
+{
+	const ROWS_KEY *ka = a, *kb = b;
+	int ret;
+
+	if (ka->s != NULL) {
+		ret = memcmp(ka->s, kb->s, ka->slen < kb->slen ?
+			     ka->slen : kb->slen);
+		if (ret == 0 && ka->slen != kb->slen)
+			ret = ka->slen < kb->slen ? -1 : 1;
+	} else
+		ret = ka->n < kb->n ? -1 : ka->n > kb->n;
+
+	if (ret == 0)
+		ret = ka->i < kb->i ? -1 : 1;
+
+	return ret;
+}
+
+/*
+ * ucrp_rows_print()
+ *
+ * lay the table out as text, with a line of column names on top,
+ * every column as wide as its widest cell.  when that is wider than
+ * 'width' the widest text columns are cut down to fit, if 'width'
+ * is not 0.  the text goes to 'out' a few lines at a time.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_rows_print(UCRP_ROWS *rows, int width,
+		int (*out)(const void *, size_t, void *), void *arg)
+{
+	int w[UCRP_TABLE_MAXCOLS], min[UCRP_TABLE_MAXCOLS];
+	char num[24], *buf, *lp;
+	const uint8_t *p, *end, *s;
+	size_t len, slen, i;
+	int64_t n;
+	int c, wide, total, cut, pad, ret;
+
+	if (rows->ncols == 0)
+		return 0;
+
+	for (c = 0; c < rows->ncols; c++)
+		w[c] = min[c] = strlen(rows->name[c]);
+
+	end = rows->data + rows->len;
+	for (i = 0; i < rows->nrows; i++) {
+		p = rows->data + rows->row[i];
+		for (c = 0; c < rows->ncols; c++) {
+			rows_get(rows, &p, end, c, &n, &s, &slen);
+			if (s == NULL)
+				slen = snprintf(num, sizeof(num), "%lld",
+						(long long)n);
+			if (slen > w[c])
+				w[c] = slen;
+		}
+	}
+
+	/* numbers stay whole, the widest text gives way first */
+	for (total = rows->ncols - 1, c = 0; c < rows->ncols; c++)
+		total += w[c];
+	while (width > 0 && total > width) {
+		for (wide = -1, c = 0; c < rows->ncols; c++)
+			if (rows->type[c] == UCRP_COL_STR && w[c] > min[c] &&
+			    (wide == -1 || w[c] > w[wide]))
+				wide = c;
+		if (wide == -1)
+			break;
+		cut = total - width;
+		if (cut > w[wide] - min[wide])
+			cut = w[wide] - min[wide];
+		w[wide] -= cut;
+		total -= cut;
+	}
+
+	if ((buf = malloc(ROWS_OUTSIZE + total + 2)) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	len = 0;
+	ret = 0;
+	for (i = 0; i <= rows->nrows && ret == 0; i++) {
+		lp = buf + len;
+		p = i > 0 ? rows->data + rows->row[i - 1] : NULL;
+		for (c = 0; c < rows->ncols; c++) {
+			if (p == NULL) {
+				s = (uint8_t *)rows->name[c];
+				slen = strlen(rows->name[c]);
+			} else {
+				rows_get(rows, &p, end, c, &n, &s, &slen);
+				if (s == NULL) {
+					slen = snprintf(num, sizeof(num),
+							"%lld", (long long)n);
+					s = (uint8_t *)num;
+				}
+			}
+			if (slen > w[c])
+				slen = w[c];
+			pad = w[c] - slen;
+
+			if (c > 0)
+				*lp++ = ' ';
+			if (rows->type[c] == UCRP_COL_INT) {
+				memset(lp, ' ', pad);
+				lp += pad;
+				pad = 0;
+			}
+			for (; slen > 0; slen--, s++)
+				*lp++ = *s < ' ' || *s == 0x7f ? '?' : *s;
+
+			/* nothing trails the last column */
+			if (c < rows->ncols - 1) {
+				memset(lp, ' ', pad);
+				lp += pad;
+			}
+		}
+		*lp++ = '\n';
+		len = lp - buf;
+
+		if (len >= ROWS_OUTSIZE || i == rows->nrows) {
+			ret = out(buf, len, arg);
+			len = 0;
+		}
+	}
+
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * timers, see UCRP_WHEEL
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+static void wheel_add(UCRP_WHEEL *, UCRP_TIMER *);
+static void wheel_cascade(UCRP_WHEEL *, int, int);
+static void timer_unlink(UCRP_TIMER *);
+
+/*
+ * ucrp_wheel_init()
+ */
+void
+ucrp_wheel_init(UCRP_WHEEL *w)
+{
+	int level, slot;
+
+	w->now = ucrp_msec();
+	w->n = 0;
+
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		w->used[level] = 0;
+		for (slot = 0; slot < TIMER_SLOTS; slot++)
+			LIST_INIT(&w->slots[level][slot]);
+	}
+
+	return;
+}
+
+/*
+ * wheel_add()
+ *
+ * put a timer in the slot for its deadline, as seen from now
+ */
+static void
+wheel_add(UCRP_WHEEL *w, UCRP_TIMER *tm)
+{
+	uint64_t when, delta;
+	int level, slot;
+
+	when = tm->expires > w->now ? tm->expires : w->now;
+	delta = when - w->now;
+	if (delta >= TIMER_REACH) {
+		when = w->now + TIMER_REACH - 1;
+		delta = TIMER_REACH - 1;
+	}
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < (uint64_t)1 << (TIMER_BITS * (level + 1)))
+			break;
+
+	slot = (when >> (TIMER_BITS * level)) & TIMER_MASK;
+	LIST_INSERT_HEAD(&w->slots[level][slot], tm, entry);
+	w->used[level] |= (uint64_t)1 << slot;
+	tm->slot = level * TIMER_SLOTS + slot;
+
+	return;
+}
+
+/*
+ * wheel_cascade()
+ *
+ * the level below has wrapped, spread a slot's timers over it
+ */
+static void
+wheel_cascade(UCRP_WHEEL *w, int level, int slot)
+{
+	UCRP_TIMER *tm, *next;
+
+	/* some may land here again, go by the list as it was */
+	tm = LIST_FIRST(&w->slots[level][slot]);
+	LIST_INIT(&w->slots[level][slot]);
+	w->used[level] &= ~((uint64_t)1 << slot);
+
+	for (; tm != NULL; tm = next) {
+		next = LIST_NEXT(tm, entry);
+		wheel_add(w, tm);
+	}
+
+	return;
+}
+
+/*
+ * ucrp_wheel_run()
+ *
+ * move the wheel up to now, running the timers that are due.  ticks
+ * with nothing to do on the bottom level are skipped over.
+ */
+void
+ucrp_wheel_run(UCRP_WHEEL *w)
+{
+	UCRP_TIMER *tm;
+	uint64_t target, t, bits;
+	int idx, level, slot;
+
+	target = ucrp_msec();
+
+	while (w->now < target) {
+		if (w->n == 0) {
+			w->now = target;
+			break;
+		}
+
+		t = w->now + 1;
+		idx = t & TIMER_MASK;
+		if (idx != 0) {
+			if ((bits = w->used[0] >> idx) == 0) {
+				t = (t | TIMER_MASK) + 1;
+				idx = 0;
+			} else {
+				t += __builtin_ctzll(bits);
+				idx = t & TIMER_MASK;
+			}
+
+			if (t > target) {
+				w->now = target;
+				break;
+			}
+		}
+
+		w->now = t;
+
+		/* every wrap brings the next slot of the level above down */
+		for (level = 1; idx == 0 && level < TIMER_LEVELS; level++) {
+			slot = (t >> (TIMER_BITS * level)) & TIMER_MASK;
+			wheel_cascade(w, level, slot);
+			if (slot != 0)
+				break;
+		}
+
+		/* a timer set from here is never due on this tick */
+		while ((tm = LIST_FIRST(&w->slots[0][idx])) != NULL) {
+			LIST_REMOVE(tm, entry);
+			tm->pending = 0;
+			w->n--;
+			tm->f(tm, tm->arg);
+		}
+		w->used[0] &= ~((uint64_t)1 << idx);
+	}
+
+	return;
+}
+
+/*
+ * ucrp_wheel_timeout()
+ *
+ * returns the milliseconds until the wheel has something to do, a
+ * timer to run or a slot to bring down, or -1 if it has no timers,
+ * for epoll_wait()
+ */
+int
+ucrp_wheel_timeout(UCRP_WHEEL *w)
+{
+	uint64_t next, at, pos, bits, now;
+	int level, rot;
+
+	if (w->n == 0)
+		return -1;
+
+	next = UINT64_MAX;
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		if (w->used[level] == 0)
+			continue;
+
+		/* the slots in the order they come round, from the next */
+		pos = (w->now >> (TIMER_BITS * level)) + 1;
+		rot = pos & TIMER_MASK;
+		bits = w->used[level] >> rot;
+		if (rot != 0)
+			bits |= w->used[level] << (TIMER_SLOTS - rot);
+
+		at = (pos + __builtin_ctzll(bits)) << (TIMER_BITS * level);
+		if (at < next)
+			next = at;
+	}
+
+	now = ucrp_msec();
+	if (next <= now)
+		return 0;
+
+	return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+/*
+ * ucrp_timer_init()
+ *
+ * set up a timer of shard 'shp' that calls f(tm, arg)
+ */
+void
+ucrp_timer_init(UCRP_TIMER *tm, UCRP_SHARD *shp,
+		void (*f)(UCRP_TIMER *, void *), void *arg)
+{
+	memset(tm, 0, sizeof(*tm));
+	tm->shard = shp;
+	tm->f = f;
+	tm->arg = arg;
+
+	return;
+}
+
+/*
+ * ucrp_timer_new()
+ *
+ * returns a timer of session 'sp' that calls f(tm, arg), not set, or
+ * NULL on error
+ */
+UCRP_TIMER *
+ucrp_timer_new(UCRP_SESSION *sp, void (*f)(UCRP_TIMER *, void *), void *arg)
+{
+	UCRP_TIMER *tm;
+
+	if ((tm = malloc(sizeof(*tm))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	ucrp_timer_init(tm, sp->shard, f, arg);
+	tm->sp = sp;
+	LIST_INSERT_HEAD(&sp->timers, tm, sessent);
+
+	return tm;
+}
+
+/*
+ * timer_unlink()
+ *
+ * take a pending timer off the wheel
+ */
+static void
+timer_unlink(UCRP_TIMER *tm)
+{
+	UCRP_WHEEL *w = &tm->shard->wheel;
+	int level = tm->slot / TIMER_SLOTS, slot = tm->slot % TIMER_SLOTS;
+
+	LIST_REMOVE(tm, entry);
+	if (LIST_EMPTY(&w->slots[level][slot]))
+		w->used[level] &= ~((uint64_t)1 << slot);
+
+	tm->pending = 0;
+	w->n--;
+
+	return;
+}
+
+/*
+ * ucrp_timer_set()
+ *
+ * run the timer in 'ms' milliseconds, at the earliest on the next
+ * tick
+ */
+void
+ucrp_timer_set(UCRP_TIMER *tm, unsigned int ms)
+{
+	UCRP_WHEEL *w = &tm->shard->wheel;
+
+	if (ucrp_curshard != tm->shard) {
+		ucrp_shard_postptr(tm->shard, POST_TIMER, tm->sp, tm,
+				   ms > INT_MAX ? INT_MAX : ms);
+		return;
+	}
+
+	if (tm->pending)
+		timer_unlink(tm);
+
+	tm->expires = ucrp_msec() + ms;
+	if (tm->expires <= w->now)
+		tm->expires = w->now + 1;
+
+	wheel_add(w, tm);
+	tm->pending = 1;
+	w->n++;
+
+	return;
+}
+
+/*
+ * ucrp_timer_cancel()
+ */
+void
+ucrp_timer_cancel(UCRP_TIMER *tm)
+{
+	if (ucrp_curshard != tm->shard) {
+		ucrp_shard_postptr(tm->shard, POST_TIMER, tm->sp, tm, -1);
+		return;
+	}
+
+	if (tm->pending)
+		timer_unlink(tm);
+
+	return;
+}
+
+/*
+ * ucrp_timer_pending()
+ *
+ * returns 1 if the timer is set and has not run yet, 0 otherwise
+ */
+int
+ucrp_timer_pending(UCRP_TIMER *tm)
+{
+	return tm->pending;
+}
+
+/*
+ * ucrp_timer_free()
+ */
+void
+ucrp_timer_free(UCRP_TIMER *tm)
+{
+	if (tm->pending)
+		timer_unlink(tm);
+
+	if (tm->sp != NULL)
+		LIST_REMOVE(tm, sessent);
+
+	free(tm);
+
+	return;
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+#define TSTREAM_WIDTH 80                       /* without COLUMNS       */
+
+static int tstream_head(UCRP_TSTREAM *);
+static int tstream_row(UCRP_TSTREAM *);
+static int tstream_send(UCRP_TSTREAM *, uint16_t, size_t);
+static int tstream_write(const void *, size_t, void *);
+
+/*
+ * ucrp_channel_table()
+ *
+ * returns a new table to send on the channel, or NULL on error
+ */
+UCRP_TSTREAM *
+ucrp_channel_table(UCRP_CHANNEL *cp)
+{
+	UCRP_TSTREAM *ts;
+	UCRP_EXT *ext;
+
+	if ((ts = calloc(1, sizeof(*ts))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	if ((ts->rows = ucrp_rows_new()) == NULL) {
+		free(ts);
+		return NULL;
+	}
+
+	ts->cp = cp;
+	ext = ucrp_session_ext(cp->sp);
+	ts->native = (ext->flags & UCRP_EXT_TABLES) != 0;
+
+	/* a screen compares text */
+	if (cp->os != NULL && cp->os->capture != NULL)
+		ts->native = 0;
+	ts->columns = (ext->flags & UCRP_EXT_COLUMNS) ? ext->columns :
+	    TSTREAM_WIDTH;
+
+	return ts;
+}
+
+/*
+ * ucrp_tstream_column()
+ *
+ * add a column called 'name' of UCRP_COL_* 'type', before any cells
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_tstream_column(UCRP_TSTREAM *ts, const char *name, int type)
+{
+	if (ts->started) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ucrp_rows_column(ts->rows, name, type);
+}
+
+/*
+ * ucrp_tstream_int()
+ *
+ * add a number as the next cell
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_tstream_int(UCRP_TSTREAM *ts, int64_t n)
+{
+	if (tstream_head(ts) == -1 || ucrp_rows_int(ts->rows, n) == -1)
+		return -1;
+
+	return tstream_row(ts);
+}
+
+/*
+ * ucrp_tstream_str()
+ *
+ * add text as the next cell.  sent as a table, text is cut short
+ * where the row would no longer fit in a message.
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_tstream_str(UCRP_TSTREAM *ts, const char *s)
+{
+	UCRP_ROWS *rows = ts->rows;
+	char buf[UCRP_MAX_PAYLOAD];
+	ssize_t room;
+
+	if (tstream_head(ts) == -1)
+		return -1;
+
+	if (ts->native) {
+		/* what this row has, and the most the rest of it takes */
+		room = UCRP_MAX_PAYLOAD - 3 -
+		    (rows->cell > 0 ? rows->len - rows->row[rows->nrows] : 0) -
+		    (rows->ncols - rows->cell - 1) * 10;
+		if (room < 0)
+			room = 0;
+		if (strlen(s) > room) {
+			snprintf(buf, sizeof(buf), "%.*s", (int)room, s);
+			s = buf;
+		}
+	}
+
+	if (ucrp_rows_str(rows, s) == -1)
+		return -1;
+
+	return tstream_row(ts);
+}
+
+/*
+ * ucrp_tstream_end()
+ *
+ * send the rest of the table, or print all of it, and free the
+ * stream
+ *
+ * returns 0 or -1 on error
+ */
+int
+ucrp_tstream_end(UCRP_TSTREAM *ts)
+{
+	UCRP_OSTREAM *os;
+	int ret;
+
+	ret = 0;
+	if (ucrp_channel_cancelled(ts->cp))
+		;
+	else if (ts->native) {
+		if ((ret = tstream_head(ts)) == 0)
+			ret = tstream_send(ts, TABLE_END, ts->rows->len);
+	} else if ((os = ucrp_channel_ostream(ts->cp)) == NULL)
+		ret = -1;
+	else
+		ret = ucrp_rows_print(ts->rows, ts->columns, tstream_write, os);
+
+	ucrp_rows_free(ts->rows);
+	free(ts);
+
+	return ret;
+}
+
+/*
+ * tstream_head()
+ *
+ * send the columns ahead of the first row
+ *
+ * returns 0 or -1 on error
+ */
+static int
+tstream_head(UCRP_TSTREAM *ts)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	if (ts->started)
+		return 0;
+	ts->started = 1;
+
+	if (!ts->native)
+		return 0;
+
+	sm->type = UCRP_TABLE;
+	sm->options = TABLE_HEAD;
+	sm->length = ucrp_rows_schema(ts->rows, (char *)UCRP_PAYLOAD(sm),
+				      UCRP_MAX_PAYLOAD);
+
+	return ucrp_channel_send(ts->cp, sm);
+}
+
+/*
+ * tstream_row()
+ *
+ * once a row is complete, send the ones before it if it doesn't fit
+ * in the same message
+ *
+ * returns 0 or -1 on error
+ */
+static int
+tstream_row(UCRP_TSTREAM *ts)
+{
+	UCRP_ROWS *rows = ts->rows;
+	UCRP_OSTREAM *os;
+	char buf[FILTER_LINEMAX];
+	size_t last, n;
+
+	if (rows->cell != 0)
+		return 0;
+
+	/* a row the filters don't pass is taken back out */
+	os = __atomic_load_n(&ts->cp->os, __ATOMIC_ACQUIRE);
+	if (os != NULL && os->filter != NULL) {
+		n = ucrp_rows_text(rows, buf, sizeof(buf));
+		pthread_mutex_lock(&os->lock);
+		if (!ucrp_filter_row(os->filter, buf, n))
+			ucrp_rows_drop(rows);
+		pthread_mutex_unlock(&os->lock);
+	}
+
+	if (!ts->native || rows->len <= UCRP_MAX_PAYLOAD)
+		return 0;
+
+	last = rows->row[rows->nrows - 1];
+	if (tstream_send(ts, 0, last) == -1)
+		return -1;
+
+	memmove(rows->data, rows->data + last, rows->len - last);
+	rows->len -= last;
+	rows->row[0] = 0;
+	rows->nrows = 1;
+
+	return 0;
+}
+
+/*
+ * tstream_send()
+ *
+ * send the first 'len' bytes of rows, unless the command was
+ * interrupted
+ *
+ * returns 0 or -1 on error
+ */
+static int
+tstream_send(UCRP_TSTREAM *ts, uint16_t opts, size_t len)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	if (ucrp_channel_cancelled(ts->cp))
+		return 0;
+
+	ucrp_msg_table(sm, opts, ts->rows->data, len);
+
+	return ucrp_channel_send(ts->cp, sm);
+}
+
+/*
+ * tstream_write()
+ *
+ * ucrp_rows_print() output for clients without tables
+ *
+ * returns 0 or -1 on error
+ */
+static int
+tstream_write(const void *data, size_t len, void *arg)
+{
+	/* the rows were filtered on the way in */
+	return ucrp_ostream_writeraw(arg, data, len);
+}
@@ -43,6 +43,14 @@ ucrp_strtype(uint16_t type)
 		return "UCRP_SWINSZ";
 	case UCRP_EXEC:
 		return "UCRP_EXEC";
+	case UCRP_EXTENDED:
+		return "UCRP_EXTENDED";
+	case UCRP_INTERRUPTED:
+		return "UCRP_INTERRUPTED";
+	case UCRP_TABLE:
+		return "UCRP_TABLE";
+	case UCRP_UPDATE:
+		return "UCRP_UPDATE";
 	case UCRP_COMMAND:
 		return "UCRP_COMMAND";
 	case UCRP_COMPLETE:
@@ -57,6 +65,8 @@ ucrp_strtype(uint16_t type)
 		return "UCRP_SUSPEND";
 	case UCRP_WAIT:
 		return "UCRP_WAIT";
+	case UCRP_EXTEND:
+		return "UCRP_EXTEND";
 	default:
 		break;
 	}
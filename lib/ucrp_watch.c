@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * descriptors of the application in the event loop, see UCRP_WATCH
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ucrp_local.h"
+
+static void watch_handler(UCRP_EV *, uint32_t);
+static int  watch_events(UCRP_WATCH *, uint32_t);
+
+/*
+ * ucrp_watch_new()
+ *
+ * watch 'fd' for session 'sp', calling f(wp, fd, arg) when it can be
+ * read.  must be called on the session's thread.
+ *
+ * returns the watch or NULL on error
+ */
+UCRP_WATCH *
+ucrp_watch_new(UCRP_SESSION *sp, int fd,
+	       void (*f)(UCRP_WATCH *, int, void *), void *arg)
+{
+	struct epoll_event ee;
+	UCRP_WATCH *wp;
+
+	if ((wp = calloc(1, sizeof(*wp))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	wp->ev.fd = fd;
+	wp->ev.handler = watch_handler;
+	wp->sp = sp;
+	wp->evmask = sp->held ? 0 : EPOLLIN;
+	wp->f = f;
+	wp->arg = arg;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = wp->evmask;
+	ee.data.ptr = &wp->ev;
+	if (epoll_ctl(sp->shard->epfd, EPOLL_CTL_ADD, fd, &ee) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		free(wp);
+		return NULL;
+	}
+
+	LIST_INSERT_HEAD(&sp->watches, wp, entry);
+
+	return wp;
+}
+
+/*
+ * watch_events()
+ *
+ * register 'mask' for the watch
+ *
+ * returns 0 or -1 on error
+ */
+static int
+watch_events(UCRP_WATCH *wp, uint32_t mask)
+{
+	struct epoll_event ee;
+
+	if (mask == wp->evmask)
+		return 0;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = mask;
+	ee.data.ptr = &wp->ev;
+	if (epoll_ctl(wp->sp->shard->epfd, EPOLL_CTL_MOD, wp->ev.fd,
+		      &ee) == -1) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	wp->evmask = mask;
+
+	return 0;
+}
+
+/*
+ * watch_handler()
+ *
+ * event loop callback
+ */
+static void
+watch_handler(UCRP_EV *ev, uint32_t events)
+{
+	UCRP_WATCH *wp = (UCRP_WATCH *)ev;
+
+	/* stopped or freed earlier in this batch */
+	if (wp->dead || wp->evmask == 0)
+		return;
+
+	wp->f(wp, wp->ev.fd, wp->arg);
+
+	return;
+}
+
+/*
+ * ucrp_watch_hold()
+ *
+ * hold the session's watches off, or let them go again
+ */
+void
+ucrp_watch_hold(UCRP_SESSION *sp, int hold)
+{
+	UCRP_WATCH *wp;
+
+	if (sp->held == hold)
+		return;
+
+	sp->held = hold;
+	LIST_FOREACH(wp, &sp->watches, entry)
+		if (!wp->dead)
+			watch_events(wp, hold ? 0 : EPOLLIN);
+
+	return;
+}
+
+/*
+ * ucrp_watch_stop()
+ *
+ * take the watches of a session that is going away out of the event
+ * loop, the application frees them or they go with the session
+ */
+void
+ucrp_watch_stop(UCRP_SESSION *sp)
+{
+	UCRP_WATCH *wp;
+
+	LIST_FOREACH(wp, &sp->watches, entry) {
+		if (wp->dead)
+			continue;
+		epoll_ctl(sp->shard->epfd, EPOLL_CTL_DEL, wp->ev.fd, NULL);
+		wp->dead = 1;
+	}
+
+	return;
+}
+
+/*
+ * ucrp_watch_free()
+ *
+ * stop watching, on the session's thread.  the descriptor is left
+ * open.
+ */
+void
+ucrp_watch_free(UCRP_WATCH *wp)
+{
+	UCRP_SHARD *shp = wp->sp->shard;
+
+	if (!wp->dead)
+		epoll_ctl(shp->epfd, EPOLL_CTL_DEL, wp->ev.fd, NULL);
+	wp->dead = 1;
+
+	LIST_REMOVE(wp, entry);
+	LIST_INSERT_HEAD(&shp->reap, wp, entry);
+
+	return;
+}
+
+/*
+ * ucrp_watch_reap()
+ *
+ * free the watches freed since the last batch of events
+ */
+void
+ucrp_watch_reap(UCRP_SHARD *shp)
+{
+	UCRP_WATCH *wp;
+
+	while ((wp = LIST_FIRST(&shp->reap)) != NULL) {
+		LIST_REMOVE(wp, entry);
+		free(wp);
+	}
+
+	return;
+}
@@ -0,0 +1,905 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ucrp-loadgen -- protocol level load generator
+ *
+ * opens 'sessions' sessions from one event loop and runs a mix of
+ * commands, completions, help requests and ASK/TELL exchanges on
+ * them.  closed loop, the default, every session sends its next
+ * request as soon as the last one is done.  open loop (-r rate)
+ * requests start at a fixed rate spread over the sessions whether
+ * the server keeps up or not: one that finds no session idle waits
+ * for one, and its latency counts from when it should have started.
+ *
+ * the time to the first UCRP_DISPLAY of a request and to its end, the
+ * UCRP_PROMPT (UCRP_COMPLETED and UCRP_HELPED for completions and
+ * help), is reported in microseconds as JSON.  requests started in
+ * the warmup are not counted.
+ *
+ * a script has a request per line, "weight kind text", where kind is
+ * command, complete, help or ask.  an ask is a command that asks, its
+ * text is the answer followed by the command:
+ *
+ *	10 command show version
+ *	2  complete sh ver
+ *	2  help show
+ *	1  ask Y askc
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ucrp.h>
+#include <ucrp_stats.h>
+
+#define LG_RXSIZE    4096                  /* >= UCRP_MAX_MSGSIZE      */
+#define LG_TXSIZE    (2 * UCRP_MAX_MSGSIZE)
+#define LG_MAXSTEPS  64
+#define LG_MAXEVENTS 256
+#define LG_BACKLOG   65536                 /* open loop, waiting       */
+#define LG_DRAIN     10.0                  /* s for the last replies   */
+
+#define STEP_COMMAND  0
+#define STEP_COMPLETE 1
+#define STEP_HELP     2
+#define STEP_ASK      3
+
+static char *kinds[] = { "command", "complete", "help", "ask" };
+
+#define SESS_CONNECT  0                    /* waiting for the prompt   */
+#define SESS_EXTEND   1                    /* waiting for UCRP_EXTENDED */
+#define SESS_IDLE     2
+#define SESS_BUSY     3
+#define SESS_DEAD     4
+
+typedef struct _lg_lat {
+	uint64_t hist[UCRP_HIST_BUCKETS];  /* microseconds             */
+	uint64_t n;
+	uint64_t max;
+} LG_LAT;
+
+typedef struct _lg_step {
+	int      kind;                     /* STEP_*                   */
+	int      weight;
+	char    *text;
+	char    *answer;                   /* STEP_ASK                 */
+	uint64_t requests;
+	LG_LAT   first;                    /* to the first UCRP_DISPLAY */
+	LG_LAT   done;                     /* to the end               */
+} LG_STEP;
+
+typedef struct _lg_sess {
+	int      fd;
+	int      state;                    /* SESS_*                   */
+	LG_STEP *step;                     /* running                  */
+	double   start;                    /* when it started, or was  */
+					   /* meant to                 */
+	int      displayed;
+	int      asked;
+	size_t   rxlen;
+	size_t   txlen;
+	struct _lg_sess *next;             /* on the idle list         */
+	uint8_t  rx[LG_RXSIZE];
+	uint8_t  tx[LG_TXSIZE];
+} LG_SESS;
+
+extern char *__progname;
+
+static LG_STEP  steps[LG_MAXSTEPS];
+static int      nsteps;
+static int      weights;                   /* of all the steps         */
+static LG_LAT   first, done;               /* of all the steps         */
+static LG_SESS *idle;
+static int      ep;
+static int      batch;
+static int      closedloop;
+static double   tmeasure;                  /* warmup is over           */
+static uint64_t requests, errors, busy, ready;
+
+static double   now(void);
+static void     lat_add(LG_LAT *, double);
+static uint64_t lat_pct(LG_LAT *, double);
+static void     lat_json(char *, LG_LAT *, char *);
+static void     json_str(char *);
+static int      script_add(char *, int);
+static void     script_load(char *);
+static LG_STEP *step_pick(void);
+static int      sess_connect(LG_SESS *, struct addrinfo *);
+static void     sess_fail(LG_SESS *);
+static void     sess_send(LG_SESS *, UCRP *);
+static void     sess_flush(LG_SESS *);
+static void     sess_start(LG_SESS *, double);
+static void     sess_done(LG_SESS *);
+static void     sess_read(LG_SESS *);
+static void     sess_msg(LG_SESS *, UCRP *);
+static void     usage(void);
+
+/*
+ * now()
+ *
+ * returns the current time in seconds
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * lat_add()
+ *
+ * count a latency of 't' seconds
+ */
+static void
+lat_add(LG_LAT *lp, double t)
+{
+	uint64_t us;
+
+	us = t > 0 ? (uint64_t)(t * 1e6) : 0;
+	lp->hist[ucrp_hist_bucket(us)]++;
+	lp->n++;
+	if (us > lp->max)
+		lp->max = us;
+
+	return;
+}
+
+/*
+ * lat_pct()
+ *
+ * returns the 'p'th percentile, no more than the largest seen
+ */
+static uint64_t
+lat_pct(LG_LAT *lp, double p)
+{
+	uint64_t v = ucrp_hist_percentile(lp->hist, p);
+
+	return v < lp->max ? v : lp->max;
+}
+
+/*
+ * lat_json()
+ *
+ * print a latency as a JSON member called 'name', followed by 'sep'
+ */
+static void
+lat_json(char *name, LG_LAT *lp, char *sep)
+{
+	printf("\"%s\": {\"count\": %llu, \"p50\": %llu, \"p99\": %llu, "
+	       "\"p999\": %llu, \"max\": %llu}%s", name,
+	       (unsigned long long)lp->n,
+	       (unsigned long long)lat_pct(lp, 50),
+	       (unsigned long long)lat_pct(lp, 99),
+	       (unsigned long long)lat_pct(lp, 99.9),
+	       (unsigned long long)lp->max, sep);
+
+	return;
+}
+
+/*
+ * json_str()
+ *
+ * print 's' as a JSON string
+ */
+static void
+json_str(char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+
+	return;
+}
+
+/*
+ * script_add()
+ *
+ * add the step on script line 'line', number 'n' for errors
+ *
+ * returns 0, or -1 if the line is empty or a comment
+ */
+static int
+script_add(char *line, int n)
+{
+	LG_STEP *stp;
+	char *p, *kind, *text;
+	int i, weight;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	for (p = line; isspace((unsigned char)*p); p++)
+		;
+	if (*p == '\0' || *p == '#')
+		return -1;
+
+	weight = strtol(p, &p, 10);
+	kind = strtok(p, " \t");
+	text = strtok(NULL, "");
+	if (weight < 1 || kind == NULL)
+		errx(EX_DATAERR, "line %d: weight and kind expected", n);
+	while (text != NULL && isspace((unsigned char)*text))
+		text++;
+	if (text == NULL)
+		text = "";
+
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+		if (strcmp(kind, kinds[i]) == 0)
+			break;
+	if (i == sizeof(kinds) / sizeof(kinds[0]))
+		errx(EX_DATAERR, "line %d: unknown kind \"%s\"", n, kind);
+
+	if (nsteps == LG_MAXSTEPS)
+		errx(EX_DATAERR, "line %d: more than %d steps", n,
+		     LG_MAXSTEPS);
+
+	stp = &steps[nsteps++];
+	stp->kind = i;
+	stp->weight = weight;
+	if ((stp->text = strdup(text)) == NULL)
+		err(EX_OSERR, "strdup");
+
+	/* the answer comes first */
+	if (i == STEP_ASK) {
+		stp->answer = strsep(&stp->text, " \t");
+		if (stp->text == NULL || *stp->text == '\0')
+			errx(EX_DATAERR, "line %d: answer and command "
+			     "expected", n);
+	}
+	weights += weight;
+
+	return 0;
+}
+
+/*
+ * script_load()
+ *
+ * read the steps from 'path', or take the default mix, which suits
+ * test-server/ucrp-server, if it is NULL
+ */
+static void
+script_load(char *path)
+{
+	static char *mix[] = {
+		"10 command show version",
+		"2 complete sh ver",
+		"2 help show",
+		"1 ask Y askc",
+		NULL
+	};
+	char line[UCRP_MAX_PAYLOAD];
+	FILE *fp;
+	int i;
+
+	if (path == NULL) {
+		for (i = 0; mix[i] != NULL; i++) {
+			snprintf(line, sizeof(line), "%s", mix[i]);
+			script_add(line, i + 1);
+		}
+		return;
+	}
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(EX_NOINPUT, "%s", path);
+
+	for (i = 1; fgets(line, sizeof(line), fp) != NULL; i++)
+		script_add(line, i);
+	fclose(fp);
+
+	if (nsteps == 0)
+		errx(EX_DATAERR, "%s: no steps", path);
+
+	return;
+}
+
+/*
+ * step_pick()
+ *
+ * returns a step at random, as often as its weight says
+ */
+static LG_STEP *
+step_pick(void)
+{
+	int i, w;
+
+	w = random() % weights;
+	for (i = 0; i < nsteps - 1; i++)
+		if ((w -= steps[i].weight) < 0)
+			break;
+
+	return &steps[i];
+}
+
+/*
+ * sess_connect()
+ *
+ * start a non-blocking connect
+ *
+ * returns 0 or -1 on error
+ */
+static int
+sess_connect(LG_SESS *sp, struct addrinfo *ai)
+{
+	struct epoll_event ee;
+	int on = 1;
+
+	sp->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+			ai->ai_protocol);
+	if (sp->fd == -1)
+		return -1;
+
+	setsockopt(sp->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (connect(sp->fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		close(sp->fd);
+		return -1;
+	}
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN;
+	ee.data.ptr = sp;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, sp->fd, &ee) == -1) {
+		close(sp->fd);
+		return -1;
+	}
+
+	sp->state = SESS_CONNECT;
+
+	return 0;
+}
+
+/*
+ * sess_fail()
+ *
+ * the session is no use any more, close it
+ */
+static void
+sess_fail(LG_SESS *sp)
+{
+	if (sp->state == SESS_DEAD)
+		return;
+
+	if (sp->state == SESS_BUSY) {
+		busy--;
+		errors++;
+	}
+	if (sp->state == SESS_IDLE || sp->state == SESS_BUSY)
+		ready--;
+
+	close(sp->fd);
+	sp->state = SESS_DEAD;
+
+	return;
+}
+
+/*
+ * sess_send()
+ *
+ * queue message 'msg' for the server
+ */
+static void
+sess_send(LG_SESS *sp, UCRP *msg)
+{
+	size_t len = UCRP_HDR_SIZE + msg->length;
+
+	if (sp->txlen + len > sizeof(sp->tx)) {
+		warnx("session %d: output overrun", sp->fd);
+		sess_fail(sp);
+		return;
+	}
+
+	ucrp_msg_hton(msg);
+	memcpy(sp->tx + sp->txlen, msg, len);
+	sp->txlen += len;
+
+	sess_flush(sp);
+
+	return;
+}
+
+/*
+ * sess_flush()
+ *
+ * write out what is queued, waiting for room if there is none
+ */
+static void
+sess_flush(LG_SESS *sp)
+{
+	struct epoll_event ee;
+	ssize_t ret;
+
+	if (sp->state == SESS_DEAD)
+		return;
+
+	while (sp->txlen > 0) {
+		ret = send(sp->fd, sp->tx, sp->txlen, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && errno == EAGAIN)
+			break;
+		if (ret == -1) {
+			sess_fail(sp);
+			return;
+		}
+
+		memmove(sp->tx, sp->tx + ret, sp->txlen - ret);
+		sp->txlen -= ret;
+	}
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN | (sp->txlen > 0 ? EPOLLOUT : 0);
+	ee.data.ptr = sp;
+	epoll_ctl(ep, EPOLL_CTL_MOD, sp->fd, &ee);
+
+	return;
+}
+
+/*
+ * sess_start()
+ *
+ * send a request, counting its latency from 'start'
+ */
+static void
+sess_start(LG_SESS *sp, double start)
+{
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	LG_STEP *stp;
+
+	stp = step_pick();
+	sp->step = stp;
+	sp->start = start;
+	sp->displayed = sp->asked = 0;
+	sp->state = SESS_BUSY;
+	busy++;
+
+	switch (stp->kind) {
+	case STEP_COMMAND:
+	case STEP_ASK:
+		ucrp_msg_command(sm, stp->text);
+		break;
+	case STEP_COMPLETE:
+		ucrp_msg_complete(sm, stp->text);
+		break;
+	case STEP_HELP:
+		ucrp_msg_help(sm, stp->text);
+		break;
+	}
+
+	sess_send(sp, sm);
+
+	return;
+}
+
+/*
+ * sess_done()
+ *
+ * the request has ended, count it and make the session idle
+ */
+static void
+sess_done(LG_SESS *sp)
+{
+	LG_STEP *stp = sp->step;
+	double t = now() - sp->start;
+
+	if (sp->start >= tmeasure) {
+		lat_add(&stp->done, t);
+		lat_add(&done, t);
+		stp->requests++;
+		requests++;
+	}
+
+	busy--;
+	sp->state = SESS_IDLE;
+	sp->next = idle;
+	idle = sp;
+
+	return;
+}
+
+/*
+ * sess_msg()
+ *
+ * act on message 'rm' from the server
+ */
+static void
+sess_msg(LG_SESS *sp, UCRP *rm)
+{
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	UCRP *sm = (UCRP *)buf;
+	UCRP_EXT ext;
+	LG_STEP *stp = sp->step;
+	double t;
+
+	switch (sp->state) {
+	case SESS_CONNECT:
+		if (rm->type != UCRP_PROMPT)
+			break;
+
+		if (batch) {
+			memset(&ext, 0, sizeof(ext));
+			ext.flags = UCRP_EXT_BATCH;
+			ucrp_msg_extend(sm, &ext);
+			sp->state = SESS_EXTEND;
+			sess_send(sp, sm);
+			break;
+		}
+		/* FALLTHROUGH */
+	case SESS_EXTEND:
+		if (sp->state == SESS_EXTEND && rm->type != UCRP_EXTENDED)
+			break;
+
+		sp->state = SESS_IDLE;
+		sp->next = idle;
+		idle = sp;
+		ready++;
+		break;
+	case SESS_BUSY:
+		switch (rm->type) {
+		case UCRP_DISPLAY:
+			if (sp->displayed++ || sp->start < tmeasure)
+				break;
+			t = now() - sp->start;
+			lat_add(&stp->first, t);
+			lat_add(&first, t);
+			break;
+		case UCRP_ASK:
+			if (stp->kind != STEP_ASK || sp->asked++)
+				break;
+			ucrp_msg_tell(sm, stp->answer);
+			sess_send(sp, sm);
+			break;
+		case UCRP_PROMPT:
+			if (stp->kind == STEP_COMMAND || stp->kind == STEP_ASK)
+				sess_done(sp);
+			break;
+		case UCRP_COMPLETED:
+			if (stp->kind == STEP_COMPLETE)
+				sess_done(sp);
+			break;
+		case UCRP_HELPED:
+			if (stp->kind == STEP_HELP)
+				sess_done(sp);
+			break;
+		}
+		break;
+	}
+
+	return;
+}
+
+/*
+ * sess_read()
+ *
+ * read what is available and act on every complete message
+ */
+static void
+sess_read(LG_SESS *sp)
+{
+	uint16_t rmbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *rm = (UCRP *)rmbuf;
+	ssize_t ret;
+	size_t len, off;
+
+	ret = recv(sp->fd, sp->rx + sp->rxlen, sizeof(sp->rx) - sp->rxlen, 0);
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret < 1) {
+		sess_fail(sp);
+		return;
+	}
+	sp->rxlen += ret;
+
+	off = 0;
+	while (sp->rxlen - off >= UCRP_HDR_SIZE) {
+		memcpy(rm, sp->rx + off, UCRP_HDR_SIZE);
+		ucrp_msg_ntoh(rm);
+		if (rm->length > UCRP_MAX_PAYLOAD) {
+			warnx("session %d: message too long", sp->fd);
+			sess_fail(sp);
+			return;
+		}
+
+		len = UCRP_HDR_SIZE + rm->length;
+		if (sp->rxlen - off < len)
+			break;
+
+		memcpy(UCRP_PAYLOAD(rm), sp->rx + off + UCRP_HDR_SIZE,
+		       rm->length);
+		UCRP_PAYLOAD(rm)[rm->length] = '\0';
+		off += len;
+
+		sess_msg(sp, rm);
+		if (sp->state == SESS_DEAD)
+			return;
+	}
+
+	memmove(sp->rx, sp->rx + off, sp->rxlen - off);
+	sp->rxlen -= off;
+
+	return;
+}
+
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-B] [-c concurrency] [-d duration] "
+		"[-f script] [-h host]\n"
+		"       [-n sessions] [-p port] [-r rate] [-w warmup]\n",
+		__progname);
+	exit(EX_USAGE);
+}
+
+/*
+ * main()
+ */
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints, *ai;
+	struct epoll_event evs[LG_MAXEVENTS];
+	struct rlimit rl;
+	LG_SESS *sess, *sp;
+	char *nodename, *servname, *script;
+	double *backlog, duration, warmup, rate, next, t, t0, tend;
+	int ch, i, n, ret, timeout, nsess, concurrency, started, failed;
+	unsigned int head, tail;
+	uint64_t overrun;
+
+	nodename = "localhost";
+	servname = UCRP_SERVICE;
+	script = NULL;
+	nsess = 100;
+	concurrency = 64;
+	duration = 10;
+	warmup = 1;
+	rate = 0;
+
+	while ((ch = getopt(argc, argv, "Bc:d:f:h:n:p:r:w:")) != -1)
+		switch (ch) {
+		case 'B':
+			batch = 1;
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'f':
+			script = optarg;
+			break;
+		case 'h':
+			nodename = optarg;
+			break;
+		case 'n':
+			nsess = atoi(optarg);
+			break;
+		case 'p':
+			servname = optarg;
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'w':
+			warmup = atof(optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+
+	if (nsess < 1 || concurrency < 1 || duration <= 0 || warmup < 0 ||
+	    rate < 0)
+		usage();
+	closedloop = (rate == 0);
+
+	script_load(script);
+	srandom(4646);
+
+	/* we need a descriptor per session */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < nsess + 16) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(nodename, servname, &hints, &ai)) != 0)
+		errx(EX_NOHOST, "%s", gai_strerror(ret));
+
+	sess = calloc(nsess, sizeof(*sess));
+	backlog = calloc(LG_BACKLOG, sizeof(*backlog));
+	if (sess == NULL || backlog == NULL)
+		err(EX_OSERR, "calloc");
+
+	if ((ep = epoll_create1(0)) == -1)
+		err(EX_OSERR, "epoll_create1");
+
+	/*
+	 * connect phase: keep 'concurrency' connects outstanding until
+	 * every session has its prompt.
+	 */
+	started = failed = 0;
+	tmeasure = 1e300;
+	while (ready + failed < nsess) {
+		while (started - ready - failed < concurrency &&
+		       started < nsess) {
+			sp = &sess[started++];
+			if (sess_connect(sp, ai) == -1) {
+				warn("connect");
+				sp->state = SESS_DEAD;
+				failed++;
+			}
+		}
+
+		if ((n = epoll_wait(ep, evs, LG_MAXEVENTS, 30000)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "epoll_wait");
+		}
+
+		if (n == 0)
+			errx(EX_UNAVAILABLE, "timed out, %llu of %d sessions "
+			     "open", (unsigned long long)ready, nsess);
+
+		for (i = 0; i < n; i++) {
+			sp = evs[i].data.ptr;
+			if (evs[i].events & EPOLLOUT)
+				sess_flush(sp);
+			if (sp->state != SESS_DEAD &&
+			    evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				sess_read(sp);
+			if (sp->state == SESS_DEAD)
+				failed++;
+		}
+	}
+
+	if (ready == 0)
+		errx(EX_UNAVAILABLE, "no sessions");
+
+	/*
+	 * load phase: open loop requests are due every 1/rate s and
+	 * queue in 'backlog' until a session is idle
+	 */
+	t0 = now();
+	tmeasure = t0 + warmup;
+	tend = tmeasure + duration;
+	next = t0;
+	head = tail = 0;
+	overrun = 0;
+
+	for (;;) {
+		t = now();
+		if (t >= tend + LG_DRAIN || (t >= tend && busy == 0))
+			break;
+
+		if (t < tend && closedloop) {
+			while ((sp = idle) != NULL) {
+				idle = sp->next;
+				if (sp->state == SESS_IDLE)
+					sess_start(sp, t);
+			}
+		} else if (t < tend) {
+			for (; next <= t; next += 1 / rate) {
+				if (tail - head == LG_BACKLOG) {
+					overrun++;
+					continue;
+				}
+				backlog[tail++ % LG_BACKLOG] = next;
+			}
+			while (head != tail && (sp = idle) != NULL) {
+				idle = sp->next;
+				if (sp->state == SESS_IDLE)
+					sess_start(sp,
+					    backlog[head++ % LG_BACKLOG]);
+			}
+		}
+
+		if (t >= tend)
+			timeout = (tend + LG_DRAIN - t) * 1000 + 1;
+		else if (!closedloop && head == tail)
+			timeout = (next - t) * 1000 + 1;
+		else
+			timeout = (tend - t) * 1000 + 1;
+
+		if ((n = epoll_wait(ep, evs, LG_MAXEVENTS, timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "epoll_wait");
+		}
+
+		for (i = 0; i < n; i++) {
+			sp = evs[i].data.ptr;
+			if (evs[i].events & EPOLLOUT)
+				sess_flush(sp);
+			if (sp->state != SESS_DEAD &&
+			    evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				sess_read(sp);
+		}
+	}
+
+	printf("{\n  \"server\": ");
+	json_str(nodename);
+	printf(",\n  \"port\": ");
+	json_str(servname);
+	printf(",\n  \"mode\": \"%s\",\n  \"rate\": %g,\n",
+	       closedloop ? "closed" : "open", rate);
+	printf("  \"sessions\": %d,\n  \"failed\": %d,\n", nsess, failed);
+	printf("  \"duration\": %g,\n  \"warmup\": %g,\n", duration, warmup);
+	printf("  \"requests\": %llu,\n  \"throughput\": %.1f,\n",
+	       (unsigned long long)requests, requests / duration);
+	printf("  \"errors\": %llu,\n  \"unfinished\": %llu,\n",
+	       (unsigned long long)errors, (unsigned long long)busy);
+	if (!closedloop)
+		printf("  \"overrun\": %llu,\n  \"waiting\": %u,\n",
+		       (unsigned long long)overrun, tail - head);
+	printf("  \"latency_us\": {");
+	lat_json("first_display", &first, ", ");
+	lat_json("prompt", &done, "},\n");
+	printf("  \"steps\": [\n");
+	for (i = 0; i < nsteps; i++) {
+		printf("    {\"kind\": \"%s\", \"text\": ",
+		       kinds[steps[i].kind]);
+		json_str(steps[i].text);
+		printf(", \"weight\": %d, \"requests\": %llu,\n     ",
+		       steps[i].weight, (unsigned long long)steps[i].requests);
+		lat_json("first_display", &steps[i].first, ",\n     ");
+		lat_json("prompt", &steps[i].done,
+			 i < nsteps - 1 ? "},\n" : "}\n");
+	}
+	printf("  ]\n}\n");
+
+	for (i = 0; i < nsess; i++)
+		if (sess[i].state != SESS_DEAD)
+			close(sess[i].fd);
+
+	freeaddrinfo(ai);
+
+	return errors > 0 ? EX_SOFTWARE : EX_OK;
+}
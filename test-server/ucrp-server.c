@@ -18,53 +18,67 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h> 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <netinet/in.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <ucrp.h>
+#include <ucrp_cmd.h>
+#include <ucrp_server.h>
 
 extern char *__progname;
 
-static void service_clients(void);
-int ucrp_listen4(void);
-int ucrp_listen6(void);
-void ucrp_client(int);
-
-void process_message(int, UCRP *, UCRP *);
-void sig_alrm(int);
-void xmit_msg(int, UCRP *);
-
-void do_complete(int, UCRP *, UCRP *);
-void do_help(int, UCRP *, UCRP *);
-void do_command(int, UCRP *, UCRP *);
-
-void do_askc(int, char **, int, UCRP *, UCRP *);
-void do_aske(int, char **, int, UCRP *, UCRP *);
-void do_askf(int, char **, int, UCRP *, UCRP *);
-void do_askn(int, char **, int, UCRP *, UCRP *);
-void do_busy(int, char **, int, UCRP *, UCRP *);
-void do_exec(int, char **, int, UCRP *, UCRP *);
-void do_ftp(int, char **, int, UCRP *, UCRP *);
-void do_pager(int, char **, int, UCRP *, UCRP *);
-void do_show(int, char **, int, UCRP *, UCRP *);
-void do_term(int, char **, int, UCRP *, UCRP *);
-void do_quit(int, char **, int, UCRP *, UCRP *);
-
-void do_show_version(int, char **, int, UCRP *, UCRP *);
-void do_show_time(int, char **, int, UCRP *, UCRP *);
-
-static int display_logmsg = 0;
-static int prompt = 0;
+static void service_clients(int, int, int, UCRP_LIMITS *, UCRP_LISTEN *,
+			    char *);
+static void usage(void);
+
+void ts_connect(UCRP_SESSION *);
+void ts_tell(UCRP_CHANNEL *, UCRP *);
+void ts_wait(UCRP_CHANNEL *, UCRP *);
+void ts_interrupt(UCRP_CHANNEL *, UCRP *);
+static int ts_nap(UCRP_CHANNEL *, int);
+static void ts_watch(UCRP_CHANNEL *, void *);
+
+void do_complete(UCRP_CHANNEL *, UCRP *);
+void do_help(UCRP_CHANNEL *, UCRP *);
+void do_command(UCRP_CHANNEL *, UCRP *);
+
+void do_askc(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_aske(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_askf(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_askn(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_busy(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_exec(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_ftp(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_log(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_monitor(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_pager(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_table(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_show(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_term(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_unmonitor(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_watch(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_quit(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+
+void do_show_version(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_show_file(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_show_time(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_show_memory(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+void do_show_ucrp_statistics(int, char **, UCRP_CHANNEL *, UCRP *, UCRP *);
+
+void ts_programs(UCRP_CMDCOMP *, int, char **, void *);
 
 /*
  * command data
@@ -76,26 +90,45 @@ char help_askn[] = "ask [no echo ]";
 char help_busy[] = "get busy";
 char help_exec[] = "exec local process.";
 char help_ftp[] = "ftp dummy messages.";
+char help_log[] = "log a message to the monitors";
+char help_monitor[] = "show logged messages [containing text]";
 char help_pager[] = "show lots of lines";
+char help_table[] = "show lots of rows as a table";
 char help_show[] = "show something";
+char help_file[] = "show a file from the -f directory";
+char help_ucrp[] = "protocol library";
+char help_stats[] = "server statistics";
 char help_term[] = "set terminal size";
+char help_unmonitor[] = "stop showing logged messages";
+char help_watch[] = "run a command [every n seconds] until interrupted";
 char help_quit[] = "exit out of here";
 char help_cr[] = "<cr>";
 
-typedef void (function_t)(int, char**, int, UCRP *, UCRP *);
+typedef void (function_t)(int, char**, UCRP_CHANNEL *, UCRP *, UCRP *);
 
 typedef struct _cmd { 
         char *name;
         char *help;
         struct _cmd *next;
         function_t (*f);
+        int flags;
+        UCRP_CMDPARAM *param;
+        int stat;                      /* ucrp_server_cmdstat() */
 } CMD;
 
+CMD cmd_show_ucrp[] = { 
+        { "statistics", help_stats, NULL, do_show_ucrp_statistics }, 
+        { NULL }
+};
+
 CMD cmd_show[] = { 
         { "version", help_cr, NULL, do_show_version }, 
+        { "file", help_file, NULL, do_show_file, UCRP_CMD_ARGS }, 
         { "time", help_cr, NULL, do_show_time }, 
+        { "memory", help_cr, NULL, do_show_memory }, 
+        { "ucrp", help_ucrp, cmd_show_ucrp, NULL }, 
+        { NULL }
 };
-#define CMD_SHOW_SIZE ((sizeof(cmd_show) / sizeof(cmd_show[0])))
 
 CMD cmd_main[] = { 
         { "askc", help_askc, NULL, do_askc },
@@ -103,560 +136,824 @@ CMD cmd_main[] = {
         { "askf", help_askf, NULL, do_askf },
         { "askn", help_askn, NULL, do_askn },
         { "busy", help_busy, NULL, do_busy },
-        { "exec", help_exec, NULL, do_exec },
+        { "exec", help_exec, NULL, do_exec, UCRP_CMD_ARGS, ts_programs },
         { "ftp", help_ftp, NULL, do_ftp },
+        { "log", help_log, NULL, do_log, UCRP_CMD_ARGS },
+        { "monitor", help_monitor, NULL, do_monitor, UCRP_CMD_ARGS },
         { "pager", help_pager, NULL, do_pager },
         { "show", help_show, cmd_show, do_show }, 
+        { "table", help_table, NULL, do_table },
         { "term", help_term, NULL, do_term }, 
+        { "unmonitor", help_unmonitor, NULL, do_unmonitor }, 
+        { "watch", help_watch, NULL, do_watch, UCRP_CMD_ARGS },
         { "quit", help_quit, NULL, do_quit}, 
+        { NULL }
 };
-#define CMD_MAIN_SIZE ((sizeof(cmd_main) / sizeof(cmd_main[0])))
 
+static UCRP_CMDTREE *cmds;    /* cmd_main, compiled */
+static int topic_log;         /* "log", "monitor" */
+static int filedir = -1;      /* "show file", -f */
+
+char *programs[] = { "date", "df", "ls", "ps", "top", "uptime", "vi", "w",
+		     NULL };
+static int ts_register(UCRP_SERVER *, int, CMD *, char *);
+
+/*
+ * a "watch", kept between refreshes
+ */
+typedef struct _watch {
+	UCRP_SCREEN  *sc;
+	CMD          *cmd;
+	UCRP_CMDMATCH m;                       /* argv points into line */
+	unsigned int  ms;
+	char          line[UCRP_MAX_PAYLOAD];
+	uint16_t      rmbuf[(UCRP_MAX_MSGSIZE + 1) / 2];
+	uint16_t      smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];
+} WATCH;
+
+static void ts_watchend(UCRP_CHANNEL *, WATCH *);
+
+/*
+ * ts_nap()
+ *
+ * sleep for 'ms' milliseconds unless the command is interrupted
+ *
+ * returns 1 if the command was interrupted, 0 otherwise
+ */
+static int
+ts_nap(UCRP_CHANNEL *cp, int ms)
+{
+	for (; ms > 0; ms -= 100) {
+		if (ucrp_channel_interrupted(cp))
+			return 1;
+		usleep((ms < 100 ? ms : 100) * 1000);
+	}
+
+	return ucrp_channel_interrupted(cp);
+}
 
 /*
  * command functions
  */
 void
-do_askc(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_askc(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
 	ucrp_msg_ask(sm, ASK_CHAR, "Hack the planet? [Y/n]: ", "Y");
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
 
 void
-do_aske(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_aske(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
 	ucrp_msg_ask(sm, ASK_NONE, "Hack the planet? [Y/n]: ", "Y");
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
 
 void
-do_askf(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_askf(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
 	ucrp_msg_ask(sm, ASK_FEEDBACK, "Password: ", "");
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
 
 void
-do_askn(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_askn(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
 	ucrp_msg_ask(sm, ASK_NOECHO, "Password: ", "");
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
 
 void
-do_busy(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_busy(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
 	ucrp_msg_busy(sm);
-	xmit_msg(s, sm);
-	sleep(5);
+	ucrp_channel_send(cp, sm);
+	ts_nap(cp, 5000);
 
 	return;
 }
 
 void
-do_exec(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_exec(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	char *exec_str;
+	char exec_str[UCRP_MAX_PAYLOAD - 2];
+	size_t len;
+	int i;
 
-	if ((exec_str = strstr(UCRP_PAYLOAD(rm), " ")) == NULL)
+	if (argc < 2)
 		return;
 
-	exec_str++;
+	/* put the command line back together */
+	exec_str[0] = '\0';
+	for (i = 1, len = 0; i < argc && len < sizeof(exec_str); i++)
+		len += snprintf(exec_str + len, sizeof(exec_str) - len,
+				strchr(argv[i], ' ') ? "%s\"%s\"" : "%s%s",
+				i > 1 ? " " : "", argv[i]);
+
 	ucrp_msg_exec(sm, exec_str);
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
 
 void
-do_ftp(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_ftp(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
+	UCRP_OSTREAM *os;
 	int i, c;
 
-	ucrp_msg_display(sm, "Using FTP to locate remote file...\n"); 
-	xmit_msg(s, sm);
-	sleep(1);
+	if ((os = ucrp_channel_ostream(cp)) == NULL)
+		return;
+
+	ucrp_ostream_printf(os, "Using FTP to locate remote file...\n");
+	if (ts_nap(cp, 1000))
+		return;
 
-	ucrp_msg_display(sm, "Preparing local system for download..\n"); 
-	xmit_msg(s, sm);
-	sleep(1);
+	ucrp_ostream_printf(os, "Preparing local system for download..\n");
+	if (ts_nap(cp, 1000))
+		return;
 
-	ucrp_msg_display(sm, "Downloading image file..\n"); 
-	xmit_msg(s, sm);
-	sleep(1);
+	ucrp_ostream_printf(os, "Downloading image file..\n");
+	if (ts_nap(cp, 1000))
+		return;
 
 	c = 300;
 	for (i = 0; i < c; i++) {
-		ucrp_msg_display(sm, "#"); 
-		xmit_msg(s, sm);
-		usleep(5000);
+		ucrp_ostream_putc(os, '#');
+		if (ts_nap(cp, 5))
+			return;
 	}
 
-	ucrp_msg_display(sm, "[OK]\n"); 
-	xmit_msg(s, sm);
-	sleep(1);
+	ucrp_ostream_printf(os, "[OK]\n");
+	if (ts_nap(cp, 1000))
+		return;
 
-	ucrp_msg_display(sm, "Verifying downloaded image file...\n"); 
-	xmit_msg(s, sm);
-	sleep(1);
+	ucrp_ostream_printf(os, "Verifying downloaded image file...\n");
+	if (ts_nap(cp, 1000))
+		return;
 
-	ucrp_msg_display(sm, "Blah Blah Blah...\n"); 
-	xmit_msg(s, sm);
-	sleep(1);
+	ucrp_ostream_printf(os, "Blah Blah Blah...\n");
+	if (ts_nap(cp, 1000))
+		return;
 
 	return;
 }
 
 void
-do_pager(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_log(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
+	UCRP_SESSION *sp = ucrp_channel_session(cp);
+	char line[UCRP_MAX_PAYLOAD];
+	size_t len;
 	int i;
-	char *line, *line2;
 
-	line = NULL;
-	for (i = 0; i < 10000; i++) {
-		asprintf(&line, "%-10d ooga booga\n", i);
-		asprintf(&line2, "%-10d wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy \n", i);
-		ucrp_msg_display(sm, line); 
-		ucrp_msg_display(sm, line2); 
-		xmit_msg(s, sm);
+	len = snprintf(line, sizeof(line), "%%LOG-5: session %d:",
+		       ucrp_session_fd(sp));
+	for (i = 1; i < argc && len < sizeof(line); i++)
+		len += snprintf(line + len, sizeof(line) - len, " %s",
+				argv[i]);
 
-		if (line)
-			free(line);
+	ucrp_server_publish(ucrp_session_server(sp), topic_log, LOG_NOTICE,
+			    line);
 
-		if (line2)
-			free(line2);
-	}
+	return;
+}
+
+void
+do_monitor(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	ucrp_session_subscribe(ucrp_channel_session(cp), topic_log,
+			       LOG_DEBUG, argc > 1 ? argv[1] : NULL);
 
 	return;
 }
 
 void
-do_show(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_unmonitor(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	ucrp_msg_display(sm, "Version ?.?\n"); 
-	xmit_msg(s, sm);
+	ucrp_session_unsubscribe(ucrp_channel_session(cp), topic_log);
 
 	return;
 }
 
+/*
+ * do_watch()
+ *
+ * "watch [seconds] command", run the command every so many seconds,
+ * one by default, until it is interrupted.  the client is only sent
+ * what changed.  the worker is given back between refreshes, see
+ * ts_watch().
+ */
 void
-do_term(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_watch(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	ucrp_msg_swinsz(sm, 30, 85, 0, 0); 
-	xmit_msg(s, sm);
+	UCRP_OSTREAM *os;
+	WATCH *wp;
+	size_t len;
+	int i, secs;
+
+	if ((wp = calloc(1, sizeof(*wp))) == NULL) {
+		ts_watchend(cp, NULL);
+		return;
+	}
+
+	i = 1;
+	secs = 1;
+	if (i < argc && argv[i][0] != '\0' &&
+	    argv[i][strspn(argv[i], "0123456789")] == '\0')
+		if ((secs = atoi(argv[i++])) < 1)
+			secs = 1;
+
+	/* put the command line back together, like exec */
+	for (len = 0; i < argc && len < sizeof(wp->line); i++)
+		len += snprintf(wp->line + len, sizeof(wp->line) - len,
+				strchr(argv[i], ' ') ? "%s\"%s\"" : "%s%s",
+				len > 0 ? " " : "", argv[i]);
+
+	if (ucrp_cmd_parse(cmds, wp->line, &wp->m) != UCRP_CMD_OK ||
+	    (wp->cmd = wp->m.data)->f == NULL || wp->cmd->f == do_watch) {
+		if ((os = ucrp_channel_ostream(cp)) != NULL)
+			ucrp_ostream_printf(os, "%% Watch which command?\n");
+		ts_watchend(cp, wp);
+		return;
+	}
+
+	if ((wp->sc = ucrp_channel_screen(cp)) == NULL) {
+		ts_watchend(cp, wp);
+		return;
+	}
+
+	wp->ms = secs * 1000;
+	memcpy(wp->rmbuf, rm, UCRP_HDR_SIZE + rm->length);
+	ts_watch(cp, wp);
+
+	return;
+}
+
+/*
+ * ts_watch()
+ *
+ * refresh a watch and have it run again in a while, unless it was
+ * interrupted.  without a channel the watch was stopped between
+ * refreshes and is only freed.
+ */
+static void
+ts_watch(UCRP_CHANNEL *cp, void *arg)
+{
+	WATCH *wp = arg;
+
+	if (cp == NULL) {
+		ucrp_screen_free(wp->sc);
+		free(wp);
+		return;
+	}
+
+	if (ucrp_screen_begin(wp->sc) == 0) {
+		wp->cmd->f(wp->m.argc, wp->m.argv, cp, (UCRP *)wp->rmbuf,
+			   (UCRP *)wp->smbuf);
+		if (ucrp_screen_end(wp->sc) == 0 &&
+		    !ucrp_channel_interrupted(cp) &&
+		    ucrp_channel_again(cp, wp->ms, ts_watch, wp) == 0)
+			return;
+	}
+
+	ts_watchend(cp, wp);
+
+	return;
+}
+
+/*
+ * ts_watchend()
+ *
+ * free a watch that is over, end its filters and prompt again
+ */
+static void
+ts_watchend(UCRP_CHANNEL *cp, WATCH *wp)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	if (wp != NULL) {
+		if (wp->sc != NULL)
+			ucrp_screen_free(wp->sc);
+		free(wp);
+	}
+
+	ucrp_channel_filterend(cp);
+	ucrp_msg_prompt(sm, "cli> ");
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
 
 void
-do_quit(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_pager(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	ucrp_msg_display(sm, "goodbye...\n"); 
-	xmit_msg(s, sm);
-	close(s);
-	_exit(0);
+	UCRP_OSTREAM *os;
+	int i;
+
+	if ((os = ucrp_channel_ostream(cp)) == NULL)
+		return;
+
+	for (i = 0; i < 10000; i++) {
+		if (ucrp_channel_interrupted(cp))
+			break;
+
+		ucrp_ostream_printf(os, "%-10d ooga booga\n", i);
+		ucrp_ostream_printf(os, "%-10d wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy wowy zowy \n", i);
+	}
+
 	return;
 }
 
 void
-do_show_version(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_table(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	ucrp_log(LOG_NOTICE, "%s: ok\n", __func__);
+	static char *states[] = { "idle", "running", "waiting", "stopped" };
+	UCRP_TSTREAM *ts;
+	char name[32];
+	int i;
+
+	if ((ts = ucrp_channel_table(cp)) == NULL)
+		return;
+
+	ucrp_tstream_column(ts, "Id", UCRP_COL_INT);
+	ucrp_tstream_column(ts, "Name", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "State", UCRP_COL_STR);
+	ucrp_tstream_column(ts, "Bytes", UCRP_COL_INT);
+
+	for (i = 0; i < 10000; i++) {
+		if (ucrp_channel_interrupted(cp))
+			break;
+
+		snprintf(name, sizeof(name), "ooga-booga-%d", i * 7919 % 10007);
+		ucrp_tstream_int(ts, i);
+		ucrp_tstream_str(ts, name);
+		ucrp_tstream_str(ts, states[i % 4]);
+		ucrp_tstream_int(ts, (int64_t)i * i * 31);
+	}
+
+	ucrp_tstream_end(ts);
+
 	return;
 }
 
 void
-do_show_time(int argc, char *argv[], int s, UCRP *rm, UCRP *sm)
+do_show(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	ucrp_log(LOG_NOTICE, "%s: ok\n", __func__);
+	UCRP_OSTREAM *os;
+
+	if ((os = ucrp_channel_ostream(cp)) != NULL)
+		ucrp_ostream_printf(os, "Version ?.?\n");
+
 	return;
 }
 
-/*
- *
- */
-int
-ucrp_listen4(void)
-{
-	struct sockaddr_in sin; 
-	struct servent *sp; 
-	int s;
-	int on = 1;
-
-	sp = getservbyname(UCRP_SERVICE, "tcp");
-	if (sp == NULL) {  
-                printf("%s: tcp/%s: unknown service\n",
-		       __func__, UCRP_SERVICE);  
-                return -1;  
-        }
-
-	memset(&sin, 0, sizeof(sin)); 
-        sin.sin_family = AF_INET;  
-        sin.sin_addr.s_addr = htonl(INADDR_ANY); 
-        sin.sin_port = sp->s_port;
-
-	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {   
-                perror(NULL);   
-                return -1; 
-        }
-
-	/* socket options */ 
-        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) { 
-                close(s);
-                perror(__func__); 
-                return -1; 
-        } 
- 
-        if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1) { 
-                close(s); 
-                perror(__func__);   
-                return -1; 
-        } 
-  
-        if (listen(s, 5) == -1) { 
-                close(s); 
-                perror(__func__); 
-                return -1; 
-        }
-
-	return s;
+void
+do_term(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	ucrp_msg_swinsz(sm, 30, 85, 0, 0); 
+	ucrp_channel_send(cp, sm);
+
+	return;
 }
 
-/*
- *
- */
-#ifndef __linux__
-int
-ucrp_listen6(void)
-{
-	struct sockaddr_in6 sin; 
-	struct servent *sp; 
-	int s;
-	int on = 1;
-
-	sp = getservbyname(UCRP_SERVICE, "tcp");
-	if (sp == NULL) {  
-                printf("%s: tcp/%s: unknown service\n",
-		       __func__, UCRP_SERVICE);  
-                return -1;  
-        }
-
-	memset(&sin, 0, sizeof(sin)); 
-        sin.sin6_family = AF_INET6;  
-        sin.sin6_addr = in6addr_any; 
-        sin.sin6_port = sp->s_port;
-
-	if ((s = socket(AF_INET6, SOCK_STREAM, 0)) == -1) {   
-                perror(NULL);   
-                return -1; 
-        }
-
-	/* socket options */ 
-        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) { 
-                close(s);
-                perror(__func__); 
-                return -1; 
-        } 
- 
-        if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1) { 
-                close(s); 
-                perror(__func__);   
-                return -1; 
-        } 
-  
-        if (listen(s, 5) == -1) { 
-                close(s); 
-                perror(__func__); 
-                return -1; 
-        }
-
-	return s;
-}
-#endif /* __linux__ */
+void
+do_quit(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	UCRP_OSTREAM *os;
 
-/*
- *
- */
-void sig_alrm(int s)
+	if ((os = ucrp_channel_ostream(cp)) != NULL) {
+		ucrp_ostream_printf(os, "goodbye...\n");
+		ucrp_ostream_flush(os);
+	}
+	ucrp_session_close(ucrp_channel_session(cp));
+
+	return;
+}
+
+void
+do_show_version(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
 {
-	display_logmsg = 1;
+	UCRP_OSTREAM *os;
+
+	if ((os = ucrp_channel_ostream(cp)) != NULL)
+		ucrp_ostream_printf(os, "Version ?.?\n");
+
 	return;
 }
 
-/*
- *
- */
 void
-ucrp_client(int s)
-{
-	struct sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
-	fd_set read_set, read_set_orig;
-	int c, todo;
-	pid_t pid;
-	UCRP *sm, *rm;
-
-	/* accept connection */
-	c = accept(s, (struct sockaddr *)&addr, &addrlen);
-
-	/* fork */
-	if ((pid = fork()) < 0) {
-		perror(__func__);
-		close(c);
+do_show_file(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	UCRP_OSTREAM *os;
+	struct stat st;
+	int fd;
+
+	if ((os = ucrp_channel_ostream(cp)) == NULL)
 		return;
-	} else if (pid > 0) { /* parent */
-		close(c);
+
+	if (argc < 3) {
+		ucrp_ostream_printf(os, "%% Which file?\n");
 		return;
-	} 
+	}
 
-	/* 
-	 * in child now
-	 */
-	ucrp_setlogprio(LOG_NOTICE);
-	ucrp_setlogstream(stdout);
+	if (filedir == -1) {
+		ucrp_ostream_printf(os, "%% No files to show.\n");
+		return;
+	}
 
-	if (c == -1) {
-		perror(__func__);
-		exit(c);
+	/* a name in the -f directory, not a path out of it */
+	if (strchr(argv[2], '/') != NULL || strcmp(argv[2], ".") == 0 ||
+	    strcmp(argv[2], "..") == 0) {
+		ucrp_ostream_printf(os, "%% %s: not a file name\n", argv[2]);
+		return;
 	}
 
-	if ((sm = malloc(UCRP_MAX_MSGSIZE)) == NULL) {
-		perror(__func__);
-		exit(EX_UNAVAILABLE);
+	if ((fd = openat(filedir, argv[2],
+			 O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) == -1) {
+		ucrp_ostream_printf(os, "%% %s: %s\n", argv[2],
+				    strerror(errno));
+		return;
 	}
 
-	if ((rm = malloc(UCRP_MAX_MSGSIZE)) == NULL) {
-		perror(__func__);
-		exit(EX_UNAVAILABLE);
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		ucrp_ostream_printf(os, "%% %s: not a file\n", argv[2]);
+		close(fd);
+		return;
+	}
+
+	/* sent from the page cache, not copied through here */
+	if (ucrp_ostream_sendfile(os, fd, 0, 0) == -1)
+		ucrp_ostream_printf(os, "%% %s: cannot send\n", argv[2]);
+
+	close(fd);
+
+	return;
+}
+
+void
+do_show_time(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	UCRP_OSTREAM *os;
+	char line[64];
+	time_t now;
+
+	if ((os = ucrp_channel_ostream(cp)) == NULL)
+		return;
+
+	time(&now);
+	strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S\n", localtime(&now));
+	ucrp_ostream_printf(os, "%s", line);
+
+	return;
+}
+
+void
+do_show_memory(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm, UCRP *sm)
+{
+	UCRP_OSTREAM *os;
+	UCRP_ARENA *ap;
+	UCRP_ARENASTAT st;
+	char *line;
+
+	if ((os = ucrp_channel_ostream(cp)) == NULL ||
+	    (ap = ucrp_channel_arena(cp)) == NULL)
+		return;
+
+	/* counts this command's own line too */
+	line = ucrp_arena_printf(ap, "%-10s %s\n", "arena:", "this channel");
+	ucrp_arena_stats(ap, &st);
+
+	ucrp_ostream_printf(os, "%s", line);
+	ucrp_ostream_printf(os, "%-10s %zu bytes, %zu peak, %zu reserved\n",
+			    "used:", st.used, st.peak, st.reserved);
+	ucrp_ostream_printf(os, "%-10s %lu allocations, %lu resets, "
+			    "%lu chunks made\n", "calls:", st.allocs,
+			    st.resets, st.mallocs);
+
+	return;
+}
+
+void
+do_show_ucrp_statistics(int argc, char *argv[], UCRP_CHANNEL *cp, UCRP *rm,
+			UCRP *sm)
+{
+	UCRP_OSTREAM *os;
+
+	if ((os = ucrp_channel_ostream(cp)) == NULL)
+		return;
+
+	ucrp_server_printstats(ucrp_session_server(ucrp_channel_session(cp)),
+			       os);
+
+	return;
+}
+
+/*
+ * ts_register()
+ *
+ * add a command table and the tables below it to the tree, and give
+ * every command its own latency statistics under its full name
+ *
+ * returns 0 or -1 on error
+ */
+static int
+ts_register(UCRP_SERVER *srv, int parent, CMD *table, char *prefix)
+{
+	char name[UCRP_STATS_NAMELEN];
+	CMD *cmd;
+	int id;
+
+	for (cmd = table; cmd->name != NULL; cmd++) {
+		id = ucrp_cmd_add(cmds, parent, cmd->name, cmd->help,
+				  cmd->flags, cmd);
+		if (id == -1)
+			return -1;
+
+		if (cmd->param != NULL &&
+		    ucrp_cmd_setparam(cmds, id, cmd->param, NULL) == -1)
+			return -1;
+
+		snprintf(name, sizeof(name), "%s%s%s", prefix,
+			 prefix[0] != '\0' ? " " : "", cmd->name);
+		if (cmd->f != NULL)
+			cmd->stat = ucrp_server_cmdstat(srv, name);
+
+		if (cmd->next != NULL &&
+		    ts_register(srv, id, cmd->next, name) == -1)
+			return -1;
 	}
 
+	return 0;
+}
+
+/*
+ * ts_connect()
+ *
+ * greet a new session
+ */
+void
+ts_connect(UCRP_SESSION *sp)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
 	/* display something */
 	ucrp_msg_display(sm, "\r\n\r\nUser Access Verification\r\n\r\n");
-	xmit_msg(c, sm);
+	ucrp_session_send(sp, sm);
 
 	/*
 	ucrp_msg_ask(sm, ASK_NOECHO, "Password: ", "");
-	xmit_msg(c, sm);
+	ucrp_session_send(sp, sm);
 	*/
 
 	/* XXX -- check password here */
 
-	/* send busy */
-	ucrp_msg_busy(sm);
-	xmit_msg(c, sm);
-	sleep(1);
+	/* send prompt */
+	ucrp_msg_prompt(sm, "cli> ");
+	ucrp_session_send(sp, sm);
 
-	/* setup timer for UCRP_DISPLAY messages */
-	signal(SIGALRM, sig_alrm);
-	{
-		struct itimerval it;
+	return;
+}
 
-		memset(&it, 0, sizeof(it));
-		it.it_interval.tv_sec = 60;
-		it.it_value.tv_sec = 60;
+/*
+ * ts_tell()
+ */
+void
+ts_tell(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	ucrp_pmsg(stdout, rm);
+	return;
+}
 
-		setitimer(ITIMER_REAL, &it, NULL);
-	}
+/*
+ * ts_interrupt()
+ *
+ * the command on the channel has been stopped, prompt again
+ */
+void
+ts_interrupt(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
 
-	/* send prompt */
 	ucrp_msg_prompt(sm, "cli> ");
-	xmit_msg(c, sm);
-
-	/* service */
-	FD_ZERO(&read_set_orig);
-	FD_SET(c, &read_set_orig);
-	for (;;) {
-		ucrp_log(LOG_NOTICE, "%s: selecting...\n", __func__);
-		read_set = read_set_orig;
-		todo = select(c + 1, &read_set, NULL, NULL, NULL);
-
-		if (todo == -1) {
-                        perror(__func__);
-
-			if (display_logmsg == 1) {
-				ucrp_msg_display(sm, "ALERT: look at me!\n");
-				xmit_msg(c, sm);
-				display_logmsg = 0;
-			}
+	ucrp_channel_send(cp, sm);
 
-			continue;
-		}
+	return;
+}
 
+/*
+ * ts_wait()
+ */
+void
+ts_wait(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	UCRP_RUSAGE ru;
+	int status;
 
-		if (FD_ISSET(c, &read_set)) {
-			/* process message */
-                        ucrp_log(LOG_NOTICE, "%s: new message.\n", __func__);
-			if (ucrp_recv(c, rm) < 1) {
-				ucrp_log(LOG_NOTICE, "%s: exiting...\n",
-					 __func__);
-				exit(-1);
-			}
+	if (ucrp_msg_waitparse(rm, &status, &ru) == -1)
+		return;
 
-			process_message(c, rm, sm);
-                }
+	fprintf(stdout, "%s: UCRP_WAIT: "
+		"WAIT_SIGNAL=%d "
+		"WAIT_ERROR=%d ",
+		__func__,
+		rm->options & WAIT_SIGNAL ? 1 : 0,
+		rm->options & WAIT_ERROR  ? 1 : 0);
 
-		if (prompt == 1) {
-			ucrp_msg_prompt(sm, "cli> ");
-			xmit_msg(c, sm);
-			prompt = 0;
-		}
-	}
+	if (rm->options & WAIT_STATUS)
+		fprintf(stdout, "WAIT_STATUS=%d", status);
+	else
+		fprintf(stdout, "WAIT_STATUS=N/A");
+
+	if (rm->options & WAIT_RUSAGE)
+		fprintf(stdout, " utime=%lluus stime=%lluus maxrss=%llukB",
+			(unsigned long long)ru.utime,
+			(unsigned long long)ru.stime,
+			(unsigned long long)ru.maxrss);
+
+	fprintf(stdout, "\n");
 
-	exit(0);
+	return;
 }
 
 /*
  *
  */
 static void
-service_clients(void)
+service_clients(int threads, int pin, int workers, UCRP_LIMITS *limits,
+		UCRP_LISTEN *listen, char *stats)
 {
-	struct timeval timeout;
-	fd_set read_set, read_set_orig;
-	int s4, s6, maxfd, todo;
-
-	FD_ZERO(&read_set_orig);
-	maxfd = -1;
-
-	/* setup socket */
-	s4 = ucrp_listen4();
-	if (s4 != -1) {
-		if (s4 > maxfd)
-			maxfd = s4;
-
-		fprintf(stderr, "%s: ipv4 ready.\n", __progname);
-		FD_SET(s4, &read_set_orig);
+	UCRP_CALLBACKS cb;
+	UCRP_SERVER *srv;
+
+	memset(&cb, 0, sizeof(cb));
+	cb.connect = ts_connect;
+	cb.command = do_command;
+	cb.complete = do_complete;
+	cb.help = do_help;
+	cb.interrupt = ts_interrupt;
+	cb.tell = ts_tell;
+	cb.wait = ts_wait;
+
+	if ((srv = ucrp_server_new(&cb)) == NULL ||
+	    ucrp_server_setthreads(srv, threads, pin) == -1 ||
+	    ucrp_server_setworkers(srv, workers) == -1 ||
+	    ucrp_server_setstats(srv, stats) == -1) {
+		fprintf(stderr, "%s: server setup failed.\n", __progname);
+		exit(EX_UNAVAILABLE);
 	}
-
-#ifndef __linux__
-	s6 = ucrp_listen6();
-#else
-	s6 = -1;
-#endif /* __linux__ */
-
-	if (s6 != -1) {
-		if (s6 > maxfd)
-			maxfd = s6;
-
-		fprintf(stderr, "%s: ipv6 ready.\n", __progname);
-		FD_SET(s6, &read_set_orig);
+	ucrp_server_setlimits(srv, limits);
+	ucrp_server_setlisten(srv, listen);
+
+	if ((topic_log = ucrp_server_topic(srv, "log")) == -1 ||
+	    (cmds = ucrp_cmd_new()) == NULL ||
+	    ts_register(srv, UCRP_CMD_ROOT, cmd_main, "") == -1 ||
+	    ucrp_cmd_compile(cmds) == -1) {
+		fprintf(stderr, "%s: command setup failed.\n", __progname);
+		exit(EX_UNAVAILABLE);
 	}
 
-	if (maxfd == -1) {
+	/* setup sockets, one per thread and address */
+	if (ucrp_server_bind(srv, NULL, UCRP_SERVICE) == -1) {
 		fprintf(stderr, "%s: socket setup failed.\n", __progname);
 		exit(EX_UNAVAILABLE);
 	}
 
-	for (;;) {
-		timeout.tv_sec = 5; 
-		timeout.tv_usec = 0;
-		read_set = read_set_orig;
-		todo = select(maxfd + 1, &read_set, NULL, NULL, &timeout);
+	fprintf(stderr, "%s: ready, %d thread%s, %d worker%s.\n", __progname,
+		ucrp_server_threads(srv),
+		ucrp_server_threads(srv) == 1 ? "" : "s",
+		workers, workers == 1 ? "" : "s");
 
-		if (todo == -1)
-			perror(__func__);
-
-		/* new connection */
-		if (s4 != -1 && FD_ISSET(s4, &read_set)) {
-			printf("%s: ipv4 connection.\n", __progname);
-			ucrp_client(s4);
-		}
+	/* a dead client must not take us down */
+	signal(SIGPIPE, SIG_IGN);
 
-		if (s6 != -1 && FD_ISSET(s6, &read_set)) {
-			printf("%s: ipv6 connection.\n", __progname);
-			ucrp_client(s6);
-		}
+	ucrp_setlogprio(LOG_NOTICE);
+	ucrp_setusesyslog(0);
+	ucrp_setlogstream(stdout);
 
-		/* wait for dead children */
-		wait4(-1, NULL, WNOHANG, NULL);
+	if (ucrp_server_loop(srv) == -1)
+		exit(EX_OSERR);
 
-	}
+	ucrp_server_free(srv);
 
-	/* NOTREACHED */
 	return;
 }
 
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-a] [-b batch] [-c commands] [-d defer] "
+		"[-i idle]\n"
+		"       [-f directory] [-l backlog] [-m statsfile] [-o output] "
+		"[-s sessions]\n"
+		"       [-t threads] [-w workers]\n", __progname);
+	exit(EX_USAGE);
+}
+
 /*
  * 
  */
 int
 main(int argc, char *argv[])
 {
-	service_clients();
+	UCRP_LIMITS limits;
+	UCRP_LISTEN listen;
+	char *stats;
+	int ch, threads, pin, workers;
+
+	threads = 1;
+	pin = 0;
+	workers = 4;	/* busy and ftp take their time */
+	stats = NULL;
+	memset(&limits, 0, sizeof(limits));
+	memset(&listen, 0, sizeof(listen));
+
+	while ((ch = getopt(argc, argv, "ab:c:d:f:i:l:m:o:s:t:w:")) != -1)
+		switch (ch) {
+		case 'a':
+			pin = 1;
+			break;
+		case 'b':
+			limits.batch = atoi(optarg);
+			break;
+		case 'c':
+			limits.commands = atoi(optarg);
+			break;
+		case 'd':
+			listen.defer = atoi(optarg);
+			break;
+		case 'f':
+			filedir = open(optarg, O_RDONLY | O_DIRECTORY);
+			if (filedir == -1) {
+				fprintf(stderr, "%s: %s: %s\n", __progname,
+					optarg, strerror(errno));
+				exit(EX_NOINPUT);
+			}
+			break;
+		case 'i':
+			limits.idle = atoi(optarg);
+			break;
+		case 'l':
+			listen.backlog = atoi(optarg);
+			break;
+		case 'm':
+			stats = optarg;
+			break;
+		case 'o':
+			limits.output = atoi(optarg);
+			break;
+		case 's':
+			limits.sessions = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 0)
+				usage();
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 0)
+				usage();
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+
+	service_clients(threads, pin, workers, &limits, &listen, stats);
 	return EX_OK;
 }
 
-
+/*
+ * ts_programs()
+ *
+ * complete the program name of "exec"
+ */
 void
-xmit_msg(int s, UCRP *sm)
+ts_programs(UCRP_CMDCOMP *comp, int argc, char *argv[], void *arg)
 {
-	int ret;
-
-	ret = ucrp_send(s, sm);
-
-	if (ret == -1 || ret == 0) {
-		close(s);
-		printf("%s: %s\n", __func__, strerror(errno));
-		exit(-1);
-	}
-
-	return;
-}
+	int i;
 
-void
-process_message(int s, UCRP *rm, UCRP *sm)
-{
-	UCRP_PMSG((stdout, rm));
+	if (argc != 1)
+		return;
 
-	switch (rm->type) {
-	case UCRP_COMMAND:
-		do_command(s, rm, sm);
-		break;
-	case UCRP_COMPLETE:
-		do_complete(s, rm, sm);
-		break;
-	case UCRP_HELP:
-		do_help(s, rm, sm);
-		break;
-	case UCRP_INTERRUPT:
-		ucrp_log(LOG_NOTICE, "%s: ignoring UCRP_INTERRUPT\n",
-			 __func__);
-		break;
-	case UCRP_TELL:
-		ucrp_pmsg(stdout, rm);
-		break;
-	case UCRP_SUSPEND:
-		ucrp_log(LOG_NOTICE, "%s: ignoring UCRP_SUSPEND\n",
-			 __func__);
-		break;
-	case UCRP_WAIT:
-	{
-		char *lp = UCRP_PAYLOAD(rm);
-		fprintf(stdout, "%s: UCRP_WAIT: "
-			"WAIT_SIGNAL=%d "
-			"WAIT_ERROR=%d "
-			"WAIT_STATUS=%s\n",
-			__func__,
-			rm->options & WAIT_SIGNAL ? 1 : 0,
-			rm->options & WAIT_ERROR  ? 1 : 0,
-			rm->options & WAIT_STATUS ? ucrp_msg_getln(&lp) :
-			"N/A");
-		break;
-	}
-	default:
-		ucrp_log(LOG_NOTICE, "unknown message type=%u\n", rm->type);
-		break;
-	}
+	for (i = 0; programs[i] != NULL; i++)
+		if (ucrp_cmd_candidate(comp, programs[i]) == -1)
+			break;
 
 	return;
 }
@@ -664,45 +961,68 @@ process_message(int s, UCRP *rm, UCRP *sm)
 /*
  * do_complete()
  *
+ * list the candidates if there is more than one, in columns as wide
+ * as the client's terminal, then send the completed line
  */
 void
-do_complete(int s, UCRP *rm, UCRP *sm)
+do_complete(UCRP_CHANNEL *cp, UCRP *rm)
 {
-	ucrp_msg_completed(sm, "busy");
-	xmit_msg(s, sm);
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_CMDCOMP comp;
+	UCRP_OSTREAM *os;
+	UCRP_EXT *ext;
+	char *str, buf[UCRP_MAX_PAYLOAD];
+	int row;
+
+	if ((str = strstr((char *)UCRP_PAYLOAD(rm), UCRP_SEPARATOR)) != NULL)
+		*str = '\0';
+
+	if (ucrp_cmd_complete(cmds, (char *)UCRP_PAYLOAD(rm), &comp) > 1) {
+		ext = ucrp_session_ext(ucrp_channel_session(cp));
+
+		os = ucrp_channel_ostream(cp);
+
+		/* the rows are packed, completed flushes them */
+		row = 0;
+		if (os != NULL) {
+			ucrp_ostream_putc(os, '\n');
+			while (ucrp_cmd_columns(&comp, ext->columns, &row, buf,
+						sizeof(buf)) > 0)
+				ucrp_ostream_write(os, buf, strlen(buf));
+		}
+	}
+
+	ucrp_msg_completed(sm, comp.line);
+	ucrp_channel_send(cp, sm);
+
 	return;
 }
 
 /*
  * do_help()
  *
+ * send the help of the deepest command the line names, rendered
+ * once and shared by every session
  */
 void
-do_help(int s, UCRP *rm, UCRP *sm)
+do_help(UCRP_CHANNEL *cp, UCRP *rm)
 {
-	char *line;
-	int i, ret;
-
-	ucrp_msg_display(sm, "\n\n");
-	xmit_msg(s, sm);
-
-	for (i = 0; i < CMD_MAIN_SIZE; i++) {
-		ret = asprintf(&line, " %-10s\t%-40s\n",
-			       cmd_main[i].name, cmd_main[i].help);
-		if (ret == -1)
-			_exit(ret);
-
-		ucrp_msg_display(sm, line);
-		xmit_msg(s, sm);
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_BUF *bp;
+	char *str;
 
-		free(line);
-	}
+	if ((str = strstr((char *)UCRP_PAYLOAD(rm), UCRP_SEPARATOR)) != NULL)
+		*str = '\0';
 
-	ucrp_msg_display(sm, "\n\n");
-	xmit_msg(s, sm);
+	str = (char *)UCRP_PAYLOAD(rm);
+	bp = ucrp_cmd_helpbuf(cmds, ucrp_cmd_helpnode(cmds, str));
+	if (bp != NULL)
+		ucrp_channel_sendbuf(cp, bp);
 
 	ucrp_msg_helped(sm);
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
@@ -712,43 +1032,80 @@ do_help(int s, UCRP *rm, UCRP *sm)
  *
  */
 void
-do_command(int s, UCRP *rm, UCRP *sm)
+do_command(UCRP_CHANNEL *cp, UCRP *rm)
 {
-	function_t *doit;
-	char *str;
-	int i;
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	UCRP_CMDMATCH m;
+	CMD *cmd;
+	char *str, line[UCRP_MAX_PAYLOAD], err[128];
 
 	ucrp_msg_busy(sm);
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	str = strstr(UCRP_PAYLOAD(rm), UCRP_SEPARATOR);
 	if (str == NULL) {
 		ucrp_msg_display(sm, "invalid message.\n");
-		xmit_msg(s, sm);
-		_exit(-1);
+		ucrp_channel_send(cp, sm);
+		ucrp_session_close(ucrp_channel_session(cp));
+		return;
 	}
 	*str = '\0';
 
-	/* run command */
-	for (i = 0; i < CMD_MAIN_SIZE; i++) {
-		if (strncmp(UCRP_PAYLOAD(rm), cmd_main[i].name,
-			    strlen(cmd_main[i].name)) == 0) {
-
-			doit = cmd_main[i].f;
-			doit(0, NULL, s, rm, sm);
-
-			ucrp_msg_prompt(sm, "cli> "); 
-			xmit_msg(s, sm);
+	/* "| include ..." at the end filters what the command shows */
+	if (ucrp_channel_filter(cp, (char *)UCRP_PAYLOAD(rm), err,
+				sizeof(err)) == -1) {
+		snprintf(line, sizeof(line), "%% Invalid filter: %s\n", err);
+		ucrp_msg_display(sm, line);
+		ucrp_channel_send(cp, sm);
+		ucrp_msg_prompt(sm, "cli> ");
+		ucrp_channel_send(cp, sm);
+		return;
+	}
 
-			return;
+	/* run command, argv points into the payload */
+	switch (ucrp_cmd_parse(cmds, (char *)UCRP_PAYLOAD(rm), &m)) {
+	case UCRP_CMD_OK:
+		cmd = m.data;
+		if (cmd->f == NULL) {
+			snprintf(line, sizeof(line), "%% Incomplete command\n");
+			break;
 		}
+		ucrp_channel_cmdstat(cp, cmd->stat);
+		cmd->f(m.argc, m.argv, cp, rm, sm);
+		/* a watch goes on after this and prompts once it stops */
+		if (cmd->f == do_watch)
+			return;
+		line[0] = '\0';
+		break;
+	case UCRP_CMD_EMPTY:
+		line[0] = '\0';
+		break;
+	case UCRP_CMD_AMBIGUOUS:
+		snprintf(line, sizeof(line), "%% Ambiguous command: \"%s\"\n",
+			 m.argv[m.bad]);
+		break;
+	case UCRP_CMD_INCOMPLETE:
+		snprintf(line, sizeof(line), "%% Incomplete command\n");
+		break;
+	case UCRP_CMD_UNKNOWN:
+		snprintf(line, sizeof(line), "%% Unknown Command: \"%s\"\n",
+			 m.argv[m.bad]);
+		break;
+	default:
+		snprintf(line, sizeof(line), "%% Invalid input\n");
+		break;
 	}
+	ucrp_channel_filterend(cp);
 
-	ucrp_msg_display(sm, "% Unknown Command\n");
-	xmit_msg(s, sm);
+	if (line[0] != '\0') {
+		ucrp_msg_display(sm, line);
+		ucrp_channel_send(cp, sm);
+	}
 
 	ucrp_msg_prompt(sm, "cli> "); 
-	xmit_msg(s, sm);
+	ucrp_channel_send(cp, sm);
 
 	return;
 }
+
@@ -83,7 +83,7 @@ cle_edit_complete(EditLine *el, int foo)
 			exit(1);
 
 		ucrp_mutex_unlock(&ctl_mutex);
-		sleep(1);
+		usleep(1000);
 	}
 
 	ctl->completed = 0;
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -45,6 +46,7 @@
 typedef void (function_t)(void);
 
 static void  command_string(void);
+static void  extend(void);
 static pid_t fork_th(function_t *);
 static void  usage(void);
 
@@ -92,6 +94,45 @@ command_string(void)
 	exit(EX_USAGE);
 }
 
+/*
+ * extend()
+ *
+ * ask the server for the protocol extensions we know.  rx picks up
+ * the answer, servers that don't know UCRP_EXTEND ignore us.
+ */
+static void
+extend(void)
+{
+	uint8_t buf[UCRP_MAX_MSGSIZE];
+	struct winsize ws;
+	UCRP_EXT ext;
+
+	memset(&ext, 0, sizeof(ext));
+	ext.flags = UCRP_EXT_INTERRUPT;
+
+	/* large output comes in fewer, larger messages */
+	ext.flags |= UCRP_EXT_MAXMSG;
+	ext.maxmsg = UCRP_MAX_JUMBO;
+
+	/* tables come as rows, we lay them out and sort them */
+	ext.flags |= UCRP_EXT_TABLES;
+
+	/* and redraw only what changed of a watched command */
+	ext.flags |= UCRP_EXT_UPDATE;
+
+	/* the server lays completions out for our terminal */
+	if (ioctl(fileno(stdout), TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+		ext.flags |= UCRP_EXT_COLUMNS;
+		ext.columns = ws.ws_col;
+	}
+	ucrp_msg_extend((UCRP *)buf, &ext);
+
+	if (ucrp_send(server, (UCRP *)buf) == -1)
+		err(EX_IOERR, "ucrp_send");
+
+	return;
+}
+
 /*
  * usage()
  *
@@ -169,6 +210,8 @@ main(int argc, char *argv[])
 		/* NOTREACHED */
 	}
 
+	extend();
+
         /* ignore SIGALRM until real handerls are setup */
 	if (signal(SIGALRM, SIG_IGN) == SIG_ERR)
 		err(1, "signal");
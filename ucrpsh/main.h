@@ -21,6 +21,7 @@ typedef struct _sh_ctl {
 	int ask;                      /* set by rx */
 	int busy;                     /* set by rx */
 	int exec;                     /* set by rx */
+	int execing;                  /* set by tx, rx holds output */
 	int display;                  /* set by rx */
 	int prompt;                   /* set by rx */
 	int completed;                /* set by rx */
@@ -29,10 +30,14 @@ typedef struct _sh_ctl {
 	int usesyslog;                /* set by tx */
 	int logprio;                  /* set by tx */
 	int exit;                     /* if set, exit now */
+	int interrupted;              /* set by tx, cleared by rx */
+	int sort_rev;                 /* set by tx */
+	UCRP_EXT ext;                 /* set by rx */
 	uint8_t am[UCRP_MAX_MSGSIZE];
 	char exec_str[UCRP_MAX_PAYLOAD];
 	char prompt_str[UCRP_MAX_PAYLOAD];
 	char completed_str[UCRP_MAX_PAYLOAD];
+	char sort_str[UCRP_TABLE_NAMELEN];  /* set by tx, "" if unsorted */
 } SH_CTL;
 
 void emenu_main(void);
@@ -129,7 +129,7 @@ cle_rl_complete(int count, int key)
 			exit(1);
 
 		ucrp_mutex_unlock(&ctl_mutex);
-		sleep(1);
+		usleep(1000);
 	}
 
 	ucrp_mutex_lock(&termios_mutex);
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -33,9 +34,24 @@
 #include "termios.h"
 #include "rx.h"
 
+#define RX_HOLDMAX (256 * 1024)   /* output held while tx runs a command */
+
+/* what goes through the pager */
+#define RX_ISDISPLAY(t) ((t) == UCRP_DISPLAY || (t) == UCRP_TABLE)
+
 static void  rx_exit(int, char *);
+static void  rx_hold(const void *, size_t);
+static void  rx_release(void);
+static void  rx_write(const void *, size_t);
+static int   rx_table_out(const void *, size_t, void *);
+static void  rx_table_end(void);
+static void  rx_update(UCRP *);
 
 static int pager = 0;
+static char *hold = NULL;          /* UCRP_DISPLAY held during UCRP_EXEC */
+static size_t holdlen = 0, holdsize = 0, holdlost = 0;
+static size_t rmsize = 0;          /* of rm, grows for UCRP_EXT_MAXMSG */
+static UCRP_ROWS *table = NULL;    /* UCRP_TABLE rows until TABLE_END */
 
 /*
  * rx_getppid()
@@ -91,6 +107,241 @@ rx_main(void)
 	return rx_exit(rx_loop(), "rx_loop returned.");
 }
 
+/*
+ * rx_hold()
+ *
+ * keep the output of a display while tx runs a command, it has the
+ * terminal.  what doesn't fit in RX_HOLDMAX is counted and dropped.
+ */
+static void
+rx_hold(const void *buf, size_t len)
+{
+	char *p;
+	size_t size;
+
+	if (holdlen + len > holdsize) {
+		size = holdsize ? holdsize * 2 : 4096;
+		while (size < holdlen + len)
+			size *= 2;
+		if (size > RX_HOLDMAX ||
+		    (p = realloc(hold, size)) == NULL) {
+			holdlost += len;
+			return;
+		}
+		hold = p;
+		holdsize = size;
+	}
+
+	memcpy(hold + holdlen, buf, len);
+	holdlen += len;
+
+	return;
+}
+
+/*
+ * rx_release()
+ *
+ * write out what was held once tx's command is done
+ */
+static void
+rx_release(void)
+{
+	char buf[64];
+	size_t i;
+	ssize_t ret;
+	int execing;
+
+	if (holdlen == 0 && holdlost == 0)
+		return;
+
+	ucrp_mutex_lock(&ctl_mutex);
+	execing = ctl->execing;
+	ucrp_mutex_unlock(&ctl_mutex);
+	if (execing)
+		return;
+
+	for (i = 0; i < holdlen; i += ret) {
+		ret = write(fileno(stdout), hold + i, holdlen - i);
+		if (ret == -1) {
+			ucrp_log(LOG_ERR, "%s: %s\n", __func__,
+				 strerror(errno));
+			rx_exit(-1, "write failed.");
+		}
+	}
+
+	if (holdlost > 0) {
+		snprintf(buf, sizeof(buf), "%% %lu bytes of output lost\n",
+			 (unsigned long)holdlost);
+		write(fileno(stdout), buf, strlen(buf));
+	}
+
+	holdlen = holdlost = 0;
+
+	return;
+}
+
+/*
+ * rx_write()
+ *
+ * show output to the user, through the pager if there is one
+ */
+static void
+rx_write(const void *buf, size_t len)
+{
+	ssize_t ret;
+	size_t i;
+	int execing;
+
+	ucrp_mutex_lock(&ctl_mutex);
+	execing = ctl->execing;
+	ucrp_mutex_unlock(&ctl_mutex);
+
+	if (execing || holdlen > 0) {
+		rx_hold(buf, len);
+		return;
+	}
+
+	if (pager) {
+		if (pager_write(buf, len) == -1) {
+			ucrp_log(LOG_ERR, "%s: %s\n",
+				 __func__, strerror(errno));
+			rx_exit(-1, "pager_write failed.");
+		}
+		return;
+	}
+
+	for (i = 0; i < len; i += ret) {
+		ret = write(fileno(stdout), (const char *)buf + i, len - i);
+		if (ret == -1) {
+			ucrp_log(LOG_ERR, "%s: %s\n",
+				 __func__, strerror(errno));
+			rx_exit(-1, "write failed.");
+		}
+	}
+
+	return;
+}
+
+/*
+ * rx_table_out()
+ *
+ * ucrp_rows_print() hands us the laid out table here
+ */
+static int
+rx_table_out(const void *buf, size_t len, void *arg)
+{
+	rx_write(buf, len);
+
+	return 0;
+}
+
+/*
+ * rx_table_end()
+ *
+ * the table is all here; sort it if tx was asked to and lay it out
+ * for the terminal as it is now.
+ */
+static void
+rx_table_end(void)
+{
+	char name[UCRP_TABLE_NAMELEN], buf[UCRP_TABLE_NAMELEN + 32];
+	struct winsize ws;
+	int rev, width;
+
+	ucrp_mutex_lock(&ctl_mutex);
+	memcpy(name, ctl->sort_str, sizeof(name));
+	name[sizeof(name) - 1] = '\0';
+	rev = ctl->sort_rev;
+	ucrp_mutex_unlock(&ctl_mutex);
+
+	if (name[0] != '\0' && ucrp_rows_sort(table, name, rev) == -1) {
+		if (errno == ENOENT)
+			snprintf(buf, sizeof(buf),
+				 "%% Unknown column \"%s\"\n", name);
+		else
+			snprintf(buf, sizeof(buf), "%% Can't sort: %s\n",
+				 strerror(errno));
+		rx_write(buf, strlen(buf));
+	}
+
+	width = 0;
+	if (ioctl(fileno(stdout), TIOCGWINSZ, &ws) == 0)
+		width = ws.ws_col;
+
+	if (ucrp_rows_print(table, width, rx_table_out, NULL) == -1)
+		ucrp_log(LOG_ERR, "%s: %s\n", __func__, strerror(errno));
+
+	ucrp_rows_free(table);
+	table = NULL;
+
+	return;
+}
+
+/*
+ * rx_update()
+ *
+ * put the lines of a UCRP_UPDATE where they go on the terminal, from
+ * the top, and clear what is below the screen's last line.  what
+ * doesn't fit the terminal is left out.  the cursor is left below.
+ */
+static void
+rx_update(UCRP *rm)
+{
+	char buf[4096], *text, *nl;
+	struct winsize ws;
+	unsigned int first, total, row, rows, cols;
+	size_t len, n, show;
+	int tlen;
+
+	if ((tlen = ucrp_msg_updateparse(rm, &first, &total, &text)) == -1)
+		return;
+
+	rows = 24;
+	cols = 80;
+	if (ioctl(fileno(stdout), TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1) {
+		rows = ws.ws_row;
+		cols = ws.ws_col;
+	}
+	rows--;		/* the cursor waits on the last one */
+
+	len = 0;
+	if (rm->options & UPDATE_CLEAR)
+		len = snprintf(buf, sizeof(buf), "\033[H\033[2J");
+
+	for (row = first; tlen > 0; row++, tlen -= n, text += n) {
+		if ((nl = memchr(text, '\n', tlen)) != NULL)
+			n = nl - text + 1;
+		else
+			n = tlen;
+		if (row >= rows)
+			continue;
+
+		/* without the '\n', a line that wraps moves the rest */
+		show = nl != NULL ? n - 1 : n;
+		if (show > cols)
+			show = cols;
+
+		if (len + 16 + show > sizeof(buf)) {
+			rx_write(buf, len);
+			len = 0;
+		}
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"\033[%u;1H%.*s\033[K", row + 1, (int)show,
+				text);
+	}
+
+	/* the screen may have got shorter */
+	if (len + 16 > sizeof(buf)) {
+		rx_write(buf, len);
+		len = 0;
+	}
+	len += snprintf(buf + len, sizeof(buf) - len, "\033[%u;1H\033[J",
+			(total < rows ? total : rows) + 1);
+	rx_write(buf, len);
+
+	return;
+}
+
 /*
  * rx_proc_msg()
  *
@@ -103,6 +354,24 @@ rx_proc_msg(UCRP *rm)
 
 	UCRP_PMSG((stdout, rm));
 
+	/* only UCRP_DISPLAY may be larger than the old limit */
+	if (rm->length > UCRP_MAX_PAYLOAD && rm->type != UCRP_DISPLAY) {
+		ucrp_log(LOG_NOTICE, "%s: type=%u length=%hu too long\n",
+			 __func__, rm->type, rm->length);
+		return;
+	}
+
+	/* what was held goes first */
+	rx_release();
+
+	/* drop what the server sent before it saw our interrupt */
+	ucrp_mutex_lock(&ctl_mutex);
+	if (ctl->interrupted && UCRP_ISOUTPUT(rm->type)) {
+		ucrp_mutex_unlock(&ctl_mutex);
+		return;
+	}
+	ucrp_mutex_unlock(&ctl_mutex);
+
 	/* clear busy flag as the ucrp server is obviously no longer busy */
 	ucrp_mutex_lock(&ctl_mutex);
 	ctl->busy = 0;
@@ -121,7 +390,7 @@ rx_proc_msg(UCRP *rm)
 	}
 
 	/* setup pager session if needed */
-	if (rm->type == UCRP_DISPLAY && pager == 0) {
+	if (RX_ISDISPLAY(rm->type) && pager == 0) {
 		if (usepager) {
 			ucrp_mutex_lock(&termios_mutex);
 			termios_rx_save();
@@ -134,7 +403,7 @@ rx_proc_msg(UCRP *rm)
 			pager = 0;
 		}
 
-	} else if (rm->type != UCRP_DISPLAY && pager != 0) {
+	} else if (!RX_ISDISPLAY(rm->type) && pager != 0) {
 		termios_rx_restore();
 		ucrp_mutex_unlock(&termios_mutex);
 		pager = 0;
@@ -142,35 +411,34 @@ rx_proc_msg(UCRP *rm)
 
 	switch (rm->type) {
 	case UCRP_DISPLAY:
-	{
-		int i, ret;
+		ucrp_mutex_lock(&ctl_mutex);
+		ctl->display++;
+		ucrp_mutex_unlock(&ctl_mutex);
 
+		rx_write(UCRP_PAYLOAD(rm), rm->length);
+		break;
+	case UCRP_TABLE:
 		ucrp_mutex_lock(&ctl_mutex);
 		ctl->display++;
 		ucrp_mutex_unlock(&ctl_mutex);
 
-		if (pager) {
-			ret = pager_write(UCRP_PAYLOAD(rm), rm->length);
-			if (ret == -1) {
-				ucrp_log(LOG_ERR, "%s: %s\n",
-					 __func__, strerror(errno));
-				rx_exit(-1, "pager_write failed.");
-			}
-		} else {
-			for (i = 0; i != rm->length; i += ret) {
-				ret = write(fileno(stdout),
-					    UCRP_PAYLOAD(rm) + i,
-					    rm->length);
-
-				if (ret == -1) {
-					ucrp_log(LOG_ERR, "%s: %s\n",
-						 __func__, strerror(errno));
-					rx_exit(-1, "write failed.");
-				}
-			}
+		if (table == NULL && (table = ucrp_rows_new()) == NULL) {
+			ucrp_log(LOG_ERR, "%s: %s\n", __func__,
+				 strerror(errno));
+			break;
 		}
+		if (ucrp_rows_parse(table, rm) == -1)
+			ucrp_log(LOG_NOTICE, "%s: %s\n", __func__,
+				 strerror(errno));
+		if (rm->options & TABLE_END)
+			rx_table_end();
+		break;
+	case UCRP_UPDATE:
+		ucrp_mutex_lock(&ctl_mutex);
+		ctl->display++;
+		ucrp_mutex_unlock(&ctl_mutex);
 
-	}
+		rx_update(rm);
 		break;
 	case UCRP_ASK:
 		ucrp_mutex_lock(&ctl_mutex);
@@ -246,6 +514,23 @@ rx_proc_msg(UCRP *rm)
 		ucrp_mutex_unlock(&termios_mutex);
 	}
 		break;
+	case UCRP_EXTENDED:
+	{
+		UCRP_EXT ext;
+
+		if (ucrp_ext_parse(rm, &ext) == -1)
+			break;
+
+		ucrp_mutex_lock(&ctl_mutex);
+		ctl->ext = ext;
+		ucrp_mutex_unlock(&ctl_mutex);
+	}
+		break;
+	case UCRP_INTERRUPTED:
+		ucrp_mutex_lock(&ctl_mutex);
+		ctl->interrupted = 0;
+		ucrp_mutex_unlock(&ctl_mutex);
+		break;
 	default:
 		ucrp_log(LOG_INFO, "%s: unknown message type=%u\n",
 			 __func__, rm->type);
@@ -272,6 +557,7 @@ rx_loop(void)
 		ucrp_log(LOG_ERR, "%s: %s\n", __func__, strerror(errno));
 		rx_exit(EX_UNAVAILABLE, "malloc failed.");
         }
+	rmsize = UCRP_MAX_MSGSIZE;
 
 	FD_ZERO(&read_set_orig);
 	FD_SET(server, &read_set_orig);
@@ -280,6 +566,13 @@ rx_loop(void)
 		read_set = read_set_orig;
 		timeout.tv_sec = 5;
 		timeout.tv_usec = 0;
+
+		/* look for the end of tx's command while we hold output */
+		rx_release();
+		if (holdlen > 0 || holdlost > 0) {
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 20000;
+		}
                 todo = select(server + 1, &read_set, NULL, NULL, &timeout);
 
 		if (todo == -1)
@@ -289,7 +582,7 @@ rx_loop(void)
 		if (FD_ISSET(server, &read_set)) {
 
                         /* process message */
-                        if (ucrp_recv(server, rm) < 1) {
+                        if (ucrp_recvalloc(server, &rm, &rmsize) < 1) {
 				ucrp_log(LOG_DEBUG, "%s: %s\n",
 					 __func__, strerror(errno));
 				rx_exit(EX_OK, "remote connection closed.\n");
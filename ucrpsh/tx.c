@@ -16,6 +16,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
@@ -23,6 +24,7 @@
 #include <errno.h>
 #include <paths.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,10 +43,13 @@
 static int interrupt = 0;
 static int suspend  = 0;
 
+extern char **environ;
+
 int  tx_loop(void);
 void tx_ask(UCRP *);
 void tx_busy(void);
 void tx_getln(UCRP *);
+void tx_sort(char *);
 void tx_interrupt(UCRP *);
 void tx_suspend(UCRP *);
 void tx_sighdlr(int);
@@ -138,6 +143,12 @@ tx_sighdlr(int sig)
 void
 tx_interrupt(UCRP *sm)
 {
+	/* have rx drop stale output until the server marks the spot */
+	ucrp_mutex_lock(&ctl_mutex);
+	if (ctl->ext.flags & UCRP_EXT_INTERRUPT)
+		ctl->interrupted = 1;
+	ucrp_mutex_unlock(&ctl_mutex);
+
 	ucrp_msg_interrupt(sm);
         if (ucrp_send(server, sm) == -1)  
                 tx_exit(-1, "ucrp_send");  
@@ -279,6 +290,9 @@ tx_getln(UCRP *sm)
 	ctl->prompt = 0; 
 	ucrp_mutex_unlock(&ctl_mutex);
 
+	/* a trailing sort is ours, the server sends a table */
+	tx_sort(line);
+
 	/* format message */
 	ucrp_msg_command(sm, line);
 
@@ -294,6 +308,55 @@ tx_getln(UCRP *sm)
 	return;
 }
 
+/*
+ * tx_sort()
+ *
+ * take a trailing "| sort [-r] column" off the command line and tell
+ * rx to sort the table that comes back by that column.  only done when
+ * the server sends tables, anyone else gets the line as typed.
+ */
+void
+tx_sort(char *line)
+{
+	char *p, *w, *word[3];
+	char buf[UCRP_MAX_PAYLOAD];
+	int n;
+
+	ucrp_mutex_lock(&ctl_mutex);
+	ctl->sort_str[0] = '\0';
+	ctl->sort_rev = 0;
+	n = ctl->ext.flags & UCRP_EXT_TABLES;
+	ucrp_mutex_unlock(&ctl_mutex);
+
+	if (n == 0 || (p = strrchr(line, '|')) == NULL)
+		return;
+
+	snprintf(buf, sizeof(buf), "%s", p + 1);
+	for (n = 0, p = buf; n < 3 && (w = strsep(&p, " \t")) != NULL; )
+		if (*w != '\0')
+			word[n++] = w;
+
+	if (n < 2 || strcmp(word[0], "sort") != 0)
+		return;
+	if (n == 3 && strcmp(word[1], "-r") != 0)
+		return;
+	if (p != NULL && p[strspn(p, " \t")] != '\0')
+		return;	/* more words than a sort takes */
+
+	ucrp_mutex_lock(&ctl_mutex);
+	snprintf(ctl->sort_str, sizeof(ctl->sort_str), "%s", word[n - 1]);
+	ctl->sort_rev = (n == 3);
+	ucrp_mutex_unlock(&ctl_mutex);
+
+	/* the command is what came before the '|' */
+	p = strrchr(line, '|');
+	while (p > line && isspace((unsigned char)p[-1]))
+		p--;
+	*p = '\0';
+
+	return;
+}
+
 /*
  * tx_ask()
  *
@@ -379,19 +442,31 @@ tx_checkchild(void)
 	return;
 }
 
+/*
+ * tx_exec()
+ *
+ * run the command of a UCRP_EXEC and answer with a UCRP_WAIT.  the
+ * child is spawned without copying us, and ctl is not held while it
+ * runs so rx keeps reading from the server.
+ */
 void
 tx_exec(UCRP *sm)
 {
-        pid_t pid;
-        int status = 0;
-        sigset_t nmask, omask;
-        char *argp[] = { "sh", "-c", NULL, NULL };
+	pid_t pid;
+	int ret, status = 0;
+	sigset_t nmask, omask, dmask;
+	posix_spawnattr_t attr;
+	struct rusage ru;
+	UCRP_RUSAGE uru;
+	char *argp[] = { "sh", "-c", NULL, NULL };
 
-        ucrp_mutex_lock(&ctl_mutex); 
-        ctl->exec = 0;
-        ctl->usepager = 0;  /* should be off already */
+	ucrp_mutex_lock(&ctl_mutex);
+	ctl->exec = 0;
+	ctl->usepager = 0;  /* should be off already */
 	if (asprintf(&argp[2], "exec %s", ctl->exec_str) == -1)
 		tx_exit(-1, "asprintf");
+	ctl->execing = 1;
+	ucrp_mutex_unlock(&ctl_mutex);
 
 	sigemptyset(&nmask);
 	sigaddset(&nmask, SIGCHLD);
@@ -399,20 +474,35 @@ tx_exec(UCRP *sm)
 	sigaddset(&nmask, SIGQUIT);
 	sigprocmask(SIG_BLOCK, &nmask, &omask);
 
-	switch (pid = fork()) {
-	case -1:
-		ucrp_log(LOG_NOTICE, "%s: %s\n", __func__, strerror(errno));
+	/* the child gets the signals we catch or ignore back */
+	sigemptyset(&dmask);
+	sigaddset(&dmask, SIGALRM);
+	sigaddset(&dmask, SIGCHLD);
+	sigaddset(&dmask, SIGHUP);
+	sigaddset(&dmask, SIGINT);
+	sigaddset(&dmask, SIGQUIT);
+	sigaddset(&dmask, SIGTSTP);
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &omask);
+	posix_spawnattr_setsigdefault(&attr, &dmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+				 POSIX_SPAWN_SETSIGDEF);
+
+	ret = posix_spawn(&pid, _PATH_BSHELL, NULL, &attr, argp, environ);
+	posix_spawnattr_destroy(&attr);
+
+	if (ret != 0) {
+		ucrp_log(LOG_NOTICE, "%s: %s\n", __func__, strerror(ret));
 		ucrp_msg_wait(sm, WAIT_ERROR, 0);
-		break;
-	case 0:
-		execv(_PATH_BSHELL, argp);
-		tx_exit(127, "execv");
-		/* NOTREACHED */
-	default:
-		if ((pid = waitpid(pid, &status, 0)) < 1) {
-			ucrp_log(LOG_ERR, "%s: waitpid: %s\n", __func__,
+	} else {
+		while ((pid = wait4(pid, &status, 0, &ru)) == -1 &&
+		       errno == EINTR)
+			;
+		if (pid < 1) {
+			ucrp_log(LOG_ERR, "%s: wait4: %s\n", __func__,
 				 strerror(errno));
-			tx_exit(-1, "waitpid");
+			tx_exit(-1, "wait4");
 		}
 
 		if (WIFEXITED(status))
@@ -421,16 +511,25 @@ tx_exec(UCRP *sm)
 			ucrp_msg_wait(sm, WAIT_SIGNAL, 0);
 		else
 			tx_exit(-1, "exit status");
+
+		uru.utime = (uint64_t)ru.ru_utime.tv_sec * 1000000 +
+		    ru.ru_utime.tv_usec;
+		uru.stime = (uint64_t)ru.ru_stime.tv_sec * 1000000 +
+		    ru.ru_stime.tv_usec;
+		uru.maxrss = ru.ru_maxrss;
+		ucrp_msg_rusage(sm, &uru);
 	}
 
 	sigprocmask(SIG_SETMASK, &omask, NULL);
 
 	free(argp[2]);
 
-	if (ucrp_send(server, sm) == -1)  
-                tx_exit(-1, "ucrp_send");
+	ucrp_mutex_lock(&ctl_mutex);
+	ctl->execing = 0;
+	ucrp_mutex_unlock(&ctl_mutex);
 
-        ucrp_mutex_unlock(&ctl_mutex); 
+	if (ucrp_send(server, sm) == -1)
+		tx_exit(-1, "ucrp_send");
 
 	/* UCRP_DISPLAY messages will appear now, but the
 	   pager is still off.  It will get turned on again
@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2003 Christopher L. Cousins <clc@sparf.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ucrp-wrap -- serve a line oriented program over UCRP
+ *
+ * every session gets its own copy of the program, running on a pty.
+ * command lines are written to the program and what it prints comes
+ * back as UCRP_DISPLAY messages, read straight into the frames that
+ * are sent.  a UCRP_PROMPT follows once the program has been quiet
+ * for a while after a command.  UCRP_INTERRUPT signals the program's
+ * foreground process group as ^C would.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <termios.h>
+#include <unistd.h>
+#include <utmp.h>
+
+#include <ucrp.h>
+#include <ucrp_server.h>
+
+#define WRAP_READMAX (64 * 1024)   /* bytes per read of the program   */
+#define WRAP_READS   16            /* reads per wakeup, a pty gives 4k */
+#define WRAP_QUIET   50            /* ms without output before prompt */
+#define WRAP_STALL   250           /* ms a full pty may take to drain */
+
+extern char *__progname;
+
+typedef struct _wrap {
+	UCRP_SESSION *sp;
+	pid_t         pid;
+	int           fd;              /* pty master                      */
+	UCRP_WATCH   *wp;
+	UCRP_TIMER   *quiet;           /* the program went quiet          */
+	int           waiting;         /* prompt once it does             */
+} WRAP;
+
+static char **prog;                /* the program and its arguments   */
+static char  *prompt = "";         /* the program prints its own      */
+static unsigned int quiet = WRAP_QUIET;
+
+static int   wrap_spawn(WRAP *);
+static void  wrap_output(UCRP_WATCH *, int, void *);
+static void  wrap_quiet(UCRP_TIMER *, void *);
+static void  wrap_say(WRAP *, char *);
+static void  wrap_connect(UCRP_SESSION *);
+static void  wrap_close(UCRP_SESSION *);
+static void  wrap_command(UCRP_CHANNEL *, UCRP *);
+static void  wrap_complete(UCRP_CHANNEL *, UCRP *);
+static void  wrap_help(UCRP_CHANNEL *, UCRP *);
+static void  wrap_interrupt(UCRP_CHANNEL *, UCRP *);
+static void  usage(void);
+
+/*
+ * wrap_spawn()
+ *
+ * start the program on a new pty.  the pty doesn't echo, the client
+ * has shown the line already, and passes output on as it is, which
+ * is more than twice as fast as turning every "\n" into "\r\n".
+ *
+ * returns 0 or -1 on error
+ */
+static int
+wrap_spawn(WRAP *w)
+{
+	struct termios tio;
+	struct winsize ws;
+	sigset_t mask;
+	char name[64];
+	int slave;
+
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_row = 24;
+	ws.ws_col = 80;
+
+	/*
+	 * not openpty(), both ends are close-on-exec from the start or
+	 * a program started by another thread meanwhile keeps them, and
+	 * ours never sees its client go
+	 */
+	if ((w->fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+		ucrp_log(LOG_WARNING, "%s: posix_openpt: %s\n", __func__,
+			 strerror(errno));
+		return -1;
+	}
+	if (grantpt(w->fd) == -1 || unlockpt(w->fd) == -1 ||
+	    ptsname_r(w->fd, name, sizeof(name)) != 0 ||
+	    (slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+		ucrp_log(LOG_WARNING, "%s: pty: %s\n", __func__,
+			 strerror(errno));
+		close(w->fd);
+		return -1;
+	}
+
+	ioctl(slave, TIOCSWINSZ, &ws);
+
+	if (tcgetattr(slave, &tio) == 0) {
+		tio.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
+		tio.c_oflag &= ~OPOST;
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+
+	switch (w->pid = fork()) {
+	case -1:
+		ucrp_log(LOG_WARNING, "%s: fork: %s\n", __func__,
+			 strerror(errno));
+		close(w->fd);
+		close(slave);
+		return -1;
+	case 0:
+		/* undo what the server did, or was started with */
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+
+		close(w->fd);
+		if (login_tty(slave) == -1)
+			_exit(127);
+		execvp(prog[0], prog);
+		fprintf(stderr, "%s: %s\n", prog[0], strerror(errno));
+		_exit(127);
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(slave);
+	fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK);
+
+	return 0;
+}
+
+/*
+ * wrap_output()
+ *
+ * watch callback, pass what the program printed on
+ */
+static void
+wrap_output(UCRP_WATCH *wp, int fd, void *arg)
+{
+	WRAP *w = arg;
+	ssize_t ret = 0;
+	int i;
+
+	for (i = 0; i < WRAP_READS; i++)
+		if ((ret = ucrp_channel_readfd(ucrp_session_channel(w->sp, 0),
+					       fd, WRAP_READMAX)) <= 0)
+			break;
+
+	if (i > 0 && w->waiting)
+		ucrp_timer_set(w->quiet, quiet);
+
+	if (ret > 0 || (ret == -1 && (errno == EAGAIN || errno == EINTR)))
+		return;
+
+	/* EIO once the program has closed the pty */
+	ucrp_watch_free(w->wp);
+	w->wp = NULL;
+	ucrp_timer_cancel(w->quiet);
+
+	wrap_say(w, "\n% Program exited.\n");
+	ucrp_session_close(w->sp);
+
+	return;
+}
+
+/*
+ * wrap_quiet()
+ *
+ * the program has printed all it will for now, prompt for more
+ */
+static void
+wrap_quiet(UCRP_TIMER *tm, void *arg)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	WRAP *w = arg;
+
+	if (!w->waiting)
+		return;
+
+	w->waiting = 0;
+	ucrp_msg_prompt(sm, prompt);
+	ucrp_session_send(w->sp, sm);
+
+	return;
+}
+
+/*
+ * wrap_say()
+ *
+ * tell the client something of our own
+ */
+static void
+wrap_say(WRAP *w, char *text)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	ucrp_msg_display(sm, text);
+	ucrp_session_send(w->sp, sm);
+
+	return;
+}
+
+/*
+ * wrap_connect()
+ *
+ * start a copy of the program for the new session
+ */
+static void
+wrap_connect(UCRP_SESSION *sp)
+{
+	WRAP *w;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL) {
+		ucrp_log(LOG_WARNING, "%s: %s\n", __func__, strerror(errno));
+		ucrp_session_close(sp);
+		return;
+	}
+	w->sp = sp;
+	w->fd = -1;
+	ucrp_session_setdata(sp, w);
+
+	if ((w->quiet = ucrp_timer_new(sp, wrap_quiet, w)) == NULL ||
+	    wrap_spawn(w) == -1 ||
+	    (w->wp = ucrp_watch_new(sp, w->fd, wrap_output, w)) == NULL) {
+		wrap_say(w, "% Cannot start program.\n");
+		ucrp_session_close(sp);
+		return;
+	}
+
+	/* its banner and prompt come first */
+	w->waiting = 1;
+	ucrp_timer_set(w->quiet, quiet);
+
+	return;
+}
+
+/*
+ * wrap_close()
+ *
+ * the session is gone, the program goes with the pty
+ */
+static void
+wrap_close(UCRP_SESSION *sp)
+{
+	WRAP *w = ucrp_session_getdata(sp);
+
+	if (w == NULL)
+		return;
+
+	if (w->wp != NULL)
+		ucrp_watch_free(w->wp);
+	if (w->quiet != NULL)
+		ucrp_timer_free(w->quiet);
+	if (w->fd != -1)
+		close(w->fd);	/* SIGHUP to the program */
+
+	free(w);
+
+	return;
+}
+
+/*
+ * wrap_command()
+ *
+ * type the line into the program
+ */
+static void
+wrap_command(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	WRAP *w = ucrp_session_getdata(ucrp_channel_session(cp));
+	struct pollfd pfd;
+	char *line, *str;
+	size_t len;
+	ssize_t ret;
+
+	line = (char *)UCRP_PAYLOAD(rm);
+	if ((str = strstr(line, UCRP_SEPARATOR)) != NULL)
+		*str = '\0';
+	len = strlen(line);
+	line[len++] = '\n';	/* the payload has room for the '\0' */
+
+	if (w->fd == -1)
+		return;
+
+	/* all of the line, or the program gets half a command */
+	pfd.fd = w->fd;
+	pfd.events = POLLOUT;
+	while (len > 0) {
+		if ((ret = write(w->fd, line, len)) > 0) {
+			line += ret;
+			len -= ret;
+		} else if (ret == -1 && errno == EINTR)
+			continue;
+		else if (ret == -1 && errno == EAGAIN &&
+			 poll(&pfd, 1, WRAP_STALL) > 0)
+			continue;
+		else
+			break;
+	}
+	if (len > 0)
+		wrap_say(w, "% Program is not reading its input.\n");
+
+	w->waiting = 1;
+	ucrp_timer_set(w->quiet, quiet);
+
+	return;
+}
+
+/*
+ * wrap_complete()
+ *
+ * the program knows nothing of Tab, the line stays as it is
+ */
+static void
+wrap_complete(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+	char *str;
+
+	if ((str = strstr((char *)UCRP_PAYLOAD(rm), UCRP_SEPARATOR)) != NULL)
+		*str = '\0';
+
+	ucrp_msg_completed(sm, (char *)UCRP_PAYLOAD(rm));
+	ucrp_channel_send(cp, sm);
+
+	return;
+}
+
+/*
+ * wrap_help()
+ */
+static void
+wrap_help(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	uint16_t smbuf[(UCRP_MAX_MSGSIZE + 1) / 2];  /* aligned for UCRP */
+	UCRP *sm = (UCRP *)smbuf;
+
+	ucrp_msg_helped(sm);
+	ucrp_channel_send(cp, sm);
+
+	return;
+}
+
+/*
+ * wrap_interrupt()
+ *
+ * what was queued is gone already, stop whatever the program runs in
+ * the foreground and prompt once it has settled
+ */
+static void
+wrap_interrupt(UCRP_CHANNEL *cp, UCRP *rm)
+{
+	WRAP *w = ucrp_session_getdata(ucrp_channel_session(cp));
+	pid_t pgrp;
+
+	if (w->fd == -1)
+		return;
+
+	if ((pgrp = tcgetpgrp(w->fd)) > 0)
+		kill(-pgrp, SIGINT);
+	else
+		kill(w->pid, SIGINT);
+
+	w->waiting = 1;
+	ucrp_timer_set(w->quiet, quiet);
+
+	return;
+}
+
+/*
+ * usage()
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-P prompt] [-p port] [-q quiet] "
+		"[-t threads] program [arg ...]\n", __progname);
+	exit(EX_USAGE);
+}
+
+/*
+ * main()
+ */
+int
+main(int argc, char *argv[])
+{
+	UCRP_CALLBACKS cb;
+	UCRP_SERVER *srv;
+	char *port;
+	int ch, threads;
+
+	port = UCRP_SERVICE;
+	threads = 1;
+
+	while ((ch = getopt(argc, argv, "+P:p:q:t:")) != -1)
+		switch (ch) {
+		case 'P':
+			prompt = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'q':
+			quiet = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 0)
+				usage();
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage();
+	prog = argv;
+
+	memset(&cb, 0, sizeof(cb));
+	cb.connect = wrap_connect;
+	cb.close = wrap_close;
+	cb.command = wrap_command;
+	cb.complete = wrap_complete;
+	cb.help = wrap_help;
+	cb.interrupt = wrap_interrupt;
+
+	if ((srv = ucrp_server_new(&cb)) == NULL ||
+	    ucrp_server_setthreads(srv, threads, 0) == -1)
+		errx(EX_UNAVAILABLE, "server setup failed.");
+
+	if (ucrp_server_bind(srv, NULL, port) == -1)
+		errx(EX_UNAVAILABLE, "socket setup failed.");
+
+	/* a dead client must not take us down, nor dead programs linger */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);
+
+	ucrp_setlogprio(LOG_NOTICE);
+	ucrp_setusesyslog(0);
+	ucrp_setlogstream(stderr);
+
+	if (ucrp_server_loop(srv) == -1)
+		exit(EX_OSERR);
+
+	ucrp_server_free(srv);
+
+	return EX_OK;
+}